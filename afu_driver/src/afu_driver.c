@@ -420,8 +420,8 @@ void psl_bfm(const svLogic       ha_pclock, 		// used as pclock on PLI
 	    parity16 = (uint16_t) c_ah_brpar;
 	    parity16 = htons(parity16);		
             getMyCacheLine(ah_brdata_top, c_ah_brdata);
-	    psl_afu_read_buffer_data(&event, CACHELINE_BYTES, c_ah_brdata,
-				 (uint8_t *) & parity16);
+	    psl_afu_read_buffer_data_tag(&event, c_ah_brtag, CACHELINE_BYTES,
+					 c_ah_brdata, (uint8_t *) & parity16);
 	// Replication of buffer_read method - ends
 	  }
 #ifdef PSL9
@@ -789,14 +789,11 @@ PLI_INT32 afu_init()
 static void psl_control(void)
 {
 	// Wait for clock edge from PSL
-	fd_set watchset;
-	FD_ZERO(&watchset);
-	FD_SET(event.sockfd, &watchset);
-	select(event.sockfd + 1, &watchset, NULL, NULL, NULL);
+	psl_wait_events(&event);
 	int rc = psl_get_psl_events(&event);
 	// No clock edge
 	while (!rc) {
-		select(event.sockfd + 1, &watchset, NULL, NULL, NULL);
+		psl_wait_events(&event);
 		rc = psl_get_psl_events(&event);
 	}
 	// Error case
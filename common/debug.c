@@ -1,7 +1,12 @@
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "debug.h"
 #include "psl_interface_t.h"
@@ -25,110 +30,678 @@ static DBG_HEADER adjust_header(DBG_HEADER header)
 	return header;
 }
 
+// Largest record: header, id, 32 bit and 64 bit values
+#define DEBUG_RECORD_MAX	14
+
+// Records each thread can have waiting for the writer thread
+#define DEBUG_RING_RECORDS	4096
+
+// Most record bytes and records in one v2 block
+#define DEBUG_BLOCK_BYTES	65536
+#define DEBUG_BLOCK_RECORDS	8192
+
+// How often the writer thread looks for new records
+#define DEBUG_WRITE_NS		2000000
+
+// Keeps fields written by different threads off each other's cache lines
+#define DEBUG_CACHE_LINE	64
+
+// How long a thread waits for room in a full ring before dropping records
+#define DEBUG_FULL_WAIT_NS	10000000
+#define DEBUG_FULL_POLL_NS	50000
+
+struct debug_record {
+	uint64_t seq;
+	uint64_t cycle;
+	uint64_t ns;
+	uint8_t size;
+	char data[DEBUG_RECORD_MAX];
+};
+
+// Single producer, single consumer ring.  The owning thread moves head and
+// only rereads tail when the ring looks full or half full, the writer thread
+// moves tail.  Rings live for the life of the process and those of threads
+// that have exited are reused once the writer empties them.
+struct debug_ring {
+	struct debug_record record[DEBUG_RING_RECORDS];
+	uint32_t head __attribute__ ((aligned(DEBUG_CACHE_LINE)));
+	uint32_t tail_seen;
+	uint32_t tail __attribute__ ((aligned(DEBUG_CACHE_LINE)));
+	int owned;
+	struct debug_ring *_next;
+};
+
+// Records from all threads are written in the order they were made, using
+// a global sequence number.  The lock only protects the ring list and the
+// writer thread wake ups, never the record path.  The block being built and
+// the index are only touched by the writer thread, or by debug_stop() once
+// that has exited.
+static struct {
+	FILE *fp;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	pthread_key_t key;
+	struct debug_ring *rings;
+	uint64_t dropped;
+	uint32_t rounds;
+	int running;
+	int stop;
+	uint64_t seq __attribute__ ((aligned(DEBUG_CACHE_LINE)));
+	uint64_t next __attribute__ ((aligned(DEBUG_CACHE_LINE)));
+	uint64_t stalled;
+	uint64_t offset;
+	struct dbg_block block;
+	char data[DEBUG_BLOCK_BYTES];
+	uint64_t cycle[DEBUG_BLOCK_RECORDS];
+	uint64_t ns[DEBUG_BLOCK_RECORDS];
+	uint8_t stamps[DEBUG_BLOCK_RECORDS * DBG_STAMP_BYTES];
+	struct dbg_index *index;
+	uint32_t blocks;
+	uint32_t index_max;
+} _trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t _trace_once = PTHREAD_ONCE_INIT;
+static __thread struct debug_ring *_ring;
+static uint64_t _cycles[256];
+
+int debug_record_parse(const uint8_t * data, size_t size, int *tag,
+		       int *context)
+{
+	int bytes, tag_at, context_at;
+
+	if (size < sizeof(DBG_HEADER))
+		return -1;
+
+	tag_at = context_at = 0;
+	switch (data[0]) {
+	case DBG_HEADER_AFU_CONNECT:
+	case DBG_HEADER_AFU_DROP:
+	case DBG_HEADER_MMIO_ACK:
+		bytes = 2;
+		break;
+	case DBG_HEADER_VERSION:
+	case DBG_HEADER_JOB_AUX2:
+		bytes = 3;
+		break;
+	case DBG_HEADER_CMD_BUFFER_WRITE:
+	case DBG_HEADER_CMD_BUFFER_READ:
+	case DBG_HEADER_CMD_RESPONSE:
+		bytes = 3;
+		tag_at = 2;
+		break;
+	case DBG_HEADER_CONTEXT_ADD:
+	case DBG_HEADER_CONTEXT_REMOVE:
+	case DBG_HEADER_MMIO_MAP:
+	case DBG_HEADER_MMIO_RETURN:
+		bytes = 4;
+		context_at = 2;
+		break;
+	case DBG_HEADER_SOCKET_PUT:
+	case DBG_HEADER_SOCKET_GET:
+		bytes = 5;
+		context_at = 3;
+		break;
+	case DBG_HEADER_CMD_CLIENT_REQ:
+	case DBG_HEADER_CMD_CLIENT_ACK:
+		bytes = 5;
+		tag_at = 2;
+		context_at = 3;
+		break;
+	case DBG_HEADER_CMD_RESPONSE_CODE:
+		bytes = 5;
+		tag_at = 2;
+		break;
+	case DBG_HEADER_JOB_ADD:
+	case DBG_HEADER_JOB_SEND:
+		bytes = 6;
+		break;
+	case DBG_HEADER_CMD_ADD:
+	case DBG_HEADER_CMD_UPDATE:
+#ifdef PSL9
+	case DBG_HEADER_CMD_CAIA2:
+	case DBG_HEADER_CMD_DMA0:
+#endif
+		bytes = 7;
+		tag_at = 2;
+		context_at = 3;
+		break;
+	case DBG_HEADER_CMD_ADD_SIZE:
+		bytes = 9;
+		tag_at = 2;
+		context_at = 3;
+		break;
+	case DBG_HEADER_PARM:
+		bytes = 9;
+		break;
+	case DBG_HEADER_MMIO_ADD:
+	case DBG_HEADER_MMIO_SEND:
+		bytes = 10;
+		context_at = 4;
+		break;
+	case DBG_HEADER_PE_ADD:
+	case DBG_HEADER_PE_SEND:
+		bytes = 14;
+		break;
+	default:
+		return -1;
+	}
+	if (size < bytes)
+		return -1;
+
+	if (tag)
+		*tag = tag_at ? data[tag_at] : -1;
+	if (context) {
+		*context = -1;
+		// Context -1 marks records for the AFU descriptor
+		if (context_at && ((data[context_at] & data[context_at + 1]) !=
+				   0xff))
+			*context = (data[context_at] << 8) |
+			    data[context_at + 1];
+	}
+	return bytes;
+}
+
+void debug_block_order(struct dbg_block *block)
+{
+	int i;
+
+	block->magic = htonl(block->magic);
+	block->bytes = htonl(block->bytes);
+	block->records = htonl(block->records);
+	block->reserved = htonl(block->reserved);
+	block->first_cycle = htonll(block->first_cycle);
+	block->last_cycle = htonll(block->last_cycle);
+	block->first_ns = htonll(block->first_ns);
+	block->last_ns = htonll(block->last_ns);
+	for (i = 0; i < 4; i++)
+		block->tags[i] = htonll(block->tags[i]);
+	block->contexts = htonll(block->contexts);
+}
+
+void debug_cycle(uint8_t id, uint64_t cycle)
+{
+	__atomic_store_n(&(_cycles[id]), cycle, __ATOMIC_RELAXED);
+}
+
+// Thread exit, ring can be reused once the writer empties it
+static void _debug_release(void *ptr)
+{
+	struct debug_ring *ring = (struct debug_ring *)ptr;
+
+	__atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void _debug_key(void)
+{
+	pthread_key_create(&_trace.key, _debug_release);
+}
+
+// Find the ring for the calling thread, claiming one on first use
+static struct debug_ring *_debug_ring(void)
+{
+	struct debug_ring *ring;
+
+	if (_ring)
+		return _ring;
+
+	pthread_mutex_lock(&_trace.lock);
+	ring = _trace.rings;
+	while (ring) {
+		if (!__atomic_load_n(&ring->owned, __ATOMIC_ACQUIRE) &&
+		    (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+		     ring->head))
+			break;
+		ring = ring->_next;
+	}
+	if (ring == NULL) {
+		ring = (struct debug_ring *)calloc(1, sizeof(struct debug_ring));
+		if (ring != NULL) {
+			ring->_next = _trace.rings;
+			__atomic_store_n(&_trace.rings, ring, __ATOMIC_RELEASE);
+		}
+	}
+	if (ring != NULL) {
+		ring->owned = 1;
+		ring->tail_seen = ring->tail;
+		pthread_setspecific(_trace.key, ring);
+	}
+	pthread_mutex_unlock(&_trace.lock);
+
+	_ring = ring;
+	return ring;
+}
+
+// Wait a bounded time for the writer thread to make room in a full ring
+static int _debug_room(struct debug_ring *ring)
+{
+	long waited;
+
+	for (waited = 0; waited < DEBUG_FULL_WAIT_NS;
+	     waited += DEBUG_FULL_POLL_NS) {
+		pthread_cond_signal(&_trace.wake);
+		ns_delay(DEBUG_FULL_POLL_NS);
+		ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (ring->head - ring->tail_seen < DEBUG_RING_RECORDS)
+			return 1;
+	}
+	return 0;
+}
+
+// Record for the writer thread, or write directly if it isn't running
+static void _debug_write(FILE * fp, char *buffer, size_t size)
+{
+	struct debug_ring *ring;
+	struct debug_record *record;
+	struct timespec ts;
+	uint32_t used;
+
+	if (!__atomic_load_n(&_trace.running, __ATOMIC_ACQUIRE) ||
+	    (fp != _trace.fp)) {
+		fwrite(buffer, size, 1, fp);
+		return;
+	}
+
+	if ((ring = _debug_ring()) == NULL) {
+		__atomic_add_fetch(&_trace.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	used = ring->head - ring->tail_seen;
+	if (used >= DEBUG_RING_RECORDS / 2) {
+		ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		used = ring->head - ring->tail_seen;
+	}
+	if ((used == DEBUG_RING_RECORDS) && !_debug_room(ring)) {
+		__atomic_add_fetch(&_trace.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	record = &(ring->record[ring->head % DEBUG_RING_RECORDS]);
+	record->seq = __atomic_fetch_add(&_trace.seq, 1, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	record->ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	// Every record except version and parm starts with an AFU id
+	record->cycle = 0;
+	if ((buffer[0] != DBG_HEADER_VERSION) && (buffer[0] != DBG_HEADER_PARM))
+		record->cycle = __atomic_load_n(&(_cycles[(uint8_t) buffer[1]]),
+						__ATOMIC_RELAXED);
+	record->size = size;
+	memcpy(record->data, buffer, size);
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+	// Get writer thread going early instead of waiting for its timer
+	if (used == DEBUG_RING_RECORDS / 2)
+		pthread_cond_signal(&_trace.wake);
+}
+
+// Write out the block being built and add it to the index
+static void _debug_block(void)
+{
+	struct dbg_block block;
+	struct dbg_index *index;
+	uint32_t i, ns;
+	uint8_t *stamp;
+
+	if (_trace.block.records == 0)
+		return;
+
+	stamp = _trace.stamps;
+	for (i = 0; i < _trace.block.records; i++) {
+		ns = htonl(_trace.ns[i] - _trace.block.first_ns);
+		_trace.cycle[i] = htonll(_trace.cycle[i]);
+		memcpy(stamp, &(_trace.cycle[i]), sizeof(uint64_t));
+		memcpy(stamp + sizeof(uint64_t), &ns, sizeof(uint32_t));
+		stamp += DBG_STAMP_BYTES;
+	}
+	block = _trace.block;
+	block.magic = DBG_BLOCK_MAGIC;
+	debug_block_order(&block);
+	fwrite(&block, sizeof(block), 1, _trace.fp);
+	fwrite(_trace.data, _trace.block.bytes, 1, _trace.fp);
+	fwrite(_trace.stamps, stamp - _trace.stamps, 1, _trace.fp);
+
+	// Index stays in host order until debug_stop() writes it
+	if (_trace.blocks == _trace.index_max) {
+		index = (struct dbg_index *)realloc(_trace.index,
+						    2 * (_trace.index_max + 64) *
+						    sizeof(struct dbg_index));
+		if (index != NULL) {
+			_trace.index = index;
+			_trace.index_max = 2 * (_trace.index_max + 64);
+		}
+	}
+	if (_trace.blocks < _trace.index_max) {
+		_trace.index[_trace.blocks].offset = _trace.offset;
+		_trace.index[_trace.blocks].block = _trace.block;
+		_trace.index[_trace.blocks].block.magic = DBG_BLOCK_MAGIC;
+		_trace.blocks++;
+	}
+
+	_trace.offset += sizeof(block) + _trace.block.bytes +
+	    (stamp - _trace.stamps);
+	memset(&(_trace.block), 0, sizeof(_trace.block));
+}
+
+// Add a record to the block being built, starting a new block when it is
+// full or the record's time can't be stamped relative to the block's
+static void _debug_append(struct debug_record *record)
+{
+	struct dbg_block *block = &(_trace.block);
+	uint64_t first_ns, last_ns;
+	int tag, context;
+	uint32_t n;
+
+	first_ns = block->first_ns;
+	last_ns = block->last_ns;
+	if (record->ns < first_ns)
+		first_ns = record->ns;
+	if (record->ns > last_ns)
+		last_ns = record->ns;
+	if (block->records &&
+	    ((block->records == DEBUG_BLOCK_RECORDS) ||
+	     (block->bytes + record->size > DEBUG_BLOCK_BYTES) ||
+	     (last_ns - first_ns > UINT32_MAX))) {
+		_debug_block();
+		first_ns = last_ns = record->ns;
+	}
+
+	n = block->records++;
+	memcpy(_trace.data + block->bytes, record->data, record->size);
+	block->bytes += record->size;
+	_trace.cycle[n] = record->cycle;
+	_trace.ns[n] = record->ns;
+	if (n == 0)
+		first_ns = last_ns = record->ns;
+	block->first_ns = first_ns;
+	block->last_ns = last_ns;
+	if (record->cycle) {
+		if (!block->first_cycle || (record->cycle < block->first_cycle))
+			block->first_cycle = record->cycle;
+		if (record->cycle > block->last_cycle)
+			block->last_cycle = record->cycle;
+	}
+	if (debug_record_parse((uint8_t *) record->data, record->size, &tag,
+			       &context) < 0)
+		return;
+	if (tag >= 0)
+		block->tags[tag / 64] |= 1ull << (tag % 64);
+	if (context >= 0)
+		block->contexts |= 1ull << (context % 64);
+}
+
+// Write out recorded records in sequence order.  A thread can be stopped
+// between taking a sequence number and publishing its record, so a gap is
+// only waited on for one round before writing past it.
+static void _debug_drain(int all)
+{
+	struct debug_ring *ring, *oldest;
+	struct debug_record *record;
+	uint32_t tail;
+	int written;
+
+	written = 0;
+	while (1) {
+		oldest = NULL;
+		record = NULL;
+		ring = __atomic_load_n(&_trace.rings, __ATOMIC_ACQUIRE);
+		while (ring) {
+			tail = ring->tail;
+			if ((tail != __atomic_load_n(&ring->head,
+						     __ATOMIC_ACQUIRE)) &&
+			    ((oldest == NULL) ||
+			     (ring->record[tail % DEBUG_RING_RECORDS].seq <
+			      record->seq))) {
+				oldest = ring;
+				record = &(ring->record[tail %
+							DEBUG_RING_RECORDS]);
+			}
+			ring = ring->_next;
+		}
+		if (oldest == NULL)
+			break;
+		if ((record->seq > _trace.next) && !all) {
+			if (_trace.stalled != _trace.next) {
+				_trace.stalled = _trace.next;
+				break;
+			}
+		}
+		// Stay on this ring while its records are next in sequence
+		do {
+			_debug_append(record);
+			if (record->seq >= _trace.next)
+				_trace.next = record->seq + 1;
+			tail = oldest->tail + 1;
+			__atomic_store_n(&oldest->tail, tail, __ATOMIC_RELEASE);
+			record = &(oldest->record[tail % DEBUG_RING_RECORDS]);
+		} while ((tail != __atomic_load_n(&oldest->head,
+						  __ATOMIC_ACQUIRE)) &&
+			 (record->seq == _trace.next));
+		written = 1;
+	}
+	if (written) {
+		_debug_block();
+		fflush(_trace.fp);
+	}
+}
+
+static void *_debug_writer(void *ptr)
+{
+	struct timespec ts;
+	sigset_t set;
+
+	// Signal handlers may call debug_flush() and wait on this thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&_trace.lock);
+	while (!_trace.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += DEBUG_WRITE_NS;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&_trace.wake, &_trace.lock, &ts);
+		pthread_mutex_unlock(&_trace.lock);
+		_debug_drain(0);
+		pthread_mutex_lock(&_trace.lock);
+		_trace.rounds++;
+		pthread_cond_broadcast(&_trace.done);
+	}
+	pthread_mutex_unlock(&_trace.lock);
+
+	return NULL;
+}
+
+int debug_start(FILE * fp)
+{
+	long offset;
+
+	if (fp == NULL)
+		return -1;
+	if (__atomic_load_n(&_trace.running, __ATOMIC_ACQUIRE))
+		return -1;
+
+	pthread_once(&_trace_once, _debug_key);
+	fflush(fp);
+	if ((offset = ftell(fp)) < 0)
+		return -1;
+	_trace.fp = fp;
+	_trace.offset = offset;
+	_trace.blocks = 0;
+	_trace.stop = 0;
+	_trace.stalled = UINT64_MAX;
+	if (pthread_create(&(_trace.thread), NULL, _debug_writer, NULL)) {
+		_trace.fp = NULL;
+		return -1;
+	}
+	__atomic_store_n(&_trace.running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void debug_flush(FILE * fp)
+{
+	struct timespec ts;
+	uint32_t rounds;
+
+	if (!__atomic_load_n(&_trace.running, __ATOMIC_ACQUIRE) ||
+	    (fp != _trace.fp)) {
+		fflush(fp);
+		return;
+	}
+
+	// Wait for a full writer round that started after this call
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec++;
+	pthread_mutex_lock(&_trace.lock);
+	rounds = _trace.rounds;
+	pthread_cond_signal(&_trace.wake);
+	while ((_trace.rounds - rounds < 2) && !_trace.stop) {
+		if (pthread_cond_timedwait(&_trace.done, &_trace.lock, &ts) ==
+		    ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&_trace.lock);
+}
+
+void debug_stop(FILE * fp)
+{
+	struct dbg_trailer trailer;
+	uint64_t offset;
+	uint32_t i;
+
+	if (!__atomic_load_n(&_trace.running, __ATOMIC_ACQUIRE) ||
+	    (fp != _trace.fp))
+		return;
+
+	pthread_mutex_lock(&_trace.lock);
+	_trace.stop = 1;
+	pthread_cond_signal(&_trace.wake);
+	pthread_mutex_unlock(&_trace.lock);
+	pthread_join(_trace.thread, NULL);
+
+	// Everything still recorded goes out before switching to direct writes
+	__atomic_store_n(&_trace.running, 0, __ATOMIC_RELEASE);
+	_debug_drain(1);
+	if (_trace.dropped)
+		warn_msg("Dropped %" PRIu64 " debug.log records", _trace.dropped);
+
+	// Block index and trailer
+	trailer.magic = htonl(DBG_INDEX_MAGIC);
+	trailer.blocks = htonl(_trace.blocks);
+	trailer.offset = htonll(_trace.offset);
+	for (i = 0; i < _trace.blocks; i++) {
+		offset = htonll(_trace.index[i].offset);
+		debug_block_order(&(_trace.index[i].block));
+		fwrite(&offset, sizeof(offset), 1, fp);
+		fwrite(&(_trace.index[i].block), sizeof(struct dbg_block), 1,
+		       fp);
+	}
+	fwrite(&trailer, sizeof(trailer), 1, fp);
+	fflush(fp);
+
+	free(_trace.index);
+	_trace.index = NULL;
+	_trace.index_max = 0;
+	_trace.dropped = 0;
+	_trace.fp = NULL;
+}
+
 static void _debug_send_id(FILE * fp, DBG_HEADER header, uint8_t id)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
 	offset = 0;
 	header = adjust_header(header);
 	size = sizeof(DBG_HEADER) + sizeof(id);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(DBG_HEADER);
-		buffer[offset] = id;
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(DBG_HEADER);
+	buffer[offset] = id;
+	_debug_write(fp, buffer, size);
 }
 
 static void _debug_send_id_8(FILE * fp, DBG_HEADER header, uint8_t id,
 			     uint8_t value)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
 	offset = 0;
 	header = adjust_header(header);
 	size = sizeof(DBG_HEADER) + sizeof(id) + sizeof(value);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		buffer[offset] = id;
-		offset += sizeof(id);
-		buffer[offset] = value;
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = id;
+	offset += sizeof(id);
+	buffer[offset] = value;
+	_debug_write(fp, buffer, size);
 }
 
 static void _debug_send_id_16(FILE * fp, DBG_HEADER header, uint8_t id,
 			      uint16_t value)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
 	offset = 0;
 	header = adjust_header(header);
 	size = sizeof(DBG_HEADER) + sizeof(id) + sizeof(value);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		buffer[offset] = id;
-		offset += sizeof(id);
-		value = htons(value);
-		memcpy(buffer + offset, (char *)&value, sizeof(value));
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = id;
+	offset += sizeof(id);
+	value = htons(value);
+	memcpy(buffer + offset, (char *)&value, sizeof(value));
+	_debug_write(fp, buffer, size);
 }
 
 static void _debug_send_id_32(FILE * fp, DBG_HEADER header, uint8_t id,
 			      uint32_t value)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
 	offset = 0;
 	header = adjust_header(header);
 	size = sizeof(DBG_HEADER) + sizeof(id) + sizeof(value);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		buffer[offset] = id;
-		offset += sizeof(id);
-		value = htonl(value);
-		memcpy(buffer + offset, (char *)&value, sizeof(value));
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = id;
+	offset += sizeof(id);
+	value = htonl(value);
+	memcpy(buffer + offset, (char *)&value, sizeof(value));
+	_debug_write(fp, buffer, size);
 }
 
 static void _debug_send_32_32(FILE * fp, DBG_HEADER header, uint32_t value0,
 			      uint32_t value1)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
 	offset = 0;
 	header = adjust_header(header);
 	size = sizeof(DBG_HEADER) + sizeof(value0) + sizeof(value1);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		value0 = htonl(value0);
-		memcpy(buffer + offset, (char *)&value0, sizeof(value0));
-		offset += sizeof(value0);
-		value1 = htonl(value1);
-		memcpy(buffer + offset, (char *)&value1, sizeof(value1));
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	value0 = htonl(value0);
+	memcpy(buffer + offset, (char *)&value0, sizeof(value0));
+	offset += sizeof(value0);
+	value1 = htonl(value1);
+	memcpy(buffer + offset, (char *)&value1, sizeof(value1));
+	_debug_write(fp, buffer, size);
 }
 
 
@@ -136,7 +709,7 @@ static void _debug_send_32_32(FILE * fp, DBG_HEADER header, uint32_t value0,
 static void _debug_send_id_8_16(FILE * fp, DBG_HEADER header, uint8_t id,
 				uint8_t value0, uint16_t value1)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
@@ -144,24 +717,21 @@ static void _debug_send_id_8_16(FILE * fp, DBG_HEADER header, uint8_t id,
 	header = adjust_header(header);
 	size =
 	    sizeof(DBG_HEADER) + sizeof(id) + sizeof(value0) + sizeof(value1);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		buffer[offset] = id;
-		offset += sizeof(id);
-		buffer[offset] = value0;
-		offset += sizeof(value0);
-		value1 = htons(value1);
-		memcpy(buffer + offset, (char *)&value1, sizeof(value1));
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = id;
+	offset += sizeof(id);
+	buffer[offset] = value0;
+	offset += sizeof(value0);
+	value1 = htons(value1);
+	memcpy(buffer + offset, (char *)&value1, sizeof(value1));
+	_debug_write(fp, buffer, size);
 }
 
 static void _debug_send_id_32_64(FILE * fp, DBG_HEADER header, uint8_t id,
 				uint32_t value0, uint64_t value1)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
@@ -169,19 +739,16 @@ static void _debug_send_id_32_64(FILE * fp, DBG_HEADER header, uint8_t id,
 	header = adjust_header(header);
 	size =
 	    sizeof(DBG_HEADER) + sizeof(id) + sizeof(value0) + sizeof(value1);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		buffer[offset] = id;
-		offset += sizeof(id);
-		value0 = htonl(value0);
-		memcpy(buffer + offset, (char *)&value0, sizeof(value0));
-		offset += sizeof(value0);
-		value1 = htonll(value1);
-		memcpy(buffer + offset, (char *)&value1, sizeof(value1));
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = id;
+	offset += sizeof(id);
+	value0 = htonl(value0);
+	memcpy(buffer + offset, (char *)&value0, sizeof(value0));
+	offset += sizeof(value0);
+	value1 = htonll(value1);
+	memcpy(buffer + offset, (char *)&value1, sizeof(value1));
+	_debug_write(fp, buffer, size);
 }
 
 
@@ -189,7 +756,7 @@ static void _debug_send_id_8_16_16(FILE * fp, DBG_HEADER header, uint8_t id,
 				   uint8_t value0, uint16_t value1,
 				   uint16_t value2)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
@@ -198,28 +765,56 @@ static void _debug_send_id_8_16_16(FILE * fp, DBG_HEADER header, uint8_t id,
 	size =
 	    sizeof(DBG_HEADER) + sizeof(id) + sizeof(value0) + sizeof(value1) +
 	    sizeof(value2);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		buffer[offset] = id;
-		offset += sizeof(id);
-		buffer[offset] = value0;
-		offset += sizeof(value0);
-		value1 = htons(value1);
-		memcpy(buffer + offset, (char *)&value1, sizeof(value1));
-		offset += sizeof(value1);
-		value2 = htons(value2);
-		memcpy(buffer + offset, (char *)&value2, sizeof(value2));
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = id;
+	offset += sizeof(id);
+	buffer[offset] = value0;
+	offset += sizeof(value0);
+	value1 = htons(value1);
+	memcpy(buffer + offset, (char *)&value1, sizeof(value1));
+	offset += sizeof(value1);
+	value2 = htons(value2);
+	memcpy(buffer + offset, (char *)&value2, sizeof(value2));
+	_debug_write(fp, buffer, size);
+}
+
+static void _debug_send_id_8_16_16_16(FILE * fp, DBG_HEADER header,
+				      uint8_t id, uint8_t value0,
+				      uint16_t value1, uint16_t value2,
+				      uint16_t value3)
+{
+	char buffer[DEBUG_RECORD_MAX];
+	size_t size;
+	int offset;
+
+	offset = 0;
+	header = adjust_header(header);
+	size =
+	    sizeof(DBG_HEADER) + sizeof(id) + sizeof(value0) + sizeof(value1) +
+	    sizeof(value2) + sizeof(value3);
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = id;
+	offset += sizeof(id);
+	buffer[offset] = value0;
+	offset += sizeof(value0);
+	value1 = htons(value1);
+	memcpy(buffer + offset, (char *)&value1, sizeof(value1));
+	offset += sizeof(value1);
+	value2 = htons(value2);
+	memcpy(buffer + offset, (char *)&value2, sizeof(value2));
+	offset += sizeof(value2);
+	value3 = htons(value3);
+	memcpy(buffer + offset, (char *)&value3, sizeof(value3));
+	_debug_write(fp, buffer, size);
 }
 
 static void _debug_send_id_8_8_16_32(FILE * fp, DBG_HEADER header, uint8_t id,
 				     uint8_t value0, uint8_t value1,
 				     uint16_t value2, uint32_t value3)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 
@@ -228,23 +823,20 @@ static void _debug_send_id_8_8_16_32(FILE * fp, DBG_HEADER header, uint8_t id,
 	size =
 	    sizeof(DBG_HEADER) + sizeof(id) + sizeof(value0) + sizeof(value1) +
 	    sizeof(value2) + sizeof(value3);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		buffer[offset] = id;
-		offset += sizeof(id);
-		buffer[offset] = value0;
-		offset += sizeof(value0);
-		buffer[offset] = value1;
-		offset += sizeof(value1);
-		value2 = htons(value2);
-		memcpy(buffer + offset, (char *)&value2, sizeof(value2));
-		offset += sizeof(value2);
-		value3 = htonl(value3);
-		memcpy(buffer + offset, (char *)&value3, sizeof(value3));
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = id;
+	offset += sizeof(id);
+	buffer[offset] = value0;
+	offset += sizeof(value0);
+	buffer[offset] = value1;
+	offset += sizeof(value1);
+	value2 = htons(value2);
+	memcpy(buffer + offset, (char *)&value2, sizeof(value2));
+	offset += sizeof(value2);
+	value3 = htonl(value3);
+	memcpy(buffer + offset, (char *)&value3, sizeof(value3));
+	_debug_write(fp, buffer, size);
 }
 
 size_t debug_get_64(FILE * fp, uint64_t * value)
@@ -303,7 +895,7 @@ DBG_HEADER debug_get_header(FILE * fp)
 
 void debug_send_version(FILE * fp, uint8_t major, uint8_t minor)
 {
-	char *buffer;
+	char buffer[DEBUG_RECORD_MAX];
 	size_t size;
 	int offset;
 	DBG_HEADER header;
@@ -311,15 +903,12 @@ void debug_send_version(FILE * fp, uint8_t major, uint8_t minor)
 	offset = 0;
 	header = adjust_header(DBG_HEADER_VERSION);
 	size = sizeof(DBG_HEADER) + sizeof(major) + sizeof(minor);
-	if ((buffer = (char *)malloc(size)) != NULL) {
-		memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
-		offset += sizeof(header);
-		buffer[offset] = major;
-		offset += sizeof(major);
-		buffer[offset] = minor;
-		fwrite(buffer, size, 1, fp);
-		free(buffer);
-	}
+	memcpy(buffer, (char *)&header, sizeof(DBG_HEADER));
+	offset += sizeof(header);
+	buffer[offset] = major;
+	offset += sizeof(major);
+	buffer[offset] = minor;
+	_debug_write(fp, buffer, size);
 }
 
 void debug_afu_connect(FILE * fp, uint8_t id)
@@ -402,10 +991,10 @@ void debug_mmio_return(FILE * fp, uint8_t id, uint16_t context)
 }
 
 void debug_cmd_add(FILE * fp, uint8_t id, uint8_t tag, uint16_t context,
-		   uint16_t command)
+		   uint16_t command, uint16_t size)
 {
-	_debug_send_id_8_16_16(fp, DBG_HEADER_CMD_ADD, id, tag, context,
-			       command);
+	_debug_send_id_8_16_16_16(fp, DBG_HEADER_CMD_ADD_SIZE, id, tag,
+				  context, command, size);
 }
 
 void debug_cmd_update(FILE * fp, uint8_t id, uint8_t tag, uint16_t context,
@@ -452,9 +1041,9 @@ void debug_cmd_buffer_read(FILE * fp, uint8_t id, uint8_t tag)
 	_debug_send_id_8(fp, DBG_HEADER_CMD_BUFFER_READ, id, tag);
 }
 
-void debug_cmd_response(FILE * fp, uint8_t id, uint8_t tag)
+void debug_cmd_response(FILE * fp, uint8_t id, uint8_t tag, uint16_t resp)
 {
-	_debug_send_id_8(fp, DBG_HEADER_CMD_RESPONSE, id, tag);
+	_debug_send_id_8_16(fp, DBG_HEADER_CMD_RESPONSE_CODE, id, tag, resp);
 }
 
 void debug_socket_put(FILE * fp, uint8_t id, uint16_t context, uint8_t type)
@@ -49,6 +49,10 @@ typedef uint8_t DBG_HEADER;
 #define DBG_HEADER_CMD_RESPONSE    	0x16
 #define DBG_HEADER_PE_ADD		0x18
 #define DBG_HEADER_PE_SEND		0x19
+// Replaces DBG_HEADER_CMD_ADD, adding the command size
+#define DBG_HEADER_CMD_ADD_SIZE		0x1A
+// Replaces DBG_HEADER_CMD_RESPONSE, adding the response code
+#define DBG_HEADER_CMD_RESPONSE_CODE	0x1B
 #if defined PSL9 || PSL9lite
 #define DBG_HEADER_CMD_CAIA2		0x30
 #define DBG_HEADER_CMD_DMA0			0x31
@@ -72,6 +76,46 @@ typedef uint8_t DBG_HEADER;
 #define DBG_PSL_REV_LVL			0x8
 #define DBG_IMAGE_LOADED		0x9
 #define DBG_BASE_IMAGE			0xA
+#define DBG_PARM_BUFFER_READS		0xB
+#define DBG_PARM_DIRECT_MEMORY		0xC
+#define DBG_PARM_PREFETCH_LINES		0xD
+#define DBG_PARM_WRITE_COMBINE		0xE
+
+// debug.log v2, written by the debug_start() writer thread.  The file is a
+// series of blocks, each a dbg_block header, the v1 records of the block and
+// then a DBG_STAMP_BYTES stamp per record.  A dbg_index entry per block and a
+// dbg_trailer end the file once debug_stop() runs, without them the blocks
+// can still be walked from the start.  All fields are big endian.
+#define DBG_BLOCK_MAGIC			0x50534c54	/* "PSLT" */
+#define DBG_INDEX_MAGIC			0x50534c49	/* "PSLI" */
+
+// Stamp: 64 bit AFU cycle (0 if record isn't from an AFU) and 32 bit
+// nanoseconds after the block's first_ns
+#define DBG_STAMP_BYTES			12
+
+struct dbg_block {
+	uint32_t magic;
+	uint32_t bytes;		// Record bytes following this header
+	uint32_t records;	// Records, and stamps following them
+	uint32_t reserved;
+	uint64_t first_cycle;	// Cycle range of stamped records, 0 if none
+	uint64_t last_cycle;
+	uint64_t first_ns;	// CLOCK_MONOTONIC range of all records
+	uint64_t last_ns;
+	uint64_t tags[4];	// Bit for each tag in the block's records
+	uint64_t contexts;	// Bit for each context modulo 64
+};
+
+struct dbg_index {
+	uint64_t offset;	// File offset of the block
+	struct dbg_block block;
+};
+
+struct dbg_trailer {
+	uint32_t magic;
+	uint32_t blocks;
+	uint64_t offset;	// File offset of the first dbg_index
+};
 
 size_t debug_get_64(FILE * fp, uint64_t * value);
 size_t debug_get_32(FILE * fp, uint32_t * value);
@@ -79,11 +123,33 @@ size_t debug_get_16(FILE * fp, uint16_t * value);
 size_t debug_get_8(FILE * fp, uint8_t * value);
 DBG_HEADER debug_get_header(FILE * fp);
 
+// Size of the record at data, and its tag and context or -1 if it has none
+int debug_record_parse(const uint8_t * data, size_t size, int *tag,
+		       int *context);
+
+// Swap a dbg_block between host and file byte order
+void debug_block_order(struct dbg_block *block);
+
+// Latest cycle count of AFU id, stamped on records the writer thread writes
+void debug_cycle(uint8_t id, uint64_t cycle);
+
+// Hand records for fp to a background writer thread.  Each thread records
+// into its own ring and the writer thread writes them to fp as v2 blocks.
+// Without debug_start() every record is written to its file directly (v1).
+int debug_start(FILE * fp);
+
+// Wait (bounded) for everything recorded so far to reach fp
+void debug_flush(FILE * fp);
+
+// Write out remaining records and the block index and stop the writer
+// thread, call before fclose
+void debug_stop(FILE * fp);
+
 void debug_send_version(FILE * fp, uint8_t major, uint8_t minor);
 void debug_afu_connect(FILE * fp, uint8_t id);
 void debug_afu_drop(FILE * fp, uint8_t id);
 void debug_cmd_add(FILE * fp, uint8_t id, uint8_t tag, uint16_t context,
-		   uint16_t command);
+		   uint16_t command, uint16_t size);
 void debug_cmd_update(FILE * fp, uint8_t id, uint8_t tag, uint16_t context,
 		      uint16_t resp);
 #if defined PSL9
@@ -97,7 +163,7 @@ void debug_cmd_client(FILE * fp, uint8_t id, uint8_t tag, uint16_t context);
 void debug_cmd_return(FILE * fp, uint8_t id, uint8_t tag, uint16_t context);
 void debug_cmd_buffer_write(FILE * fp, uint8_t id, uint8_t tag);
 void debug_cmd_buffer_read(FILE * fp, uint8_t id, uint8_t tag);
-void debug_cmd_response(FILE * fp, uint8_t id, uint8_t tag);
+void debug_cmd_response(FILE * fp, uint8_t id, uint8_t tag, uint16_t resp);
 void debug_context_add(FILE * fp, uint8_t id, uint16_t context);
 void debug_context_remove(FILE * fp, uint8_t id, uint16_t context);
 void debug_job_add(FILE * fp, uint8_t id, uint32_t code);
@@ -23,7 +23,14 @@
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 /* For PSL out-bound haX parity buses, generate Odd parity bit for a specified
@@ -44,6 +51,313 @@ static uint32_t genoddParitybitperbytes(uint64_t data)
 	return oddparity;
 }
 
+/* Shared memory ring helpers.  Each ring has exactly one producer and one
+ * consumer so head is only written by the producer and tail only by the
+ * consumer.  A consumer that runs out of spins sets waiting and sleeps on
+ * head, the producer wakes it after publishing new data. */
+
+static int _shm_futex(volatile uint32_t * addr, int op, uint32_t val,
+		      const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static int _shm_send(struct psl_shm_ring *ring, unsigned char *data,
+		     uint32_t size)
+{
+	uint32_t head, tail, pos, chunk;
+
+	while (size > 0) {
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		chunk = PSL_SHM_RING_SIZE - (head - tail);
+		if (chunk == 0) {
+			sched_yield();
+			continue;
+		}
+		if (chunk > size)
+			chunk = size;
+		pos = head & (PSL_SHM_RING_SIZE - 1);
+		if (pos + chunk > PSL_SHM_RING_SIZE)
+			chunk = PSL_SHM_RING_SIZE - pos;
+		memcpy(&(ring->data[pos]), data, chunk);
+		__atomic_store_n(&ring->head, head + chunk, __ATOMIC_RELEASE);
+		data += chunk;
+		size -= chunk;
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ring->waiting)
+		_shm_futex(&ring->head, FUTEX_WAKE, 1, NULL);
+	return PSL_SUCCESS;
+}
+
+static int _shm_recv(struct psl_shm *shm, struct psl_shm_ring *ring,
+		     unsigned char *data, uint32_t size)
+{
+	uint32_t head, tail, pos, avail, chunk;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	avail = head - tail;
+	if (avail == 0) {
+		if (shm->state == PSL_SHM_CLOSED)
+			return 0;
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+	if (size > avail)
+		size = avail;
+	pos = tail & (PSL_SHM_RING_SIZE - 1);
+	chunk = size;
+	if (pos + chunk > PSL_SHM_RING_SIZE)
+		chunk = PSL_SHM_RING_SIZE - pos;
+	memcpy(data, &(ring->data[pos]), chunk);
+	if (chunk < size)
+		memcpy(data + chunk, ring->data, size - chunk);
+	__atomic_store_n(&ring->tail, tail + size, __ATOMIC_RELEASE);
+	return size;
+}
+
+// Spin then block until ring has data, the other side closes or 10ms pass
+static void _shm_wait(struct psl_shm *shm, struct psl_shm_ring *ring,
+		      pid_t peer)
+{
+	struct timespec ts;
+	uint32_t head;
+	int spin;
+
+	for (spin = 0; spin < PSL_SHM_SPIN; spin++) {
+		if ((ring->head != ring->tail) || (shm->state == PSL_SHM_CLOSED))
+			return;
+	}
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	head = ring->head;
+	ring->waiting = 1;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((head == ring->tail) && (shm->state != PSL_SHM_CLOSED))
+		_shm_futex(&ring->head, FUTEX_WAIT, head, &ts);
+	ring->waiting = 0;
+
+	// Treat a vanished peer the same as a closed socket
+	if ((ring->head == ring->tail) && (peer > 0) && (kill(peer, 0) < 0) &&
+	    (errno == ESRCH))
+		shm->state = PSL_SHM_CLOSED;
+}
+
+static void _shm_close(struct AFU_EVENT *event)
+{
+	event->shm->state = PSL_SHM_CLOSED;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	_shm_futex(&event->shm->to_afu.head, FUTEX_WAKE, 1, NULL);
+	_shm_futex(&event->shm->to_psl.head, FUTEX_WAKE, 1, NULL);
+	munmap(event->shm, sizeof(struct psl_shm));
+	event->shm = NULL;
+	event->shm_tx = NULL;
+	event->shm_rx = NULL;
+}
+
+/* Transport wrappers.  These behave like send() and a non-blocking recv() on
+ * the socket so the framing code doesn't care which transport is in use. */
+
+static int _psl_send(struct AFU_EVENT *event, unsigned char *data, int size)
+{
+	int bc, bp;
+
+	if (event->shm)
+		return _shm_send(event->shm_tx, data, size);
+
+	bp = 0;
+	while (bp < size) {
+		bc = send(event->sockfd, data + bp, size - bp, 0);
+		if (bc < 0)
+			return PSL_TRANSMISSION_ERROR;
+		bp += bc;
+	}
+	return PSL_SUCCESS;
+}
+
+static int _psl_recv(struct AFU_EVENT *event, unsigned char *data, int size)
+{
+	if (event->shm)
+		return _shm_recv(event->shm, event->shm_rx, data, size);
+	return recv(event->sockfd, data, size, 0);
+}
+
+/* Length prefixed framing.  Once both sides agree on it every frame after
+ * the protocol exchange is preceded by its length as 2 bytes, big endian.
+ * The receiver reads whatever is available into rxb and hands out one frame
+ * at a time from there so there's no need to work out the frame length from
+ * the flag bits a few bytes at a time. */
+
+static int _psl_send_frame(struct AFU_EVENT *event, int size)
+{
+	unsigned char frame[PSL_BUFFER_SIZE + 2];
+
+	if (!event->framed)
+		return _psl_send(event, event->tbuf, size);
+	frame[0] = (size >> 8) & 0xFF;
+	frame[1] = size & 0xFF;
+	memcpy(frame + 2, event->tbuf, size);
+	return _psl_send(event, frame, size + 2);
+}
+
+// Is there a complete frame waiting in rxb?
+static int _psl_frame_ready(struct AFU_EVENT *event)
+{
+	uint32_t avail, size;
+
+	avail = event->rxb_end - event->rxb_start;
+	if (avail < 2)
+		return 0;
+	size = (event->rxb[event->rxb_start] << 8) |
+	    event->rxb[event->rxb_start + 1];
+	return (avail >= size + 2);
+}
+
+// Move next frame into rbuf, returns 1 if there was one, 0 if none is
+// complete yet, -1 on error and -2 on close
+static int _psl_read_frame(struct AFU_EVENT *event)
+{
+	uint32_t avail, size;
+	int bc;
+
+	if (!_psl_frame_ready(event)) {
+		avail = event->rxb_end - event->rxb_start;
+		if (event->rxb_start != 0) {
+			memmove(event->rxb, event->rxb + event->rxb_start,
+				avail);
+			event->rxb_start = 0;
+			event->rxb_end = avail;
+		}
+		bc = _psl_recv(event, event->rxb + event->rxb_end,
+			       PSL_RX_BUFFER_SIZE - event->rxb_end);
+		if (bc == -1)
+			return (errno == EWOULDBLOCK) ? 0 : -1;
+		if (bc == 0)
+			return -2;
+		event->rxb_end += bc;
+		if (!_psl_frame_ready(event))
+			return 0;
+	}
+	size = (event->rxb[event->rxb_start] << 8) |
+	    event->rxb[event->rxb_start + 1];
+	if ((size == 0) || (size > PSL_BUFFER_SIZE)) {
+		fprintf(stderr, "ERROR: bad frame length %d\n", size);
+		return -1;
+	}
+	memcpy(event->rbuf, event->rxb + event->rxb_start + 2, size);
+	event->rxb_start += size + 2;
+	event->rbp = size;
+	return 1;
+}
+
+/* Call this to wait for data from the other side of the connection */
+
+void psl_wait_events(struct AFU_EVENT *event)
+{
+	fd_set watchset;	/* fds to read from */
+	pid_t peer;
+
+	// Idle burst clocks are run locally and buffered frames are already
+	// here, no need to wait
+	if (event->idle_clocks || (event->framed && _psl_frame_ready(event)))
+		return;
+
+	if (event->shm) {
+		if (event->shm_rx == &(event->shm->to_psl))
+			peer = event->shm->afu_pid;
+		else
+			peer = event->shm->psl_pid;
+		_shm_wait(event->shm, event->shm_rx, peer);
+		return;
+	}
+	FD_ZERO(&watchset);
+	FD_SET(event->sockfd, &watchset);
+	select(event->sockfd + 1, &watchset, NULL, NULL, NULL);
+}
+
+// Create shared memory segment for port and offer it to the PSL side
+static struct psl_shm *_shm_create(int port)
+{
+	struct psl_shm *shm;
+	char name[64];
+	int fd;
+
+	sprintf(name, PSL_SHM_NAME, port);
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(struct psl_shm)) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof(struct psl_shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		shm_unlink(name);
+		return NULL;
+	}
+	memset(shm, 0, sizeof(struct psl_shm));
+	shm->afu_pid = getpid();
+	shm->state = PSL_SHM_LISTEN;
+	__atomic_store_n(&shm->magic, PSL_SHM_MAGIC, __ATOMIC_RELEASE);
+	return shm;
+}
+
+// Withdraw shared memory segment offer, keeping mapping if shm is in use
+static void _shm_unlink(struct psl_shm *shm, int port, int unmap)
+{
+	char name[64];
+
+	sprintf(name, PSL_SHM_NAME, port);
+	shm_unlink(name);
+	if (unmap)
+		munmap(shm, sizeof(struct psl_shm));
+}
+
+// Attach to shared memory segment created by AFU side for port
+static int _shm_connect(struct AFU_EVENT *event, int port)
+{
+	struct psl_shm *shm;
+	uint32_t state;
+	char name[64];
+	int fd;
+
+	sprintf(name, PSL_SHM_NAME, port);
+	fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0) {
+		perror("shm_open");
+		return PSL_BAD_SOCKET;
+	}
+	shm = mmap(NULL, sizeof(struct psl_shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return PSL_BAD_SOCKET;
+	}
+	state = PSL_SHM_LISTEN;
+	if ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != PSL_SHM_MAGIC)
+	    || !__atomic_compare_exchange_n(&shm->state, &state,
+					    PSL_SHM_CONNECTED, 0,
+					    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		fprintf(stderr, "ERROR: %s is not accepting connections\n",
+			name);
+		munmap(shm, sizeof(struct psl_shm));
+		return PSL_BAD_SOCKET;
+	}
+	shm->psl_pid = getpid();
+	event->sockfd = -1;
+	event->shm = shm;
+	event->shm_tx = &(shm->to_afu);
+	event->shm_rx = &(shm->to_psl);
+	return PSL_SUCCESS;
+}
+
 /*static void set_protocol_level(struct AFU_EVENT *event, uint32_t primary,
 			       uint32_t secondary, uint32_t tertiary)
 {
@@ -64,10 +378,7 @@ static uint32_t genoddParitybitperbytes(uint64_t data)
 
 static int establish_protocol(struct AFU_EVENT *event)
 {
-	int bc, bl, bp, i;
-	bp = 0;
-	bl = 16;
-	fd_set watchset;	/* fds to read from */
+	int bc, i;
 	uint8_t byte;
 	uint32_t primary, secondary, tertiary;
 
@@ -88,33 +399,27 @@ static int establish_protocol(struct AFU_EVENT *event)
 		event->tbuf[12 + i] =
 		    ((event->proto_tertiary) >> ((3 - i) * 8)) & 0xFF;
 	}
-	while (bp < bl) {
-		bc = send(event->sockfd, event->tbuf + bp, bl - bp, 0);
-		if (bc < 0) {
-			fprintf(stderr, "ERROR: establish_protocol: send failed: %s\n",
-							strerror(errno));
-			return PSL_TRANSMISSION_ERROR;
-		}
-		bp += bc;
+	if (_psl_send(event, event->tbuf, 16) != PSL_SUCCESS) {
+		fprintf(stderr, "ERROR: establish_protocol: send failed: %s\n",
+						strerror(errno));
+		return PSL_TRANSMISSION_ERROR;
 	}
 
 	// Get protocol ID from other side of socket connection
 	bc = 0;
-	FD_ZERO(&watchset);
-	FD_SET(event->sockfd, &watchset);
-	select(event->sockfd + 1, &watchset, NULL, NULL, NULL);
+	psl_wait_events(event);
 	while ((event->rbp < 16) && (bc != -1)) {
 		if ((bc =
-		     recv(event->sockfd, &(event->rbuf[event->rbp]), 1,
-			  0)) == -1) {
+		     _psl_recv(event, &(event->rbuf[event->rbp]), 1)) == -1) {
 			if (errno == EWOULDBLOCK) {
-				select(event->sockfd + 1, &watchset, NULL, NULL,
-				       NULL);
+				psl_wait_events(event);
 				continue;
 			} else {
 				return PSL_BAD_SOCKET;
 			}
 		}
+		if (bc == 0)
+			return PSL_BAD_SOCKET;
 		event->rbp += bc;
 	}
 	event->rbp = 0;
@@ -162,6 +467,20 @@ static int establish_protocol(struct AFU_EVENT *event)
 		return PSL_BAD_SOCKET;
 	}
 	
+	// Idle bursts, framing and buffer read tags are only used if both
+	// sides understand them
+	event->idle_burst = (secondary == event->proto_secondary) &&
+	    (tertiary >= PROTOCOL_IDLE_BURST) &&
+	    (event->proto_tertiary >= PROTOCOL_IDLE_BURST);
+	event->framed = (secondary == event->proto_secondary) &&
+	    (tertiary >= PROTOCOL_FRAMED) &&
+	    (event->proto_tertiary >= PROTOCOL_FRAMED);
+	event->buffer_tag = (secondary == event->proto_secondary) &&
+	    (tertiary >= PROTOCOL_BUFFER_TAG) &&
+	    (event->proto_tertiary >= PROTOCOL_BUFFER_TAG);
+	event->rxb_start = 0;
+	event->rxb_end = 0;
+
 	// Check for mis-matched primary level and error out if found
 	if (primary != event->proto_primary) {
 		printf("ERROR: Remote psl_interface code using different PSL revision level!!\n");
@@ -219,6 +538,15 @@ int psl_init_afu_event(struct AFU_EVENT *event, char *server_host, int port)
 	psl_event_reset(event);
 	event->room = 64;
 	event->rbp = 0;
+	if (strncmp(server_host, PSL_SHM_PREFIX, strlen(PSL_SHM_PREFIX)) == 0) {
+		if (_shm_connect(event, port) != PSL_SUCCESS)
+			return PSL_BAD_SOCKET;
+		int rc = establish_protocol(event);
+		printf("PSL_SHM: Using PSL protocol level : %d.%d.%d\n",
+		       event->proto_primary, event->proto_secondary,
+		       event->proto_tertiary);
+		return rc;
+	}
 	struct hostent *he;
 	if ((he = gethostbyname(server_host)) == NULL) {
 		herror("gethostbyname");
@@ -255,6 +583,11 @@ int psl_close_afu_event(struct AFU_EVENT *event)
 {
 	char buffer[4096];
 
+	if (event->shm) {
+		_shm_close(event);
+		return PSL_SUCCESS;
+	}
+
 	// Shutdown socket traffic
 	if (shutdown(event->sockfd, SHUT_RDWR))
 		return PSL_CLOSE_ERROR;
@@ -273,10 +606,14 @@ int psl_close_afu_event(struct AFU_EVENT *event)
 
 /* Call this once after creation to initialize the AFU_EVENT structure. */
 /* This function initializes the AFU side of the interface which is the
- * server in the socket connection. */
+ * server in the socket connection.  A shared memory segment is offered for
+ * the same port and whichever of the two the PSL side connects to first is
+ * used. */
 
 int psl_serv_afu_event(struct AFU_EVENT *event, int port)
 {
+	struct psl_shm *shm;
+	struct pollfd pfd;
 	int cs = -1;
 	psl_event_reset(event);
 	event->room = 64;
@@ -313,14 +650,37 @@ int psl_serv_afu_event(struct AFU_EVENT *event, int port)
 		psl_close_afu_event(event);
 		return PSL_BAD_SOCKET;
 	}
+	shm = _shm_create(port);
+	pfd.fd = event->sockfd;
+	pfd.events = POLLIN;
 	while (cs < 0) {
+		if (shm && (shm->state == PSL_SHM_CONNECTED)) {
+			_shm_unlink(shm, port, 0);
+			close(event->sockfd);
+			event->sockfd = -1;
+			event->shm = shm;
+			event->shm_tx = &(shm->to_psl);
+			event->shm_rx = &(shm->to_afu);
+			printf("PSL client connection through shared memory\n");
+			int rc = establish_protocol(event);
+			printf("Using PSL protocol level : %d.%d.%d\n",
+			       event->proto_primary, event->proto_secondary,
+			       event->proto_tertiary);
+			return rc;
+		}
+		if (poll(&pfd, 1, shm ? 1 : -1) <= 0)
+			continue;
 		cs = accept(event->sockfd, (struct sockaddr *)&csadr, &csalen);
 		if ((cs < 0) && (errno != EINTR)) {
 			perror("accept");
+			if (shm)
+				_shm_unlink(shm, port, 1);
 			psl_close_afu_event(event);
 			return PSL_BAD_SOCKET;
 		}
 	}
+	if (shm)
+		_shm_unlink(shm, port, 1);
 	close(event->sockfd);
 	event->sockfd = cs;
 	fcntl(event->sockfd, F_SETFL, O_NONBLOCK);
@@ -661,7 +1021,6 @@ psl_get_buffer_read_data(struct AFU_EVENT *event,
 		return PSL_BUFFER_READ_DATA_NOT_VALID;
 	} else {
 		event->buffer_rdata_valid = 0;
-		event->buffer_read = 0;
 		memcpy(read_data, event->buffer_rdata,
 		       sizeof(event->buffer_rdata));
 		memcpy(read_parity, event->buffer_rparity,
@@ -716,7 +1075,7 @@ psl_get_command(struct AFU_EVENT *event,
 
 int psl_signal_afu_model(struct AFU_EVENT *event)
 {
-        int i, bc, bl;
+        int i;
 	int bp = 1;
 #ifdef PSL9
 	int bytes_to_xfer;
@@ -902,15 +1261,38 @@ int psl_signal_afu_model(struct AFU_EVENT *event)
 //	  printf( "\n" );
 //	}
 
-	bl = bp;
-	bp = 0;
-	while (bp < bl) {
-		bc = send(event->sockfd, event->tbuf + bp, bl - bp, 0);
-		if (bc < 0)
-			return PSL_TRANSMISSION_ERROR;
-		bp += bc;
+	return _psl_send_frame(event, bp);
+}
+
+/* Call this instead of psl_signal_afu_model when there is nothing to send to
+ * the AFU.  The AFU side runs up to cycles clocks on its own and answers
+ * once the AFU drives a command, MMIO ack, aux2 change or DMA request or the
+ * clocks run out.  The number of clocks actually run is in idle_elapsed
+ * after psl_get_afu_events returns.  If the other side doesn't support idle
+ * bursts or there are events to send this just sends a single clock */
+
+int psl_signal_afu_idle(struct AFU_EVENT *event, uint32_t cycles)
+{
+	int i;
+	int bp = 1;
+
+	if (!event->idle_burst || (cycles < 2) || event->aux1_change ||
+	    event->job_valid || event->mmio_valid || event->response_valid ||
+	    event->buffer_read || event->buffer_write)
+		return psl_signal_afu_model(event);
+#ifdef PSL9
+	if (event->dma0_completion_valid || event->dma0_sent_utag_valid)
+		return psl_signal_afu_model(event);
+#endif
+	if (event->clock != 0)
+		return PSL_TRANSMISSION_ERROR;
+	event->clock = 1;
+	// Clock bit clear marks an idle burst, followed by number of clocks
+	event->tbuf[0] = 0x00;
+	for (i = 0; i < 4; i++) {
+		event->tbuf[bp++] = (cycles >> ((3 - i) * 8)) & 0xFF;
 	}
-	return PSL_SUCCESS;
+	return _psl_send_frame(event, bp);
 }
 
 /* Call this to send an event to the PSL model */
@@ -918,8 +1300,11 @@ int psl_signal_afu_model(struct AFU_EVENT *event)
 
 static int psl_signal_psl_model(struct AFU_EVENT *event)
 {
-	int i, bc, bl;
+	int i;
 	int bp = 1;
+#ifdef PSL9
+	int bc;
+#endif
 	if (event->clock != 1)
 		return PSL_SUCCESS;
 	event->clock = 0;
@@ -1035,6 +1420,8 @@ static int psl_signal_psl_model(struct AFU_EVENT *event)
 		for (i = 0; i < 2; i++) {
 			event->tbuf[bp++] = event->buffer_rparity[i];
 		}
+		if (event->buffer_tag)
+			event->tbuf[bp++] = event->buffer_rdata_tag;
 		event->buffer_rdata_valid = 0;
 	}
 	if (event->command_valid) {
@@ -1064,6 +1451,15 @@ static int psl_signal_psl_model(struct AFU_EVENT *event)
 		//printf("PSL_SIGNAL_PSL_MODEL: event->command_valid =1 send to PSL, tbuf[0] is 0x%02x  bp is %2d \n", event->tbuf[0], bp);
 		event->command_valid = 0;
 	}
+	if (event->idle_elapsed) {
+		// End of idle burst, report how many clocks were run
+		event->tbuf[0] = event->tbuf[0] | 0x20;
+		for (i = 0; i < 4; i++) {
+			event->tbuf[bp++] =
+			    ((event->idle_elapsed) >> ((3 - i) * 8)) & 0xFF;
+		}
+		event->idle_elapsed = 0;
+	}
 
 
         // dump tbuf
@@ -1073,14 +1469,9 @@ static int psl_signal_psl_model(struct AFU_EVENT *event)
 //	  printf( "\n" );
 //	}
 
-	bl = bp;
-	bp = 0;
-	while (bp < bl) {
-		bc = send(event->sockfd, event->tbuf + bp, bl - bp, 0);
-		if (bc < 0) {
-			printf ("PSL TRANSMISSION ERROR! bc =0x%x bp= 0x%x \n", bc, bp);
-			return PSL_TRANSMISSION_ERROR; }
-		bp += bc;
+	if (_psl_send_frame(event, bp) != PSL_SUCCESS) {
+		printf ("PSL TRANSMISSION ERROR! bp= 0x%x \n", bp);
+		return PSL_TRANSMISSION_ERROR;
 	}
 	return PSL_SUCCESS;
 }
@@ -1107,13 +1498,35 @@ int psl_get_afu_events(struct AFU_EVENT *event)
 #ifdef PSL9
 	uint32_t pbc = 0;
 #endif
-	fd_set watchset;	/* fds to read from */
-	/* initialize watchset */
-	FD_ZERO(&watchset);
-	FD_SET(event->sockfd, &watchset);
-	select(event->sockfd + 1, &watchset, NULL, NULL, NULL);
+	psl_wait_events(event);
+	if (event->framed) {
+		if ((bc = _psl_read_frame(event)) <= 0)
+			return (bc < 0) ? -1 : 0;
+		if ((event->rbuf[0] & 0x10) != 0) {
+			event->clock = 0;
+			if (event->rbuf[0] == 0x10) {
+				event->rbp = 0;
+				return 1;
+			}
+		}
+#ifdef PSL9
+		// DMA write data is whatever the other parts leave over
+		pbc = event->rbp - 8;
+		if ((event->rbuf[0] & 0x20) != 0)
+			pbc -= 4;
+		if ((event->rbuf[0] & 0x08) != 0)
+			pbc -= 10;
+		if ((event->rbuf[0] & 0x04) != 0)
+			pbc -= 9;
+		if ((event->rbuf[0] & 0x02) != 0)
+			pbc -= event->buffer_tag ? 131 : 130;
+		if ((event->rbuf[0] & 0x01) != 0)
+			pbc -= 16;
+#endif
+		goto decode;
+	}
 	if (event->rbp == 0) {
-		if ((bc = recv(event->sockfd, event->rbuf, 1, 0)) == -1) {
+		if ((bc = _psl_recv(event, event->rbuf, 1)) == -1) {
 			if (errno == EWOULDBLOCK) {
 				return 0;
 			} else {
@@ -1133,12 +1546,14 @@ int psl_get_afu_events(struct AFU_EVENT *event)
 			}
 		}
 //printf("PSL_GET_AFU_EVENT-1 - rbuf[0] is 0x%02x and e->rbp = %2d  \n", event->rbuf[0], event->rbp);
+			if ((event->rbuf[0] & 0x20) != 0)
+				rbc += 4;
 			if ((event->rbuf[0] & 0x08) != 0)
 				rbc += 10;
 			if ((event->rbuf[0] & 0x04) != 0)
 				rbc += 9;
 		 	if ((event->rbuf[0] & 0x02) != 0)
-				rbc += 130;
+				rbc += event->buffer_tag ? 131 : 130;
 			if ((event->rbuf[0] & 0x01) != 0)
 #if defined PSL9 || PSL9lite
 			// add one byte for cpagesize
@@ -1152,7 +1567,7 @@ int psl_get_afu_events(struct AFU_EVENT *event)
 			if ((event->rbuf[0] & 0x80) != 0)  {
 				rbc += 7;
 		// this only gets us a dma rd op w/o data, have to add more to rbc so need to see what dtype  & req_size are)
-				if ((bc = recv(event->sockfd, event->rbuf + event->rbp, 3, 0)) == -1) {
+				if ((bc = _psl_recv(event, event->rbuf + event->rbp, 3)) == -1) {
 					if (errno == EWOULDBLOCK) {
 						return 0;
 					} else {
@@ -1198,8 +1613,7 @@ int psl_get_afu_events(struct AFU_EVENT *event)
 #endif
 	}
 	if ((bc =
-	     recv(event->sockfd, event->rbuf + event->rbp, rbc - event->rbp,
-		  0)) == -1) {
+	     _psl_recv(event, event->rbuf + event->rbp, rbc - event->rbp)) == -1) {
 		if (errno == EWOULDBLOCK) {
 			return 0;
 		} else {
@@ -1221,6 +1635,7 @@ int psl_get_afu_events(struct AFU_EVENT *event)
 //	printf( "\n" ); 
 
 	rbc = 1;
+ decode:
 #ifdef PSL9
 	if ((event->rbuf[0] & 0x80) != 0) {
 		event->dma0_dvalid = 1;
@@ -1322,6 +1737,8 @@ int psl_get_afu_events(struct AFU_EVENT *event)
 		for (bc = 0; bc < 2; bc++) {
 			event->buffer_rparity[bc] = event->rbuf[rbc++];
 		}
+		if (event->buffer_tag)
+			event->buffer_rdata_tag = event->rbuf[rbc++];
 	} else {
 		event->buffer_rdata_valid = 0;
 	}
@@ -1349,17 +1766,53 @@ int psl_get_afu_events(struct AFU_EVENT *event)
 			    ((event->command_handle) << 8) | event->rbuf[rbc++];
 		}
 #if defined PSL9 || defined PSL9lite
-		event->command_cpagesize = event->rbuf[rbc];
+		event->command_cpagesize = event->rbuf[rbc++];
 #endif
 		//printf(" rbc is %2d \n",rbc);
 	} else {
 		event->command_valid = 0;
 	}
+	if ((event->rbuf[0] & 0x20) != 0) {
+		event->idle_elapsed = 0;
+		for (bc = 0; bc < 4; bc++) {
+			event->idle_elapsed =
+			    ((event->idle_elapsed) << 8) | event->rbuf[rbc++];
+		}
+	}
 
 	event->rbp = 0;
 	return 1;
 }
 
+/* Run one clock of an idle burst on the AFU side.  Nothing is driven to the
+ * AFU during a burst.  The burst ends early when the AFU drives something
+ * the PSL side has to see, the PSL side is answered at the end of the burst */
+
+static void _psl_idle_clock(struct AFU_EVENT *event)
+{
+	event->aux1_change = 0;
+	event->job_valid = 0;
+	event->mmio_valid = 0;
+	event->response_valid = 0;
+	event->buffer_read = 0;
+	event->buffer_write = 0;
+#ifdef PSL9
+	event->dma0_completion_valid = 0;
+	event->dma0_sent_utag_valid = 0;
+	if (event->dma0_dvalid)
+		event->idle_clocks = 1;
+#endif
+	if (event->aux2_change || event->mmio_ack ||
+	    event->buffer_rdata_valid || event->command_valid)
+		event->idle_clocks = 1;
+	--event->idle_clocks;
+	++event->idle_elapsed;
+	if (event->idle_clocks == 0) {
+		event->clock = 1;
+		psl_signal_psl_model(event);
+	}
+}
+
 /* This function checks the socket connection for data from the external PSL
  * simulator. It needs to be called periodically to poll the socket connection.
  * (every clock cycle)  It will update the AFU_EVENT structure and returns a 1
@@ -1372,8 +1825,25 @@ int psl_get_psl_events(struct AFU_EVENT *event)
 #ifdef PSL9
 	int bytes_to_read;
 #endif
+	if (event->idle_clocks) {
+		_psl_idle_clock(event);
+		return 1;
+	}
+	if (event->framed) {
+		if ((bc = _psl_read_frame(event)) <= 0)
+			return bc;
+		if ((event->rbuf[0] & 0x40) != 0) {
+			event->clock = 1;
+			psl_signal_psl_model(event);
+			if (event->rbuf[0] == 0x40) {
+				event->rbp = 0;
+				return 1;
+			}
+		}
+		goto decode;
+	}
 	if (event->rbp == 0) {
-		if ((bc = recv(event->sockfd, event->rbuf, 1, 0)) == -1) {
+		if ((bc = _psl_recv(event, event->rbuf, 1)) == -1) {
 			if (errno == EWOULDBLOCK) {
 				return 0;
 			} else {
@@ -1393,6 +1863,8 @@ int psl_get_psl_events(struct AFU_EVENT *event)
 				return 1;
 			}
 		}
+		if (event->rbuf[0] == 0x00)
+			rbc += 4;
 		if ((event->rbuf[0] & 0x20) != 0)
 			rbc += 1;
 		if ((event->rbuf[0] & 0x10) != 0)
@@ -1412,7 +1884,7 @@ int psl_get_psl_events(struct AFU_EVENT *event)
 #ifdef PSL9
 		// have to look at second byte if this is a dma op
 		if ((event->rbuf[0] & 0x80) != 0) {
-			if ((bc = recv(event->sockfd, event->rbuf + event->rbp, 1, 0)) == -1) {
+			if ((bc = _psl_recv(event, event->rbuf + event->rbp, 1)) == -1) {
 				if (errno == EWOULDBLOCK) {
 					return 0;
 				} else {
@@ -1428,7 +1900,7 @@ int psl_get_psl_events(struct AFU_EVENT *event)
 			//printf("PSL_GET_PSL_EVENTS and event->rbuf[1] is 0x%x and rbc= 0x%x \n", event->rbuf[1], rbc);
 			// have to look at third & fourth byte if this is completion data
 			if ((event->rbuf[1] & 0x30) != 0)  {
-				if ((bc = recv(event->sockfd, event->rbuf + event->rbp, 1, 0)) == -1) {
+				if ((bc = _psl_recv(event, event->rbuf + event->rbp, 1)) == -1) {
 					if (errno == EWOULDBLOCK) {
 						return 0;
 					} else {
@@ -1439,7 +1911,7 @@ int psl_get_psl_events(struct AFU_EVENT *event)
 					return -1;
 				event->rbp += bc;
 				// look at next byte to get rest of cpl_size and type 
-				if ((bc = recv(event->sockfd, event->rbuf + event->rbp, 1, 0)) == -1) {
+				if ((bc = _psl_recv(event, event->rbuf + event->rbp, 1)) == -1) {
 					if (errno == EWOULDBLOCK) {
 						return 0;
 					} else {
@@ -1466,8 +1938,8 @@ int psl_get_psl_events(struct AFU_EVENT *event)
 		}	
 #endif /* ifdef PSL9 */
 		if ((bc =
-		     recv(event->sockfd, event->rbuf + event->rbp,
-			  rbc - event->rbp, 0)) == -1) {
+		     _psl_recv(event, event->rbuf + event->rbp,
+			  rbc - event->rbp)) == -1) {
 			if (errno == EWOULDBLOCK) {
 				return 0;
 			} else {
@@ -1488,6 +1960,21 @@ int psl_get_psl_events(struct AFU_EVENT *event)
 //	printf( "\n" ); 
 
 	rbc = 1;
+ decode:
+	if (event->rbuf[0] == 0x00) {
+		// Idle burst, first clock runs now
+		event->idle_clocks = 0;
+		for (bc = 0; bc < 4; bc++) {
+			event->idle_clocks =
+			    ((event->idle_clocks) << 8) | event->rbuf[rbc++];
+		}
+		if (event->idle_clocks == 0)
+			event->idle_clocks = 1;
+		event->idle_elapsed = 0;
+		event->rbp = 0;
+		_psl_idle_clock(event);
+		return 1;
+	}
 #ifdef PSL9
 //printf("PSL_GET_PSL_EVENTS event->rbuf[0] is 0x%2x and event->rbuf[1] is 0x%2x \n", event->rbuf[0], event->rbuf[1]);
 	if (((event->rbuf[0] & 0x80) == 0x80) && ((event->rbuf[1] & 0x30) == 0x30)) {
@@ -1719,11 +2206,24 @@ int
 psl_afu_read_buffer_data(struct AFU_EVENT *event,
 			 uint32_t length,
 			 uint8_t * read_data, uint8_t * read_parity)
+{
+	return psl_afu_read_buffer_data_tag(event, event->buffer_read_tag,
+					    length, read_data, read_parity);
+}
+
+/* Call this on the AFU side to build buffer read data for the buffer read
+ * with the given tag. Length should be 64 or 128 */
+
+int
+psl_afu_read_buffer_data_tag(struct AFU_EVENT *event, uint32_t tag,
+			     uint32_t length,
+			     uint8_t * read_data, uint8_t * read_parity)
 {
 	if (event->buffer_rdata_valid) {
 		return PSL_DOUBLE_COMMAND;
 	} else {
 		event->buffer_rdata_valid = 1;
+		event->buffer_rdata_tag = tag;
 		memcpy(event->buffer_rdata, read_data, length);
 		event->buffer_read_length = length;
 		memcpy(event->buffer_rparity, read_parity, length / 64);
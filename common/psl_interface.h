@@ -27,7 +27,9 @@ void psl_event_reset(struct AFU_EVENT *event);
  * a socket conection to an AFU server.  This function initializes the PSL side
  * of the interface which is the client in the socket connection server_host
  * should be the name of the server hosting the simulation of the AFU and port
- * is the active port on that server */
+ * is the active port on that server.  If server_host starts with "shm:" the
+ * shared memory segment the AFU server offers for port is used instead of a
+ * socket, this only works when both run on the same machine */
 
 int psl_init_afu_event(struct AFU_EVENT *event, char *server_host, int port);
 
@@ -41,6 +43,13 @@ int psl_close_afu_event(struct AFU_EVENT *event);
 
 int psl_serv_afu_event(struct AFU_EVENT *event, int port);
 
+/* Call this to block until data from the other side of the connection is
+ * available or the connection is closed.  Works for both the socket and the
+ * shared memory transport.  AFU models must wait here rather than selecting
+ * on sockfd themselves, idle bursts are clocked without any socket traffic */
+
+void psl_wait_events(struct AFU_EVENT *event);
+
 /* Call this to change auxilliary signals (room) */
 
 int psl_aux1_change(struct AFU_EVENT *event, uint32_t room);
@@ -173,6 +182,13 @@ int psl_get_command(struct AFU_EVENT *event,
 
 int psl_signal_afu_model(struct AFU_EVENT *event);
 
+/* Call this instead of psl_signal_afu_model when nothing needs to be sent to
+ * the AFU to let the AFU side run up to cycles clocks on its own.  The AFU
+ * side answers early if the AFU drives a command, MMIO ack, aux2 change or
+ * DMA request.  The number of clocks run is left in idle_elapsed */
+
+int psl_signal_afu_idle(struct AFU_EVENT *event, uint32_t cycles);
+
 /* This function checks the socket connection for data from the external AFU
  * simulator. It needs to be called periodically to poll the socket connection.
  * It will update the AFU_EVENT structure.  It returns a 1 if there are new
@@ -225,6 +241,13 @@ int psl_afu_read_buffer_data(struct AFU_EVENT *event,
 			     uint32_t length,
 			     uint8_t * read_data, uint8_t * read_parity);
 
+/* Call this on the AFU side to build buffer read data for the buffer read
+ * with the given tag. Length should be 64 or 128 */
+
+int psl_afu_read_buffer_data_tag(struct AFU_EVENT *event, uint32_t tag,
+				 uint32_t length,
+				 uint8_t * read_data, uint8_t * read_parity);
+
 /* Call this on the AFU side to change the auxilliary signals
  * (running, done, job error, buffer read latency) */
 
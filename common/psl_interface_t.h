@@ -37,20 +37,36 @@
 // we'll set it at 512 for now and see if we can come up with the correct value later
 #define PSL_BUFFER_SIZE 512
 
+// size of the buffered reader used with length prefixed frames, holds several
+// frames so one read of the connection can pick up all that are available
+#define PSL_RX_BUFFER_SIZE 4096
+
+// PROTOCOL_IDLE_BURST is the first tertiary level that understands idle bursts
+// PROTOCOL_FRAMED is the first tertiary level using length prefixed frames
+// PROTOCOL_BUFFER_TAG is the first tertiary level tagging buffer read data
 #ifdef PSL8
 #define PROTOCOL_PRIMARY 0
 #define PROTOCOL_SECONDARY 9908
-#define PROTOCOL_TERTIARY 1
+#define PROTOCOL_TERTIARY 4
+#define PROTOCOL_IDLE_BURST 2
+#define PROTOCOL_FRAMED 3
+#define PROTOCOL_BUFFER_TAG 4
 #endif /* PSL8 */
 #ifdef PSL9lite
 #define PROTOCOL_PRIMARY 1
 #define PROTOCOL_SECONDARY 0000
-#define PROTOCOL_TERTIARY 0
+#define PROTOCOL_TERTIARY 3
+#define PROTOCOL_IDLE_BURST 1
+#define PROTOCOL_FRAMED 2
+#define PROTOCOL_BUFFER_TAG 3
 #endif /* PSL9lite */
 #ifdef PSL9
 #define PROTOCOL_PRIMARY 2
 #define PROTOCOL_SECONDARY 0000
-#define PROTOCOL_TERTIARY 0
+#define PROTOCOL_TERTIARY 3
+#define PROTOCOL_IDLE_BURST 1
+#define PROTOCOL_FRAMED 2
+#define PROTOCOL_BUFFER_TAG 3
 #endif /* PSL9 */
 
 /* Select # of DMA interfaces, per config options in CH 17 of workbook */
@@ -244,18 +260,63 @@
 #endif /* new DMA type & status defs */
 
 
+/* Shared memory transport.  When the PSL side is given a host name of the
+ * form "shm:<host>" it attaches to a shared memory segment created by the
+ * AFU side for the same port instead of opening a socket.  The segment holds
+ * one single-producer/single-consumer byte ring in each direction which
+ * carries exactly the same byte stream as the socket would. */
+
+#define PSL_SHM_PREFIX "shm:"
+#define PSL_SHM_NAME "/pslse.%d"
+#define PSL_SHM_MAGIC 0x50534c53
+#define PSL_SHM_RING_SIZE 0x10000	/* must be a power of 2 */
+#define PSL_SHM_SPIN 2000		/* polls before blocking on futex */
+
+#define PSL_SHM_LISTEN 1
+#define PSL_SHM_CONNECTED 2
+#define PSL_SHM_CLOSED 3
+
+/* *INDENT-OFF* */
+struct psl_shm_ring {
+  volatile uint32_t head __attribute__ ((aligned(64))); /* producer position, futex word */
+  volatile uint32_t tail __attribute__ ((aligned(64))); /* consumer position */
+  volatile uint32_t waiting;          /* consumer is blocked on head */
+  unsigned char data[PSL_SHM_RING_SIZE]; /* ring data */
+};
+
+struct psl_shm {
+  uint32_t magic;                     /* PSL_SHM_MAGIC once initialized */
+  volatile uint32_t state;            /* PSL_SHM_LISTEN, _CONNECTED or _CLOSED */
+  volatile int32_t afu_pid;           /* process id of the AFU side */
+  volatile int32_t psl_pid;           /* process id of the PSL side */
+  struct psl_shm_ring to_afu;         /* PSL to AFU byte stream */
+  struct psl_shm_ring to_psl;         /* AFU to PSL byte stream */
+};
+/* *INDENT-ON* */
+
 /* Create one of these structures to interface to an AFU model and use the functions below to manipulate it */
 
 /* *INDENT-OFF* */
 struct AFU_EVENT {
   int sockfd;                         /* socket file descriptor */
+  struct psl_shm *shm;                /* shared memory segment, NULL when using the socket */
+  struct psl_shm_ring *shm_tx;        /* shared memory ring this side writes */
+  struct psl_shm_ring *shm_rx;        /* shared memory ring this side reads */
   uint32_t proto_primary;             /* socket protocol version 1st number */
   uint32_t proto_secondary;           /* socket protocol version 2nd number */
   uint32_t proto_tertiary;            /* socket protocol version 3rd number */
   int clock;                          /* clock */
+  uint32_t idle_burst;                /* other side supports idle bursts */
+  uint32_t idle_clocks;               /* AFU side: clocks left to run locally in current idle burst */
+  uint32_t idle_elapsed;              /* clocks run in current (AFU side) or last (PSL side) idle burst */
   unsigned char tbuf[PSL_BUFFER_SIZE];/* transmit buffer for socket communications */
   unsigned char rbuf[PSL_BUFFER_SIZE];/* receive buffer for socket communications */
   uint32_t rbp;                       /* receive buffer position */
+  uint32_t framed;                    /* frames carry a 2 byte length prefix */
+  uint32_t buffer_tag;                /* buffer read data carries its tag */
+  unsigned char rxb[PSL_RX_BUFFER_SIZE]; /* buffered reader for length prefixed frames */
+  uint32_t rxb_start;                 /* start of unread data in rxb */
+  uint32_t rxb_end;                   /* end of unread data in rxb */
   uint64_t job_address;               /* effective address of the work element descriptor */
   uint64_t job_error;                 /* error code for completed job */
   uint32_t job_valid;                 /* AFU event contains a valid job control command */
@@ -310,6 +371,7 @@ struct AFU_EVENT {
   uint32_t buffer_rdata_valid;        /* buffer read data is valid */
   unsigned char buffer_rdata[128];    /* 128B data to read from the AFUs buffer (only first half used for 64B calls) */
   unsigned char buffer_rparity[2];    /* 128b parity for the read data (only first half used for 64B calls) */
+  uint32_t buffer_rdata_tag;          /* tag of the buffer read this data answers */
   uint32_t aux1_change;               /* The value of one of the auxilliary signals has changed (room) */
   uint32_t room;                      /* the number of commands PSL has room to accept */
   uint64_t command_address;           /* effective address for commands requiring an address */
@@ -18,9 +18,11 @@
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
@@ -57,77 +59,306 @@ uint64_t ntohll(uint64_t netlonglong)
 }
 #endif				/* __APPLE__ */
 
-// Display fatal message (For catching coding bugs, not AFU bugs)
-void fatal_msg(const char *format, ...)
+// Messages made after msg_start() wait in a ring for the writer thread, so
+// the thread making them never takes the stdio lock or flushes.  Each one
+// is the level, a 16 bit length and the text.
+#define MSG_RING_BYTES	(256 * 1024)
+#define MSG_HEADER	3
+
+// Time between writer thread rounds
+#define MSG_WRITE_NS	2000000
+
+int msg_level = MSG_LEVEL_DEBUG;
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	size_t head;
+	size_t tail;
+	int running;
+	int stop;
+	char ring[MSG_RING_BYTES];
+} _msg = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *_msg_names[] = { "fatal", "error", "warn", "info", "debug" };
+static const char *_msg_prefix[] = { "FATAL:", "ERROR:", "WARNING:", "INFO:",
+	"DEBUG:"
+};
+
+int msg_level_set(const char *name)
 {
-	va_list args;
+	char *end;
+	long level;
+	int i;
+
+	for (i = MSG_LEVEL_FATAL; i <= MSG_LEVEL_DEBUG; i++) {
+		if (!strcasecmp(name, _msg_names[i])) {
+			msg_level = i;
+			return 0;
+		}
+	}
+	level = strtol(name, &end, 0);
+	if ((*end != '\0') || (end == name) || (level < MSG_LEVEL_FATAL) ||
+	    (level > MSG_LEVEL_DEBUG))
+		return -1;
+	msg_level = level;
+	return 0;
+}
+
+// Runtime level for every program using these messages, set before main()
+static void __attribute__ ((constructor)) _msg_env(void)
+{
+	char *name;
+
+	name = getenv("PSLSE_LOG_LEVEL");
+	if (name && (msg_level_set(name) < 0))
+		warn_msg("PSLSE_LOG_LEVEL must be fatal, error, warn, info, "
+			 "debug or 0-4");
+}
+
+static size_t _msg_format(char *line, int level, const char *format,
+			  va_list args)
+{
+	int size, max;
+
+	// Leave room for the suffix
+	max = MAX_LINE_CHARS - 3;
+	size = snprintf(line, max, "%s", _msg_prefix[level]);
+	size += vsnprintf(line + size, max - size, format, args);
+	if (size >= max)
+		size = max - 1;
+	if (level <= MSG_LEVEL_WARN)
+		line[size++] = '!';
+	line[size++] = '\n';
+	return size;
+}
+
+// Display message from the calling thread
+static void _msg_display(int level, const char *line, size_t size)
+{
+	FILE *stream = (level <= MSG_LEVEL_WARN) ? stderr : stdout;
 
 	fflush(stdout);
-	fprintf(stderr, "FATAL:");
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	va_end(args);
-	fprintf(stderr, "!\n");
-	fflush(stderr);
+	fwrite(line, 1, size, stream);
+	fflush(stream);
 }
 
-// Display error message
-void error_msg(const char *format, ...)
+static void _msg_copy(char *to, size_t from, size_t size)
 {
-	va_list args;
+	size_t at = from % MSG_RING_BYTES;
+	size_t part = MSG_RING_BYTES - at;
+
+	if (part > size)
+		part = size;
+	memcpy(to, _msg.ring + at, part);
+	memcpy(to + part, _msg.ring, size - part);
+}
+
+// Queue message for the writer thread, waiting for room if needed
+static int _msg_queue(int level, const char *line, size_t size)
+{
+	char header[MSG_HEADER];
+	size_t at, part, i;
+
+	if (!__atomic_load_n(&_msg.running, __ATOMIC_ACQUIRE))
+		return -1;
+
+	header[0] = level;
+	header[1] = size >> 8;
+	header[2] = size & 0xff;
+	pthread_mutex_lock(&_msg.lock);
+	while (!_msg.stop &&
+	       (_msg.head - _msg.tail + MSG_HEADER + size > MSG_RING_BYTES)) {
+		pthread_cond_signal(&_msg.wake);
+		pthread_cond_wait(&_msg.done, &_msg.lock);
+	}
+	if (_msg.stop) {
+		pthread_mutex_unlock(&_msg.lock);
+		return -1;
+	}
+	for (i = 0; i < MSG_HEADER; i++)
+		_msg.ring[(_msg.head + i) % MSG_RING_BYTES] = header[i];
+	at = (_msg.head + MSG_HEADER) % MSG_RING_BYTES;
+	part = MSG_RING_BYTES - at;
+	if (part > size)
+		part = size;
+	memcpy(_msg.ring + at, line, part);
+	memcpy(_msg.ring, line + part, size - part);
+	_msg.head += MSG_HEADER + size;
+	if (_msg.head - _msg.tail > MSG_RING_BYTES / 2)
+		pthread_cond_signal(&_msg.wake);
+	pthread_mutex_unlock(&_msg.lock);
+	return 0;
+}
+
+// Display everything queued, only called by the writer thread or once it
+// has exited
+static void _msg_drain(void)
+{
+	char line[MAX_LINE_CHARS];
+	unsigned char header[MSG_HEADER];
+	FILE *stream, *last;
+	size_t head, tail, size;
+
+	pthread_mutex_lock(&_msg.lock);
+	head = _msg.head;
+	tail = _msg.tail;
+	pthread_mutex_unlock(&_msg.lock);
+	if (head == tail)
+		return;
+
+	// Producers only write past head, so this part of the ring is stable
+	last = NULL;
+	while (tail != head) {
+		_msg_copy((char *)header, tail, MSG_HEADER);
+		size = (header[1] << 8) | header[2];
+		_msg_copy(line, tail + MSG_HEADER, size);
+		tail += MSG_HEADER + size;
+		stream = (header[0] <= MSG_LEVEL_WARN) ? stderr : stdout;
+		if (last && (stream != last))
+			fflush(last);
+		fwrite(line, 1, size, stream);
+		last = stream;
+	}
+	fflush(last);
+
+	pthread_mutex_lock(&_msg.lock);
+	_msg.tail = tail;
+	pthread_cond_broadcast(&_msg.done);
+	pthread_mutex_unlock(&_msg.lock);
+}
+
+static void *_msg_writer(void *ptr)
+{
+	struct timespec ts;
+	sigset_t set;
+
+	// Signal handlers may call msg_flush() and wait on this thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&_msg.lock);
+	while (!_msg.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += MSG_WRITE_NS;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&_msg.wake, &_msg.lock, &ts);
+		pthread_mutex_unlock(&_msg.lock);
+		_msg_drain();
+		pthread_mutex_lock(&_msg.lock);
+	}
+	pthread_mutex_unlock(&_msg.lock);
+
+	return NULL;
+}
+
+int msg_start(void)
+{
+	static int registered;
+
+	if (__atomic_load_n(&_msg.running, __ATOMIC_ACQUIRE))
+		return -1;
 
 	fflush(stdout);
-	fprintf(stderr, "ERROR:");
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	va_end(args);
-	fprintf(stderr, "!\n");
 	fflush(stderr);
-	exit(-1);
+	_msg.stop = 0;
+	if (pthread_create(&(_msg.thread), NULL, _msg_writer, NULL))
+		return -1;
+	__atomic_store_n(&_msg.running, 1, __ATOMIC_RELEASE);
+
+	// Messages queued before exit() still get displayed
+	if (!registered)
+		atexit(msg_stop);
+	registered = 1;
+	return 0;
+}
+
+void msg_flush(void)
+{
+	struct timespec ts;
+
+	if (!__atomic_load_n(&_msg.running, __ATOMIC_ACQUIRE))
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec++;
+	pthread_mutex_lock(&_msg.lock);
+	while ((_msg.tail != _msg.head) && !_msg.stop) {
+		pthread_cond_signal(&_msg.wake);
+		if (pthread_cond_timedwait(&_msg.done, &_msg.lock, &ts) ==
+		    ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&_msg.lock);
+}
+
+void msg_stop(void)
+{
+	if (!__atomic_load_n(&_msg.running, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&_msg.lock);
+	_msg.stop = 1;
+	pthread_cond_signal(&_msg.wake);
+	// Wake anyone waiting for room, they display their own message
+	pthread_cond_broadcast(&_msg.done);
+	pthread_mutex_unlock(&_msg.lock);
+	pthread_join(_msg.thread, NULL);
+
+	__atomic_store_n(&_msg.running, 0, __ATOMIC_RELEASE);
+	_msg_drain();
 }
 
-// Display warning message
-void warn_msg(const char *format, ...)
+// Display message at level
+void level_msg(int level, const char *format, ...)
 {
+	char line[MAX_LINE_CHARS];
 	va_list args;
+	size_t size;
 
-	fflush(stdout);
-	fprintf(stderr, "WARNING:");
 	va_start(args, format);
-	vfprintf(stderr, format, args);
+	size = _msg_format(line, level, format, args);
 	va_end(args);
-	fprintf(stderr, "!\n");
-	fflush(stderr);
+	if (_msg_queue(level, line, size) < 0)
+		_msg_display(level, line, size);
 }
 
-// Display informational message
-void info_msg(const char *format, ...)
+// Display fatal message (For catching coding bugs, not AFU bugs)
+void fatal_msg(const char *format, ...)
 {
+	char line[MAX_LINE_CHARS];
 	va_list args;
+	size_t size;
 
-	fflush(stdout);
-	printf("INFO:");
 	va_start(args, format);
-	vprintf(format, args);
+	size = _msg_format(line, MSG_LEVEL_FATAL, format, args);
 	va_end(args);
-	printf("\n");
-	fflush(stdout);
+	msg_flush();
+	_msg_display(MSG_LEVEL_FATAL, line, size);
 }
 
-// Display debug message
-void debug_msg(const char *format, ...)
+// Display error message
+void error_msg(const char *format, ...)
 {
-#ifdef DEBUG
+	char line[MAX_LINE_CHARS];
 	va_list args;
+	size_t size;
 
-	fflush(stdout);
-	printf("DEBUG:");
 	va_start(args, format);
-	vprintf(format, args);
+	size = _msg_format(line, MSG_LEVEL_ERROR, format, args);
 	va_end(args);
-	printf("\n");
-#endif				/* DEBUG */
-	fflush(stdout);
+	msg_flush();
+	_msg_display(MSG_LEVEL_ERROR, line, size);
+	exit(-1);
 }
 
 // Delay for up to ns nanoseconds
@@ -139,14 +370,6 @@ void ns_delay(long ns)
 	nanosleep(&ts, &ts);
 }
 
-// Delay to allow another thread to have mutex lock
-void lock_delay(pthread_mutex_t * lock)
-{
-	pthread_mutex_unlock(lock);
-	ns_delay(100000);
-	pthread_mutex_lock(lock);
-}
-
 // Is there incoming data on socket?
 int bytes_ready(int fd, int timeout, int *abort)
 {
@@ -35,15 +35,16 @@
 #define DWORDS_PER_CACHELINE 16
 #define CACHELINE_BYTES 128
 #define PSL_IDLE_CYCLES 20
+#define PSL_IDLE_BURST 256
 
 #ifdef PSL8
 #define PSLSE_VERSION_MAJOR	0x01
-#define PSLSE_VERSION_MINOR	0x02
+#define PSLSE_VERSION_MINOR	0x09
 #endif /* ifdef PSL8 */
 
 #if defined PSL9lite || defined PSL9
 #define PSLSE_VERSION_MAJOR	0x02
-#define PSLSE_VERSION_MINOR	0x00
+#define PSLSE_VERSION_MINOR	0x07
 #endif /* ifdef PSL9 */
 
 #define PSLSE_CONNECT		0x01
@@ -68,6 +69,10 @@
 #define PSLSE_AFU_ERROR		0x14
 #define PSLSE_MMIO_EBREAD	0x15
 #define PSLSE_VSEC_INFO		0x16
+#define PSLSE_MMIO_BATCH	0x17
+#define PSLSE_MMIO_DESC_READ	0x18
+#define PSLSE_MEMORY_PREFETCH	0x19
+#define PSLSE_MEMORY_WRITE_COMBINED	0x1a
 #ifdef PSL9
 #define PSLSE_DMA0_RD		0x21
 #define PSLSE_DMA0_WR		0x22
@@ -81,6 +86,15 @@
 
 #endif /*ifdef PSL9 */
 
+// Largest number of MMIO accesses in one PSLSE_MMIO_BATCH message and the
+// size of each access: type, offset and data
+#define PSLSE_MMIO_BATCH_MAX	1024
+#define PSLSE_MMIO_BATCH_OP	13
+
+// Descriptor space a PSLSE_MMIO_DESC_READ offset is relative to
+#define PSLSE_DESC_SPACE	0x00
+#define PSLSE_DESC_ERROR_BUFFER	0x01
+
 // PSLSE states
 enum pslse_state {
 	PSLSE_IDLE,
@@ -105,21 +119,64 @@ void fatal_msg(const char *format, ...);
 // Display error message
 void error_msg(const char *format, ...);
 
+// Message levels, most severe first
+#define MSG_LEVEL_FATAL		0
+#define MSG_LEVEL_ERROR		1
+#define MSG_LEVEL_WARN		2
+#define MSG_LEVEL_INFO		3
+#define MSG_LEVEL_DEBUG		4
+
+// Least severe level built in, set with "make MSG_LEVEL=n".  Messages past
+// it compile to nothing, so their arguments aren't evaluated either.
+#ifndef MSG_LEVEL_MIN
+#ifdef DEBUG
+#define MSG_LEVEL_MIN		MSG_LEVEL_DEBUG
+#else
+#define MSG_LEVEL_MIN		MSG_LEVEL_INFO
+#endif				/* DEBUG */
+#endif				/* MSG_LEVEL_MIN */
+
+// Least severe level displayed, from PSLSE_LOG_LEVEL or LOG_LEVEL in
+// pslse.parms
+extern int msg_level;
+
+#define msg_enabled(level) \
+	(((level) <= MSG_LEVEL_MIN) && ((level) <= msg_level))
+
+#define _level_msg(level, ...) \
+	do { \
+		if (msg_enabled(level)) \
+			level_msg(level, __VA_ARGS__); \
+	} while (0)
+
+// Display message at level, use the macros below
+void level_msg(int level, const char *format, ...);
+
+// Set msg_level from a level name or number
+int msg_level_set(const char *name);
+
+// Display messages from a background thread until msg_stop().  Until then,
+// and for fatal and error messages, the calling thread displays them.
+int msg_start(void);
+
+// Wait for messages already made to be displayed
+void msg_flush(void);
+
+// Display any messages left and stop the background thread
+void msg_stop(void);
+
 // Display warning message
-void warn_msg(const char *format, ...);
+#define warn_msg(...)	_level_msg(MSG_LEVEL_WARN, __VA_ARGS__)
 
 // Display informational message
-void info_msg(const char *format, ...);
+#define info_msg(...)	_level_msg(MSG_LEVEL_INFO, __VA_ARGS__)
 
 // Display debug message
-void debug_msg(const char *format, ...);
+#define debug_msg(...)	_level_msg(MSG_LEVEL_DEBUG, __VA_ARGS__)
 
 // Delay for up to ns nanoseconds
 void ns_delay(long ns);
 
-// Delay to allow another thread to have mutex lock
-void lock_delay(pthread_mutex_t * lock);
-
 // Is there incoming data on socket?
 int bytes_ready(int fd, int timeout, int *abort);
 
@@ -0,0 +1,614 @@
+/*
+ * Copyright 2014,2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Description: analyze.c
+ *
+ *  This file contains the analysis mode of the debug tool.  One pass over a
+ *  v2 debug.log pairs each record that starts something with the record that
+ *  ends it, see pair.c, using the cycle and time stamps of both:
+ *
+ *    CMD_ADD to CMD_RESPONSE per AFU and tag, by command and by response
+ *    CLIENT_REQ to CLIENT_ACK per AFU and tag, the host memory round trip
+ *    MMIO_SEND to MMIO_ACK per AFU, the time the AFU took
+ *    MMIO_ADD to MMIO_RETURN per AFU and context, the time the client saw
+ *
+ *  Latencies go into log-linear histograms with 16 buckets per power of two,
+ *  so percentiles are within about 6% and memory use doesn't grow with the
+ *  size of the log.  Bytes moved by completed commands are printed per context every interval cycles as
+ *  the pass goes, and the number of outstanding tags is weighted by the
+ *  cycles it lasted for.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyze.h"
+#include "pair.h"
+#include "../common/psl_interface_t.h"
+#include "../common/utils.h"
+
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// Key for MMIO latencies
+#define MMIO_KEY_DW	0x1
+#define MMIO_KEY_READ	0x2
+#define MMIO_KEY_DESC	0x4
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+struct latency {
+	struct histogram cycles;
+	struct histogram ns;
+};
+
+// Latencies for one command, response or MMIO type, list is sorted by key
+struct stats {
+	uint32_t key;
+	struct latency latency;
+	struct stats *_next;
+};
+
+struct bandwidth {
+	uint16_t context;
+	uint64_t read;
+	uint64_t write;
+	struct bandwidth *_next;
+};
+
+struct afu {
+	uint8_t id;
+	int outstanding;
+	uint64_t occupancy_cycle;
+	struct histogram occupancy;
+	uint64_t interval_cycle;
+	uint64_t interval_first_ns;
+	uint64_t interval_last_ns;
+	struct bandwidth *bandwidth;
+	struct afu *_next;
+};
+
+struct analysis {
+	struct pair pair;
+	uint64_t interval;
+	struct afu *afus;
+	struct stats *commands;
+	struct stats *responses;
+	struct stats *clients;
+	struct stats *mmio_afu;
+	struct stats *mmio_client;
+	uint64_t unsized;
+	uint64_t xlat;
+	int banner;
+};
+
+struct name {
+	uint32_t code;
+	char *name;
+};
+
+static struct name _commands[] = {
+	{PSL_COMMAND_READ_CL_NA, "READ_CL_NA"},
+	{PSL_COMMAND_READ_CL_S, "READ_CL_S"},
+	{PSL_COMMAND_READ_CL_M, "READ_CL_M"},
+	{PSL_COMMAND_READ_CL_LCK, "READ_CL_LCK"},
+	{PSL_COMMAND_READ_CL_RES, "READ_CL_RES"},
+	{PSL_COMMAND_READ_PE, "READ_PE"},
+	{PSL_COMMAND_READ_PNA, "READ_PNA"},
+	{PSL_COMMAND_TOUCH_I, "TOUCH_I"},
+	{PSL_COMMAND_TOUCH_S, "TOUCH_S"},
+	{PSL_COMMAND_TOUCH_M, "TOUCH_M"},
+	{PSL_COMMAND_WRITE_MI, "WRITE_MI"},
+	{PSL_COMMAND_WRITE_MS, "WRITE_MS"},
+	{PSL_COMMAND_WRITE_UNLOCK, "WRITE_UNLOCK"},
+	{PSL_COMMAND_WRITE_C, "WRITE_C"},
+	{PSL_COMMAND_WRITE_NA, "WRITE_NA"},
+	{PSL_COMMAND_WRITE_INJ, "WRITE_INJ"},
+	{PSL_COMMAND_PUSH_I, "PUSH_I"},
+	{PSL_COMMAND_PUSH_S, "PUSH_S"},
+	{PSL_COMMAND_EVICT_I, "EVICT_I"},
+	{PSL_COMMAND_FLUSH, "FLUSH"},
+	{PSL_COMMAND_INTREQ, "INTREQ"},
+	{PSL_COMMAND_LOCK, "LOCK"},
+	{PSL_COMMAND_UNLOCK, "UNLOCK"},
+	{PSL_COMMAND_RESTART, "RESTART"},
+	{PSL_COMMAND_ZERO_M, "ZERO_M"},
+#ifdef PSL9
+	{PSL_COMMAND_CAS_E_4B, "CAS_E_4B"},
+	{PSL_COMMAND_CAS_NE_4B, "CAS_NE_4B"},
+	{PSL_COMMAND_CAS_U_4B, "CAS_U_4B"},
+	{PSL_COMMAND_CAS_E_8B, "CAS_E_8B"},
+	{PSL_COMMAND_CAS_NE_8B, "CAS_NE_8B"},
+	{PSL_COMMAND_CAS_U_8B, "CAS_U_8B"},
+	{PSL_COMMAND_ASBNOT, "ASBNOT"},
+	{PSL_COMMAND_XLAT_RD_P0, "XLAT_RD_P0"},
+	{PSL_COMMAND_XLAT_WR_P0, "XLAT_WR_P0"},
+	{PSL_COMMAND_XLAT_RD_P1, "XLAT_RD_P1"},
+	{PSL_COMMAND_XLAT_WR_P1, "XLAT_WR_P1"},
+	{PSL_COMMAND_ITAG_ABRT_RD, "ITAG_ABRT_RD"},
+	{PSL_COMMAND_ITAG_ABRT_WR, "ITAG_ABRT_WR"},
+	{PSL_COMMAND_XLAT_RD_TOUCH, "XLAT_RD_TOUCH"},
+	{PSL_COMMAND_XLAT_WR_TOUCH, "XLAT_WR_TOUCH"},
+#endif
+	{0, NULL}
+};
+
+static struct name _responses[] = {
+	{PSL_RESPONSE_DONE, "DONE"},
+	{PSL_RESPONSE_AERROR, "AERROR"},
+	{PSL_RESPONSE_DERROR, "DERROR"},
+	{PSL_RESPONSE_NLOCK, "NLOCK"},
+	{PSL_RESPONSE_NRES, "NRES"},
+	{PSL_RESPONSE_FLUSHED, "FLUSHED"},
+	{PSL_RESPONSE_FAULT, "FAULT"},
+	{PSL_RESPONSE_FAILED, "FAILED"},
+	{PSL_RESPONSE_PAGED, "PAGED"},
+	{PSL_RESPONSE_CONTEXT, "CONTEXT"},
+#ifdef PSL9
+	{PSL_RESPONSE_COMP_EQ, "COMP_EQ"},
+	{PSL_RESPONSE_COMP_NEQ, "COMP_NEQ"},
+	{PSL_RESPONSE_CAS_INV, "CAS_INV"},
+	{PSL_RESPONSE_XLAT_NO_ITAG, "XLAT_NO_ITAG"},
+#endif
+	{0, NULL}
+};
+
+static struct name _mmios[] = {
+	{0, "Write32"},
+	{MMIO_KEY_DW, "Write64"},
+	{MMIO_KEY_READ, "Read32"},
+	{MMIO_KEY_READ | MMIO_KEY_DW, "Read64"},
+	{MMIO_KEY_DESC, "Desc Write32"},
+	{MMIO_KEY_DESC | MMIO_KEY_DW, "Desc Write64"},
+	{MMIO_KEY_DESC | MMIO_KEY_READ, "Desc Read32"},
+	{MMIO_KEY_DESC | MMIO_KEY_READ | MMIO_KEY_DW, "Desc Read64"},
+	{0, NULL}
+};
+
+static int _bucket(uint64_t value)
+{
+	int msb;
+
+	if (value < HIST_SUB)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	    ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Smallest value that falls in bucket
+static uint64_t _bucket_value(int bucket)
+{
+	int msb;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+	msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((uint64_t) (HIST_SUB + (bucket % HIST_SUB))) <<
+	    (msb - HIST_SUB_BITS);
+}
+
+static void _hist_add(struct histogram *hist, uint64_t value, uint64_t weight)
+{
+	if (weight == 0)
+		return;
+	hist->count += weight;
+	hist->sum += value * weight;
+	hist->bucket[_bucket(value)] += weight;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+static uint64_t _hist_percentile(struct histogram *hist, int percent)
+{
+	uint64_t target, seen, value;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+	target = (hist->count * percent + 99) / 100;
+	seen = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= target)
+			break;
+	}
+	value = _bucket_value(i);
+	return (value > hist->max) ? hist->max : value;
+}
+
+static struct stats *_stat(struct stats **list, uint32_t key)
+{
+	struct stats *stat;
+
+	while ((*list != NULL) && ((*list)->key < key))
+		list = &((*list)->_next);
+	if ((*list != NULL) && ((*list)->key == key))
+		return *list;
+	if ((stat = (struct stats *)calloc(1, sizeof(struct stats))) == NULL) {
+		perror("calloc");
+		exit(-1);
+	}
+	stat->key = key;
+	stat->_next = *list;
+	*list = stat;
+	return stat;
+}
+
+static void _latency(struct stats **list, uint32_t key, uint64_t cycle,
+		     uint64_t ns, struct trace_record *record)
+{
+	struct stats *stat = _stat(list, key);
+
+	_hist_add(&(stat->latency.cycles), record->cycle - cycle, 1);
+	_hist_add(&(stat->latency.ns), record->ns - ns, 1);
+}
+
+static struct afu *_afu(struct analysis *analysis, uint8_t id)
+{
+	struct afu *afu;
+
+	for (afu = analysis->afus; afu != NULL; afu = afu->_next) {
+		if (afu->id == id)
+			return afu;
+	}
+	if ((afu = (struct afu *)calloc(1, sizeof(struct afu))) == NULL) {
+		perror("calloc");
+		exit(-1);
+	}
+	afu->id = id;
+	afu->_next = analysis->afus;
+	analysis->afus = afu;
+	return afu;
+}
+
+static char *_name(struct name *names, uint32_t code)
+{
+	for (; names->name != NULL; names++) {
+		if (names->code == code)
+			return names->name;
+	}
+	return "";
+}
+
+char *analyze_command_name(uint32_t command)
+{
+	return _name(_commands, command);
+}
+
+char *analyze_response_name(uint32_t resp)
+{
+	return _name(_responses, resp);
+}
+
+// Does command move data to or from host memory, and which way?
+static int _is_read(uint16_t command)
+{
+	return ((command & 0xff00) == 0x0a00) ||
+	    (command == PSL_COMMAND_READ_PNA);
+}
+
+static int _is_write(uint16_t command)
+{
+	return (command & 0xff00) == 0x0d00;
+}
+
+// PSL9 translations whose data moves over the DMA port.  The log has no sizes
+// for DMA transfers so they are left out of the bandwidth.
+static int _is_xlat(uint16_t command)
+{
+#ifdef PSL9
+	switch (command) {
+	case PSL_COMMAND_ITAG_ABRT_RD:
+	case PSL_COMMAND_ITAG_ABRT_WR:
+	case PSL_COMMAND_XLAT_RD_TOUCH:
+	case PSL_COMMAND_XLAT_WR_TOUCH:
+		return 0;
+	default:
+		return (command & 0xff00) == 0x1f00;
+	}
+#else
+	return 0;
+#endif
+}
+
+// Account for the cycles at the current number of outstanding tags, then
+// change to outstanding
+static void _occupancy(struct afu *afu, struct trace_record *record,
+		       int outstanding)
+{
+	if (afu->occupancy_cycle && (record->cycle > afu->occupancy_cycle))
+		_hist_add(&(afu->occupancy), afu->outstanding,
+			  record->cycle - afu->occupancy_cycle);
+	afu->occupancy_cycle = record->cycle;
+	afu->outstanding = outstanding;
+}
+
+static void _bandwidth_report(struct analysis *analysis, struct afu *afu)
+{
+	struct bandwidth *bw;
+	uint64_t ns;
+
+	ns = afu->interval_last_ns - afu->interval_first_ns;
+	for (bw = afu->bandwidth; bw != NULL; bw = bw->_next) {
+		if (!bw->read && !bw->write)
+			continue;
+		if (!analysis->banner) {
+			printf("Bandwidth per context every %" PRIu64
+			       " cycles\n", analysis->interval);
+			printf("  %-8s %12s %7s %12s %12s %10s %10s\n", "afu",
+			       "cycle", "context", "read bytes", "write bytes",
+			       "bytes/cyc", "MB/s");
+			analysis->banner = 1;
+		}
+		printf("  afu%d.%-3d %12" PRIu64 " %7d %12" PRIu64 " %12" PRIu64
+		       " %10.3f", afu->id >> 4, afu->id & 0xf,
+		       afu->interval_cycle, bw->context, bw->read, bw->write,
+		       (double)(bw->read + bw->write) / analysis->interval);
+		if (ns)
+			printf(" %10.3f\n", (bw->read + bw->write) * 1000.0 / ns);
+		else
+			printf(" %10s\n", "-");
+		bw->read = bw->write = 0;
+	}
+}
+
+static void _bandwidth(struct analysis *analysis, struct afu *afu,
+		       struct pair_span *span)
+{
+	struct trace_record *record = span->record;
+	struct bandwidth *bw;
+	uint64_t start;
+
+	if (_is_xlat(span->command))
+		analysis->xlat++;
+	if (!_is_read(span->command) && !_is_write(span->command))
+		return;
+
+	start = record->cycle - (record->cycle % analysis->interval);
+	if (start != afu->interval_cycle) {
+		_bandwidth_report(analysis, afu);
+		afu->interval_cycle = start;
+		afu->interval_first_ns = record->ns;
+	}
+	afu->interval_last_ns = record->ns;
+
+	for (bw = afu->bandwidth; bw != NULL; bw = bw->_next) {
+		if (bw->context == span->context)
+			break;
+	}
+	if (bw == NULL) {
+		if ((bw = (struct bandwidth *)calloc(1, sizeof(*bw))) == NULL) {
+			perror("calloc");
+			exit(-1);
+		}
+		bw->context = span->context;
+		bw->_next = afu->bandwidth;
+		afu->bandwidth = bw;
+	}
+	if (_is_read(span->command))
+		bw->read += span->size;
+	else
+		bw->write += span->size;
+}
+
+static uint32_t _mmio_key(struct pair_span *span)
+{
+	uint32_t key;
+
+	key = (span->rnw ? MMIO_KEY_READ : 0) | (span->dw ? MMIO_KEY_DW : 0);
+	if (span->context == (uint16_t) - 1)
+		key |= MMIO_KEY_DESC;
+	return key;
+}
+
+static void _span(void *arg, struct pair_span *span)
+{
+	struct analysis *analysis = (struct analysis *)arg;
+	struct afu *afu = _afu(analysis, span->afu);
+	struct trace_record *record = span->record;
+
+	switch (span->kind) {
+	case PAIR_CMD_ADD:
+		if (record->data[0] == DBG_HEADER_CMD_ADD)
+			analysis->unsized++;
+		_occupancy(afu, record, span->outstanding);
+		return;
+	case PAIR_CMD:
+		_latency(&(analysis->commands), span->command, span->cycle,
+			 span->ns, record);
+		if (span->resp >= 0)
+			_latency(&(analysis->responses), span->resp,
+				 span->cycle, span->ns, record);
+		if (span->resp == PSL_RESPONSE_DONE)
+			_bandwidth(analysis, afu, span);
+		_occupancy(afu, record, span->outstanding);
+		return;
+	case PAIR_CLIENT:
+		_latency(&(analysis->clients), span->command, span->cycle,
+			 span->ns, record);
+		return;
+	case PAIR_MMIO_AFU:
+		_latency(&(analysis->mmio_afu), _mmio_key(span), span->cycle,
+			 span->ns, record);
+		return;
+	case PAIR_MMIO:
+		_latency(&(analysis->mmio_client), _mmio_key(span),
+			 span->cycle, span->ns, record);
+		return;
+	case PAIR_AFU_DROP:
+		_occupancy(afu, record, 0);
+		afu->occupancy_cycle = 0;
+		_bandwidth_report(analysis, afu);
+		return;
+	default:
+		return;
+	}
+}
+
+static void _report_banner(char *title)
+{
+	printf("%s\n", title);
+	printf("  %-22s %10s %9s %9s %9s %9s %10s %10s %10s\n", "", "count",
+	       "mean cyc", "p50 cyc", "p99 cyc", "max cyc", "p50 us",
+	       "p99 us", "max us");
+}
+
+static void _report(char *title, struct stats *list, struct name *names,
+		    int mmio)
+{
+	struct histogram *cycles, *ns;
+	char label[32];
+
+	if (list == NULL)
+		return;
+	printf("\n");
+	_report_banner(title);
+	for (; list != NULL; list = list->_next) {
+		cycles = &(list->latency.cycles);
+		ns = &(list->latency.ns);
+		if (mmio)
+			sprintf(label, "%s", _name(names, list->key));
+		else
+			sprintf(label, "0x%04x %s", list->key,
+				_name(names, list->key));
+		printf("  %-22s %10" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9"
+		       PRIu64 " %9" PRIu64 " %10.3f %10.3f %10.3f\n", label,
+		       cycles->count, cycles->sum / cycles->count,
+		       _hist_percentile(cycles, 50),
+		       _hist_percentile(cycles, 99), cycles->max,
+		       _hist_percentile(ns, 50) / 1000.0,
+		       _hist_percentile(ns, 99) / 1000.0, ns->max / 1000.0);
+	}
+}
+
+static void _report_occupancy(struct analysis *analysis)
+{
+	struct histogram *hist;
+	struct afu *afu;
+	int banner = 0;
+
+	for (afu = analysis->afus; afu != NULL; afu = afu->_next) {
+		hist = &(afu->occupancy);
+		if (hist->count == 0)
+			continue;
+		if (!banner) {
+			printf("\nOutstanding tags, weighted by cycles\n");
+			printf("  %-22s %10s %9s %9s %9s %9s\n", "", "cycles",
+			       "mean", "p50", "p99", "max");
+			banner = 1;
+		}
+		printf("  afu%d.%-18d %10" PRIu64 " %9.2f %9" PRIu64 " %9"
+		       PRIu64 " %9" PRIu64 "\n", afu->id >> 4, afu->id & 0xf,
+		       hist->count, (double)hist->sum / hist->count,
+		       _hist_percentile(hist, 50), _hist_percentile(hist, 99),
+		       hist->max);
+	}
+}
+
+static void _free_stats(struct stats *list)
+{
+	struct stats *next;
+
+	while (list != NULL) {
+		next = list->_next;
+		free(list);
+		list = next;
+	}
+}
+
+int analyze_trace(struct trace *trace, struct trace_filter *filter,
+		  uint64_t interval)
+{
+	struct analysis analysis;
+	struct trace_filter pairing;
+	struct trace_record record;
+	struct bandwidth *bw;
+	struct afu *afu;
+	uint64_t outstanding;
+	int rc;
+
+	memset(&analysis, 0, sizeof(analysis));
+	pair_init(&(analysis.pair), filter->context, _span, &analysis);
+	analysis.interval = interval ? interval : ANALYZE_INTERVAL;
+
+	// Responses carry no context, pair.c applies the context filter
+	pairing = *filter;
+	pairing.context = -1;
+	trace_rewind(trace);
+	while ((rc = trace_next(trace, &pairing, &record)) > 0)
+		pair_record(&(analysis.pair), &record);
+	if (rc < 0)
+		printf("Bad record at offset %zu, stopping there\n",
+		       record.offset);
+
+	for (afu = analysis.afus; afu != NULL; afu = afu->_next)
+		_bandwidth_report(&analysis, afu);
+	outstanding = pair_outstanding(&(analysis.pair));
+
+	_report("Commands, CMD_ADD to CMD_RESPONSE", analysis.commands,
+		_commands, 0);
+	_report("Responses, CMD_ADD to CMD_RESPONSE", analysis.responses,
+		_responses, 0);
+	_report("Host memory, CLIENT_REQ to CLIENT_ACK", analysis.clients,
+		_commands, 0);
+	_report("MMIO at AFU, MMIO_SEND to MMIO_ACK", analysis.mmio_afu,
+		_mmios, 1);
+	_report("MMIO at client, MMIO_ADD to MMIO_RETURN", analysis.mmio_client,
+		_mmios, 1);
+	_report_occupancy(&analysis);
+
+	printf("\n");
+	if (outstanding)
+		printf("%" PRIu64 " commands and MMIOs still outstanding\n",
+		       outstanding);
+	if (analysis.pair.unpaired)
+		printf("%" PRIu64 " records without a partner\n",
+		       analysis.pair.unpaired);
+	if (analysis.unsized)
+		printf("%" PRIu64 " commands without a size, bandwidth is low\n",
+		       analysis.unsized);
+	if (analysis.xlat)
+		printf("%" PRIu64 " XLAT commands, their DMA transfers are not "
+		       "in the bandwidth\n", analysis.xlat);
+
+	_free_stats(analysis.commands);
+	_free_stats(analysis.responses);
+	_free_stats(analysis.clients);
+	_free_stats(analysis.mmio_afu);
+	_free_stats(analysis.mmio_client);
+	pair_free(&(analysis.pair));
+	while (analysis.afus != NULL) {
+		afu = analysis.afus;
+		analysis.afus = afu->_next;
+		while (afu->bandwidth != NULL) {
+			bw = afu->bandwidth;
+			afu->bandwidth = bw->_next;
+			free(bw);
+		}
+		free(afu);
+	}
+	return (rc < 0) ? -1 : 0;
+}
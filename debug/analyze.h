@@ -0,0 +1,36 @@
+/*
+ * Copyright 2014,2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ANALYZE_H_
+#define _ANALYZE_H_
+
+#include <stdint.h>
+
+#include "trace.h"
+
+// Default cycles per line of the bandwidth report
+#define ANALYZE_INTERVAL	100000
+
+// Report latency, bandwidth and tag occupancy for the records matching
+// filter in one pass over trace
+int analyze_trace(struct trace *trace, struct trace_filter *filter,
+		  uint64_t interval);
+
+// Names of PSL command and response codes, "" for unknown codes
+char *analyze_command_name(uint32_t command);
+char *analyze_response_name(uint32_t resp);
+
+#endif				/* _ANALYZE_H_ */
@@ -0,0 +1,571 @@
+/*
+ * Copyright 2014,2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Description: chrome.c
+ *
+ *  This file writes a v2 debug.log as Chrome trace events, the JSON format
+ *  that chrome://tracing and ui.perfetto.dev load.  Each AFU is a process
+ *  with a track per command tag and per context doing MMIO:
+ *
+ *    tag 0xNN		CMD_ADD to CMD_RESPONSE, with the host memory round
+ *			trip nested inside and buffer transfers marked
+ *    mmio context N	MMIO_ADD to MMIO_RETURN, with MMIO_SEND to MMIO_ACK
+ *			nested inside as the time taken by the AFU
+ *    mmio descriptor	AFU descriptor MMIOs, which end at MMIO_ACK
+ *
+ *  Jobs and LLCMDs are async slices on the AFU, first while queued by
+ *  add_job() or add_pe() and then until the AFU answers on aux2 with
+ *  jrunning, jdone or jcack.  Interrupt requests, PAGED and FLUSHED responses
+ *  and the RESTART that ends a flush are instant events.  The number of
+ *  outstanding tags is a counter, which shows when the AFU runs out of
+ *  credits.  Commands and MMIOs are paired by pair.c.  Event times come from
+ *  the record stamps and every event also carries the AFU cycle it started
+ *  on.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyze.h"
+#include "chrome.h"
+#include "pair.h"
+#include "../common/psl_interface_t.h"
+
+// Most jobs tracked per AFU at a time
+#define CHROME_JOBS	64
+
+// Thread ids of the AFU tracks, the tags use 0 to 255
+#define TID_DESC	0x100
+#define TID_MMIO	0x200
+#define TIDS		(TID_MMIO + 0x10000)
+
+// Async slice for a job or LLCMD
+struct chrome_job {
+	uint32_t id;
+	uint32_t code;
+	uint64_t addr;
+	char name[32];
+};
+
+struct chrome_queue {
+	struct chrome_job job[CHROME_JOBS];
+	int count;
+};
+
+struct chrome_afu {
+	uint8_t id;
+	int outstanding;
+	struct chrome_queue jobs;
+	struct chrome_queue pes;
+	struct chrome_queue llcmds;
+	struct chrome_job job;
+	struct chrome_job running;
+	uint8_t named[TIDS / 8];
+	struct chrome_afu *_next;
+};
+
+struct chrome {
+	struct pair pair;
+	FILE *fp;
+	struct chrome_afu *afus;
+	uint64_t events;
+	uint64_t unpaired;
+	uint32_t async_id;
+};
+
+static uint16_t _get_16(const uint8_t * data)
+{
+	return (data[0] << 8) | data[1];
+}
+
+static uint32_t _get_32(const uint8_t * data)
+{
+	return ((uint32_t) _get_16(data) << 16) | _get_16(data + 2);
+}
+
+static uint64_t _get_64(const uint8_t * data)
+{
+	return ((uint64_t) _get_32(data) << 32) | _get_32(data + 4);
+}
+
+static void _time(FILE * fp, char *key, uint64_t ns)
+{
+	fprintf(fp, ",\"%s\":%" PRIu64 ".%03d", key, ns / 1000,
+		(int)(ns % 1000));
+}
+
+// Start an event, the caller adds the rest and closes it with _end()
+static void _begin(struct chrome *chrome, char *ph, char *name,
+		   struct chrome_afu *afu, uint32_t tid, uint64_t ns)
+{
+	fprintf(chrome->fp, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%d,"
+		"\"tid\":%u", chrome->events++ ? ",\n" : "", name, ph, afu->id,
+		tid);
+	_time(chrome->fp, "ts", ns);
+}
+
+static void _args(struct chrome *chrome, uint64_t cycle)
+{
+	fprintf(chrome->fp, ",\"args\":{\"cycle\":%" PRIu64, cycle);
+}
+
+static void _end(struct chrome *chrome)
+{
+	fprintf(chrome->fp, "}}");
+}
+
+static void _meta(struct chrome *chrome, char *what, struct chrome_afu *afu,
+		  uint32_t tid, char *name)
+{
+	fprintf(chrome->fp, "%s{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+		chrome->events++ ? ",\n" : "", what, afu->id, tid, name);
+}
+
+// Name the track the first time it is used
+static void _track(struct chrome *chrome, struct chrome_afu *afu, uint32_t tid)
+{
+	char name[32];
+
+	if (afu->named[tid / 8] & (1 << (tid % 8)))
+		return;
+	afu->named[tid / 8] |= 1 << (tid % 8);
+	if (tid < TID_DESC)
+		sprintf(name, "tag 0x%02x", tid);
+	else if (tid == TID_DESC)
+		sprintf(name, "mmio descriptor");
+	else
+		sprintf(name, "mmio context %d", tid - TID_MMIO);
+	_meta(chrome, "thread_name", afu, tid, name);
+}
+
+static struct chrome_afu *_afu(struct chrome *chrome, uint8_t id)
+{
+	struct chrome_afu *afu;
+	char name[16];
+
+	for (afu = chrome->afus; afu != NULL; afu = afu->_next) {
+		if (afu->id == id)
+			return afu;
+	}
+	if ((afu = (struct chrome_afu *)calloc(1, sizeof(*afu))) == NULL) {
+		perror("calloc");
+		exit(-1);
+	}
+	afu->id = id;
+	afu->_next = chrome->afus;
+	chrome->afus = afu;
+	sprintf(name, "afu%d.%d", id >> 4, id & 0xf);
+	_meta(chrome, "process_name", afu, 0, name);
+	return afu;
+}
+
+// Complete event for span
+static void _slice(struct chrome *chrome, struct chrome_afu *afu, uint32_t tid,
+		   char *name, struct pair_span *span)
+{
+	_track(chrome, afu, tid);
+	_begin(chrome, "X", name, afu, tid, span->ns);
+	_time(chrome->fp, "dur", span->record->ns - span->ns);
+	_args(chrome, span->cycle);
+	fprintf(chrome->fp, ",\"cycles\":%" PRIu64,
+		span->record->cycle - span->cycle);
+}
+
+// Instant event on a track, or on the whole AFU when tid is -1
+static void _instant(struct chrome *chrome, struct chrome_afu *afu, int tid,
+		     char *name, struct trace_record *record)
+{
+	if (tid >= 0)
+		_track(chrome, afu, tid);
+	_begin(chrome, "i", name, afu, (tid < 0) ? 0 : tid, record->ns);
+	fprintf(chrome->fp, ",\"s\":\"%s\"", (tid < 0) ? "p" : "t");
+	_args(chrome, record->cycle);
+}
+
+static void _outstanding(struct chrome *chrome, struct chrome_afu *afu,
+			 struct trace_record *record)
+{
+	_begin(chrome, "C", "outstanding tags", afu, 0, record->ns);
+	fprintf(chrome->fp, ",\"args\":{\"tags\":%d", afu->outstanding);
+	_end(chrome);
+}
+
+static void _async_begin(struct chrome *chrome, struct chrome_afu *afu,
+			 struct chrome_job *job, struct trace_record *record)
+{
+	job->id = ++chrome->async_id;
+	_begin(chrome, "b", job->name, afu, 0, record->ns);
+	fprintf(chrome->fp, ",\"cat\":\"job\",\"id\":%u", job->id);
+	_args(chrome, record->cycle);
+	_end(chrome);
+}
+
+static void _async_end(struct chrome *chrome, struct chrome_afu *afu,
+		       struct chrome_job *job, struct trace_record *record)
+{
+	if (job->id == 0)
+		return;
+	_begin(chrome, "e", job->name, afu, 0, record->ns);
+	fprintf(chrome->fp, ",\"cat\":\"job\",\"id\":%u", job->id);
+	_args(chrome, record->cycle);
+	_end(chrome);
+	job->id = 0;
+}
+
+static struct chrome_job *_queue_add(struct chrome *chrome,
+				     struct chrome_afu *afu,
+				     struct chrome_queue *queue,
+				     struct trace_record *record)
+{
+	if (queue->count == CHROME_JOBS) {
+		chrome->unpaired++;
+		_async_end(chrome, afu, &(queue->job[0]), record);
+		queue->count--;
+		memmove(&(queue->job[0]), &(queue->job[1]),
+			queue->count * sizeof(queue->job[0]));
+	}
+	memset(&(queue->job[queue->count]), 0, sizeof(queue->job[0]));
+	return &(queue->job[queue->count++]);
+}
+
+// End the slice for entry i of queue and any queued before it, which pslse
+// must have thrown away
+static void _queue_remove(struct chrome *chrome, struct chrome_afu *afu,
+			  struct chrome_queue *queue, int i,
+			  struct trace_record *record)
+{
+	int j;
+
+	for (j = 0; j <= i; j++)
+		_async_end(chrome, afu, &(queue->job[j]), record);
+	chrome->unpaired += i;
+	queue->count -= i + 1;
+	memmove(&(queue->job[0]), &(queue->job[i + 1]),
+		queue->count * sizeof(queue->job[0]));
+}
+
+static void _command_name(char *name, uint16_t command)
+{
+	if (*analyze_command_name(command))
+		strcpy(name, analyze_command_name(command));
+	else
+		sprintf(name, "0x%04x", command);
+}
+
+static uint32_t _mmio_tid(struct pair_span *span)
+{
+	return (span->context == (uint16_t) - 1) ? TID_DESC :
+	    TID_MMIO + span->context;
+}
+
+static void _span(void *arg, struct pair_span *span)
+{
+	struct chrome *chrome = (struct chrome *)arg;
+	struct chrome_afu *afu = _afu(chrome, span->afu);
+	struct trace_record *record = span->record;
+	char name[16];
+
+	switch (span->kind) {
+	case PAIR_CMD_ADD:
+		afu->outstanding = span->outstanding;
+		_outstanding(chrome, afu, record);
+		if (span->command == PSL_COMMAND_INTREQ) {
+			_instant(chrome, afu, -1, "interrupt", record);
+			fprintf(chrome->fp, ",\"context\":%d", span->context);
+			_end(chrome);
+		}
+		return;
+	case PAIR_CLIENT:
+		_slice(chrome, afu, span->tag, "host memory", span);
+		_end(chrome);
+		return;
+	case PAIR_CMD_BUFFER:
+		_instant(chrome, afu, span->tag,
+			 (record->data[0] == DBG_HEADER_CMD_BUFFER_WRITE) ?
+			 "buffer write" : "buffer read", record);
+		_end(chrome);
+		return;
+	case PAIR_CMD:
+		_command_name(name, span->command);
+		_slice(chrome, afu, span->tag, name, span);
+		fprintf(chrome->fp, ",\"context\":%d", span->context);
+		if (span->size)
+			fprintf(chrome->fp, ",\"size\":%d", span->size);
+		if (span->resp >= 0)
+			fprintf(chrome->fp, ",\"response\":\"%s\"",
+				analyze_response_name(span->resp));
+		_end(chrome);
+		afu->outstanding = span->outstanding;
+		_outstanding(chrome, afu, record);
+
+		// A PAGED response starts a flush, the RESTART command ends it
+		if (span->resp == PSL_RESPONSE_PAGED) {
+			_instant(chrome, afu, -1, "PAGED", record);
+			fprintf(chrome->fp, ",\"tag\":%d", span->tag);
+			_end(chrome);
+		} else if (span->resp == PSL_RESPONSE_FLUSHED) {
+			_instant(chrome, afu, span->tag, "FLUSHED", record);
+			_end(chrome);
+		}
+		if (span->command == PSL_COMMAND_RESTART) {
+			_instant(chrome, afu, -1, "restart", record);
+			_end(chrome);
+		}
+		return;
+	case PAIR_MMIO_AFU:
+		_slice(chrome, afu, _mmio_tid(span), "AFU", span);
+		_end(chrome);
+		return;
+	case PAIR_MMIO:
+		sprintf(name, "%s%d", span->rnw ? "Read" : "Write",
+			span->dw ? 64 : 32);
+		_slice(chrome, afu, _mmio_tid(span), name, span);
+		fprintf(chrome->fp, ",\"address\":\"0x%06x\"", span->addr);
+		_end(chrome);
+		return;
+	case PAIR_AFU_DROP:
+		if (afu->outstanding) {
+			afu->outstanding = 0;
+			_outstanding(chrome, afu, record);
+		}
+		return;
+	default:
+		return;
+	}
+}
+
+static char *_job_name(uint32_t code)
+{
+	switch (code) {
+	case PSL_JOB_START:
+		return "START";
+	case PSL_JOB_RESET:
+		return "RESET";
+	default:
+		return "JOB";
+	}
+}
+
+static char *_llcmd_name(uint64_t addr)
+{
+	switch (addr & PSL_LLCMD_MASK) {
+	case PSL_LLCMD_ADD:
+		return "ADD";
+	case PSL_LLCMD_REMOVE:
+		return "REMOVE";
+	case PSL_LLCMD_TERMINATE:
+		return "TERMINATE";
+	default:
+		return "LLCMD";
+	}
+}
+
+static void _job(struct chrome *chrome, struct trace_record *record)
+{
+	const uint8_t *data = record->data;
+	struct chrome_afu *afu = _afu(chrome, data[1]);
+	struct chrome_job *job;
+	uint32_t code;
+	uint64_t addr;
+	int i;
+
+	switch (data[0]) {
+	case DBG_HEADER_JOB_ADD:
+		job = _queue_add(chrome, afu, &(afu->jobs), record);
+		job->code = _get_32(data + 2);
+		sprintf(job->name, "add_job %s", _job_name(job->code));
+		_async_begin(chrome, afu, job, record);
+		return;
+	case DBG_HEADER_JOB_SEND:
+		code = _get_32(data + 2);
+		for (i = 0; i < afu->jobs.count; i++) {
+			if (afu->jobs.job[i].code == code)
+				break;
+		}
+		if (i < afu->jobs.count)
+			_queue_remove(chrome, afu, &(afu->jobs), i, record);
+		else
+			chrome->unpaired++;
+		if (afu->job.id)
+			chrome->unpaired++;
+		_async_end(chrome, afu, &(afu->job), record);
+		afu->job.code = code;
+		sprintf(afu->job.name, "%s", _job_name(code));
+		_async_begin(chrome, afu, &(afu->job), record);
+		return;
+	case DBG_HEADER_PE_ADD:
+		job = _queue_add(chrome, afu, &(afu->pes), record);
+		job->code = _get_32(data + 2);
+		job->addr = _get_64(data + 6);
+		sprintf(job->name, "add_pe %s %d", _llcmd_name(job->addr),
+			(int)(job->addr & PSL_LLCMD_CONTEXT_MASK));
+		_async_begin(chrome, afu, job, record);
+		return;
+	case DBG_HEADER_PE_SEND:
+		addr = _get_64(data + 6);
+		for (i = 0; i < afu->pes.count; i++) {
+			if (afu->pes.job[i].addr == addr)
+				break;
+		}
+		if (i < afu->pes.count)
+			_queue_remove(chrome, afu, &(afu->pes), i, record);
+		else
+			chrome->unpaired++;
+		job = _queue_add(chrome, afu, &(afu->llcmds), record);
+		job->addr = addr;
+		sprintf(job->name, "LLCMD %s %d", _llcmd_name(addr),
+			(int)(addr & PSL_LLCMD_CONTEXT_MASK));
+		_async_begin(chrome, afu, job, record);
+		return;
+	default:
+		return;
+	}
+}
+
+static void _aux2(struct chrome *chrome, struct trace_record *record)
+{
+	struct chrome_afu *afu = _afu(chrome, record->data[1]);
+	uint8_t aux2 = record->data[2];
+
+	if (aux2 & DBG_AUX2_LLCACK) {
+		if (afu->llcmds.count)
+			_queue_remove(chrome, afu, &(afu->llcmds), 0, record);
+		else
+			chrome->unpaired++;
+	}
+	if ((aux2 & DBG_AUX2_RUNNING) && !afu->running.id) {
+		_async_end(chrome, afu, &(afu->job), record);
+		sprintf(afu->running.name, "running");
+		_async_begin(chrome, afu, &(afu->running), record);
+	}
+	if (!(aux2 & DBG_AUX2_RUNNING))
+		_async_end(chrome, afu, &(afu->running), record);
+	if (aux2 & DBG_AUX2_DONE) {
+		_async_end(chrome, afu, &(afu->job), record);
+		_instant(chrome, afu, -1, "jdone", record);
+		_end(chrome);
+	}
+}
+
+static void _context(struct chrome *chrome, struct trace_record *record)
+{
+	struct chrome_afu *afu = _afu(chrome, record->data[1]);
+
+	_instant(chrome, afu, -1, (record->data[0] == DBG_HEADER_CONTEXT_ADD) ?
+		 "context added" : "context removed", record);
+	fprintf(chrome->fp, ",\"context\":%d", _get_16(record->data + 2));
+	_end(chrome);
+}
+
+// AFU went away, no job still outstanding will complete
+static void _afu_drop(struct chrome *chrome, struct trace_record *record)
+{
+	struct chrome_afu *afu = _afu(chrome, record->data[1]);
+
+	if (afu->jobs.count)
+		_queue_remove(chrome, afu, &(afu->jobs), afu->jobs.count - 1,
+			      record);
+	if (afu->pes.count)
+		_queue_remove(chrome, afu, &(afu->pes), afu->pes.count - 1,
+			      record);
+	if (afu->llcmds.count)
+		_queue_remove(chrome, afu, &(afu->llcmds),
+			      afu->llcmds.count - 1, record);
+	_async_end(chrome, afu, &(afu->job), record);
+	_async_end(chrome, afu, &(afu->running), record);
+	_instant(chrome, afu, -1, "disconnect", record);
+	_end(chrome);
+}
+
+int chrome_trace(struct trace *trace, struct trace_filter *filter,
+		 const char *path)
+{
+	struct chrome chrome;
+	struct trace_filter pairing;
+	struct trace_record record;
+	struct chrome_afu *afu;
+	int rc;
+
+	memset(&chrome, 0, sizeof(chrome));
+	pair_init(&(chrome.pair), filter->context, _span, &chrome);
+	if ((chrome.fp = fopen(path, "w")) == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	fprintf(chrome.fp, "{\"traceEvents\":[\n");
+
+	// Responses carry no context, pair.c applies the context filter
+	pairing = *filter;
+	pairing.context = -1;
+	trace_rewind(trace);
+	while ((rc = trace_next(trace, &pairing, &record)) > 0) {
+		pair_record(&(chrome.pair), &record);
+		if ((filter->context >= 0) &&
+		    (record.context != filter->context))
+			continue;
+		switch (record.data[0]) {
+		case DBG_HEADER_JOB_ADD:
+		case DBG_HEADER_JOB_SEND:
+		case DBG_HEADER_PE_ADD:
+		case DBG_HEADER_PE_SEND:
+			_job(&chrome, &record);
+			break;
+		case DBG_HEADER_JOB_AUX2:
+			_aux2(&chrome, &record);
+			break;
+		case DBG_HEADER_CONTEXT_ADD:
+		case DBG_HEADER_CONTEXT_REMOVE:
+			_context(&chrome, &record);
+			break;
+		case DBG_HEADER_AFU_CONNECT:
+			_instant(&chrome, _afu(&chrome, record.data[1]), -1,
+				 "connect", &record);
+			_end(&chrome);
+			break;
+		case DBG_HEADER_AFU_DROP:
+			_afu_drop(&chrome, &record);
+			break;
+		default:
+			break;
+		}
+	}
+	if (rc < 0)
+		printf("Bad record at offset %zu, stopping there\n",
+		       record.offset);
+
+	fprintf(chrome.fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	if (fclose(chrome.fp) != 0) {
+		perror("fclose");
+		rc = -1;
+	}
+	printf("Wrote %" PRIu64 " events to %s\n", chrome.events, path);
+	chrome.unpaired += chrome.pair.unpaired;
+	if (chrome.unpaired)
+		printf("%" PRIu64 " records without a partner\n",
+		       chrome.unpaired);
+
+	pair_free(&(chrome.pair));
+	while (chrome.afus != NULL) {
+		afu = chrome.afus;
+		chrome.afus = afu->_next;
+		free(afu);
+	}
+	return (rc < 0) ? -1 : 0;
+}
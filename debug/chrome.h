@@ -0,0 +1,27 @@
+/*
+ * Copyright 2014,2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CHROME_H_
+#define _CHROME_H_
+
+#include "trace.h"
+
+// Write the records matching filter to path as Chrome trace events, for
+// chrome://tracing or ui.perfetto.dev
+int chrome_trace(struct trace *trace, struct trace_filter *filter,
+		 const char *path);
+
+#endif				/* _CHROME_H_ */
@@ -1,8 +1,13 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include "analyze.h"
+#include "chrome.h"
+#include "trace.h"
 #include "../common/debug.h"
 #include "../common/psl_interface_t.h"
 #include "../common/utils.h"
@@ -11,15 +16,20 @@
 
 int parity, running, latency;
 
+// Cycle and time of the record being parsed from a v2 file
+static char stamp[48];
+
 static char *_afu_name(uint8_t id)
 {
 	char *name;
 	uint8_t major, minor;
+	size_t size;
 
 	major = id >> 4;
 	minor = id & 0xf;
-	name = (char *)malloc(7);
-	sprintf(name, "afu%d.%d", major, minor);
+	size = strlen(stamp) + sizeof("afu15.15");
+	name = (char *)malloc(size);
+	snprintf(name, size, "%safu%d.%d", stamp, major, minor);
 	return name;
 }
 
@@ -70,6 +80,18 @@ static int _parse_parm(FILE * fp)
 	case DBG_PARM_BUFFER_PERCENT:
 		printf("PARM:BUFFER_PERCENT=%d\n", value);
 		break;
+	case DBG_PARM_BUFFER_READS:
+		printf("PARM:BUFFER_READS=%d\n", value);
+		break;
+	case DBG_PARM_DIRECT_MEMORY:
+		printf("PARM:DIRECT_MEMORY=%d\n", value);
+		break;
+	case DBG_PARM_PREFETCH_LINES:
+		printf("PARM:PREFETCH_LINES=%d\n", value);
+		break;
+	case DBG_PARM_WRITE_COMBINE:
+		printf("PARM:WRITE_COMBINE=%d\n", value);
+		break;
 	default:
 		return -1;
 	}
@@ -310,7 +332,7 @@ static int _parse_mmio_return(FILE * fp, DBG_HEADER header)
 
 static int _parse_cmd_add(FILE * fp, DBG_HEADER header)
 {
-	uint16_t context, command;
+	uint16_t context, command, size;
 	uint8_t id, tag;
 	char *name;
 
@@ -322,10 +344,15 @@ static int _parse_cmd_add(FILE * fp, DBG_HEADER header)
 		return -1;
 	if (debug_get_16(fp, &command) < 1)
 		return -1;
+	if ((header == DBG_HEADER_CMD_ADD_SIZE) && (debug_get_16(fp, &size) < 1))
+		return -1;
 	name = _afu_name(id);
 
-	printf("%s,%d:CMD: New tag=0x%02x code=0x%04x\n", name, context,
+	printf("%s,%d:CMD: New tag=0x%02x code=0x%04x", name, context,
 	       tag, command);
+	if (header == DBG_HEADER_CMD_ADD_SIZE)
+		printf(" size=%d", size);
+	printf("\n");
 	free(name);
 
 	return 0;
@@ -454,15 +481,22 @@ static int _parse_cmd_buffer(FILE * fp, DBG_HEADER header)
 static int _parse_cmd_response(FILE * fp, DBG_HEADER header)
 {
 	uint8_t id, tag;
+	uint16_t resp;
 	char *name;
 
 	if (debug_get_8(fp, &id) < 1)
 		return -1;
 	if (debug_get_8(fp, &tag) < 1)
 		return -1;
+	if ((header == DBG_HEADER_CMD_RESPONSE_CODE) &&
+	    (debug_get_16(fp, &resp) < 1))
+		return -1;
 	name = _afu_name(id);
 
-	printf("%s:CMD: Response tag=0x%02x\n", name, tag);
+	printf("%s:CMD: Response tag=0x%02x", name, tag);
+	if (header == DBG_HEADER_CMD_RESPONSE_CODE)
+		printf(" code=0x%02x", resp);
+	printf("\n");
 	free(name);
 
 	return 0;
@@ -570,6 +604,8 @@ static int _parse_socket(FILE * fp, DBG_HEADER header, int silent)
 			printf(",%d", context);
 		printf(":");
 		free(name);
+	} else {
+		printf("%s", stamp);
 	}
 	printf("SOCKET ");
 	switch (header) {
@@ -605,6 +641,9 @@ static int _parse_socket(FILE * fp, DBG_HEADER header, int silent)
 	case PSLSE_MEMORY_WRITE:
 		printf("WRITE");
 		break;
+	case PSLSE_MEMORY_WRITE_COMBINED:
+		printf("WRITE COMBINED");
+		break;
 	case PSLSE_MEMORY_TOUCH:
 		printf("TOUCH");
 		break;
@@ -614,6 +653,9 @@ static int _parse_socket(FILE * fp, DBG_HEADER header, int silent)
 	case PSLSE_MEM_FAILURE:
 		printf("MEM FAIL");
 		break;
+	case PSLSE_MEMORY_PREFETCH:
+		printf("PREFETCH");
+		break;
 	case PSLSE_MMIO_MAP:
 		printf("MAP");
 		break;
@@ -659,110 +701,228 @@ static int _parse_socket(FILE * fp, DBG_HEADER header, int silent)
 	return 0;
 }
 
-int main(int argc, char **argv)
+static int _parse_record(FILE * fp, DBG_HEADER header)
 {
-	FILE *fp;
+	switch (header) {
+	case DBG_HEADER_VERSION:
+		_report_version(fp);
+		break;
+	case DBG_HEADER_PARM:
+		if (_parse_parm(fp) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_AFU_CONNECT:
+	case DBG_HEADER_AFU_DROP:
+		if (_parse_afu(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_CONTEXT_ADD:
+	case DBG_HEADER_CONTEXT_REMOVE:
+		if (_parse_context(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_JOB_ADD:
+	case DBG_HEADER_JOB_SEND:
+		if (_parse_job(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_PE_ADD:
+	case DBG_HEADER_PE_SEND:
+		if (_parse_pe(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_JOB_AUX2:
+		if (_parse_aux(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_MMIO_MAP:
+		if (_parse_map(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_MMIO_ADD:
+	case DBG_HEADER_MMIO_SEND:
+		if (_parse_mmio(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_MMIO_ACK:
+		if (_parse_mmio_ack(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_MMIO_RETURN:
+		if (_parse_mmio_return(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_CMD_ADD:
+	case DBG_HEADER_CMD_ADD_SIZE:
+		if (_parse_cmd_add(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_CMD_UPDATE:
+		if (_parse_cmd_update(fp, header) < 0)
+			return -1;
+		break;
+#ifdef PSL9
+	case DBG_HEADER_CMD_CAIA2:
+		if (_parse_cmd_caia2(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_CMD_DMA0:
+		if (_parse_cmd_dma0(fp, header) < 0)
+			return -1;
+		break;
+#endif
+	case DBG_HEADER_CMD_CLIENT_ACK:
+	case DBG_HEADER_CMD_CLIENT_REQ:
+		if (_parse_cmd_client(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_CMD_BUFFER_WRITE:
+	case DBG_HEADER_CMD_BUFFER_READ:
+		if (_parse_cmd_buffer(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_CMD_RESPONSE:
+	case DBG_HEADER_CMD_RESPONSE_CODE:
+		if (_parse_cmd_response(fp, header) < 0)
+			return -1;
+		break;
+	case DBG_HEADER_SOCKET_GET:
+	case DBG_HEADER_SOCKET_PUT:
+		if (_parse_socket(fp, header, 0) < 0)
+			return -1;
+		break;
+	default:
+		printf("Bad header: %d\n", header);
+		return -1;
+	}
+	return 0;
+}
+
+static void _usage(char *prog)
+{
+	printf("Usage: %s [-a [-i cycles] | -j json] [-c first[:last]] "
+	       "[-t tag] [-x context] [file]\n", prog);
+	printf("  -a  report latencies, bandwidth and outstanding tags\n");
+	printf("  -j  write Chrome trace events to json instead\n");
+	printf("  -i  cycles per bandwidth line of -a, default %d\n",
+	       ANALYZE_INTERVAL);
+	printf("  -c  only records from AFU cycles first to last\n");
+	printf("  -t  only records for command tag\n");
+	printf("  -x  only records for context\n");
+	printf("Filters, -a and -j need a v2 debug.log, file defaults to "
+	       "debug.log\n");
+}
+
+// Walk a v2 file using its block index, printing each record with its AFU
+// cycle and time since the first record
+static int _parse_trace(struct trace *trace, struct trace_filter *filter)
+{
+	struct trace_record record;
 	DBG_HEADER header;
-	int silent;
+	FILE *fp;
+	int rc;
 
-	if ((fp = fopen("debug.log", "r")) == NULL) {
-		perror("fopen:debug.log");
+	if ((fp = fmemopen(trace->map, trace->size, "r")) == NULL) {
+		perror("fmemopen");
 		return -1;
 	}
-
-	while ((header = debug_get_header(fp)) != (DBG_HEADER) - 1) {
-		silent = 0;
-		switch (header) {
-		case DBG_HEADER_VERSION:
-			_report_version(fp);
-			break;
-		case DBG_HEADER_PARM:
-			if (_parse_parm(fp) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_AFU_CONNECT:
-		case DBG_HEADER_AFU_DROP:
-			if (_parse_afu(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_CONTEXT_ADD:
-		case DBG_HEADER_CONTEXT_REMOVE:
-			if (_parse_context(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_JOB_ADD:
-		case DBG_HEADER_JOB_SEND:
-			if (_parse_job(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_PE_ADD:
-		case DBG_HEADER_PE_SEND:
-			if (_parse_pe(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_JOB_AUX2:
-			if (_parse_aux(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_MMIO_MAP:
-			if (_parse_map(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_MMIO_ADD:
-		case DBG_HEADER_MMIO_SEND:
-			if (_parse_mmio(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_MMIO_ACK:
-			if (_parse_mmio_ack(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_MMIO_RETURN:
-			if (_parse_mmio_return(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_CMD_ADD:
-			if (_parse_cmd_add(fp, header) < 0)
-				return -1;
-			break;
-		case DBG_HEADER_CMD_UPDATE:
-			if (_parse_cmd_update(fp, header) < 0)
-				return -1;
+	while ((rc = trace_next(trace, filter, &record)) > 0) {
+		sprintf(stamp, "%" PRIu64 ":%" PRIu64 ".%06" PRIu64 ":",
+			record.cycle, record.ns / 1000000000,
+			(record.ns % 1000000000) / 1000);
+		fseek(fp, record.offset, SEEK_SET);
+		header = debug_get_header(fp);
+		if (_parse_record(fp, header) < 0)
 			break;
-#ifdef PSL9
-		case DBG_HEADER_CMD_CAIA2:
-			if (_parse_cmd_caia2(fp, header) < 0)
-				return -1;
+	}
+	if (rc < 0)
+		printf("Bad record at offset %zu\n", record.offset);
+	fclose(fp);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_filter filter;
+	struct trace trace;
+	uint64_t interval;
+	char *path, *end, *json;
+	FILE *fp;
+	DBG_HEADER header;
+	int opt, rc, analyze;
+
+	filter.first_cycle = 0;
+	filter.last_cycle = UINT64_MAX;
+	filter.tag = -1;
+	filter.context = -1;
+	interval = ANALYZE_INTERVAL;
+	analyze = 0;
+	json = NULL;
+	while ((opt = getopt(argc, argv, "ac:i:j:t:x:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			analyze = 1;
 			break;
-		case DBG_HEADER_CMD_DMA0:
-			if (_parse_cmd_dma0(fp, header) < 0)
+		case 'i':
+			interval = strtoull(optarg, NULL, 0);
+			if (interval == 0) {
+				_usage(argv[0]);
 				return -1;
+			}
 			break;
-#endif
-		case DBG_HEADER_CMD_CLIENT_ACK:
-		case DBG_HEADER_CMD_CLIENT_REQ:
-			if (_parse_cmd_client(fp, header) < 0)
-				return -1;
+		case 'j':
+			json = optarg;
 			break;
-		case DBG_HEADER_CMD_BUFFER_WRITE:
-		case DBG_HEADER_CMD_BUFFER_READ:
-			if (_parse_cmd_buffer(fp, header) < 0)
+		case 'c':
+			filter.first_cycle = strtoull(optarg, &end, 0);
+			if (*end == ':')
+				filter.last_cycle = strtoull(end + 1, &end, 0);
+			if (*end != '\0') {
+				_usage(argv[0]);
 				return -1;
+			}
 			break;
-		case DBG_HEADER_CMD_RESPONSE:
-			if (_parse_cmd_response(fp, header) < 0)
-				return -1;
+		case 't':
+			filter.tag = strtol(optarg, NULL, 0) & 0xff;
 			break;
-		case DBG_HEADER_SOCKET_GET:
-		case DBG_HEADER_SOCKET_PUT:
-			if (_parse_socket(fp, header, silent) < 0)
-				return -1;
+		case 'x':
+			filter.context = strtol(optarg, NULL, 0) & 0xffff;
 			break;
 		default:
-			printf("Bad header: %d\n", header);
+			_usage(argv[0]);
 			return -1;
 		}
-		header = 0;
+	}
+	path = "debug.log";
+	if (optind < argc)
+		path = argv[optind];
+
+	if ((rc = trace_open(&trace, path)) < 0)
+		return -1;
+	if (rc > 0) {
+		if (json)
+			rc = chrome_trace(&trace, &filter, json);
+		else if (analyze)
+			rc = analyze_trace(&trace, &filter, interval);
+		else
+			rc = _parse_trace(&trace, &filter);
+		trace_close(&trace);
+		return rc;
+	}
+
+	if ((filter.first_cycle != 0) || (filter.last_cycle != UINT64_MAX) ||
+	    (filter.tag >= 0) || (filter.context >= 0) || analyze || json) {
+		printf("%s has no cycles, tags or contexts to use\n", path);
+		return -1;
+	}
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	while ((header = debug_get_header(fp)) != (DBG_HEADER) - 1) {
+		if (_parse_record(fp, header) < 0)
+			return -1;
 	}
 
 	fclose(fp);
@@ -0,0 +1,373 @@
+/*
+ * Copyright 2014,2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Description: pair.c
+ *
+ *  This file pairs the records of a v2 debug.log that start something with
+ *  the records that end it, for the analysis and Chrome trace modes:
+ *
+ *    CMD_ADD to CMD_RESPONSE per AFU and tag
+ *    CLIENT_REQ to CLIENT_ACK per AFU and tag
+ *    MMIO_SEND to MMIO_ACK per AFU, MMIOs go to the AFU one at a time
+ *    MMIO_ADD to MMIO_RETURN per AFU and context
+ *
+ *  Each span is passed to a callback once its last record is seen, with the
+ *  cycle and time stamps of its first.  Only requests still outstanding are
+ *  kept.  Records that can't be paired are counted.
+ *
+ *  Most records that end a span don't carry its context, so a context filter
+ *  is applied here to the paired spans rather than to the records.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pair.h"
+
+static uint16_t _get_16(const uint8_t * data)
+{
+	return (data[0] << 8) | data[1];
+}
+
+static uint32_t _get_32(const uint8_t * data)
+{
+	return ((uint32_t) _get_16(data) << 16) | _get_16(data + 2);
+}
+
+static int _match(struct pair *pair, int context)
+{
+	return (pair->context < 0) || (context == pair->context);
+}
+
+static struct pair_afu *_afu(struct pair *pair, uint8_t id)
+{
+	struct pair_afu *afu;
+
+	for (afu = pair->afus; afu != NULL; afu = afu->_next) {
+		if (afu->id == id)
+			return afu;
+	}
+	if ((afu = (struct pair_afu *)calloc(1, sizeof(*afu))) == NULL) {
+		perror("calloc");
+		exit(-1);
+	}
+	afu->id = id;
+	afu->_next = pair->afus;
+	pair->afus = afu;
+	return afu;
+}
+
+static void _span(struct pair *pair, enum pair_kind kind,
+		  struct pair_afu *afu, struct trace_record *record,
+		  struct pair_span *span)
+{
+	if ((kind != PAIR_AFU_DROP) && !_match(pair, span->context))
+		return;
+	span->kind = kind;
+	span->afu = afu->id;
+	span->outstanding = afu->outstanding;
+	span->record = record;
+	pair->fn(pair->arg, span);
+}
+
+static void _tag_span(struct pair *pair, enum pair_kind kind,
+		      struct pair_afu *afu, uint8_t id, uint64_t cycle,
+		      uint64_t ns, struct trace_record *record)
+{
+	struct pair_tag *tag = &(afu->tag[id]);
+	struct pair_span span;
+
+	memset(&span, 0, sizeof(span));
+	span.tag = id;
+	span.command = tag->command;
+	span.context = tag->context;
+	span.size = tag->size;
+	span.resp = tag->resp;
+	span.cycle = cycle;
+	span.ns = ns;
+	_span(pair, kind, afu, record, &span);
+}
+
+static void _cmd(struct pair *pair, struct trace_record *record)
+{
+	const uint8_t *data = record->data;
+	struct pair_afu *afu = _afu(pair, data[1]);
+	struct pair_tag *tag = &(afu->tag[data[2]]);
+
+	switch (data[0]) {
+	case DBG_HEADER_CMD_ADD:
+	case DBG_HEADER_CMD_ADD_SIZE:
+		// A busy tag being reused never got its response
+		if (tag->busy && _match(pair, tag->context)) {
+			pair->unpaired++;
+			afu->outstanding--;
+		}
+		memset(tag, 0, sizeof(*tag));
+		tag->busy = 1;
+		tag->resp = -1;
+		tag->context = _get_16(data + 3);
+		if (_match(pair, tag->context))
+			afu->outstanding++;
+		tag->command = _get_16(data + 5);
+		if (data[0] == DBG_HEADER_CMD_ADD_SIZE)
+			tag->size = _get_16(data + 7);
+		tag->cycle = record->cycle;
+		tag->ns = record->ns;
+		_tag_span(pair, PAIR_CMD_ADD, afu, data[2], tag->cycle,
+			  tag->ns, record);
+		return;
+	case DBG_HEADER_CMD_UPDATE:
+		if (tag->busy)
+			tag->resp = _get_16(data + 5);
+		return;
+	case DBG_HEADER_CMD_CLIENT_REQ:
+		if (!tag->busy)
+			return;
+		tag->client = 1;
+		tag->client_cycle = record->cycle;
+		tag->client_ns = record->ns;
+		return;
+	case DBG_HEADER_CMD_CLIENT_ACK:
+		if (!tag->busy || !tag->client) {
+			if (_match(pair, tag->busy ? tag->context :
+				   record->context))
+				pair->unpaired++;
+			return;
+		}
+		tag->client = 0;
+		_tag_span(pair, PAIR_CLIENT, afu, data[2], tag->client_cycle,
+			  tag->client_ns, record);
+		return;
+	case DBG_HEADER_CMD_BUFFER_WRITE:
+	case DBG_HEADER_CMD_BUFFER_READ:
+		if (!tag->busy)
+			return;
+		_tag_span(pair, PAIR_CMD_BUFFER, afu, data[2], tag->cycle,
+			  tag->ns, record);
+		return;
+	case DBG_HEADER_CMD_RESPONSE:
+	case DBG_HEADER_CMD_RESPONSE_CODE:
+		if (!tag->busy) {
+			if (_match(pair, record->context))
+				pair->unpaired++;
+			return;
+		}
+		if (data[0] == DBG_HEADER_CMD_RESPONSE_CODE)
+			tag->resp = _get_16(data + 3);
+		tag->busy = 0;
+		if (_match(pair, tag->context))
+			afu->outstanding--;
+		_tag_span(pair, PAIR_CMD, afu, data[2], tag->cycle, tag->ns,
+			  record);
+		return;
+	default:
+		return;
+	}
+}
+
+static void _mmio_span(struct pair *pair, enum pair_kind kind,
+		       struct pair_afu *afu, struct pair_mmio *mmio,
+		       uint64_t cycle, uint64_t ns,
+		       struct trace_record *record)
+{
+	struct pair_span span;
+
+	memset(&span, 0, sizeof(span));
+	span.context = mmio->context;
+	span.resp = -1;
+	span.rnw = mmio->rnw;
+	span.dw = mmio->dw;
+	span.addr = mmio->addr;
+	span.cycle = cycle;
+	span.ns = ns;
+	_span(pair, kind, afu, record, &span);
+}
+
+static void _mmio_remove(struct pair_afu *afu, int i)
+{
+	afu->mmios--;
+	memmove(&(afu->mmio[i]), &(afu->mmio[i + 1]),
+		(afu->mmios - i) * sizeof(afu->mmio[0]));
+}
+
+static void _mmio(struct pair *pair, struct trace_record *record)
+{
+	const uint8_t *data = record->data;
+	struct pair_afu *afu = _afu(pair, data[1]);
+	struct pair_mmio *mmio;
+	enum pair_mmio_state want;
+	uint16_t context;
+	int i;
+
+	// MMIOs go to the AFU in the order they were added, one at a time
+	switch (data[0]) {
+	case DBG_HEADER_MMIO_ADD:
+		if (afu->mmios == PAIR_MMIOS) {
+			if (_match(pair, afu->mmio[0].context))
+				pair->unpaired++;
+			_mmio_remove(afu, 0);
+		}
+		mmio = &(afu->mmio[afu->mmios++]);
+		memset(mmio, 0, sizeof(*mmio));
+		mmio->rnw = data[2];
+		mmio->dw = data[3];
+		mmio->context = _get_16(data + 4);
+		mmio->addr = _get_32(data + 6);
+		mmio->cycle = record->cycle;
+		mmio->ns = record->ns;
+		return;
+	case DBG_HEADER_MMIO_SEND:
+	case DBG_HEADER_MMIO_ACK:
+		want = (data[0] == DBG_HEADER_MMIO_SEND) ?
+		    PAIR_MMIO_ADDED : PAIR_MMIO_SENT;
+		for (i = 0; i < afu->mmios; i++) {
+			if (afu->mmio[i].state == want)
+				break;
+		}
+		if (i == afu->mmios) {
+			if (_match(pair, record->context))
+				pair->unpaired++;
+			return;
+		}
+		mmio = &(afu->mmio[i]);
+		if (data[0] == DBG_HEADER_MMIO_SEND) {
+			mmio->state = PAIR_MMIO_SENT;
+			mmio->sent_cycle = record->cycle;
+			mmio->sent_ns = record->ns;
+			return;
+		}
+		_mmio_span(pair, PAIR_MMIO_AFU, afu, mmio, mmio->sent_cycle,
+			   mmio->sent_ns, record);
+		mmio->state = PAIR_MMIO_ACKED;
+		// Descriptor reads aren't returned to a client
+		if (mmio->context == (uint16_t) - 1) {
+			_mmio_span(pair, PAIR_MMIO, afu, mmio, mmio->cycle,
+				   mmio->ns, record);
+			_mmio_remove(afu, i);
+		}
+		return;
+	case DBG_HEADER_MMIO_RETURN:
+		context = _get_16(data + 2);
+		for (i = 0; i < afu->mmios; i++) {
+			if ((afu->mmio[i].state == PAIR_MMIO_ACKED) &&
+			    (afu->mmio[i].context == context))
+				break;
+		}
+		if (i == afu->mmios) {
+			if (_match(pair, context))
+				pair->unpaired++;
+			return;
+		}
+		mmio = &(afu->mmio[i]);
+		_mmio_span(pair, PAIR_MMIO, afu, mmio, mmio->cycle, mmio->ns,
+			   record);
+		_mmio_remove(afu, i);
+		return;
+	default:
+		return;
+	}
+}
+
+// AFU went away, anything still outstanding will never complete
+static void _afu_drop(struct pair *pair, struct trace_record *record)
+{
+	struct pair_afu *afu = _afu(pair, record->data[1]);
+	struct pair_span span;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		if (afu->tag[i].busy && _match(pair, afu->tag[i].context))
+			pair->unpaired++;
+		afu->tag[i].busy = 0;
+	}
+	for (i = 0; i < afu->mmios; i++) {
+		if (_match(pair, afu->mmio[i].context))
+			pair->unpaired++;
+	}
+	afu->mmios = 0;
+	afu->outstanding = 0;
+	memset(&span, 0, sizeof(span));
+	span.resp = -1;
+	span.cycle = record->cycle;
+	span.ns = record->ns;
+	_span(pair, PAIR_AFU_DROP, afu, record, &span);
+}
+
+void pair_init(struct pair *pair, int context, pair_fn fn, void *arg)
+{
+	memset(pair, 0, sizeof(*pair));
+	pair->context = context;
+	pair->fn = fn;
+	pair->arg = arg;
+}
+
+int pair_record(struct pair *pair, struct trace_record *record)
+{
+	switch (record->data[0]) {
+	case DBG_HEADER_CMD_ADD:
+	case DBG_HEADER_CMD_ADD_SIZE:
+	case DBG_HEADER_CMD_UPDATE:
+	case DBG_HEADER_CMD_CLIENT_REQ:
+	case DBG_HEADER_CMD_CLIENT_ACK:
+	case DBG_HEADER_CMD_BUFFER_WRITE:
+	case DBG_HEADER_CMD_BUFFER_READ:
+	case DBG_HEADER_CMD_RESPONSE:
+	case DBG_HEADER_CMD_RESPONSE_CODE:
+		_cmd(pair, record);
+		return 1;
+	case DBG_HEADER_MMIO_ADD:
+	case DBG_HEADER_MMIO_SEND:
+	case DBG_HEADER_MMIO_ACK:
+	case DBG_HEADER_MMIO_RETURN:
+		_mmio(pair, record);
+		return 1;
+	case DBG_HEADER_AFU_DROP:
+		_afu_drop(pair, record);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+uint64_t pair_outstanding(struct pair *pair)
+{
+	struct pair_afu *afu;
+	uint64_t outstanding;
+	int i;
+
+	outstanding = 0;
+	for (afu = pair->afus; afu != NULL; afu = afu->_next) {
+		outstanding += afu->outstanding;
+		for (i = 0; i < afu->mmios; i++) {
+			if (_match(pair, afu->mmio[i].context))
+				outstanding++;
+		}
+	}
+	return outstanding;
+}
+
+void pair_free(struct pair *pair)
+{
+	struct pair_afu *afu;
+
+	while (pair->afus != NULL) {
+		afu = pair->afus;
+		pair->afus = afu->_next;
+		free(afu);
+	}
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2014,2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PAIR_H_
+#define _PAIR_H_
+
+#include <stdint.h>
+
+#include "trace.h"
+
+// Most MMIOs tracked per AFU between MMIO_ADD and MMIO_RETURN
+#define PAIR_MMIOS	256
+
+enum pair_kind {
+	PAIR_CMD_ADD,		// CMD_ADD, the command has just started
+	PAIR_CMD_BUFFER,	// Buffer read or write for a started command
+	PAIR_CMD,		// CMD_ADD to CMD_RESPONSE
+	PAIR_CLIENT,		// CLIENT_REQ to CLIENT_ACK
+	PAIR_MMIO_AFU,		// MMIO_SEND to MMIO_ACK
+	PAIR_MMIO,		// MMIO_ADD to MMIO_RETURN, or MMIO_ACK for
+				// descriptor MMIOs
+	PAIR_AFU_DROP		// AFU_DROP, nothing outstanding completes
+};
+
+// Span from the record that started it to record, which ended it
+struct pair_span {
+	enum pair_kind kind;
+	uint8_t afu;
+	uint8_t tag;
+	uint16_t command;
+	uint16_t context;	// 0xffff for descriptor MMIOs
+	uint16_t size;		// 0 if CMD_ADD had no size
+	int resp;		// -1 if no response code was seen
+	uint8_t rnw;
+	uint8_t dw;
+	uint32_t addr;
+	int outstanding;	// Tags outstanding on the AFU after record,
+				// counting only those matching the context
+	uint64_t cycle;
+	uint64_t ns;
+	struct trace_record *record;
+};
+
+typedef void (*pair_fn) (void *arg, struct pair_span * span);
+
+struct pair_tag {
+	int busy;
+	int client;
+	int resp;
+	uint16_t command;
+	uint16_t context;
+	uint16_t size;
+	uint64_t cycle;
+	uint64_t ns;
+	uint64_t client_cycle;
+	uint64_t client_ns;
+};
+
+enum pair_mmio_state {
+	PAIR_MMIO_ADDED,
+	PAIR_MMIO_SENT,
+	PAIR_MMIO_ACKED
+};
+
+struct pair_mmio {
+	enum pair_mmio_state state;
+	uint8_t rnw;
+	uint8_t dw;
+	uint16_t context;
+	uint32_t addr;
+	uint64_t cycle;
+	uint64_t ns;
+	uint64_t sent_cycle;
+	uint64_t sent_ns;
+};
+
+struct pair_afu {
+	uint8_t id;
+	struct pair_tag tag[256];
+	struct pair_mmio mmio[PAIR_MMIOS];
+	int mmios;
+	int outstanding;
+	struct pair_afu *_next;
+};
+
+struct pair {
+	int context;
+	pair_fn fn;
+	void *arg;
+	struct pair_afu *afus;
+	uint64_t unpaired;
+};
+
+// Only spans for context are passed to fn, -1 for any context.  AFU_DROP
+// spans are always passed.
+void pair_init(struct pair *pair, int context, pair_fn fn, void *arg);
+
+// Pair record with the records before it, calling back with each span it
+// starts or completes.  Returns 0 for records pairing doesn't use.
+int pair_record(struct pair *pair, struct trace_record *record);
+
+// Commands and MMIOs started but not yet completed
+uint64_t pair_outstanding(struct pair *pair);
+
+void pair_free(struct pair *pair);
+
+#endif				/* _PAIR_H_ */
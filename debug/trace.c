@@ -0,0 +1,282 @@
+/*
+ * Copyright 2014,2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Description: trace.c
+ *
+ *  This file contains the reader for v2 debug.log files.  The file is mapped
+ *  rather than read so that only the blocks that can hold wanted records are
+ *  ever touched.  The block index written at the end of the file by
+ *  debug_stop() gives the cycle range, tags and contexts of every block.  If
+ *  pslse didn't get to write it the index is rebuilt by walking the block
+ *  headers from the start of the file, which only touches one page per block.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "../common/utils.h"
+
+static uint64_t _get_64(const uint8_t * data)
+{
+	uint64_t value;
+
+	memcpy(&value, data, sizeof(value));
+	return ntohll(value);
+}
+
+static uint32_t _get_32(const uint8_t * data)
+{
+	uint32_t value;
+
+	memcpy(&value, data, sizeof(value));
+	return ntohl(value);
+}
+
+static size_t _block_end(struct dbg_index *index)
+{
+	return index->offset + sizeof(struct dbg_block) + index->block.bytes +
+	    (size_t) index->block.records * DBG_STAMP_BYTES;
+}
+
+// Load index from the trailer at the end of the file
+static int _load_index(struct trace *trace)
+{
+	struct dbg_trailer trailer;
+	struct dbg_index *index;
+	uint32_t i;
+
+	if (trace->size < sizeof(trailer))
+		return -1;
+	memcpy(&trailer, trace->map + trace->size - sizeof(trailer),
+	       sizeof(trailer));
+	if (ntohl(trailer.magic) != DBG_INDEX_MAGIC)
+		return -1;
+	trailer.blocks = ntohl(trailer.blocks);
+	trailer.offset = ntohll(trailer.offset);
+	if (trailer.offset + (uint64_t) trailer.blocks *
+	    sizeof(struct dbg_index) + sizeof(trailer) != trace->size)
+		return -1;
+
+	index = (struct dbg_index *)calloc(trailer.blocks + 1, sizeof(*index));
+	if (index == NULL)
+		return -1;
+	memcpy(index, trace->map + trailer.offset,
+	       trailer.blocks * sizeof(*index));
+	for (i = 0; i < trailer.blocks; i++) {
+		index[i].offset = ntohll(index[i].offset);
+		debug_block_order(&(index[i].block));
+		if ((index[i].block.magic != DBG_BLOCK_MAGIC) ||
+		    (_block_end(&(index[i])) > trailer.offset)) {
+			free(index);
+			return -1;
+		}
+	}
+	trace->index = index;
+	trace->blocks = trailer.blocks;
+	return 0;
+}
+
+// Rebuild index from the block headers, stopping at a partly written block
+static int _walk_blocks(struct trace *trace)
+{
+	struct dbg_index *index, *grown;
+	uint32_t count, max;
+	size_t offset;
+
+	index = NULL;
+	count = max = 0;
+	offset = 0;
+	while (offset + sizeof(struct dbg_block) <= trace->size) {
+		if (count == max) {
+			max = 2 * (max + 64);
+			grown = (struct dbg_index *)realloc(index,
+							    max *
+							    sizeof(*index));
+			if (grown == NULL) {
+				free(index);
+				return -1;
+			}
+			index = grown;
+		}
+		index[count].offset = offset;
+		memcpy(&(index[count].block), trace->map + offset,
+		       sizeof(struct dbg_block));
+		debug_block_order(&(index[count].block));
+		if ((index[count].block.magic != DBG_BLOCK_MAGIC) ||
+		    (_block_end(&(index[count])) > trace->size))
+			break;
+		offset = _block_end(&(index[count]));
+		count++;
+	}
+	if (offset != trace->size)
+		warn_msg("Trace is incomplete after offset %zu", offset);
+	trace->index = index;
+	trace->blocks = count;
+	return 0;
+}
+
+int trace_open(struct trace *trace, const char *path)
+{
+	struct stat st;
+	uint32_t i;
+	int fd;
+
+	memset(trace, 0, sizeof(*trace));
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < sizeof(uint32_t)) {
+		close(fd);
+		return 0;
+	}
+	trace->size = st.st_size;
+	trace->map = (uint8_t *) mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE,
+				      fd, 0);
+	close(fd);
+	if (trace->map == MAP_FAILED) {
+		perror("mmap");
+		trace->map = NULL;
+		return -1;
+	}
+
+	// v1 files start with a record header, never with a block
+	if (_get_32(trace->map) != DBG_BLOCK_MAGIC) {
+		trace_close(trace);
+		return 0;
+	}
+	if ((_load_index(trace) < 0) && (_walk_blocks(trace) < 0)) {
+		trace_close(trace);
+		return -1;
+	}
+	madvise(trace->map, trace->size, MADV_RANDOM);
+
+	for (i = 0; i < trace->blocks; i++) {
+		if ((i == 0) || (trace->index[i].block.first_ns <
+				 trace->first_ns))
+			trace->first_ns = trace->index[i].block.first_ns;
+	}
+	trace_rewind(trace);
+	return 1;
+}
+
+void trace_close(struct trace *trace)
+{
+	if (trace->map)
+		munmap(trace->map, trace->size);
+	free(trace->index);
+	memset(trace, 0, sizeof(*trace));
+}
+
+void trace_rewind(struct trace *trace)
+{
+	trace->block = 0;
+	trace->record = 0;
+	trace->next = 0;
+}
+
+// Can block have records that match filter?
+static int _block_match(struct dbg_block *block, struct trace_filter *filter)
+{
+	if ((filter->first_cycle != 0) || (filter->last_cycle != UINT64_MAX)) {
+		if ((block->first_cycle == 0) ||
+		    (block->last_cycle < filter->first_cycle) ||
+		    (block->first_cycle > filter->last_cycle))
+			return 0;
+	}
+	if ((filter->tag >= 0) &&
+	    !(block->tags[filter->tag / 64] & (1ull << (filter->tag % 64))))
+		return 0;
+	if ((filter->context >= 0) &&
+	    !(block->contexts & (1ull << (filter->context % 64))))
+		return 0;
+	return 1;
+}
+
+static int _record_match(struct trace_record *record,
+			 struct trace_filter *filter)
+{
+	if ((filter->first_cycle != 0) || (filter->last_cycle != UINT64_MAX)) {
+		if ((record->cycle == 0) ||
+		    (record->cycle < filter->first_cycle) ||
+		    (record->cycle > filter->last_cycle))
+			return 0;
+	}
+	if ((filter->tag >= 0) && (record->tag != filter->tag))
+		return 0;
+	if ((filter->context >= 0) && (record->context != filter->context))
+		return 0;
+	return 1;
+}
+
+int trace_next(struct trace *trace, struct trace_filter *filter,
+	       struct trace_record *record)
+{
+	struct dbg_index *index;
+	const uint8_t *stamp;
+	size_t end;
+
+	while (trace->block < trace->blocks) {
+		index = &(trace->index[trace->block]);
+		if (trace->record == 0) {
+			if (!_block_match(&(index->block), filter)) {
+				trace->block++;
+				continue;
+			}
+			trace->next = index->offset + sizeof(struct dbg_block);
+		}
+		end = index->offset + sizeof(struct dbg_block) +
+		    index->block.bytes;
+		if (trace->record == index->block.records) {
+			if (trace->next != end) {
+				record->offset = trace->next;
+				return -1;
+			}
+			trace->block++;
+			trace->record = 0;
+			continue;
+		}
+
+		record->data = trace->map + trace->next;
+		record->offset = trace->next;
+		record->size = debug_record_parse(record->data,
+						  end - trace->next,
+						  &(record->tag),
+						  &(record->context));
+		if (record->size < 0)
+			return -1;
+		stamp = trace->map + end + trace->record * DBG_STAMP_BYTES;
+		record->cycle = _get_64(stamp);
+		record->ns = index->block.first_ns + _get_32(stamp + 8) -
+		    trace->first_ns;
+		trace->next += record->size;
+		trace->record++;
+		if (_record_match(record, filter))
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2014,2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../common/debug.h"
+
+// Records wanted from a trace, tag and context of -1 match anything
+struct trace_filter {
+	uint64_t first_cycle;
+	uint64_t last_cycle;
+	int tag;
+	int context;
+};
+
+struct trace_record {
+	const uint8_t *data;
+	size_t offset;		// File offset of the record
+	int size;
+	int tag;		// -1 if the record has no tag
+	int context;		// -1 if the record has no context
+	uint64_t cycle;		// 0 if the record isn't from an AFU
+	uint64_t ns;		// Nanoseconds after the first record
+};
+
+struct trace {
+	uint8_t *map;
+	size_t size;
+	struct dbg_index *index;
+	uint32_t blocks;
+	uint64_t first_ns;
+	uint32_t block;
+	uint32_t record;
+	size_t next;
+};
+
+// Map a v2 debug.log and load its block index, rebuilding it from the blocks
+// if the file has no trailer.  Returns 0 if path is a v1 file.
+int trace_open(struct trace *trace, const char *path);
+
+void trace_close(struct trace *trace);
+
+// Restart trace_next() from the first block
+void trace_rewind(struct trace *trace);
+
+// Next record matching filter, skipping blocks whose index entry shows it
+// can't match.  Returns 0 at the end of the trace and -1 on a bad record, with
+// the offset of the bad record set in record.
+int trace_next(struct trace *trace, struct trace_filter *filter,
+	       struct trace_record *record);
+
+#endif				/* _TRACE_H_ */
@@ -17,10 +17,13 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -58,31 +61,288 @@
 #define MAX_LINE_CHARS 1024
 
 #define FOURK_MASK        0xFFFFFFFFFFFFF000L
+#define CACHELINE_MASK    0xFFFFFFFFFFFFFF80L
 
 #define DSISR 0x4000000040000000L
 #define ERR_BUFF_MAX_COPY_SIZE 4096
 
-static int _delay_1ms()
+// Wake the PSL thread so it notices a new request or a shutdown
+static void _wake(struct cxl_afu_h *afu)
 {
-	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 1000000;
-	return nanosleep(&ts, &ts);
+	uint8_t byte = 1;
+
+	// A full pipe already has a wakeup pending
+	if (write(afu->wake[1], &byte, 1) < 0)
+		return;
+}
+
+// Write to the PSLSE socket.  Memory workers send acknowledgements alongside
+// the PSL thread so whole messages are written under send_lock.
+static int _send(struct cxl_afu_h *afu, int size, uint8_t * data)
+{
+	int rc;
+
+	pthread_mutex_lock(&(afu->send_lock));
+	rc = put_bytes_silent(afu->fd, size, data);
+	pthread_mutex_unlock(&(afu->send_lock));
+	return rc;
+}
+
+// Hand a request to the PSL thread
+static void _req_send(struct cxl_afu_h *afu,
+		      volatile enum libcxl_req_state *state)
+{
+	*state = LIBCXL_REQ_REQUEST;
+	_wake(afu);
+}
+
+// Block until the PSL thread completes a request
+static void _req_wait(struct cxl_afu_h *afu,
+		      volatile enum libcxl_req_state *state)
+{
+	pthread_mutex_lock(&(afu->req_lock));
+	while (*state != LIBCXL_REQ_IDLE)
+		pthread_cond_wait(&(afu->req_cond), &(afu->req_lock));
+	pthread_mutex_unlock(&(afu->req_lock));
+}
+
+// Wake any callers whose requests the PSL thread has completed.  Request
+// states are updated before this takes req_lock so no wakeup is lost.
+static void _req_done(struct cxl_afu_h *afu)
+{
+	pthread_mutex_lock(&(afu->req_lock));
+	pthread_cond_broadcast(&(afu->req_cond));
+	pthread_mutex_unlock(&(afu->req_lock));
+}
+
+// Add entry to the tail of MMIO queue
+static void _mmio_push(struct mmio_queue *queue, struct mmio_entry *entry)
+{
+	entry->_next = NULL;
+	if (queue->tail != NULL)
+		queue->tail->_next = entry;
+	else
+		queue->head = entry;
+	queue->tail = entry;
 }
 
-static int _testmemaddr(uint8_t * memaddr)
+// Remove entry from the head of MMIO queue
+static struct mmio_entry *_mmio_pop(struct mmio_queue *queue)
 {
-	int fd[2];
-	int ret = 0;
-	if (pipe(fd) >= 0) {
-		if (write(fd[1], memaddr, 1) > 0)
-			ret = 1;
+	struct mmio_entry *entry;
+
+	entry = queue->head;
+	if (entry != NULL) {
+		queue->head = entry->_next;
+		if (queue->head == NULL)
+			queue->tail = NULL;
+	}
+	return entry;
+}
+
+// Free the asynchronous MMIO accesses left on queue.  Synchronous accesses
+// belong to the callers waiting on them.
+static void _mmio_free_async(struct mmio_queue *queue)
+{
+	struct mmio_entry *entry;
+
+	while ((entry = _mmio_pop(queue)) != NULL) {
+		if (entry->async)
+			free(entry);
+	}
+}
+
+// Release the pipes and request signalling resources of afu
+static void _req_free(struct cxl_afu_h *afu)
+{
+	_mmio_free_async(&(afu->mmio_submit));
+	_mmio_free_async(&(afu->mmio_sent));
+	_mmio_free_async(&(afu->mmio_done));
+	pthread_mutex_destroy(&(afu->req_lock));
+	pthread_cond_destroy(&(afu->req_cond));
+	pthread_cond_destroy(&(afu->event_cond));
+	pthread_mutex_destroy(&(afu->push_lock));
+	pthread_mutex_destroy(&(afu->read_lock));
+	pthread_mutex_destroy(&(afu->send_lock));
+	pthread_mutex_destroy(&(afu->prefetch_lock));
+	close(afu->wake[0]);
+	close(afu->wake[1]);
+	close(afu->mmio_fd[0]);
+	close(afu->mmio_fd[1]);
+	close(afu->probe[0]);
+	close(afu->probe[1]);
+}
+
+// Complete a queued MMIO access.  Asynchronous accesses are queued to be
+// reaped with a byte on the completion pipe for each.  The thread waiting on
+// a synchronous access is woken by the following _req_done().
+static void _mmio_complete(struct cxl_afu_h *afu, struct mmio_entry *entry)
+{
+	uint8_t byte = 1;
+
+	if (!entry->async) {
+		entry->done = 1;
+		return;
+	}
+	pthread_mutex_lock(&(afu->req_lock));
+	_mmio_push(&(afu->mmio_done), entry);
+	if (write(afu->mmio_fd[1], &byte, 1) < 0)
+		warn_msg("Failed to signal MMIO completion");
+	pthread_mutex_unlock(&(afu->req_lock));
+}
+
+// Fail every MMIO access still queued when the PSL thread stops
+static void _mmio_fail_all(struct cxl_afu_h *afu)
+{
+	struct mmio_entry *entry;
+
+	pthread_mutex_lock(&(afu->req_lock));
+	afu->mmio_closed = 1;
+	while ((entry = _mmio_pop(&(afu->mmio_submit))) != NULL)
+		_mmio_push(&(afu->mmio_sent), entry);
+	pthread_mutex_unlock(&(afu->req_lock));
+	while ((entry = _mmio_pop(&(afu->mmio_sent))) != NULL) {
+		// Slot requests were already idled with the socket
+		if (entry->op == NULL)
+			continue;
+		entry->op->result = -1;
+		_mmio_complete(afu, entry);
+	}
+}
+
+// Is op a valid MMIO access?
+static int _mmio_op_valid(struct cxl_mmio_op *op)
+{
+	switch (op->type) {
+	case CXL_MMIO_OP_WRITE64:
+	case CXL_MMIO_OP_READ64:	/*fall through */
+		return !(op->offset & 0x7);
+	case CXL_MMIO_OP_WRITE32:
+	case CXL_MMIO_OP_READ32:	/*fall through */
+		return !(op->offset & 0x3);
+	default:
+		return 0;
+	}
+}
+
+// Queue op behind any other MMIO on this handle and wait for it to complete
+static int _mmio_sync(struct cxl_afu_h *afu, struct cxl_mmio_op *op)
+{
+	struct mmio_entry entry;
+
+	entry.op = op;
+	entry.async = 0;
+	entry.done = 0;
+	pthread_mutex_lock(&(afu->req_lock));
+	if (afu->mmio_closed) {
+		pthread_mutex_unlock(&(afu->req_lock));
+		return -1;
+	}
+	_mmio_push(&(afu->mmio_submit), &entry);
+	_wake(afu);
+	while (!entry.done)
+		pthread_cond_wait(&(afu->req_cond), &(afu->req_lock));
+	pthread_mutex_unlock(&(afu->req_lock));
+	return op->result;
+}
+
+// Jump buffer of the calling thread while it probes a cached page
+static __thread sigjmp_buf *volatile _probe_jmp;
+static struct sigaction _probe_old_segv;
+static struct sigaction _probe_old_bus;
+static pthread_once_t _probe_once = PTHREAD_ONCE_INIT;
+static int _probe_faults;
+
+// Fault handler that fails a probe of a page unmapped since it was cached.
+// Faults outside a probe go to the application's previous handler.
+static void _probe_fault(int sig, siginfo_t * info, void *context)
+{
+	struct sigaction *old;
+
+	if (_probe_jmp != NULL)
+		siglongjmp(*_probe_jmp, 1);
+	old = (sig == SIGBUS) ? &_probe_old_bus : &_probe_old_segv;
+	if (old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, info, context);
+		return;
+	}
+	if ((old->sa_handler != SIG_DFL) && (old->sa_handler != SIG_IGN)) {
+		old->sa_handler(sig);
+		return;
+	}
+	// Return to fault again with the previous action
+	sigaction(sig, old, NULL);
+}
+
+// Catch faults on cached pages only if LIBCXL_PROBE_FAULTS is set, the
+// handlers are process wide
+static void _probe_init(void)
+{
+	struct sigaction action;
+	char *value;
+
+	value = getenv("LIBCXL_PROBE_FAULTS");
+	if ((value == NULL) || (atoi(value) <= 0))
+		return;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = _probe_fault;
+	// No mask is restored by siglongjmp() so the signal must stay unblocked
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	if ((sigaction(SIGSEGV, &action, &_probe_old_segv) < 0) ||
+	    (sigaction(SIGBUS, &action, &_probe_old_bus) < 0)) {
+		warn_msg("Failed to install memory probe fault handler");
+		return;
 	}
+	_probe_faults = 1;
+}
 
-	close(fd[0]);
-	close(fd[1]);
+// Read a byte of a cached page, failing instead of faulting if the
+// application has unmapped it since
+static int _probe_cached(volatile uint8_t * memaddr)
+{
+	sigjmp_buf jmp;
+	uint8_t byte;
 
-	return ret;
+	if (sigsetjmp(jmp, 0)) {
+		_probe_jmp = NULL;
+		return 0;
+	}
+	_probe_jmp = &jmp;
+	byte = *memaddr;
+	_probe_jmp = NULL;
+	(void)byte;
+	return 1;
+}
+
+// Can memaddr be read?  The kernel is asked to copy a byte from it into the
+// probe pipe, which fails rather than faulting.  Pages found valid are kept
+// in a direct mapped cache so repeated accesses to them need no system calls.
+// The cache is cleared on attach and detach.  A page unmapped while attached
+// faults in libcxl on its next access, unless LIBCXL_PROBE_FAULTS has cached
+// pages touched under a fault handler so the access is a DSI instead.
+static int _testmemaddr(struct cxl_afu_h *afu, uint8_t * memaddr)
+{
+	uint64_t *entry;
+	uint64_t page;
+	uint8_t byte;
+
+	page = ((uint64_t) memaddr & FOURK_MASK) | 1;
+	entry = &(afu->page_cache[((uint64_t) memaddr >> 12) %
+				  PAGE_CACHE_ENTRIES]);
+	if (*entry == page) {
+		if (!_probe_faults || _probe_cached(memaddr))
+			return 1;
+		*entry = 0;
+		return 0;
+	}
+	if (write(afu->probe[1], memaddr, 1) <= 0)
+		return 0;
+	if (read(afu->probe[0], &byte, 1) < 0)
+		warn_msg("Failed to drain memory probe");
+	*entry = page;
+
+	return 1;
 }
 
 static void _all_idle(struct cxl_afu_h *afu)
@@ -98,47 +358,120 @@ static void _all_idle(struct cxl_afu_h *afu)
 	afu->opened = 0;
 }
 
-static int _handle_dsi(struct cxl_afu_h *afu, uint64_t addr)
+// Allocate the event ring once the number of interrupts is known
+static int _event_alloc(struct cxl_afu_h *afu, uint16_t irqs)
 {
-	uint16_t size;
-	int i;
+	struct event_ring *ring = &(afu->events);
+	uint32_t size;
 
-	if (!afu)
-		fatal_msg("NULL afu passed to libcxl.c:_handle_dsi");
-	// Only track a single DSI at a time
-	pthread_mutex_lock(&(afu->event_lock));
-	i = 0;
-	while (afu->events[i] != NULL) {
-		if (afu->events[i]->header.type == CXL_EVENT_DATA_STORAGE) {
-			pthread_mutex_unlock(&(afu->event_lock));
-			return 0;
-		}
-		++i;
+	if (ring->entry != NULL)
+		return 0;
+	// One entry per source, plus one for a source whose event is being
+	// read after its pending flag was cleared
+	size = 1;
+	while (size < (uint32_t)irqs + 3)
+		size <<= 1;
+	ring->entry = (struct cxl_event *)calloc(size, sizeof(struct cxl_event));
+	ring->irq_pending = (uint8_t *) calloc(irqs + 1, sizeof(uint8_t));
+	if ((ring->entry == NULL) || (ring->irq_pending == NULL)) {
+		free(ring->entry);
+		free((void *)ring->irq_pending);
+		ring->entry = NULL;
+		ring->irq_pending = NULL;
+		return -1;
 	}
-	assert(i < afu->irqs_max);
+	ring->size = size;
+	ring->irqs = irqs;
+	return 0;
+}
 
-	size = sizeof(struct cxl_event_header) +
-	    sizeof(struct cxl_event_data_storage);
-	afu->events[i] = (struct cxl_event *)calloc(1, size);
-	afu->events[i]->header.type = CXL_EVENT_DATA_STORAGE;
-	afu->events[i]->header.size = size;
-	afu->events[i]->header.process_element = afu->context;
-	afu->events[i]->fault.addr = addr & FOURK_MASK;
-	afu->events[i]->fault.dsisr = DSISR;
+static void _event_free(struct cxl_afu_h *afu)
+{
+	free(afu->events.entry);
+	free((void *)afu->events.irq_pending);
+	afu->events.entry = NULL;
+	afu->events.irq_pending = NULL;
+}
+
+// Pending flag for the source of an event
+static volatile uint8_t *_event_source(struct event_ring *ring,
+				       struct cxl_event *event)
+{
+	switch (event->header.type) {
+	case CXL_EVENT_DATA_STORAGE:
+		return &(ring->dsi_pending);
+	case CXL_EVENT_AFU_ERROR:
+		return &(ring->error_pending);
+	default:
+		return &(ring->irq_pending[event->irq.irq]);
+	}
+}
+
+// Return the next free ring entry, or NULL if an event from the same source
+// is still waiting to be read and this one coalesces with it.  An entry is
+// returned with push_lock held until _event_push().
+static struct cxl_event *_event_claim(struct cxl_afu_h *afu,
+				      volatile uint8_t * pending)
+{
+	struct event_ring *ring = &(afu->events);
+	struct cxl_event *event;
+
+	pthread_mutex_lock(&(afu->push_lock));
+	if (__atomic_load_n(pending, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&(afu->push_lock));
+		return NULL;
+	}
+	*pending = 1;
+	event = &(ring->entry[ring->head & (ring->size - 1)]);
+	memset(event, 0, sizeof(struct cxl_event));
+	event->header.process_element = afu->context;
+	return event;
+}
+
+// Publish the entry returned by _event_claim and wake a blocked reader
+static int _event_push(struct cxl_afu_h *afu, struct cxl_event *event)
+{
+	struct event_ring *ring = &(afu->events);
+	int rc;
 
 	do {
-		i = write(afu->pipe[1], &(afu->events[i]->header.type), 1);
+		rc = write(afu->pipe[1], &(event->header.type), 1);
 	}
-	while ((i == 0) || (errno == EINTR));
-	pthread_mutex_unlock(&(afu->event_lock));
-	return i;
+	while ((rc == 0) || ((rc < 0) && (errno == EINTR)));
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(afu->push_lock));
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ring->waiting) {
+		pthread_mutex_lock(&(afu->event_lock));
+		pthread_cond_broadcast(&(afu->event_cond));
+		pthread_mutex_unlock(&(afu->event_lock));
+	}
+	return rc;
+}
+
+static int _handle_dsi(struct cxl_afu_h *afu, uint64_t addr)
+{
+	struct cxl_event *event;
+
+	if (!afu)
+		fatal_msg("NULL afu passed to libcxl.c:_handle_dsi");
+	// Only track a single DSI at a time
+	event = _event_claim(afu, &(afu->events.dsi_pending));
+	if (event == NULL)
+		return 0;
+	event->header.type = CXL_EVENT_DATA_STORAGE;
+	event->header.size = sizeof(struct cxl_event_header) +
+	    sizeof(struct cxl_event_data_storage);
+	event->fault.addr = addr & FOURK_MASK;
+	event->fault.dsisr = DSISR;
+	return _event_push(afu, event);
 }
 
 static int _handle_interrupt(struct cxl_afu_h *afu)
 {
-	uint16_t size, irq;
+	struct cxl_event *event;
+	uint16_t irq;
 	uint8_t data[sizeof(irq)];
-	int i;
 
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_handle_interrupt");
@@ -150,45 +483,28 @@ static int _handle_interrupt(struct cxl_afu_h *afu)
 	}
 	memcpy(&irq, data, sizeof(irq));
 	irq = ntohs(irq);
-
-	// Only track a single interrupt at a time
-	// search list for CXL_EVENT_AFU_INTERRUPT that has a matching irq return 0 if found add if not
-	pthread_mutex_lock(&(afu->event_lock));
-	i = 0;
-	while (afu->events[i] != NULL) {
-		if (afu->events[i]->header.type == CXL_EVENT_AFU_INTERRUPT) {
-		  if (afu->events[i]->irq.irq == irq) {
-			pthread_mutex_unlock(&(afu->event_lock));
-			return 0;
-		  }
-		}
-		++i;
+	if (irq > afu->events.irqs) {
+		warn_msg("Dropping interrupt %d beyond limit of %d", irq,
+			 afu->events.irqs);
+		return 0;
 	}
 
-	assert(i < afu->irqs_max);
-
-	size = sizeof(struct cxl_event_header) +
+	// Coalesce with an unread interrupt of the same number
+	event = _event_claim(afu, &(afu->events.irq_pending[irq]));
+	if (event == NULL)
+		return 0;
+	event->header.type = CXL_EVENT_AFU_INTERRUPT;
+	event->header.size = sizeof(struct cxl_event_header) +
 	    sizeof(struct cxl_event_afu_interrupt);
-	afu->events[i] = (struct cxl_event *)calloc(1, size);
-	afu->events[i]->header.type = CXL_EVENT_AFU_INTERRUPT;
-	afu->events[i]->header.size = size;
-	afu->events[i]->header.process_element = afu->context;
-	afu->events[i]->irq.irq = irq;
-
-	do {
-		i = write(afu->pipe[1], &(afu->events[i]->header.type), 1);
-	}
-	while ((i == 0) || (errno == EINTR));
-	pthread_mutex_unlock(&(afu->event_lock));
-	return i;
+	event->irq.irq = irq;
+	return _event_push(afu, event);
 }
 
 static int _handle_afu_error(struct cxl_afu_h *afu)
 {
+	struct cxl_event *event;
 	uint64_t error;
-	uint16_t size;
 	uint8_t data[sizeof(error)];
-	int i;
 
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_handle_afu_error");
@@ -202,120 +518,245 @@ static int _handle_afu_error(struct cxl_afu_h *afu)
 	error = ntohll(error);
 
 	// Only track a single AFU error at a time
-	pthread_mutex_lock(&(afu->event_lock));
-	i = 0;
-	while (afu->events[i] != NULL) {
-		if (afu->events[i]->header.type == CXL_EVENT_AFU_ERROR) {
-			pthread_mutex_unlock(&(afu->event_lock));
-			return 0;
-		}
-		++i;
+	event = _event_claim(afu, &(afu->events.error_pending));
+	if (event == NULL)
+		return 0;
+	event->header.type = CXL_EVENT_AFU_ERROR;
+	event->header.size = sizeof(struct cxl_event_header) +
+	    sizeof(struct cxl_event_afu_error);
+	event->afu_error.error = error;
+	return _event_push(afu, event);
+}
+
+// Acknowledge memory request id from PSLSE, followed by size bytes of data
+static void _mem_ack(struct cxl_afu_h *afu, uint8_t code, uint16_t id,
+		     uint8_t * data, int size)
+{
+	uint8_t buffer[MAX_LINE_CHARS];
+	uint16_t value;
+
+	buffer[0] = code;
+	value = htons(id);
+	memcpy(&(buffer[1]), &value, sizeof(uint16_t));
+	if (size)
+		memcpy(&(buffer[3]), data, size);
+	if (_send(afu, size + 3, buffer) != size + 3) {
+		afu->opened = 0;
+		afu->attached = 0;
 	}
+}
+
+// Get request id of a memory request from PSLSE
+static int _get_mem_id(struct cxl_afu_h *afu, uint16_t * id)
+{
+	if (get_bytes_silent(afu->fd, sizeof(uint16_t), (uint8_t *) id, 1000,
+			     0) < 0)
+		return -1;
+	*id = ntohs(*id);
+	return 0;
+}
 
-	assert(i < afu->irqs_max);
+// Add a message sending PSLSE the lines after a read to buffer if the read
+// continues a sequential stream.  Returns the size of the message.
+static int _prefetch(struct cxl_afu_h *afu, uint64_t addr, uint8_t * buffer)
+{
+	struct prefetch_stream *stream;
+	uint64_t line, next;
+	uint8_t count;
+	int i;
 
-	size = sizeof(struct cxl_event_header) +
-	    sizeof(struct cxl_event_afu_error);
-	afu->events[i] = (struct cxl_event *)calloc(1, size);
-	afu->events[i]->header.type = CXL_EVENT_AFU_ERROR;
-	afu->events[i]->header.size = size;
-	afu->events[i]->header.process_element = afu->context;
-	afu->events[i]->afu_error.error = error;
+	line = addr & CACHELINE_MASK;
+	stream = NULL;
+	for (i = 0; i < PREFETCH_STREAMS; i++) {
+		// Read of a line already sent that PSLSE asked for first
+		if ((line > afu->prefetch[i].last) &&
+		    (line < afu->prefetch[i].next))
+			return 0;
+		if (afu->prefetch[i].next == line)
+			stream = &(afu->prefetch[i]);
+	}
 
-	do {
-		i = write(afu->pipe[1], &(afu->events[i]->header.type), 1);
+	// Start tracking a new stream in place of the oldest
+	if (stream == NULL) {
+		stream = &(afu->prefetch[afu->prefetch_victim]);
+		afu->prefetch_victim = (afu->prefetch_victim + 1) %
+		    PREFETCH_STREAMS;
+		stream->last = line;
+		stream->next = line + CACHELINE_BYTES;
+		return 0;
 	}
-	while ((i == 0) || (errno == EINTR));
-	pthread_mutex_unlock(&(afu->event_lock));
-	return i;
+
+	// Stop short of any page that can't be read.  With memory workers
+	// stop at the end of the page, as writes to the next one go to another
+	// worker and could be acknowledged before these lines are sent.
+	next = line + CACHELINE_BYTES;
+	for (count = 0; count < afu->prefetch_lines; count++) {
+		if (((next & ~FOURK_MASK) == 0) && (afu->worker_count ||
+		    !_testmemaddr(afu, (uint8_t *) next)))
+			break;
+		next += CACHELINE_BYTES;
+	}
+	stream->last = line;
+	stream->next = next;
+	if (count == 0)
+		return 0;
+
+	buffer[0] = PSLSE_MEMORY_PREFETCH;
+	buffer[1] = count;
+	line = htonll(line + CACHELINE_BYTES);
+	memcpy(&(buffer[2]), &line, sizeof(line));
+	memcpy(&(buffer[10]), (uint8_t *) (stream->last + CACHELINE_BYTES),
+	       count * CACHELINE_BYTES);
+	return 10 + count * CACHELINE_BYTES;
 }
 
-static void _handle_read(struct cxl_afu_h *afu, uint64_t addr, uint16_t size)
+static void _handle_read(struct cxl_afu_h *afu, uint16_t id, uint64_t addr,
+			 uint16_t size)
 {
-	uint8_t buffer[MAX_LINE_CHARS];
+	uint8_t buffer[3 + CACHELINE_BYTES + 10 +
+		       PREFETCH_MAX_LINES * CACHELINE_BYTES];
+	uint16_t value;
+	int len;
 
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_handle_read");
-	if (!_testmemaddr((uint8_t *) addr)) {
+	if (!_testmemaddr(afu, (uint8_t *) addr)) {
 		if (_handle_dsi(afu, addr) < 0) {
 			perror("DSI Failure");
 			return;
 		}
 		//DPRINTF("READ from invalid addr @ 0x%016" PRIx64 "\n", addr);
 		info_msg(" ERROR: READ from invalid addr @ 0x%016" PRIx64 "\n", addr);
-		buffer[0] = (uint8_t) PSLSE_MEM_FAILURE;
-		if (put_bytes_silent(afu->fd, 1, buffer) != 1) {
-			afu->opened = 0;
-			afu->attached = 0;
-		}
+		_mem_ack(afu, PSLSE_MEM_FAILURE, id, NULL, 0);
 		return;
 	}
+	if (size > CACHELINE_BYTES) {
+		_mem_ack(afu, PSLSE_MEM_SUCCESS, id, (uint8_t *) addr, size);
+		return;
+	}
+
+	// Any lines sent ahead go in the same write as the read data so
+	// the socket doesn't hold them back waiting on an ack
 	buffer[0] = PSLSE_MEM_SUCCESS;
-	memcpy(&(buffer[1]), (void *)addr, size);
-	if (put_bytes_silent(afu->fd, size + 1, buffer) != size + 1) {
+	value = htons(id);
+	memcpy(&(buffer[1]), &value, sizeof(uint16_t));
+	memcpy(&(buffer[3]), (uint8_t *) addr, size);
+	len = 3 + size;
+	if (afu->prefetch_lines) {
+		pthread_mutex_lock(&(afu->prefetch_lock));
+		len += _prefetch(afu, addr, &(buffer[len]));
+		pthread_mutex_unlock(&(afu->prefetch_lock));
+	}
+	if (_send(afu, len, buffer) != len) {
 		afu->opened = 0;
 		afu->attached = 0;
 	}
 	DPRINTF("READ from addr @ 0x%016" PRIx64 "\n", addr);
 }
 
-static void _handle_write(struct cxl_afu_h *afu, uint64_t addr, uint16_t size,
-			  uint8_t * data)
+static void _handle_write(struct cxl_afu_h *afu, uint16_t id, uint64_t addr,
+			  uint16_t size, uint8_t * data)
 {
-	uint8_t buffer;
-
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_handle_write");
-	if (!_testmemaddr((uint8_t *) addr)) {
+	if (!_testmemaddr(afu, (uint8_t *) addr)) {
 		if (_handle_dsi(afu, addr) < 0) {
 			perror("DSI Failure");
 			return;
 		}
 		//DPRINTF("WRITE to invalid addr @ 0x%016" PRIx64 "\n", addr);
 		info_msg("ERROR: WRITE to invalid addr @ 0x%016" PRIx64 "\n", addr);
-		buffer = PSLSE_MEM_FAILURE;
-		if (put_bytes_silent(afu->fd, 1, &buffer) != 1) {
-			afu->opened = 0;
-			afu->attached = 0;
-		}
+		_mem_ack(afu, PSLSE_MEM_FAILURE, id, NULL, 0);
 		return;
 	}
 	memcpy((void *)addr, data, size);
-	buffer = PSLSE_MEM_SUCCESS;
-	if (put_bytes_silent(afu->fd, 1, &buffer) != 1) {
-		warn_msg("ERROR: _handle_write: memory write acknowledgement for addr @ 0x%016" PRIx64, addr);
-		afu->opened = 0;
-		afu->attached = 0;
-	}
+	_mem_ack(afu, PSLSE_MEM_SUCCESS, id, NULL, 0);
 	DPRINTF("WRITE to addr @ 0x%016" PRIx64 "\n", addr);
 }
 
-static void _handle_touch(struct cxl_afu_h *afu, uint64_t addr, uint8_t size)
+static void _handle_touch(struct cxl_afu_h *afu, uint16_t id, uint64_t addr,
+			  uint8_t size)
 {
-	uint8_t buffer;
-
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_handle_touch");
-	if (!_testmemaddr((uint8_t *) addr)) {
+	if (!_testmemaddr(afu, (uint8_t *) addr)) {
 		if (_handle_dsi(afu, addr) < 0) {
 			perror("DSI Failure");
 			return;
 		}
 		//DPRINTF("TOUCH of invalid addr @ 0x%016" PRIx64 "\n", addr);
 		info_msg("ERROR: TOUCH of invalid addr @ 0x%016" PRIx64 "\n", addr);
-		buffer = (uint8_t) PSLSE_MEM_FAILURE;
-		if (put_bytes_silent(afu->fd, 1, &buffer) != 1) {
-			afu->opened = 0;
-			afu->attached = 0;
+		_mem_ack(afu, PSLSE_MEM_FAILURE, id, NULL, 0);
+		return;
+	}
+	_mem_ack(afu, PSLSE_MEM_SUCCESS, id, NULL, 0);
+	DPRINTF("TOUCH of addr @ 0x%016" PRIx64 "\n", addr);
+}
+
+// Get read data for a batch of MMIO accesses, 64 bits for each read
+static void _handle_batch_ack(struct cxl_afu_h *afu)
+{
+	struct cxl_mmio_op *op;
+	uint8_t *buffer;
+	uint64_t data;
+	int i, size;
+
+	size = 0;
+	for (i = 0; i < afu->mmio.count; i++) {
+		op = &(afu->mmio.ops[i]);
+		if ((op->type == CXL_MMIO_OP_READ64) ||
+		    (op->type == CXL_MMIO_OP_READ32))
+			size += sizeof(uint64_t);
+	}
+	buffer = (uint8_t *) malloc(size + 1);
+	if (get_bytes_silent(afu->fd, size, buffer, 1000, 0) < 0) {
+		warn_msg("Socket failure getting MMIO batch data");
+		free(buffer);
+		afu->mmio.ops = NULL;
+		_all_idle(afu);
+		return;
+	}
+	size = 0;
+	for (i = 0; i < afu->mmio.count; i++) {
+		op = &(afu->mmio.ops[i]);
+		op->result = 0;
+		if (op->type == CXL_MMIO_OP_READ64) {
+			memcpy(&data, &(buffer[size]), sizeof(uint64_t));
+			op->data = ntohll(data);
+			size += sizeof(uint64_t);
 		}
+		if (op->type == CXL_MMIO_OP_READ32) {
+			memcpy(&data, &(buffer[size]), sizeof(uint64_t));
+			op->data = (uint32_t) ntohll(data);
+			size += sizeof(uint64_t);
+		}
+	}
+	free(buffer);
+	afu->mmio.state = LIBCXL_REQ_IDLE;
+}
+
+// Get the dwords of a bulk descriptor read
+static void _handle_desc_read_ack(struct cxl_afu_h *afu)
+{
+	uint8_t *buffer;
+	uint64_t data;
+	int i, size;
+
+	size = afu->mmio.count * sizeof(uint64_t);
+	buffer = (uint8_t *) malloc(size);
+	if (get_bytes_silent(afu->fd, size, buffer, 1000, 0) < 0) {
+		warn_msg("Socket failure getting descriptor read data");
+		free(buffer);
+		afu->mmio.words = NULL;
+		_all_idle(afu);
 		return;
 	}
-	buffer = PSLSE_MEM_SUCCESS;
-	if (put_bytes_silent(afu->fd, 1, &buffer) != 1) {
-		afu->opened = 0;
-		afu->attached = 0;
+	for (i = 0; i < afu->mmio.count; i++) {
+		memcpy(&data, &(buffer[i * sizeof(uint64_t)]), sizeof(data));
+		afu->mmio.words[i] = ntohll(data);
 	}
-	DPRINTF("TOUCH of addr @ 0x%016" PRIx64 "\n", addr);
+	free(buffer);
+	afu->mmio.state = LIBCXL_REQ_IDLE;
 }
 
 static void _handle_ack(struct cxl_afu_h *afu)
@@ -325,6 +766,14 @@ static void _handle_ack(struct cxl_afu_h *afu)
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_handle_ack");
 	DPRINTF("MMIO ACK\n");
+	if (afu->mmio.type == PSLSE_MMIO_BATCH) {
+		_handle_batch_ack(afu);
+		return;
+	}
+	if (afu->mmio.type == PSLSE_MMIO_DESC_READ) {
+		_handle_desc_read_ack(afu);
+		return;
+	}
 	if ((afu->mmio.type == PSLSE_MMIO_READ64)| (afu->mmio.type == PSLSE_MMIO_EBREAD)) {
 		if (get_bytes_silent(afu->fd, sizeof(uint64_t), data, 1000, 0) <
 		    0) {
@@ -354,14 +803,12 @@ static void _handle_ack(struct cxl_afu_h *afu)
 
 #ifdef PSL9
 
-static void _handle_DMO_OPs(struct cxl_afu_h *afu, uint8_t op_size, uint64_t addr,
+static void _handle_DMO_OPs(struct cxl_afu_h *afu, uint16_t id, uint8_t op_size, uint64_t addr,
 			  uint8_t function_code, uint64_t op1, uint64_t op2)
 {
 
 	uint8_t atomic_op;
 	uint8_t atomic_le;
-	uint8_t buffer;
-	uint8_t wbuffer[9];
 	uint32_t lvalue, op_A, op_1, op_2;
 	uint64_t llvalue, op_Al, op_1l, op_2l;
 	int op_ptr;
@@ -369,18 +816,14 @@ static void _handle_DMO_OPs(struct cxl_afu_h *afu, uint8_t op_size, uint64_t add
 
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_handle_DMO_OPs");
-	if (!_testmemaddr((uint8_t *) addr)) {
+	if (!_testmemaddr(afu, (uint8_t *) addr)) {
 		if (_handle_dsi(afu, addr) < 0) {
 			perror("DSI Failure");
 			return;
 		}
 		//DPRINTF("READ from invalid addr @ 0x%016" PRIx64 "\n", addr);
 		info_msg("ERROR: READ from invalid addr @ 0x%016" PRIx64 "\n", addr);
-		buffer = (uint8_t) PSLSE_MEM_FAILURE;
-		if (put_bytes_silent(afu->fd, 1, &buffer) != 1) {
-			afu->opened = 0;
-			afu->attached = 0;
-		}	
+		_mem_ack(afu, PSLSE_MEM_FAILURE, id, NULL, 0);
 		return;
 	}
 	// select op_1 & op_2 based on op_size & addr [60:61]
@@ -424,11 +867,7 @@ static void _handle_DMO_OPs(struct cxl_afu_h *afu, uint8_t op_size, uint64_t add
 				// printf(" case 4: op_2 is %08"PRIx32 "\n", op_2);
 			} else if (op_size == 8) {
 				DPRINTF("INVALID op_size  0x%x for  addr  0x%016" PRIx64 "\n", op_size, addr);
-				buffer = (uint8_t) PSLSE_MEM_FAILURE;
-				if (put_bytes_silent(afu->fd, 1, &buffer) != 1) {
-					afu->opened = 0;
-					afu->attached = 0;
-				}	
+				_mem_ack(afu, PSLSE_MEM_FAILURE, id, NULL, 0);
 				return;
 			}
 			break;
@@ -460,11 +899,7 @@ static void _handle_DMO_OPs(struct cxl_afu_h *afu, uint8_t op_size, uint64_t add
 				// printf(" case c: op_2 is %08"PRIx32 "\n", op_2);
 			} else if (op_size == 8) {
 				DPRINTF("INVALID op_size  0x%x for  addr  0x%016" PRIx64 "\n", op_size, addr);
-				buffer = (uint8_t) PSLSE_MEM_FAILURE;
-				if (put_bytes_silent(afu->fd, 1, &buffer) != 1) {
-					afu->opened = 0;
-					afu->attached = 0;
-				}	
+				_mem_ack(afu, PSLSE_MEM_FAILURE, id, NULL, 0);
 				return;
 			}
 			break;
@@ -911,32 +1346,20 @@ static void _handle_DMO_OPs(struct cxl_afu_h *afu, uint8_t op_size, uint64_t add
 // only AMO_ARMWF_* commands return back original data from EA, otherwise just MEM ACK
 	switch (wb)  {
 			case 0:
-				buffer = PSLSE_MEM_SUCCESS;
-				if (put_bytes_silent(afu->fd, 1, &buffer) != 1) {
-					afu->opened = 0;
-					afu->attached = 0;
-				}
+				_mem_ack(afu, PSLSE_MEM_SUCCESS, id, NULL, 0);
 				break;
 			case 1:
-				wbuffer[0] = PSLSE_MEM_SUCCESS;
 				if (atomic_le == 0) 
 					op_A = htonl(op_A);
-				memcpy(&(wbuffer[1]), (void *)&op_A, op_size);
-				if (put_bytes_silent(afu->fd, op_size + 1, wbuffer) != op_size + 1) {
-					afu->opened = 0;
-					afu->attached = 0;
-				}		
+				_mem_ack(afu, PSLSE_MEM_SUCCESS, id, (uint8_t *) &op_A,
+					 op_size);
 				DPRINTF("READ from addr @ 0x%016" PRIx64 "\n", addr);
 				break;
 			case 2:
-				wbuffer[0] = PSLSE_MEM_SUCCESS;
 				if (atomic_le == 0) 
 					op_Al = htonll(op_Al);
-				memcpy(&(wbuffer[1]), (void *)&op_Al, op_size);
-				if (put_bytes_silent(afu->fd, op_size + 1, wbuffer) != op_size + 1) {
-					afu->opened = 0;
-					afu->attached = 0;
-				}		
+				_mem_ack(afu, PSLSE_MEM_SUCCESS, id, (uint8_t *) &op_Al,
+					 op_size);
 				DPRINTF("READ from addr @ 0x%016" PRIx64 "\n", addr);
 				break;
 
@@ -952,6 +1375,160 @@ static void _handle_DMO_OPs(struct cxl_afu_h *afu, uint8_t op_size, uint64_t add
 
 #endif /* ifdef PSL9 */
 
+// Service a memory request from PSLSE
+static void _mem_run(struct cxl_afu_h *afu, uint8_t type, uint16_t id,
+		     uint64_t addr, uint16_t size, uint8_t * data)
+{
+#ifdef PSL9
+	uint64_t op1, op2;
+#endif /* ifdef PSL9 */
+
+	switch (type) {
+	case PSLSE_MEMORY_READ:
+		_handle_read(afu, id, addr, size);
+		break;
+	case PSLSE_MEMORY_WRITE:
+		_handle_write(afu, id, addr, size, data);
+		break;
+	case PSLSE_MEMORY_TOUCH:
+		_handle_touch(afu, id, addr, (uint8_t) size);
+		break;
+#ifdef PSL9
+	case PSLSE_DMA0_WR_AMO:
+		// Function code followed by the two operands
+		memcpy((char *)&op1, (char *)&(data[1]), sizeof(uint64_t));
+		debug_msg("op1 bytes 1-8 are 0x%016" PRIx64, op1);
+		memcpy((char *)&op2, (char *)&(data[9]), sizeof(uint64_t));
+		debug_msg("op2 bytes 1-8 are 0x%016" PRIx64, op2);
+		_handle_DMO_OPs(afu, id, (uint8_t) size, addr, data[0], op1,
+				op2);
+		break;
+#endif /* ifdef PSL9 */
+	default:
+		break;
+	}
+}
+
+// Service the memory requests queued for one worker until told to stop
+static void *_mem_worker(void *ptr)
+{
+	struct mem_worker *worker = (struct mem_worker *)ptr;
+	struct mem_work *work;
+
+	pthread_mutex_lock(&(worker->lock));
+	while (1) {
+		while ((worker->head == worker->tail) && !worker->stop)
+			pthread_cond_wait(&(worker->cond), &(worker->lock));
+		if (worker->head == worker->tail)
+			break;
+		work = &(worker->work[worker->tail % MEM_WORK_QUEUE]);
+		pthread_mutex_unlock(&(worker->lock));
+		_mem_run(worker->afu, work->type, work->id, work->addr,
+			 work->size, work->data);
+		pthread_mutex_lock(&(worker->lock));
+		// Wake the PSL thread if it is waiting for room
+		if (worker->head - worker->tail++ == MEM_WORK_QUEUE)
+			pthread_cond_broadcast(&(worker->cond));
+	}
+	pthread_mutex_unlock(&(worker->lock));
+	return NULL;
+}
+
+// Hand a memory request with bytes of data to the worker for its page, so
+// requests to the same page are serviced in the order PSLSE sent them.
+// Without workers the request is serviced straight away.
+static void _mem_queue(struct cxl_afu_h *afu, uint8_t type, uint16_t id,
+		       uint64_t addr, uint16_t size, uint8_t * data, int bytes)
+{
+	struct mem_worker *worker;
+	struct mem_work *work;
+
+	if (afu->worker_count == 0) {
+		_mem_run(afu, type, id, addr, size, data);
+		return;
+	}
+	worker = &(afu->workers[(addr >> 12) % afu->worker_count]);
+	pthread_mutex_lock(&(worker->lock));
+	while (worker->head - worker->tail == MEM_WORK_QUEUE)
+		pthread_cond_wait(&(worker->cond), &(worker->lock));
+	work = &(worker->work[worker->head % MEM_WORK_QUEUE]);
+	work->type = type;
+	work->id = id;
+	work->addr = addr;
+	work->size = size;
+	if (bytes)
+		memcpy(work->data, data, bytes);
+	if (worker->head++ == worker->tail)
+		pthread_cond_broadcast(&(worker->cond));
+	pthread_mutex_unlock(&(worker->lock));
+}
+
+// Start the number of memory workers set by LIBCXL_MEM_WORKERS
+static void _workers_start(struct cxl_afu_h *afu)
+{
+	struct mem_worker *worker;
+	char *value;
+	int count;
+
+	value = getenv("LIBCXL_MEM_WORKERS");
+	if (value == NULL)
+		return;
+	count = atoi(value);
+	if (count <= 0)
+		return;
+	if (count > MEM_WORKERS_MAX) {
+		warn_msg("LIBCXL_MEM_WORKERS limited to %d", MEM_WORKERS_MAX);
+		count = MEM_WORKERS_MAX;
+	}
+	afu->workers = (struct mem_worker *)
+	    calloc(count, sizeof(struct mem_worker));
+	if (afu->workers == NULL) {
+		warn_msg("Failed to allocate memory workers");
+		return;
+	}
+	while (afu->worker_count < count) {
+		worker = &(afu->workers[afu->worker_count]);
+		worker->afu = afu;
+		worker->work = (struct mem_work *)
+		    malloc(MEM_WORK_QUEUE * sizeof(struct mem_work));
+		if (worker->work == NULL)
+			break;
+		pthread_mutex_init(&(worker->lock), NULL);
+		pthread_cond_init(&(worker->cond), NULL);
+		if (pthread_create(&(worker->thread), NULL, _mem_worker,
+				   worker)) {
+			perror("pthread_create");
+			pthread_mutex_destroy(&(worker->lock));
+			pthread_cond_destroy(&(worker->cond));
+			free(worker->work);
+			break;
+		}
+		afu->worker_count++;
+	}
+}
+
+// Stop the memory workers once they have serviced the requests queued
+static void _workers_stop(struct cxl_afu_h *afu)
+{
+	struct mem_worker *worker;
+	int i;
+
+	for (i = 0; i < afu->worker_count; i++) {
+		worker = &(afu->workers[i]);
+		pthread_mutex_lock(&(worker->lock));
+		worker->stop = 1;
+		pthread_cond_broadcast(&(worker->cond));
+		pthread_mutex_unlock(&(worker->lock));
+		pthread_join(worker->thread, NULL);
+		pthread_mutex_destroy(&(worker->lock));
+		pthread_cond_destroy(&(worker->cond));
+		free(worker->work);
+	}
+	free(afu->workers);
+	afu->workers = NULL;
+	afu->worker_count = 0;
+}
+
 static void _req_max_int(struct cxl_afu_h *afu)
 {
 	uint8_t *buffer;
@@ -965,7 +1542,7 @@ static void _req_max_int(struct cxl_afu_h *afu)
 	buffer[0] = PSLSE_MAX_INT;
 	value = htons(afu->int_req.max);
 	memcpy((char *)&(buffer[1]), (char *)&value, sizeof(uint16_t));
-	if (put_bytes_silent(afu->fd, size, buffer) != size) {
+	if (_send(afu, size, buffer) != size) {
 		free(buffer);
 		close_socket(&(afu->fd));
 		afu->int_req.max = 0;
@@ -979,18 +1556,28 @@ static void _req_max_int(struct cxl_afu_h *afu)
 static void _pslse_attach(struct cxl_afu_h *afu)
 {
 	uint8_t *buffer;
-	uint64_t *wed_ptr;
+	uint64_t *wed_ptr, *addr_ptr;
+	uint32_t *pid_ptr;
 	int size, offset;
 
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_pslse_attach");
-	size = 1 + sizeof(uint64_t);
+	size = 1 + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t);
 	buffer = (uint8_t *) malloc(size);
 	buffer[0] = PSLSE_ATTACH;
 	offset = 1;
 	wed_ptr = (uint64_t *) & (buffer[offset]);
 	*wed_ptr = htonll(afu->attach.wed);
-	if (put_bytes_silent(afu->fd, size, buffer) != size) {
+	// Send pid and where a copy of it is so PSLSE on the same host can
+	// check it is able to access memory directly
+	offset += sizeof(uint64_t);
+	afu->pid = (uint32_t) getpid();
+	pid_ptr = (uint32_t *) & (buffer[offset]);
+	*pid_ptr = htonl(afu->pid);
+	offset += sizeof(uint32_t);
+	addr_ptr = (uint64_t *) & (buffer[offset]);
+	*addr_ptr = htonll((uint64_t) & (afu->pid));
+	if (_send(afu, size, buffer) != size) {
 		free(buffer);
 		close_socket(&(afu->fd));
 		afu->opened = 0;
@@ -1017,7 +1604,7 @@ static void _mmio_map(struct cxl_afu_h *afu)
 	flags = (uint32_t) afu->mmio.data;
 	flags_ptr = (uint32_t *) & (buffer[1]);
 	*flags_ptr = htonl(flags);
-	if (put_bytes_silent(afu->fd, size, buffer) != size) {
+	if (_send(afu, size, buffer) != size) {
 		free(buffer);
 		close_socket(&(afu->fd));
 		afu->opened = 0;
@@ -1029,64 +1616,136 @@ static void _mmio_map(struct cxl_afu_h *afu)
 	afu->mmio.state = LIBCXL_REQ_PENDING;
 }
 
-static void _mmio_write64(struct cxl_afu_h *afu)
+static void _mmio_desc_read(struct cxl_afu_h *afu)
 {
-	uint8_t *buffer;
-	uint64_t data;
+	uint8_t buffer[2 + sizeof(uint32_t) + sizeof(uint16_t)];
 	uint32_t addr;
+	uint16_t count;
 	int size, offset;
 
 	if (!afu)
-		fatal_msg("NULL afu passed to libcxl.c:_mmio_write64");
-	size = 1 + sizeof(addr) + sizeof(data);
-	buffer = (uint8_t *) malloc(size);
-	buffer[0] = PSLSE_MMIO_WRITE64;
-	offset = 1;
+		fatal_msg("NULL afu passed to libcxl.c:_mmio_desc_read");
+	buffer[0] = PSLSE_MMIO_DESC_READ;
+	buffer[1] = PSLSE_DESC_ERROR_BUFFER;
+	offset = 2;
 	addr = htonl(afu->mmio.addr);
 	memcpy((char *)&(buffer[offset]), (char *)&addr, sizeof(addr));
 	offset += sizeof(addr);
-	data = htonll(afu->mmio.data);
-	memcpy((char *)&(buffer[offset]), (char *)&data, sizeof(data));
-	if (put_bytes_silent(afu->fd, size, buffer) != size) {
-		free(buffer);
+	count = htons((uint16_t) afu->mmio.count);
+	memcpy((char *)&(buffer[offset]), (char *)&count, sizeof(count));
+	size = offset + sizeof(count);
+	if (_send(afu, size, buffer) != size) {
 		close_socket(&(afu->fd));
 		afu->opened = 0;
 		afu->attached = 0;
+		afu->mmio.words = NULL;
 		afu->mmio.state = LIBCXL_REQ_IDLE;
 		return;
 	}
-	free(buffer);
 	afu->mmio.state = LIBCXL_REQ_PENDING;
 }
 
-static void _mmio_write32(struct cxl_afu_h *afu)
+// Send MMIO access op to PSLSE
+static void _mmio_send_op(struct cxl_afu_h *afu, struct cxl_mmio_op *op)
 {
-	uint8_t *buffer;
-	uint32_t data;
-	uint32_t addr;
+	uint8_t buffer[1 + sizeof(uint32_t) + sizeof(uint64_t)];
+	uint64_t data;
+	uint32_t addr, data32;
 	int size, offset;
 
-	if (!afu)
-		fatal_msg("NULL afu passed to libcxl.c:_mmio_write32");
-	size = 1 + sizeof(addr) + sizeof(data);
-	buffer = (uint8_t *) malloc(size);
-	buffer[0] = PSLSE_MMIO_WRITE32;
+	switch (op->type) {
+	case CXL_MMIO_OP_WRITE64:
+		buffer[0] = PSLSE_MMIO_WRITE64;
+		break;
+	case CXL_MMIO_OP_READ64:
+		buffer[0] = PSLSE_MMIO_READ64;
+		break;
+	case CXL_MMIO_OP_WRITE32:
+		buffer[0] = PSLSE_MMIO_WRITE32;
+		break;
+	default:
+		buffer[0] = PSLSE_MMIO_READ32;
+		break;
+	}
 	offset = 1;
-	addr = htonl(afu->mmio.addr);
+	addr = htonl((uint32_t) op->offset);
 	memcpy((char *)&(buffer[offset]), (char *)&addr, sizeof(addr));
 	offset += sizeof(addr);
-	data = htonl(afu->mmio.data);
-	memcpy((char *)&(buffer[offset]), (char *)&data, sizeof(data));
-	if (put_bytes_silent(afu->fd, size, buffer) != size) {
-		free(buffer);
+	if (op->type == CXL_MMIO_OP_WRITE64) {
+		data = htonll(op->data);
+		memcpy((char *)&(buffer[offset]), (char *)&data, sizeof(data));
+		offset += sizeof(data);
+	}
+	if (op->type == CXL_MMIO_OP_WRITE32) {
+		data32 = htonl((uint32_t) op->data);
+		memcpy((char *)&(buffer[offset]), (char *)&data32,
+		       sizeof(data32));
+		offset += sizeof(data32);
+	}
+	size = offset;
+	if (_send(afu, size, buffer) != size) {
 		close_socket(&(afu->fd));
 		afu->opened = 0;
 		afu->attached = 0;
-		afu->mmio.state = LIBCXL_REQ_IDLE;
-		return;
 	}
-	free(buffer);
-	afu->mmio.state = LIBCXL_REQ_PENDING;
+}
+
+// Send the MMIO accesses application threads have queued, in order
+static void _mmio_send(struct cxl_afu_h *afu)
+{
+	struct mmio_entry *entry, *next;
+
+	pthread_mutex_lock(&(afu->req_lock));
+	entry = afu->mmio_submit.head;
+	afu->mmio_submit.head = NULL;
+	afu->mmio_submit.tail = NULL;
+	pthread_mutex_unlock(&(afu->req_lock));
+	while (entry != NULL) {
+		next = entry->_next;
+		_mmio_push(&(afu->mmio_sent), entry);
+		if (afu->opened)
+			_mmio_send_op(afu, entry->op);
+		entry = next;
+	}
+}
+
+// Get the acknowledge and any read data for a queued MMIO access
+static void _handle_op_ack(struct cxl_afu_h *afu, struct mmio_entry *entry,
+			   uint8_t ack)
+{
+	struct cxl_mmio_op *op = entry->op;
+	uint8_t data[sizeof(uint64_t)];
+	uint64_t data64;
+	uint32_t data32;
+
+	op->result = 0;
+	if (ack == PSLSE_MMIO_FAIL) {
+		warn_msg("MMIO request failed");
+		op->result = -1;
+	} else if (op->type == CXL_MMIO_OP_READ64) {
+		if (get_bytes_silent(afu->fd, sizeof(uint64_t), data, 1000, 0) <
+		    0) {
+			warn_msg("Socket failure getting MMIO Ack");
+			_all_idle(afu);
+			op->data = 0xFEEDB00FFEEDB00FL;
+			op->result = -1;
+		} else {
+			memcpy(&data64, data, sizeof(uint64_t));
+			op->data = ntohll(data64);
+		}
+	} else if (op->type == CXL_MMIO_OP_READ32) {
+		if (get_bytes_silent(afu->fd, sizeof(uint32_t), data, 1000, 0) <
+		    0) {
+			warn_msg("Socket failure getting MMIO Read 32 data");
+			_all_idle(afu);
+			op->data = 0xFEEDB00FL;
+			op->result = -1;
+		} else {
+			memcpy(&data32, data, sizeof(uint32_t));
+			op->data = (uint64_t) ntohl(data32);
+		}
+	}
+	_mmio_complete(afu, entry);
 }
 
 static void _mmio_read(struct cxl_afu_h *afu)
@@ -1103,7 +1762,7 @@ static void _mmio_read(struct cxl_afu_h *afu)
 	offset = 1;
 	addr = htonl(afu->mmio.addr);
 	memcpy((char *)&(buffer[offset]), (char *)&addr, sizeof(addr));
-	if (put_bytes_silent(afu->fd, size, buffer) != size) {
+	if (_send(afu, size, buffer) != size) {
 	        warn_msg("_mmio_read: put_bytes_silent failed");
 		free(buffer);
 		close_socket(&(afu->fd));
@@ -1117,52 +1776,138 @@ static void _mmio_read(struct cxl_afu_h *afu)
 	afu->mmio.state = LIBCXL_REQ_PENDING;
 }
 
+// Wait for input from PSLSE or a new request from the application.  Returns
+// 1 when the socket has data, 0 when it doesn't and -1 on socket failure.
+static int _psl_wait(struct cxl_afu_h *afu)
+{
+	struct pollfd pfd[2];
+	uint8_t wake[64];
+	int rc;
+
+	pfd[0].fd = afu->fd;
+	pfd[0].events = POLLIN | POLLHUP;
+	pfd[0].revents = 0;
+	pfd[1].fd = afu->wake[0];
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+	do {
+		rc = poll(pfd, 2, 1000);
+	}
+	while ((rc < 0) && (errno == EINTR));
+	if (rc < 0)
+		return -1;
+	if (pfd[1].revents & POLLIN) {
+		while (read(afu->wake[0], wake, sizeof(wake)) > 0) ;
+	}
+	if (pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+		return -1;
+	if (pfd[0].revents & POLLIN)
+		return 1;
+	return 0;
+}
+
+static void _mmio_batch(struct cxl_afu_h *afu)
+{
+	struct cxl_mmio_op *op;
+	uint8_t *buffer;
+	uint64_t data;
+	uint32_t addr;
+	uint16_t count;
+	int i, size, offset;
+
+	if (!afu)
+		fatal_msg("NULL afu passed to libcxl.c:_mmio_batch");
+	size = 1 + sizeof(count) + afu->mmio.count * PSLSE_MMIO_BATCH_OP;
+	buffer = (uint8_t *) malloc(size);
+	buffer[0] = PSLSE_MMIO_BATCH;
+	offset = 1;
+	count = htons((uint16_t) afu->mmio.count);
+	memcpy((char *)&(buffer[offset]), (char *)&count, sizeof(count));
+	offset += sizeof(count);
+	for (i = 0; i < afu->mmio.count; i++) {
+		op = &(afu->mmio.ops[i]);
+		switch (op->type) {
+		case CXL_MMIO_OP_WRITE64:
+			buffer[offset] = PSLSE_MMIO_WRITE64;
+			break;
+		case CXL_MMIO_OP_READ64:
+			buffer[offset] = PSLSE_MMIO_READ64;
+			break;
+		case CXL_MMIO_OP_WRITE32:
+			buffer[offset] = PSLSE_MMIO_WRITE32;
+			break;
+		default:
+			buffer[offset] = PSLSE_MMIO_READ32;
+			break;
+		}
+		offset += 1;
+		addr = htonl((uint32_t) op->offset);
+		memcpy((char *)&(buffer[offset]), (char *)&addr, sizeof(addr));
+		offset += sizeof(addr);
+		data = htonll(op->data);
+		memcpy((char *)&(buffer[offset]), (char *)&data, sizeof(data));
+		offset += sizeof(data);
+	}
+	if (_send(afu, size, buffer) != size) {
+		free(buffer);
+		close_socket(&(afu->fd));
+		afu->opened = 0;
+		afu->attached = 0;
+		afu->mmio.ops = NULL;
+		afu->mmio.state = LIBCXL_REQ_IDLE;
+		return;
+	}
+	free(buffer);
+	afu->mmio.state = LIBCXL_REQ_PENDING;
+}
+
 static void *_psl_loop(void *ptr)
 {
 	struct cxl_afu_h *afu = (struct cxl_afu_h *)ptr;
+	struct mmio_entry *entry;
 	uint8_t buffer[MAX_LINE_CHARS];
 	uint64_t addr;
-	uint16_t size, value;
+	uint16_t size, value, id;
 	uint32_t lvalue;
 	uint64_t llvalue;
 	int rc;
 #ifdef PSL9
-	uint8_t op_size, function_code;
-	uint64_t op1, op2;
+	uint8_t op_size;
 #endif /*ifdef PSL9 */
 
 	if (!afu)
 		fatal_msg("NULL afu passed to libcxl.c:_psl_loop");
 	afu->opened = 1;
 	while (afu->opened) {
-		_delay_1ms();
 		// Send any requests to PSLSE over socket
 		if (afu->int_req.state == LIBCXL_REQ_REQUEST)
 			_req_max_int(afu);
 		if (afu->attach.state == LIBCXL_REQ_REQUEST)
 			_pslse_attach(afu);
 		if (afu->mmio.state == LIBCXL_REQ_REQUEST) {
+			// Acks come back in the order MMIOs are sent, mark
+			// where this one goes among the queued accesses
+			_mmio_push(&(afu->mmio_sent), &(afu->mmio_slot));
 			switch (afu->mmio.type) {
 			case PSLSE_MMIO_MAP:
 				_mmio_map(afu);
 				break;
-			case PSLSE_MMIO_WRITE64:
-				_mmio_write64(afu);
-				break;
-			case PSLSE_MMIO_WRITE32:
-				_mmio_write32(afu);
+			case PSLSE_MMIO_BATCH:
+				_mmio_batch(afu);
 				break;
 			case PSLSE_MMIO_EBREAD:
-			case PSLSE_MMIO_READ64:
-			case PSLSE_MMIO_READ32:	/*fall through */
 				_mmio_read(afu);
 				break;
+			case PSLSE_MMIO_DESC_READ:
+				_mmio_desc_read(afu);
+				break;
 			default:
 				break;
 			}
 		}
-		// Process socket input from PSLSE
-		rc = bytes_ready(afu->fd, 1000, 0);
+		_mmio_send(afu);
+		// Sleep until PSLSE sends something or a new request arrives
+		rc = _psl_wait(afu);
 		if (rc == 0)
 			continue;
 		if (rc < 0) {
@@ -1187,10 +1932,20 @@ static void *_psl_loop(void *ptr)
 			afu->open.state = LIBCXL_REQ_IDLE;
 			break;
 		case PSLSE_ATTACH:
+			if (get_bytes_silent(afu->fd, 1, buffer, 1000, 0) < 0) {
+				warn_msg("Socket failure getting attach ack");
+				_all_idle(afu);
+				break;
+			}
+			afu->prefetch_lines = buffer[0];
+			if (afu->prefetch_lines > PREFETCH_MAX_LINES)
+				afu->prefetch_lines = PREFETCH_MAX_LINES;
+			memset(afu->prefetch, 0, sizeof(afu->prefetch));
 			afu->attach.state = LIBCXL_REQ_IDLE;
 			break;
 		case PSLSE_DETACH:
 		        info_msg("detach response from from pslse");
+			memset(afu->page_cache, 0, sizeof(afu->page_cache));
 			afu->mapped = 0;
 			afu->attached = 0;
 			afu->opened = 0;
@@ -1229,8 +1984,11 @@ static void *_psl_loop(void *ptr)
 
 			memcpy((char *)&value, (char *)&(buffer[2]), 2);
 			afu->irqs_max = (long)(value);
-			size = sizeof(struct cxl_event *) * afu->irqs_max;
-			afu->events = (struct cxl_event **)calloc(1, size);
+			if (_event_alloc(afu, value) < 0) {
+				warn_msg("Failed to allocate event queue");
+				_all_idle(afu);
+				break;
+			}
 
                 	memcpy((char *)&value, (char *)&(buffer[4]), 2);
 			afu->modes_supported = (long)(value);
@@ -1259,6 +2017,12 @@ static void *_psl_loop(void *ptr)
 		}
 		case PSLSE_MEMORY_READ:
 			DPRINTF("AFU MEMORY READ\n");
+			if (_get_mem_id(afu, &id) < 0) {
+				warn_msg
+				    ("Socket failure getting memory request id");
+				_all_idle(afu);
+				break;
+			}
 			if (get_bytes_silent(afu->fd, 1, buffer, 1000, 0) < 0) {
 				warn_msg
 				    ("Socket failure getting memory read size");
@@ -1275,10 +2039,17 @@ static void *_psl_loop(void *ptr)
 			}
 			memcpy((char *)&addr, (char *)buffer, sizeof(uint64_t));
 			addr = ntohll(addr);
-			_handle_read(afu, addr, size);
+			_mem_queue(afu, PSLSE_MEMORY_READ, id, addr, size, NULL,
+				   0);
 			break;
 		case PSLSE_MEMORY_WRITE:
 			DPRINTF("AFU MEMORY WRITE\n");
+			if (_get_mem_id(afu, &id) < 0) {
+				warn_msg
+				    ("Socket failure getting memory request id");
+				_all_idle(afu);
+				break;
+			}
 			if (get_bytes_silent(afu->fd, 1, buffer, 1000, 0) < 0) {
 				warn_msg
 				    ("Socket failure getting memory write size");
@@ -1300,11 +2071,52 @@ static void *_psl_loop(void *ptr)
 				_all_idle(afu);
 				break;
 			}
-			_handle_write(afu, addr, size, buffer);
+			_mem_queue(afu, PSLSE_MEMORY_WRITE, id, addr, size,
+				   buffer, size);
+			break;
+		case PSLSE_MEMORY_WRITE_COMBINED:
+			DPRINTF("AFU MEMORY WRITE COMBINED\n");
+			if (_get_mem_id(afu, &id) < 0) {
+				warn_msg
+				    ("Socket failure getting memory request id");
+				_all_idle(afu);
+				break;
+			}
+			if (get_bytes_silent(afu->fd, 2, buffer, 1000, 0) < 0) {
+				warn_msg
+				    ("Socket failure getting memory write size");
+				_all_idle(afu);
+				break;
+			}
+			memcpy((char *)&size, (char *)buffer, 2);
+			size = ntohs(size);
+			if (get_bytes_silent(afu->fd, sizeof(uint64_t), buffer,
+					     -1, 0) < 0) {
+				_all_idle(afu);
+				break;
+			}
+			memcpy((char *)&addr, (char *)buffer, sizeof(uint64_t));
+			addr = ntohll(addr);
+			if ((size > MAX_LINE_CHARS) ||
+			    (get_bytes_silent(afu->fd, size, buffer, 1000, 0) <
+			     0)) {
+				warn_msg
+				    ("Socket failure getting memory write data");
+				_all_idle(afu);
+				break;
+			}
+			_mem_queue(afu, PSLSE_MEMORY_WRITE, id, addr, size,
+				   buffer, size);
 			break;
 #ifdef PSL9
 		case PSLSE_DMA0_RD:
 			DPRINTF("AFU DMA0 MEMORY READ\n");
+			if (_get_mem_id(afu, &id) < 0) {
+				warn_msg
+				    ("Socket failure getting memory request id");
+				_all_idle(afu);
+				break;
+			}
 			if (get_bytes_silent(afu->fd, 2, buffer, 1000, 0) < 0) {
 				warn_msg
 				    ("Socket failure getting memory read size");
@@ -1322,12 +2134,19 @@ static void *_psl_loop(void *ptr)
 			}
 			memcpy((char *)&addr, (char *)buffer, sizeof(uint64_t));
 			addr = ntohll(addr);
-			_handle_read(afu, addr, size);
+			_mem_queue(afu, PSLSE_MEMORY_READ, id, addr, size, NULL,
+				   0);
 			break;
 
 
 		case PSLSE_DMA0_WR:
 			DPRINTF("AFU DMA0 MEMORY WRITE\n");
+			if (_get_mem_id(afu, &id) < 0) {
+				warn_msg
+				    ("Socket failure getting memory request id");
+				_all_idle(afu);
+				break;
+			}
 			if (get_bytes_silent(afu->fd, 2, buffer, 1000, 0) < 0) {
 				warn_msg
 				    ("Socket failure getting memory write size");
@@ -1351,11 +2170,18 @@ static void *_psl_loop(void *ptr)
 				_all_idle(afu);
 				break;
 			}
-			_handle_write(afu, addr, size, buffer);
+			_mem_queue(afu, PSLSE_MEMORY_WRITE, id, addr, size,
+				   buffer, size);
 			break;
 
 		case PSLSE_DMA0_WR_AMO:
 			DPRINTF("AFU DMA0 MEMORY WRITE AMO \n");
+			if (_get_mem_id(afu, &id) < 0) {
+				warn_msg
+				    ("Socket failure getting memory request id");
+				_all_idle(afu);
+				break;
+			}
 			if (get_bytes_silent(afu->fd, 1, buffer, 1000, 0) < 0) {
 				warn_msg
 				    ("Socket failure getting memory write size");
@@ -1377,23 +2203,20 @@ static void *_psl_loop(void *ptr)
 				_all_idle(afu);
 				break;
 			}
-			function_code = (uint8_t) buffer[0];
-			memcpy((char *)&op1, (char *)&buffer[1], sizeof(uint64_t));
-			debug_msg("op1 bytes 1-8 are 0x%016" PRIx64, op1);
-			//op1 = ntohll (op1);
-			//printf("op1 bytes 1-8 are 0x%016" PRIx64 " \n", op1);
-			memcpy((char *)&op2, (char *)&buffer[9], sizeof(uint64_t));
-			debug_msg("op2 bytes 1-8 are 0x%016" PRIx64, op2);
-			//op2 = ntohll (op2);
-			//printf("op2 bytes 1-8 are 0x%016" PRIx64 " \n", op2);
-			
-			_handle_DMO_OPs(afu, op_size, addr, function_code, op1, op2);	
+			_mem_queue(afu, PSLSE_DMA0_WR_AMO, id, addr, op_size,
+				   buffer, 17);
 			break;
 
 
 #endif /* ifdef PSL9 */
 		case PSLSE_MEMORY_TOUCH:
 			DPRINTF("AFU MEMORY TOUCH\n");
+			if (_get_mem_id(afu, &id) < 0) {
+				warn_msg
+				    ("Socket failure getting memory request id");
+				_all_idle(afu);
+				break;
+			}
 			if (get_bytes_silent(afu->fd, 1, buffer, 1000, 0) < 0) {
 				warn_msg
 				    ("Socket failure getting memory touch size");
@@ -1410,10 +2233,25 @@ static void *_psl_loop(void *ptr)
 			}
 			memcpy((char *)&addr, (char *)buffer, sizeof(uint64_t));
 			addr = ntohll(addr);
-			_handle_touch(afu, addr, size);
+			_mem_queue(afu, PSLSE_MEMORY_TOUCH, id, addr, size, NULL,
+				   0);
 			break;
 		case PSLSE_MMIO_ACK:
-			_handle_ack(afu);
+		case PSLSE_MMIO_FAIL:	/*fall through */
+			entry = _mmio_pop(&(afu->mmio_sent));
+			if ((entry != NULL) && (entry->op != NULL)) {
+				_handle_op_ack(afu, entry, buffer[0]);
+				break;
+			}
+			if (buffer[0] == PSLSE_MMIO_ACK) {
+				_handle_ack(afu);
+				break;
+			}
+			warn_msg("MMIO request failed");
+			afu->mmio.data = 0xFEEDB00FFEEDB00FL;
+			afu->mmio.ops = NULL;
+			afu->mmio.words = NULL;
+			afu->mmio.state = LIBCXL_REQ_IDLE;
 			break;
 		case PSLSE_INTERRUPT:
 			if (_handle_interrupt(afu) < 0) {
@@ -1431,10 +2269,17 @@ static void *_psl_loop(void *ptr)
 			DPRINTF("UNKNOWN CMD IS 0x%2x \n", buffer[0]);
 			break;
 		}
+		_req_done(afu);
 	}
 
  psl_fail:
 	afu->attached = 0;
+	_mmio_fail_all(afu);
+	_req_done(afu);
+	// Release any thread waiting for an event that will never come
+	pthread_mutex_lock(&(afu->event_lock));
+	pthread_cond_broadcast(&(afu->event_cond));
+	pthread_mutex_unlock(&(afu->event_lock));
 	pthread_exit(NULL);
 }
 
@@ -1588,8 +2433,32 @@ static struct cxl_afu_h *_new_afu(uint16_t afu_map, uint16_t position, int fd)
 	if (pipe(afu->pipe) < 0)
 		return NULL;
 
+	// Non-blocking pipe for waking the PSL thread on new requests
+	if (pipe(afu->wake) < 0)
+		return NULL;
+	fcntl(afu->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(afu->wake[1], F_SETFL, O_NONBLOCK);
+
+	// Pipe signalling asynchronous MMIO completions to the application
+	if (pipe(afu->mmio_fd) < 0)
+		return NULL;
+	fcntl(afu->mmio_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(afu->mmio_fd[1], F_SETFL, O_NONBLOCK);
+
+	// Pipe for probing whether AFU accesses are to valid memory
+	if (pipe(afu->probe) < 0)
+		return NULL;
+	pthread_once(&_probe_once, _probe_init);
+
 	pthread_mutex_init(&(afu->event_lock), NULL);
+	pthread_cond_init(&(afu->event_cond), NULL);
+	pthread_mutex_init(&(afu->push_lock), NULL);
+	pthread_mutex_init(&(afu->read_lock), NULL);
+	pthread_mutex_init(&(afu->send_lock), NULL);
+	pthread_mutex_init(&(afu->prefetch_lock), NULL);
 	pthread_mutex_init(&(afu->mmio_lock), NULL);
+	pthread_mutex_init(&(afu->req_lock), NULL);
+	pthread_cond_init(&(afu->req_cond), NULL);
 	afu->fd = fd;
 	afu->map = afu_map;
 	afu->dbg_id = (major << 4) | minor;
@@ -1643,6 +2512,8 @@ static void _release_afus(struct cxl_afu_h *afu)
 			free(afu->id);
 		pthread_mutex_destroy(&(afu->event_lock));
 		pthread_mutex_destroy(&(afu->mmio_lock));
+		_event_free(afu);
+		_req_free(afu);
 		free(afu);
 	}
 }
@@ -1709,15 +2580,16 @@ static struct cxl_afu_h *_pslse_open(int *fd, uint16_t afu_map, uint8_t major,
 	afu->id = (char *)malloc(7);
 	afu->open.state = LIBCXL_REQ_PENDING;
 
-	// Start thread
+	// Start threads
+	_workers_start(afu);
 	if (pthread_create(&(afu->thread), NULL, _psl_loop, afu)) {
 		perror("pthread_create");
+		_workers_stop(afu);
 		close_socket(&(afu->fd));
 		goto open_fail;
 	}
 	// Wait for open acknowledgement
-	while (afu->open.state != LIBCXL_REQ_IDLE)	/*infinite loop */
-		_delay_1ms();
+	_req_wait(afu, &(afu->open.state));
 
 	if (!afu->opened) {
 		pthread_join(afu->thread, NULL);
@@ -1729,8 +2601,11 @@ static struct cxl_afu_h *_pslse_open(int *fd, uint16_t afu_map, uint8_t major,
 	return afu;
 
  open_fail:
+	_workers_stop(afu);
 	pthread_mutex_destroy(&(afu->event_lock));
 	pthread_mutex_destroy(&(afu->mmio_lock));
+	_event_free(afu);
+	_req_free(afu);
 	free(afu);
 	errno = ENODEV;
 	return NULL;
@@ -2023,9 +2898,9 @@ struct cxl_afu_h *cxl_afu_open_h(struct cxl_afu_h *afu, enum cxl_views view)
 
 void cxl_afu_free(struct cxl_afu_h *afu)
 {
+	struct timespec deadline;
 	uint8_t buffer;
 	int rc;
-	int loop_count = 0;
 
 	if (!afu) {
 		warn_msg("cxl_afu_free: No AFU given");
@@ -2036,27 +2911,39 @@ void cxl_afu_free(struct cxl_afu_h *afu)
 
 	DPRINTF("AFU FREE\n");
 	buffer = PSLSE_DETACH;
-	rc = put_bytes_silent(afu->fd, 1, &buffer);
+	rc = _send(afu, 1, &buffer);
 	if (rc == 1) {
 	        debug_msg("detach request sent from from host on socket %d", afu->fd);
-		while ((afu->attached) && (loop_count < 180000)) {	/*infinite loop changed to a 3 minute timeout */
-			_delay_1ms();
-			loop_count = loop_count + 1;
-		}
-                if(loop_count == 180000)
-		   fatal_msg("_afu_free: time out of 3s reached");
-	}
+		// Wait up to 3 minutes for PSLSE to acknowledge the detach
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 180;
+		rc = 0;
+		pthread_mutex_lock(&(afu->req_lock));
+		while (afu->attached && (rc != ETIMEDOUT))
+			rc = pthread_cond_timedwait(&(afu->req_cond),
+						    &(afu->req_lock), &deadline);
+		pthread_mutex_unlock(&(afu->req_lock));
+		if (rc == ETIMEDOUT)
+			fatal_msg("_afu_free: time out of 3 minutes reached");
+	}
+	// PSLSE sends no memory requests after the detach, so the workers can
+	// drain before the socket they answer on is closed
+	_workers_stop(afu);
 	debug_msg("closing host side socket %d", afu->fd);
 	close_socket(&(afu->fd));
 	afu->opened = 0;
+	_wake(afu);
 	pthread_join(afu->thread, NULL);
 
  free_done:
+	_workers_stop(afu);
 	if (afu->id != NULL)
 		free(afu->id);
  free_done_no_afu:
 	pthread_mutex_destroy(&(afu->event_lock));
 	pthread_mutex_destroy(&(afu->mmio_lock));
+	_event_free(afu);
+	_req_free(afu);
 	free(afu);
 }
 
@@ -2087,11 +2974,13 @@ int cxl_afu_attach(struct cxl_afu_h *afu, uint64_t wed)
 		errno = ENODEV;
 		return -1;
 	}
+	// Pages cached valid may have been unmapped since any earlier attach
+	memset(afu->page_cache, 0, sizeof(afu->page_cache));
+
 	// Perform PSLSE attach
 	afu->attach.wed = wed;
-	afu->attach.state = LIBCXL_REQ_REQUEST;
-	while (afu->attach.state != LIBCXL_REQ_IDLE)	/*infinite loop */
-		_delay_1ms();
+	_req_send(afu, &(afu->attach.state));
+	_req_wait(afu, &(afu->attach.state));
 	afu->attached = 1;
 
 	return 0;
@@ -2193,37 +3082,55 @@ int cxl_set_irqs_max(struct cxl_afu_h *afu, long value)
 
 int cxl_event_pending(struct cxl_afu_h *afu)
 {
-	if (afu->events[0] != NULL)
+	struct event_ring *ring = &(afu->events);
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail)
 		return 1;
 
 	return 0;
 }
 
+// Readers take read_lock so concurrent callers each get a different event
 int cxl_read_event(struct cxl_afu_h *afu, struct cxl_event *event)
 {
+	struct event_ring *ring;
+	struct cxl_event *entry;
+	uint32_t tail;
 	uint8_t type;
-	int i;
 
 	if (afu == NULL || event == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
+	ring = &(afu->events);
+	pthread_mutex_lock(&(afu->read_lock));
+	tail = ring->tail;
+
 	// Function will block until event occurs
-	pthread_mutex_lock(&(afu->event_lock));
-	while (afu->opened && !afu->events[0]) {	/*infinite loop */
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+		pthread_mutex_lock(&(afu->event_lock));
+		ring->waiting = 1;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (afu->opened && (ring->head == tail))
+			pthread_cond_wait(&(afu->event_cond),
+					  &(afu->event_lock));
+		ring->waiting = 0;
 		pthread_mutex_unlock(&(afu->event_lock));
-		if (_delay_1ms() < 0)
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+			pthread_mutex_unlock(&(afu->read_lock));
+			errno = ENODEV;
 			return -1;
-		pthread_mutex_lock(&(afu->event_lock));
+		}
 	}
 
-	// Copy event data, free and move remaining events in queue
-	memcpy(event, afu->events[0], afu->events[0]->header.size);
-	free(afu->events[0]);
-	for (i = 1; i < afu->irqs_max; i++)
-		afu->events[i - 1] = afu->events[i];
-	afu->events[afu->irqs_max - 1] = NULL;
-	pthread_mutex_unlock(&(afu->event_lock));
+	// Copy event data and release its source at once so an event from
+	// the same source arriving meanwhile queues rather than coalesces.
+	// The ring has room for it until the entry is released.
+	entry = &(ring->entry[tail & (ring->size - 1)]);
+	memcpy(event, entry, entry->header.size);
+	__atomic_store_n(_event_source(ring, event), 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(afu->read_lock));
 	if (read(afu->pipe[0], &type, 1) > 0)
 		return 0;
 	return -1;
@@ -2267,9 +3174,8 @@ int cxl_mmio_map(struct cxl_afu_h *afu, uint32_t flags)
 	// Send MMIO map to PSLSE
 	afu->mmio.type = PSLSE_MMIO_MAP;
 	afu->mmio.data = (uint64_t) flags;
-	afu->mmio.state = LIBCXL_REQ_REQUEST;
-	while (afu->mmio.state != LIBCXL_REQ_IDLE)	/*infinite loop */
-		_delay_1ms();
+	_req_send(afu, &(afu->mmio.state));
+	_req_wait(afu, &(afu->mmio.state));
 	afu->mapped = 1;
 
 	return 0;
@@ -2286,6 +3192,8 @@ int cxl_mmio_unmap(struct cxl_afu_h *afu)
 
 int cxl_mmio_write64(struct cxl_afu_h *afu, uint64_t offset, uint64_t data)
 {
+	struct cxl_mmio_op op;
+
 	if (offset & 0x7) {
 		errno = EINVAL;
 		return -1;
@@ -2293,23 +3201,11 @@ int cxl_mmio_write64(struct cxl_afu_h *afu, uint64_t offset, uint64_t data)
 	if ((afu == NULL) || !afu->mapped)
 		goto write64_fail;
 
-	// obtain mmio lock before reading and updating mmio structure
-	while (1) {
-	  pthread_mutex_lock( &(afu->mmio_lock) );
-	  if ( afu->mmio.state == LIBCXL_REQ_IDLE ) break; // it is ok to make the mmio request
-	  pthread_mutex_unlock( &(afu->mmio_lock) );
-	  _delay_1ms();
-	}
-
-	// Send MMIO map to PSLSE
-	afu->mmio.type = PSLSE_MMIO_WRITE64;
-	afu->mmio.addr = (uint32_t) offset;
-	afu->mmio.data = data;
-	afu->mmio.state = LIBCXL_REQ_REQUEST;
-	pthread_mutex_unlock( &(afu->mmio_lock) );
-
-	while (afu->mmio.state != LIBCXL_REQ_IDLE)	/*infinite loop */
-		_delay_1ms();
+	op.type = CXL_MMIO_OP_WRITE64;
+	op.offset = offset;
+	op.data = data;
+	if (_mmio_sync(afu, &op) < 0)
+		goto write64_fail;
 
 	if (!afu->opened)
 		goto write64_fail;
@@ -2323,6 +3219,8 @@ int cxl_mmio_write64(struct cxl_afu_h *afu, uint64_t offset, uint64_t data)
 
 int cxl_mmio_read64(struct cxl_afu_h *afu, uint64_t offset, uint64_t * data)
 {
+	struct cxl_mmio_op op;
+
 	if (offset & 0x7) {
 		errno = EINVAL;
 		return -1;
@@ -2330,23 +3228,12 @@ int cxl_mmio_read64(struct cxl_afu_h *afu, uint64_t offset, uint64_t * data)
 	if ((afu == NULL) || !afu->mapped)
 		goto read64_fail;
 
-	// obtain mmio lock before reading and updating mmio structure
-	while (1) {
-	  pthread_mutex_lock( &(afu->mmio_lock) );
-	  if ( afu->mmio.state == LIBCXL_REQ_IDLE ) break; // it is ok to make the mmio request
-	  pthread_mutex_unlock( &(afu->mmio_lock) );
-	  _delay_1ms();
-	}
-
-	// Send MMIO map to PSLSE
-	afu->mmio.type = PSLSE_MMIO_READ64;
-	afu->mmio.addr = (uint32_t) offset;
-	afu->mmio.state = LIBCXL_REQ_REQUEST;
-
-	while (afu->mmio.state != LIBCXL_REQ_IDLE)	/*infinite loop */
-		_delay_1ms();
-	*data = afu->mmio.data;
-	pthread_mutex_unlock( &(afu->mmio_lock) );
+	op.type = CXL_MMIO_OP_READ64;
+	op.offset = offset;
+	op.data = 0;
+	if (_mmio_sync(afu, &op) < 0)
+		goto read64_fail;
+	*data = op.data;
 
 	if (!afu->opened)
 		goto read64_fail;
@@ -2358,12 +3245,54 @@ int cxl_mmio_read64(struct cxl_afu_h *afu, uint64_t offset, uint64_t * data)
 	return -1;
 }
 
+int cxl_mmio_batch(struct cxl_afu_h *afu, struct cxl_mmio_op *ops, int n)
+{
+	int i, count;
+
+	if ((afu == NULL) || !afu->mapped)
+		goto batch_fail;
+
+	for (i = 0; i < n; i++) {
+		if (!_mmio_op_valid(&(ops[i])))
+			goto batch_inval;
+	}
+
+	// hold mmio lock for the whole batch, sending it to PSLSE in chunks
+	// of up to PSLSE_MMIO_BATCH_MAX accesses
+	pthread_mutex_lock( &(afu->mmio_lock) );
+	for (i = 0; i < n; i += count) {
+		count = MIN(n - i, PSLSE_MMIO_BATCH_MAX);
+		afu->mmio.type = PSLSE_MMIO_BATCH;
+		afu->mmio.ops = &(ops[i]);
+		afu->mmio.count = count;
+		_req_send(afu, &(afu->mmio.state));
+		_req_wait(afu, &(afu->mmio.state));
+		// ops is cleared if PSLSE rejected the batch
+		if (!afu->opened || (afu->mmio.ops == NULL)) {
+			pthread_mutex_unlock( &(afu->mmio_lock) );
+			goto batch_fail;
+		}
+	}
+	pthread_mutex_unlock( &(afu->mmio_lock) );
+
+	return 0;
+
+ batch_inval:
+	errno = EINVAL;
+	return -1;
+
+ batch_fail:
+	errno = ENODEV;
+	return -1;
+}
+
 int cxl_errinfo_read(struct cxl_afu_h *afu, void *dst, off_t off, size_t len)
 {
         off_t aligned_start, last_byte;
 	off_t index1, index2;
 	uint8_t *buffer;
 	size_t total_read_length;
+	int count;
 
 	if ((afu == NULL) || !afu->mapped)   {
 		errno = ENODEV;
@@ -2387,26 +3316,29 @@ int cxl_errinfo_read(struct cxl_afu_h *afu, void *dst, off_t off, size_t len)
 	if (total_read_length > ERR_BUFF_MAX_COPY_SIZE) {
 		total_read_length = ERR_BUFF_MAX_COPY_SIZE;
 		len = ERR_BUFF_MAX_COPY_SIZE - (off & 0x7);
+		last_byte = aligned_start + len + (off & 0x7);
+	}
+
+	/* read the whole aligned window from PSLSE in one request */
+	count = ((last_byte - aligned_start) >> 3) + 1;
+	pthread_mutex_lock( &(afu->mmio_lock) );
+	afu->mmio.type = PSLSE_MMIO_DESC_READ;
+	afu->mmio.addr = (uint32_t) aligned_start;
+	afu->mmio.words = wbuf;
+	afu->mmio.count = count;
+	_req_send(afu, &(afu->mmio.state));
+	_req_wait(afu, &(afu->mmio.state));
+	// words is cleared if PSLSE rejected the read
+	if (!afu->opened || (afu->mmio.words == NULL)) {
+		pthread_mutex_unlock( &(afu->mmio_lock) );
+		goto bread64_fail;
+	}
+	pthread_mutex_unlock( &(afu->mmio_lock) );
+	// if offset, have to potentially do BE->LE swap
+	if ((off & 0x7) > 0) {
+		for (index1 = 0; index1 < count; index1++)
+			wbuf[index1] = htonll(wbuf[index1]);
 	}
-
-	/* perform aligned read from the mmio region */
-        index1 = 0;
-	while (aligned_start <= last_byte)  {
-	// Send MMIO request to PSLSE
-		afu->mmio.type = PSLSE_MMIO_EBREAD;
-		afu->mmio.addr = (uint32_t) aligned_start ;
-		afu->mmio.state = LIBCXL_REQ_REQUEST;
-		while (afu->mmio.state != LIBCXL_REQ_IDLE)	/*infinite loop */
-			_delay_1ms();
-		if (!afu->opened)
-			goto bread64_fail;
-		// if offset, have to potentially do BE->LE swap
-        	if ((off & 0x7) >0) 
-                	afu->mmio.data = htonll(afu->mmio.data);
-        	wbuf[index1] = afu->mmio.data;
-        	aligned_start = aligned_start + 8;
-                ++index1;
-        }
 	memcpy(&wbuf[0], &bbuf[off & 0x7], len);
 	// if offset we have to do LE->BE swap back	
  	if ((off & 0x7) > 0)    {
@@ -2437,6 +3369,8 @@ int cxl_errinfo_read(struct cxl_afu_h *afu, void *dst, off_t off, size_t len)
 
 int cxl_mmio_write32(struct cxl_afu_h *afu, uint64_t offset, uint32_t data)
 {
+	struct cxl_mmio_op op;
+
 	if (offset & 0x3) {
 		errno = EINVAL;
 		return -1;
@@ -2444,23 +3378,11 @@ int cxl_mmio_write32(struct cxl_afu_h *afu, uint64_t offset, uint32_t data)
 	if ((afu == NULL) || !afu->mapped)
 		goto write32_fail;
 
-	// obtain mmio lock before reading and updating mmio structure
-	while (1) {
-	  pthread_mutex_lock( &(afu->mmio_lock) );
-	  if ( afu->mmio.state == LIBCXL_REQ_IDLE ) break; // it is ok to make the mmio request
-	  pthread_mutex_unlock( &(afu->mmio_lock) );
-	  _delay_1ms();
-	}
-
-	// Send MMIO map to PSLSE
-	afu->mmio.type = PSLSE_MMIO_WRITE32;
-	afu->mmio.addr = (uint32_t) offset;
-	afu->mmio.data = (uint64_t) data;
-	afu->mmio.state = LIBCXL_REQ_REQUEST;
-	pthread_mutex_unlock( &(afu->mmio_lock) );
-
-	while (afu->mmio.state != LIBCXL_REQ_IDLE)	/*infinite loop */
-		_delay_1ms();
+	op.type = CXL_MMIO_OP_WRITE32;
+	op.offset = offset;
+	op.data = (uint64_t) data;
+	if (_mmio_sync(afu, &op) < 0)
+		goto write32_fail;
 
 	if (!afu->opened)
 		goto write32_fail;
@@ -2474,6 +3396,8 @@ int cxl_mmio_write32(struct cxl_afu_h *afu, uint64_t offset, uint32_t data)
 
 int cxl_mmio_read32(struct cxl_afu_h *afu, uint64_t offset, uint32_t * data)
 {
+	struct cxl_mmio_op op;
+
 	if (offset & 0x3) {
 		errno = EINVAL;
 		return -1;
@@ -2481,23 +3405,12 @@ int cxl_mmio_read32(struct cxl_afu_h *afu, uint64_t offset, uint32_t * data)
 	if ((afu == NULL) || !afu->mapped)
 		goto read32_fail;
 
-	// obtain mmio lock before reading and updating mmio structure
-	while (1) {
-	  pthread_mutex_lock( &(afu->mmio_lock) );
-	  if ( afu->mmio.state == LIBCXL_REQ_IDLE ) break; // it is ok to make the mmio request
-	  pthread_mutex_unlock( &(afu->mmio_lock) );
-	  _delay_1ms();
-	}
-
-	// Send MMIO map to PSLSE.
-	afu->mmio.type = PSLSE_MMIO_READ32;
-	afu->mmio.addr = (uint32_t) offset;
-	afu->mmio.state = LIBCXL_REQ_REQUEST;
-
-	while (afu->mmio.state != LIBCXL_REQ_IDLE)	/*infinite loop */
-		_delay_1ms();
-	*data = (uint32_t) afu->mmio.data;
-	pthread_mutex_unlock( &(afu->mmio_lock) );
+	op.type = CXL_MMIO_OP_READ32;
+	op.offset = offset;
+	op.data = 0;
+	if (_mmio_sync(afu, &op) < 0)
+		goto read32_fail;
+	*data = (uint32_t) op.data;
 
 	if (!afu->opened)
 		goto read32_fail;
@@ -2509,6 +3422,80 @@ int cxl_mmio_read32(struct cxl_afu_h *afu, uint64_t offset, uint32_t * data)
 	return -1;
 }
 
+int cxl_mmio_submit(struct cxl_afu_h *afu, struct cxl_mmio_op *op)
+{
+	struct mmio_entry *entry;
+
+	if (!_mmio_op_valid(op)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((afu == NULL) || !afu->mapped) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	entry = (struct mmio_entry *)malloc(sizeof(struct mmio_entry));
+	if (entry == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	entry->op = op;
+	entry->async = 1;
+	entry->done = 0;
+	pthread_mutex_lock(&(afu->req_lock));
+	if (afu->mmio_closed || (afu->mmio_async >= CXL_MMIO_ASYNC_MAX)) {
+		errno = afu->mmio_closed ? ENODEV : EAGAIN;
+		pthread_mutex_unlock(&(afu->req_lock));
+		free(entry);
+		return -1;
+	}
+	afu->mmio_async++;
+	_mmio_push(&(afu->mmio_submit), entry);
+	_wake(afu);
+	pthread_mutex_unlock(&(afu->req_lock));
+
+	return 0;
+}
+
+int cxl_mmio_completion_fd(struct cxl_afu_h *afu)
+{
+	if (afu == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return afu->mmio_fd[0];
+}
+
+int cxl_mmio_reap(struct cxl_afu_h *afu, struct cxl_mmio_op **ops, int max)
+{
+	struct mmio_entry *entry;
+	uint8_t bytes[64];
+	int count, size;
+
+	if (afu == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	count = 0;
+	pthread_mutex_lock(&(afu->req_lock));
+	while ((count < max) &&
+	       ((entry = _mmio_pop(&(afu->mmio_done))) != NULL)) {
+		ops[count++] = entry->op;
+		free(entry);
+	}
+	afu->mmio_async -= count;
+	// Consume the completion byte of each op reaped
+	for (size = count; size > 0; size -= sizeof(bytes)) {
+		if (read(afu->mmio_fd[0], bytes, MIN(size, sizeof(bytes))) < 0)
+			break;
+	}
+	pthread_mutex_unlock(&(afu->req_lock));
+
+	return count;
+}
+
 int cxl_get_cr_device(struct cxl_afu_h *afu, long cr_num, long *valp)
 {
 	if (afu == NULL) 
@@ -221,6 +221,37 @@ int cxl_mmio_read64(struct cxl_afu_h *afu, uint64_t offset, uint64_t * data);
 int cxl_mmio_write32(struct cxl_afu_h *afu, uint64_t offset, uint32_t data);
 int cxl_mmio_read32(struct cxl_afu_h *afu, uint64_t offset, uint32_t * data);
 
+/*
+ * PSL Simulation Engine extension: perform n MMIO accesses in a single round
+ * trip to PSLSE.  The accesses are made in order and data from reads is
+ * returned in the data field of their ops.
+ */
+#define CXL_MMIO_OP_WRITE64 0x0
+#define CXL_MMIO_OP_READ64 0x1
+#define CXL_MMIO_OP_WRITE32 0x2
+#define CXL_MMIO_OP_READ32 0x3
+struct cxl_mmio_op {
+	uint32_t type;
+	int32_t result;
+	uint64_t offset;
+	uint64_t data;
+};
+int cxl_mmio_batch(struct cxl_afu_h *afu, struct cxl_mmio_op *ops, int n);
+
+/*
+ * PSL Simulation Engine extension: asynchronous MMIO.  cxl_mmio_submit()
+ * queues op and returns at once, op must stay valid until it is handed back
+ * by cxl_mmio_reap().  Any number of threads may submit on the same AFU
+ * handle and accesses are made in the order they were submitted.  The file
+ * descriptor from cxl_mmio_completion_fd() is readable while completed ops
+ * are waiting to be reaped.  Each reaped op has result 0 on success or -1 if
+ * the access failed.
+ */
+#define CXL_MMIO_ASYNC_MAX 256
+int cxl_mmio_submit(struct cxl_afu_h *afu, struct cxl_mmio_op *op);
+int cxl_mmio_completion_fd(struct cxl_afu_h *afu);
+int cxl_mmio_reap(struct cxl_afu_h *afu, struct cxl_mmio_op **ops, int max);
+
 /*
  * Calling this function will install the libcxl SIGBUS handler. This will
  * catch bad MMIO accesses (e.g. due to hardware failures) that would otherwise
@@ -23,6 +23,12 @@
 #include <pthread.h>
 
 #define EVENT_QUEUE_MAX 3
+#define PAGE_CACHE_ENTRIES 4096
+#define PREFETCH_STREAMS 4
+#define PREFETCH_MAX_LINES 16
+#define MEM_WORKERS_MAX 16
+#define MEM_WORK_QUEUE 64
+#define MEM_WORK_BYTES 1024
 
 enum libcxl_req_state {
 	LIBCXL_REQ_IDLE,
@@ -50,13 +56,85 @@ struct mmio_req {
 	volatile uint8_t type;
 	volatile uint32_t addr;
 	uint64_t data;
+	struct cxl_mmio_op *volatile ops;
+	uint64_t *volatile words;
+	volatile int count;
+};
+
+// MMIO access queued on an AFU handle.  Synchronous accesses wait for done,
+// asynchronous ones are handed back by cxl_mmio_reap()
+struct mmio_entry {
+	struct cxl_mmio_op *op;
+	int async;
+	volatile int done;
+	struct mmio_entry *_next;
+};
+
+struct mmio_queue {
+	struct mmio_entry *head;
+	struct mmio_entry *tail;
+};
+
+// Events waiting for cxl_read_event().  The PSLSE socket thread and the
+// memory workers produce events one at a time under push_lock and write head,
+// the single reader thread writes tail.  Sources are coalesced, at most one
+// event per interrupt number plus one DSI and one AFU error can be pending,
+// so the ring is sized to never fill.
+struct event_ring {
+	struct cxl_event *entry;
+	volatile uint8_t *irq_pending;
+	volatile uint8_t dsi_pending;
+	volatile uint8_t error_pending;
+	uint32_t size;
+	uint16_t irqs;
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile int waiting;
+};
+
+// Sequential read stream of the AFU.  next is the first line PSLSE doesn't
+// hold yet, last the line whose read sent the lines before it ahead.
+struct prefetch_stream {
+	uint64_t last;
+	uint64_t next;
+};
+
+// Memory request from PSLSE, with the data of a write or the function code
+// and operands of an AMO
+struct mem_work {
+	uint8_t type;
+	uint16_t id;
+	uint16_t size;
+	uint64_t addr;
+	uint8_t data[MEM_WORK_BYTES];
+};
+
+// Thread servicing the memory requests to a share of the pages of host
+// memory, in the order PSLSE sent them.  The PSL thread adds requests at head
+// and the worker takes them from tail, both under lock.
+struct mem_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct mem_work *work;
+	uint32_t head;
+	uint32_t tail;
+	int stop;
+	struct cxl_afu_h *afu;
 };
 
 struct cxl_afu_h {
 	pthread_t thread;
 	pthread_mutex_t event_lock;
+	pthread_cond_t event_cond;
+	pthread_mutex_t push_lock;
+	pthread_mutex_t read_lock;
+	pthread_mutex_t send_lock;
+	pthread_mutex_t prefetch_lock;
         pthread_mutex_t mmio_lock;
-        struct cxl_event **events;
+	pthread_mutex_t req_lock;
+	pthread_cond_t req_cond;
+	struct event_ring events;
 	int adapter;
 	char *id;
 	uint16_t context;
@@ -64,10 +142,12 @@ struct cxl_afu_h {
 	uint16_t position;
 	uint8_t dbg_id;
 	int fd;
+	uint32_t pid;
 	int opened;
 	int attached;
 	int mapped;
 	int pipe[2];
+	int wake[2];
 	long irqs_max;
 	long irqs_min;
 	long mode;
@@ -83,6 +163,20 @@ struct cxl_afu_h {
 	struct open_req open;
 	struct attach_req attach;
 	struct mmio_req mmio;
+	struct mmio_entry mmio_slot;
+	struct mmio_queue mmio_submit;
+	struct mmio_queue mmio_sent;
+	struct mmio_queue mmio_done;
+	int mmio_async;
+	int mmio_closed;
+	int mmio_fd[2];
+	int probe[2];
+	uint64_t page_cache[PAGE_CACHE_ENTRIES];
+	uint8_t prefetch_lines;
+	struct prefetch_stream prefetch[PREFETCH_STREAMS];
+	int prefetch_victim;
+	struct mem_worker *workers;
+	int worker_count;
 	struct cxl_afu_h *_head;
 	struct cxl_afu_h *_next;
 	struct cxl_afu_h *_next_adapter;
@@ -17,15 +17,153 @@
 /*
  * Description: client.c
  *
- * This file contains code for handling client disconnect.
+ * This file contains code for handling client disconnect, the ids of
+ * memory requests outstanding to a client, direct access to the memory of
+ * a client on the same host and the lines of client memory libcxl has sent
+ * ahead of the AFU reading them.
  */
 
+#define _GNU_SOURCE
+#include <string.h>
+#include <sys/uio.h>
+
 #include "client.h"
 
 void client_drop(struct client *client, int cycles, enum client_state state)
 {
+	int i;
+
 	client->idle_cycles = cycles;
 	client->pending = 0;
 	client->state = state;
-	client->mem_access = NULL;
+	memset(client->mem_access, 0, sizeof(client->mem_access));
+	client->mem_pending = 0;
+	client_prefetch_flush(client);
+	for (i = 0; i < CLIENT_COMBINE_SLOTS; i++)
+		client->combine[i].first = NULL;
+	client->combining = 0;
+}
+
+// Claim a request id for a memory access, -1 if all ids are in use
+int client_mem_request(struct client *client, void *access)
+{
+	int id;
+
+	if (client->mem_pending >= CLIENT_MEM_REQUESTS)
+		return -1;
+	while (client->mem_access[client->mem_next] != NULL)
+		client->mem_next = (client->mem_next + 1) % CLIENT_MEM_REQUESTS;
+	id = client->mem_next;
+	client->mem_access[id] = access;
+	client->mem_pending++;
+	client->mem_next = (id + 1) % CLIENT_MEM_REQUESTS;
+	return id;
+}
+
+// Release request id and return its memory access, NULL if id isn't in use
+void *client_mem_response(struct client *client, uint16_t id)
+{
+	void *access;
+
+	if (id >= CLIENT_MEM_REQUESTS)
+		return NULL;
+	access = client->mem_access[id];
+	if (access != NULL) {
+		client->mem_access[id] = NULL;
+		client->mem_pending--;
+	}
+	return access;
+}
+
+// Copy size bytes between data and addr in the client's address space, write
+// selects the direction.  Fails unless every byte was copied.
+int client_mem_copy(struct client *client, uint64_t addr, uint8_t * data,
+		    uint32_t size, int write)
+{
+	struct iovec local, remote;
+	ssize_t bytes;
+
+	local.iov_base = data;
+	local.iov_len = size;
+	remote.iov_base = (void *)addr;
+	remote.iov_len = size;
+	if (write)
+		bytes = process_vm_writev(client->pid, &local, 1, &remote, 1, 0);
+	else
+		bytes = process_vm_readv(client->pid, &local, 1, &remote, 1, 0);
+	return (bytes == (ssize_t) size) ? 0 : -1;
+}
+
+// Find the prefetched line holding addr, -1 if there isn't one
+static int _prefetch_find(struct client *client, uint64_t addr)
+{
+	int i;
+
+	addr &= ~((uint64_t) CLIENT_PREFETCH_BYTES - 1);
+	for (i = 0; i < CLIENT_PREFETCH_LINES; i++) {
+		if (client->prefetch[i].valid && (client->prefetch[i].addr == addr))
+			return i;
+	}
+	return -1;
+}
+
+// Hold a line of client memory, replacing the oldest line held
+void client_prefetch_store(struct client *client, uint64_t addr,
+			   uint8_t * data)
+{
+	int i;
+
+	if ((i = _prefetch_find(client, addr)) < 0) {
+		i = client->prefetch_next;
+		client->prefetch_next = (i + 1) % CLIENT_PREFETCH_LINES;
+	}
+	client->prefetch[i].addr = addr;
+	client->prefetch[i].valid = 1;
+	memcpy(client->prefetch[i].data, data, CLIENT_PREFETCH_BYTES);
+}
+
+// Copy size bytes at addr out of a prefetched line.  Returns -1 if the line
+// isn't held.  A line is dropped once read to its end so memory the AFU
+// reads again is fetched fresh.
+int client_prefetch_read(struct client *client, uint64_t addr, uint8_t * data,
+			 uint32_t size)
+{
+	uint32_t offset;
+	int i;
+
+	offset = addr & (CLIENT_PREFETCH_BYTES - 1);
+	if ((client->prefetch_lines == 0) ||
+	    (offset + size > CLIENT_PREFETCH_BYTES) ||
+	    ((i = _prefetch_find(client, addr)) < 0))
+		return -1;
+	memcpy(data, &(client->prefetch[i].data[offset]), size);
+	if (offset + size == CLIENT_PREFETCH_BYTES)
+		client->prefetch[i].valid = 0;
+	return 0;
+}
+
+// Drop prefetched lines overlapping size bytes at addr
+void client_prefetch_invalidate(struct client *client, uint64_t addr,
+				uint32_t size)
+{
+	uint64_t line;
+	int i;
+
+	if (client->prefetch_lines == 0)
+		return;
+	line = addr & ~((uint64_t) CLIENT_PREFETCH_BYTES - 1);
+	while (line < addr + size) {
+		if ((i = _prefetch_find(client, line)) >= 0)
+			client->prefetch[i].valid = 0;
+		line += CLIENT_PREFETCH_BYTES;
+	}
+}
+
+// Drop all prefetched lines
+void client_prefetch_flush(struct client *client)
+{
+	int i;
+
+	for (i = 0; i < CLIENT_PREFETCH_LINES; i++)
+		client->prefetch[i].valid = 0;
 }
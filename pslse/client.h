@@ -19,6 +19,19 @@
 #include <pthread.h>
 #include <stdint.h>
 
+// Most memory requests outstanding to a client at once.  The request id sent
+// with each request indexes mem_access.
+#define CLIENT_MEM_REQUESTS 1024
+
+// Host memory cache lines pushed ahead of demand by libcxl and held until read
+#define CLIENT_PREFETCH_LINES 64
+#define CLIENT_PREFETCH_BYTES 128
+
+// AFU writes held back per client to be sent together, each slot covering one
+// aligned block of client memory
+#define CLIENT_COMBINE_SLOTS 4
+#define CLIENT_COMBINE_BYTES 1024
+
 enum client_state {
 	CLIENT_NONE,
 	CLIENT_INIT,
@@ -31,12 +44,32 @@ enum flush_state {
 	FLUSH_FLUSHING
 };
 
+struct prefetch_line {
+	uint64_t addr;
+	int valid;
+	uint8_t data[CLIENT_PREFETCH_BYTES];
+};
+
+// Bytes lo up to hi of the block at base hold the data of the chain of
+// writes from first to last
+struct write_combine {
+	void *first;
+	void *last;
+	uint64_t base;
+	uint16_t lo;
+	uint16_t hi;
+	int cycles;
+	uint8_t data[CLIENT_COMBINE_BYTES];
+};
+
 struct client {
 	int pending;
+	int detached;
 	int idle_cycles;
 	int fd;
 	int context;
 	int abort;
+	int ready;
 	int timeout;
 	enum flush_state flushing;
 	enum client_state state;
@@ -45,8 +78,17 @@ struct client {
 	uint64_t wed;
 	uint32_t mmio_offset;
 	uint32_t mmio_size;
-	void *mem_access;
+	void *mem_access[CLIENT_MEM_REQUESTS];
+	int mem_pending;
+	uint16_t mem_next;
+	int pid;
+	uint8_t prefetch_lines;
+	struct prefetch_line prefetch[CLIENT_PREFETCH_LINES];
+	int prefetch_next;
+	struct write_combine combine[CLIENT_COMBINE_SLOTS];
+	int combining;
 	void *mmio_access;
+	void *mmio_last;
 	char *ip;
 	pthread_t thread;
 	struct client *_prev;
@@ -55,4 +97,22 @@ struct client {
 
 void client_drop(struct client *client, int cycles, enum client_state state);
 
+int client_mem_request(struct client *client, void *access);
+
+void *client_mem_response(struct client *client, uint16_t id);
+
+int client_mem_copy(struct client *client, uint64_t addr, uint8_t * data,
+		    uint32_t size, int write);
+
+void client_prefetch_store(struct client *client, uint64_t addr,
+			   uint8_t * data);
+
+int client_prefetch_read(struct client *client, uint64_t addr, uint8_t * data,
+			 uint32_t size);
+
+void client_prefetch_invalidate(struct client *client, uint64_t addr,
+				uint32_t size);
+
+void client_prefetch_flush(struct client *client);
+
 #endif				/* _CLIENT_H_ */
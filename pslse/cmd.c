@@ -26,18 +26,24 @@
  *  type.  Depending on command type either _add_interrupt(), _add_touch(),
  *  _add_unlock(), _add_read(), _add_write() or _add_other() will be called to
  *  format the tracking event properly.  Each of these functions calls
- *  _add_cmd() which will randomly insert the command in the list.
+ *  _add_cmd() which will randomly insert the command in the list.  Events
+ *  and their data/parity buffers come from a free list that is carved out
+ *  of slabs sized by the credit count, so the command path never calls the
+ *  allocator once the first slab is in place.
  *
  *  Once an event is in the list then the event will be service in random order
  *  by the periodic calling by psl code of the functions: handle_interrupt(),
  *  handle_response(), handle_buffer_write(), handle_buffer_data() and
  *  handle_touch().  The state field is used to track the progress of each
  *  event until is fully completed and removed from the list completely.
+ *  With the WRITE_COMBINE parm set, handle_mem_write() holds writes back in
+ *  per client combine slots so neighbouring writes reach the client as one.
  */
 
 #include <assert.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include "cmd.h"
@@ -48,6 +54,234 @@
 #define IRQ_MASK       0x00000000000007FFL
 #define CACHELINE_MASK 0xFFFFFFFFFFFFFF80L
 
+// Add a slab of count events to the free list.  Data buffers are cache line
+// aligned and each event keeps its own buffers for its whole life.
+static int _grow_pool(struct cmd *cmd, int count)
+{
+	struct cmd_slab *slab;
+	struct cmd_event *event;
+	void *data;
+	int i;
+
+	slab = (struct cmd_slab *)calloc(1, sizeof(struct cmd_slab));
+	if (slab == NULL)
+		return -1;
+	slab->event = (struct cmd_event *)calloc(count,
+						 sizeof(struct cmd_event));
+	slab->parity = (uint8_t *) malloc(count * CMD_PARITY_BYTES);
+	if (posix_memalign(&data, CACHELINE_BYTES, count * CMD_DATA_BYTES))
+		data = NULL;
+	slab->data = (uint8_t *) data;
+	if ((slab->event == NULL) || (slab->parity == NULL) ||
+	    (slab->data == NULL)) {
+		free(slab->event);
+		free(slab->parity);
+		free(slab->data);
+		free(slab);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		event = &(slab->event[i]);
+		event->data = &(slab->data[i * CMD_DATA_BYTES]);
+		event->parity = &(slab->parity[i * CMD_PARITY_BYTES]);
+		event->_next = cmd->free_list;
+		cmd->free_list = event;
+	}
+	slab->_next = cmd->slabs;
+	cmd->slabs = slab;
+	return 0;
+}
+
+// Take an event off the free list, cleared as calloc() would leave it but
+// with data and parity filled with 0xFF
+static struct cmd_event *_alloc_event(struct cmd *cmd)
+{
+	struct cmd_event *event;
+	uint8_t *data, *parity;
+
+	// PSL9 translate events outlive their tag so the pool may need to
+	// grow past the credit count
+	if ((cmd->free_list == NULL) &&
+	    (_grow_pool(cmd, cmd->parms->credits) < 0)) {
+		perror("malloc");
+		exit(-1);
+	}
+	event = cmd->free_list;
+	cmd->free_list = event->_next;
+	data = event->data;
+	parity = event->parity;
+	memset(event, 0, sizeof(struct cmd_event));
+	event->data = data;
+	event->parity = parity;
+	memset(event->data, 0xFF, CMD_DATA_BYTES);
+	memset(event->parity, 0xFF, CMD_PARITY_BYTES);
+	return event;
+}
+
+// Put event on the ready queue for its state.  Events are kept in issue order
+// so start from the tail, where a newly changed event usually belongs.
+static void _enqueue(struct cmd *cmd, struct cmd_event *event)
+{
+	struct cmd_event *prev;
+
+	prev = cmd->ready_tail[event->state];
+	while ((prev != NULL) && (prev->seq > event->seq))
+		prev = prev->_ready_prev;
+	event->_ready_prev = prev;
+	if (prev == NULL) {
+		event->_ready_next = cmd->ready[event->state];
+		cmd->ready[event->state] = event;
+	} else {
+		event->_ready_next = prev->_ready_next;
+		prev->_ready_next = event;
+	}
+	if (event->_ready_next == NULL)
+		cmd->ready_tail[event->state] = event;
+	else
+		event->_ready_next->_ready_prev = event;
+}
+
+// Take event off the ready queue for its state
+static void _dequeue(struct cmd *cmd, struct cmd_event *event)
+{
+	if (event->_ready_prev == NULL)
+		cmd->ready[event->state] = event->_ready_next;
+	else
+		event->_ready_prev->_ready_next = event->_ready_next;
+	if (event->_ready_next == NULL)
+		cmd->ready_tail[event->state] = event->_ready_prev;
+	else
+		event->_ready_next->_ready_prev = event->_ready_prev;
+	event->_ready_next = NULL;
+	event->_ready_prev = NULL;
+}
+
+// Move event to the ready queue for a new state
+void cmd_set_state(struct cmd *cmd, struct cmd_event *event,
+		   enum mem_state state)
+{
+	// Freed events are off every queue, a stale client->mem_access may
+	// still point at one
+	if (event->seq == 0) {
+		event->state = state;
+		return;
+	}
+	if (event->state == state)
+		return;
+	_dequeue(cmd, event);
+	event->state = state;
+	_enqueue(cmd, event);
+}
+
+// Release tag for reuse by AFU
+static void _clear_tag(struct cmd *cmd, struct cmd_event *event)
+{
+	if ((event->tag < CMD_TAGS) && (cmd->tag[event->tag] == event))
+		cmd->tag[event->tag] = NULL;
+}
+
+// Take event off the buffer reads waiting on data from AFU
+static void _buffer_read_done(struct cmd *cmd, struct cmd_event *event)
+{
+	int i;
+
+	if (!event->buffer_read)
+		return;
+	for (i = 0; cmd->buffer_read[i] != event; i++) ;
+	for (; i + 1 < cmd->buffer_reads; i++)
+		cmd->buffer_read[i] = cmd->buffer_read[i + 1];
+	cmd->buffer_reads--;
+	event->buffer_read = 0;
+}
+
+// Return the outstanding buffer read event the AFU's buffer read data answers,
+// or NULL if there is none.  AFUs that don't tag the data return it in the
+// order the buffer reads were sent, so the oldest buffer read is matched.
+static struct cmd_event *_buffer_read_match(struct cmd *cmd)
+{
+	struct cmd_event *event;
+	uint32_t tag;
+
+	if (!cmd->afu_event->buffer_tag)
+		return cmd->buffer_reads ? cmd->buffer_read[0] : NULL;
+	tag = cmd->afu_event->buffer_rdata_tag;
+	if (tag >= CMD_TAGS)
+		return NULL;
+	event = cmd->tag[tag];
+	if ((event == NULL) || !event->buffer_read)
+		return NULL;
+	return event;
+}
+
+// Oldest event of the given types waiting in state
+static struct cmd_event *_first(struct cmd *cmd, enum mem_state state,
+				uint32_t types)
+{
+	struct cmd_event *event;
+
+	event = cmd->ready[state];
+	while ((event != NULL) && !(CMD_MASK(event->type) & types))
+		event = event->_ready_next;
+	return event;
+}
+
+// Randomly selected event of the given types waiting in state.  Each
+// candidate is passed over with the allow_reorder() probability, falling back
+// to the oldest if all of them were.
+static struct cmd_event *_pick(struct cmd *cmd, enum mem_state state,
+			       uint32_t types)
+{
+	struct cmd_event *event, *first;
+
+	first = _first(cmd, state, types);
+	for (event = first; event != NULL; event = event->_ready_next) {
+		if ((CMD_MASK(event->type) & types) &&
+		    !allow_reorder(cmd->parms))
+			return event;
+	}
+	return first;
+}
+
+// Remove event from command tracking and return it to the free list
+void cmd_free_event(struct cmd *cmd, struct cmd_event *event)
+{
+	if (event->_prev == NULL)
+		cmd->list = event->_next;
+	else
+		event->_prev->_next = event->_next;
+	if (event->_next != NULL)
+		event->_next->_prev = event->_prev;
+	_dequeue(cmd, event);
+	_buffer_read_done(cmd, event);
+	_clear_tag(cmd, event);
+#ifdef PSL9
+	if ((event->itag < CMD_ITAGS) && (cmd->itag[event->itag] == event))
+		cmd->itag[event->itag] = NULL;
+#endif /* ifdef PSL9 */
+	if ((cmd->pending != NULL) && (event->context < cmd->max_clients))
+		cmd->pending[event->context]--;
+	event->seq = 0;
+	event->_next = cmd->free_list;
+	cmd->free_list = event;
+}
+
+// Free cmd structure and all event slabs
+void cmd_free(struct cmd *cmd)
+{
+	struct cmd_slab *slab;
+
+	while (cmd->slabs != NULL) {
+		slab = cmd->slabs;
+		cmd->slabs = slab->_next;
+		free(slab->event);
+		free(slab->data);
+		free(slab->parity);
+		free(slab);
+	}
+	free(cmd->pending);
+	free(cmd);
+}
+
 // Initialize cmd structure for tracking AFU command activity
 struct cmd *cmd_init(struct AFU_EVENT *afu_event, struct parms *parms,
 		     struct mmio *mmio, volatile enum pslse_state *state,
@@ -85,6 +319,10 @@ struct cmd *cmd_init(struct AFU_EVENT *afu_event, struct parms *parms,
 	cmd->afu_name = afu_name;
 	cmd->dbg_fp = dbg_fp;
 	cmd->dbg_id = dbg_id;
+	if (_grow_pool(cmd, cmd->credits) < 0) {
+		perror("malloc");
+		exit(-1);
+	}
 
 #if defined PSL9
 	cmd->afu_event->dma0_dvalid = 0;
@@ -153,15 +391,12 @@ static void _print_event(struct cmd_event *event)
 static void _update_pending_resps(struct cmd *cmd, uint32_t resp)
 {
 	struct cmd_event *event;
-	event = cmd->list;
-	while (event) {
-		if (event->state == MEM_IDLE) {
-			event->state = MEM_DONE;
-			event->resp = resp;
-			debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
-					 event->context, event->resp);
-		}
-		event = event->_next;
+
+	while ((event = cmd->ready[MEM_IDLE]) != NULL) {
+		cmd_set_state(cmd, event, MEM_DONE);
+		event->resp = resp;
+		debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
+				 event->context, event->resp);
 	}
 }
 
@@ -175,25 +410,310 @@ static struct client *_get_client(struct cmd *cmd, struct cmd_event *event)
 	// Abort if client disconnected
 	if (cmd->client[event->context] == NULL) {
 		event->resp = PSL_RESPONSE_FAILED;
-		event->state = MEM_DONE;
+		cmd_set_state(cmd, event, MEM_DONE);
 		debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
 				 event->context, event->resp);
 	}
 	return cmd->client[event->context];
 }
 
+static void _mem_return(struct cmd *cmd, struct cmd_event *event, int fd,
+			uint8_t * direct);
+
+// Move data straight between event and the memory of a client on this host.
+// Returns -1 to fall back to the socket, which is also how bad addresses are
+// reported to the application.  DMA writes stay on the socket as their
+// acknowledgement has to follow the sent utag status.
+static int _mem_direct(struct cmd *cmd, struct client *client,
+		       struct cmd_event *event, uint8_t type)
+{
+	uint8_t data[MAX_LINE_CHARS];
+	uint8_t *buffer;
+	uint64_t addr;
+	uint32_t size;
+	int write;
+
+	if (client->pid == 0)
+		return -1;
+	addr = event->addr;
+	buffer = data;
+	write = 0;
+	switch (type) {
+	case PSLSE_MEMORY_READ:
+		size = event->size;
+		break;
+	case PSLSE_MEMORY_WRITE:
+		size = event->size;
+		buffer = &(event->data[addr & ~CACHELINE_MASK]);
+		write = 1;
+		break;
+	case PSLSE_MEMORY_TOUCH:
+		addr &= CACHELINE_MASK;
+		size = 1;
+		break;
+#ifdef PSL9
+	case PSLSE_DMA0_RD:
+		size = event->dsize;
+		break;
+#endif /* ifdef PSL9 */
+	default:
+		return -1;
+	}
+	if ((size > MAX_LINE_CHARS) ||
+	    (client_mem_copy(client, addr, buffer, size, write) < 0))
+		return -1;
+	_mem_return(cmd, event, -1, (buffer == data) ? data : NULL);
+	return 0;
+}
+
+// Drop any lines libcxl sent ahead that an AFU write to client memory is
+// changing.  Done when the write is sent and again when it is acknowledged,
+// as lines libcxl sent before it saw the write hold the old data.
+static void _prefetch_invalidate(struct client *client,
+				 struct cmd_event *event)
+{
+	switch (event->type) {
+	case CMD_WRITE:
+#if defined PSL9 || defined PSL9lite
+	case CMD_CAS_4B:
+	case CMD_CAS_8B:
+#endif
+		client_prefetch_invalidate(client, event->addr, event->size);
+		break;
+#ifdef PSL9
+	case CMD_DMA_WR:
+	case CMD_DMA_WR_AMO:
+		client_prefetch_invalidate(client, event->addr, event->dsize);
+		break;
+#endif /* ifdef PSL9 */
+	default:
+		break;
+	}
+}
+
+static void _mem_request(struct cmd *cmd, struct client *client,
+			 struct cmd_event *event, uint8_t * buffer, int size);
+
+// Send the writes held in a combine slot to client as one write.  The
+// client's acknowledgement of the first write on the chain answers them all.
+static void _combine_flush(struct cmd *cmd, struct client *client,
+			   struct write_combine *combine)
+{
+	uint8_t buffer[CLIENT_COMBINE_BYTES + 13];
+	struct cmd_event *event;
+	uint64_t addr;
+	uint16_t size;
+
+	event = (struct cmd_event *)combine->first;
+	if (event == NULL)
+		return;
+	combine->first = NULL;
+	combine->last = NULL;
+	client->combining--;
+	size = combine->hi - combine->lo;
+	debug_msg("%s:MEMORY WRITE COMBINED tag=0x%02x size=%d addr=0x%016"PRIx64,
+		  cmd->afu_name, event->tag, size, combine->base + combine->lo);
+	buffer[0] = (uint8_t) PSLSE_MEMORY_WRITE_COMBINED;
+	memcpy(&(buffer[13]), &(combine->data[combine->lo]), size);
+	addr = htonll(combine->base + combine->lo);
+	memcpy(&(buffer[5]), &addr, sizeof(addr));
+	size = htons(size);
+	memcpy(&(buffer[3]), &size, sizeof(size));
+	_mem_request(cmd, client, event, buffer,
+		     combine->hi - combine->lo + 13);
+}
+
+// Send every write held back for client
+void cmd_flush_writes(struct cmd *cmd, struct client *client)
+{
+	int i;
+
+	if ((cmd == NULL) || (client == NULL))
+		return;
+	for (i = 0; client->combining && (i < CLIENT_COMBINE_SLOTS); i++)
+		_combine_flush(cmd, client, &(client->combine[i]));
+}
+
+// Send the writes held back for client that a request of type has to follow.
+// A read only follows writes to the line it reads.  Anything else besides the
+// touch ahead of a write, such as a fence, a CAS or a write that can't be
+// combined, follows all of them.
+static void _combine_order(struct cmd *cmd, struct client *client,
+			   struct cmd_event *event, uint8_t type)
+{
+	struct write_combine *combine;
+	uint64_t line;
+	int i;
+
+	if ((client->combining == 0) ||
+	    (type == PSLSE_MEMORY_WRITE_COMBINED) ||
+	    ((type == PSLSE_MEMORY_TOUCH) && (event->type == CMD_WRITE)))
+		return;
+	if ((type != PSLSE_MEMORY_READ) || (event->type != CMD_READ)) {
+		cmd_flush_writes(cmd, client);
+		return;
+	}
+	line = event->addr & CACHELINE_MASK;
+	for (i = 0; i < CLIENT_COMBINE_SLOTS; i++) {
+		combine = &(client->combine[i]);
+		if ((combine->first != NULL) &&
+		    (line < combine->base + combine->hi) &&
+		    (line + CACHELINE_BYTES > combine->base + combine->lo))
+			_combine_flush(cmd, client, combine);
+	}
+}
+
+// Hold write event back to go to client with the writes next to it.  Each
+// combine slot gathers one unbroken range of an aligned block, a write to
+// another block takes a free slot or the one held longest.  Returns -1 if
+// event has to be sent on its own.
+static int _combine_write(struct cmd *cmd, struct client *client,
+			  struct cmd_event *event)
+{
+	struct write_combine *combine, *slot;
+	uint64_t base;
+	uint16_t lo, hi;
+	int i;
+
+	if ((cmd->parms->write_combine == 0) || (client->pid != 0) ||
+	    (event->type != CMD_WRITE) || event->unlock)
+		return -1;
+	base = event->addr & ~((uint64_t) CLIENT_COMBINE_BYTES - 1);
+	lo = event->addr - base;
+	hi = lo + event->size;
+	slot = &(client->combine[0]);
+	for (i = 0; i < CLIENT_COMBINE_SLOTS; i++) {
+		combine = &(client->combine[i]);
+		if ((combine->first != NULL) && (combine->base == base)) {
+			slot = combine;
+			break;
+		}
+		if ((slot->first != NULL) && ((combine->first == NULL) ||
+					      (combine->cycles < slot->cycles)))
+			slot = combine;
+	}
+	cmd_set_state(cmd, event, MEM_REQUEST);
+	event->abort = &(client->abort);
+	_prefetch_invalidate(client, event);
+
+	// Writes that would leave a gap go out first
+	if ((slot->first != NULL) &&
+	    ((slot->base != base) || (hi < slot->lo) || (lo > slot->hi)))
+		_combine_flush(cmd, client, slot);
+	if (slot->first == NULL) {
+		slot->first = event;
+		slot->base = base;
+		slot->lo = lo;
+		slot->hi = hi;
+		slot->cycles = cmd->parms->write_combine;
+		client->combining++;
+	} else {
+		((struct cmd_event *)slot->last)->_combine = event;
+		if (lo < slot->lo)
+			slot->lo = lo;
+		if (hi > slot->hi)
+			slot->hi = hi;
+	}
+	slot->last = event;
+	memcpy(&(slot->data[lo]), &(event->data[event->addr & ~CACHELINE_MASK]),
+	       event->size);
+
+	// Nothing more can join a full block
+	if ((slot->lo == 0) && (slot->hi == CLIENT_COMBINE_BYTES))
+		_combine_flush(cmd, client, slot);
+	return 0;
+}
+
+// Is a write from context on its way to the combine slots?
+static int _combine_pending(struct cmd *cmd, int context)
+{
+	static const enum mem_state states[] = {
+		MEM_IDLE, MEM_TOUCH, MEM_TOUCHED, MEM_BUFFER, MEM_RECEIVED
+	};
+	struct cmd_event *event;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(states) / sizeof(states[0]); i++) {
+		event = _first(cmd, states[i], CMD_MASK(CMD_WRITE));
+		for (; event != NULL; event = event->_ready_next) {
+			if ((event->type == CMD_WRITE) &&
+			    (event->context == context))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+// Send the writes held back for each client once no more writes from it are
+// on their way, as an AFU that waits for their responses would otherwise
+// stall, or once they have been held for the cycle budget
+static void _combine_age(struct cmd *cmd)
+{
+	struct write_combine *combine;
+	struct client *client;
+	int i, j;
+
+	if ((cmd->parms->write_combine == 0) || (cmd->client == NULL))
+		return;
+	for (i = 0; i < cmd->max_clients; i++) {
+		client = cmd->client[i];
+		if ((client == NULL) || (client->combining == 0))
+			continue;
+		if (!_combine_pending(cmd, i)) {
+			cmd_flush_writes(cmd, client);
+			continue;
+		}
+		for (j = 0; j < CLIENT_COMBINE_SLOTS; j++) {
+			combine = &(client->combine[j]);
+			if ((combine->first != NULL) && (--combine->cycles <= 0))
+				_combine_flush(cmd, client, combine);
+		}
+	}
+}
+
+// Send memory request in buffer to client.  The request id the client
+// acknowledges it with goes in the two bytes after the request type.
+static void _mem_request(struct cmd *cmd, struct client *client,
+			 struct cmd_event *event, uint8_t * buffer, int size)
+{
+	uint8_t data[CACHELINE_BYTES];
+	uint16_t id;
+
+	_combine_order(cmd, client, event, buffer[0]);
+
+	// Reads of lines libcxl already sent ahead need no round trip
+	if ((buffer[0] == PSLSE_MEMORY_READ) && (event->type == CMD_READ) &&
+	    (client_prefetch_read(client, event->addr, data, event->size) ==
+	     0)) {
+		debug_msg("%s:MEMORY PREFETCHED tag=0x%02x addr=0x%016"PRIx64,
+			  cmd->afu_name, event->tag, event->addr);
+		_mem_return(cmd, event, -1, data);
+		return;
+	}
+	_prefetch_invalidate(client, event);
+	if (_mem_direct(cmd, client, event, buffer[0]) == 0)
+		return;
+	id = htons((uint16_t) client_mem_request(client, event));
+	memcpy(&(buffer[1]), &id, sizeof(id));
+	event->abort = &(client->abort);
+	if (put_bytes(client->fd, size, buffer, cmd->dbg_fp, cmd->dbg_id,
+		      event->context) < 0) {
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+	}
+}
+
 // Add new command to list
 static void _add_cmd(struct cmd *cmd, uint32_t context, uint32_t tag,
 		     uint32_t command, uint32_t abort, enum cmd_type type,
 		     uint64_t addr, uint32_t size, enum mem_state state,
 		     uint32_t resp, uint8_t unlock)
 {
-	struct cmd_event **head;
 	struct cmd_event *event;
 
 	if (cmd == NULL)
 		return;
-	event = (struct cmd_event *)calloc(1, sizeof(struct cmd_event));
+	event = _alloc_event(cmd);
+	event->seq = ++cmd->seq;
 	event->context = context;
 	event->command = command;
 	event->tag = tag;
@@ -212,31 +732,30 @@ static void _add_cmd(struct cmd *cmd, uint32_t context, uint32_t tag,
 #endif
 	event->unlock = unlock;
 #ifdef PSL9
-	// make sure data buffer is big enough to hold 512B (MAX DMA xfer)
-	event->data = (uint8_t *) malloc(CACHELINE_BYTES * 4);
-	memset(event->data, 0xFF, CACHELINE_BYTES * 4);
 	event->cpl_xfers_to_go = 0;  //init this to 0 (used for DMA read multi completion flow)
 	event->itag = 0;  //init this to 0 (used for DMA read /write ops )
-#else
-	event->data = (uint8_t *) malloc(CACHELINE_BYTES);
-	memset(event->data, 0xFF, CACHELINE_BYTES);
 #endif /* ifdef PSL9 */
-	event->parity = (uint8_t *) malloc(DWORDS_PER_CACHELINE / 8);
-	memset(event->parity, 0xFF, DWORDS_PER_CACHELINE / 8);
+
+	// Track event by tag and state, handlers will randomly select from
+	// the ready queues
+	event->_next = cmd->list;
+	if (cmd->list != NULL)
+		cmd->list->_prev = event;
+	cmd->list = event;
+	_enqueue(cmd, event);
+	if (tag < CMD_TAGS)
+		cmd->tag[tag] = event;
+	if ((cmd->pending != NULL) && (context < cmd->max_clients))
+		cmd->pending[context]++;
 
 	// Test for client disconnect
 	if (_get_client(cmd, event) == NULL) {
 		event->resp = PSL_RESPONSE_FAILED;
-		event->state = MEM_DONE;
+		cmd_set_state(cmd, event, MEM_DONE);
 	}
-
-	head = &(cmd->list);
-	while ((*head != NULL) && !allow_reorder(cmd->parms))
-		head = &((*head)->_next);
-	event->_next = *head;
-	*head = event;
 	debug_msg("_add_cmd:created cmd_event @ 0x%016"PRIx64":command=0x%02x, type=0x%02x, tag=0x%02x, state=0x%03x", event, event->command, event->type, event->tag, event-> state );
-	debug_cmd_add(cmd->dbg_fp, cmd->dbg_id, tag, context, command);
+	debug_cmd_add(cmd->dbg_fp, cmd->dbg_id, tag, context, command,
+		      size);
 }
 
 // Format and add interrupt to command list
@@ -245,11 +764,13 @@ static void _add_interrupt(struct cmd *cmd, uint32_t handle, uint32_t tag,
 {
 	uint32_t resp = PSL_RESPONSE_DONE;
 	enum cmd_type type = CMD_INTERRUPT;
+	enum mem_state state = MEM_IDLE;
 
 	if (!irq || (irq > cmd->client[handle]->max_irqs)) {
 		warn_msg("AFU issued interrupt with illegal source id");
 		resp = PSL_RESPONSE_FAILED;
 		type = CMD_OTHER;
+		state = MEM_DONE;
 		goto int_done;
 	}
 	// Only track first interrupt until software reads event
@@ -257,7 +778,7 @@ static void _add_interrupt(struct cmd *cmd, uint32_t handle, uint32_t tag,
 		cmd->irq = irq;
  int_done:
 	_add_cmd(cmd, handle, tag, command, abort, type, (uint64_t) irq, 0,
-		 MEM_IDLE, resp, 0);
+		 state, resp, 0);
 }
 
 // Format and add misc. command to list
@@ -587,7 +1108,6 @@ static void _cmd_parity_error(const char *msg, uint64_t value, uint8_t parity)
 // See if a command was sent by AFU and process if so
 void handle_cmd(struct cmd *cmd, uint32_t parity_enabled, uint32_t latency)
 {
-	struct cmd_event *event;
 	uint64_t address, address_parity;
 #if defined PSL9 || defined PSL9lite
 	uint32_t command, command_parity, tag, tag_parity, size, abort, handle, cpagesize;
@@ -679,13 +1199,9 @@ void handle_cmd(struct cmd *cmd, uint32_t parity_enabled, uint32_t latency)
 		return;
 	}
 	// Check for duplicate tag
-	event = cmd->list;
-	while (event != NULL) {
-		if (event->tag == tag) {
-			error_msg("Duplicate tag 0x%02x", tag);
-			return;
-		}
-		event = event->_next;
+	if ((tag < CMD_TAGS) && (cmd->tag[tag] != NULL)) {
+		error_msg("Duplicate tag 0x%02x", tag);
+		return;
 	}
 	// Parse command
 	_parse_cmd(cmd, command, tag, address, size, abort, handle, latency);
@@ -698,7 +1214,7 @@ void handle_buffer_write(struct cmd *cmd)
 {
 	struct cmd_event *event;
 	struct client *client;
-	uint8_t buffer[10];
+	uint8_t buffer[12];
 	uint64_t *addr;
 	int quadrant, byte;
 
@@ -706,25 +1222,18 @@ void handle_buffer_write(struct cmd *cmd)
 	if (cmd == NULL)
 		return;
 
-	// Randomly select a pending read or read_pe (or none)
-	event = cmd->list;
-	while (event != NULL) {
-	        if (((event->type == CMD_READ) || (event->type == CMD_READ_PE) )&&
-		    (event->state != MEM_DONE) &&
-		    ((event->client_state != CLIENT_VALID) ||
-		     !allow_reorder(cmd->parms))) {
-			break;
-		}
+	// Randomly select a pending read or read_pe (or none), favoring
+	// reads that already have their data
+	event = _pick(cmd, MEM_RECEIVED,
+		      CMD_MASK(CMD_READ) | CMD_MASK(CMD_READ_PE));
 #if defined PSL9 || defined PSL9lite
-	        if (((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B) )&&
-		    (event->state == MEM_CAS_RD) &&
-		    ((event->client_state != CLIENT_VALID) ||
-		     !allow_reorder(cmd->parms))) {
-			break;
-		}
+	if (event == NULL)
+		event = _pick(cmd, MEM_CAS_RD,
+			      CMD_MASK(CMD_CAS_4B) | CMD_MASK(CMD_CAS_8B));
 #endif
-		event = event->_next;
-	}
+	if (event == NULL)
+		event = _pick(cmd, MEM_IDLE,
+			      CMD_MASK(CMD_READ) | CMD_MASK(CMD_READ_PE));
 
 	// Test for client disconnect
 	if ((event == NULL) || ((client = _get_client(cmd, event)) == NULL))
@@ -752,7 +1261,7 @@ void handle_buffer_write(struct cmd *cmd)
 				DPRINTF("\n");
 			}
 			event->resp = PSL_RESPONSE_DONE;
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 			debug_cmd_buffer_write(cmd->dbg_fp, cmd->dbg_id,
 					       event->tag);
 			debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
@@ -762,20 +1271,16 @@ void handle_buffer_write(struct cmd *cmd)
 
 #if defined PSL9 || defined PSL9lite
 
-                if (event->state == MEM_CAS_RD) {
+                if ((event->state == MEM_CAS_RD) &&
+		    (client->mem_pending < CLIENT_MEM_REQUESTS)) {
 		  buffer[0] = (uint8_t) PSLSE_MEMORY_READ;
-		  buffer[1] = (uint8_t) event->size;
-		  addr = (uint64_t *) & (buffer[2]);
+		  buffer[3] = (uint8_t) event->size;
+		  addr = (uint64_t *) & (buffer[4]);
 		  *addr = htonll(event->addr);
-		  event->abort = &(client->abort);
 		  debug_msg("%s:MEMORY READ FOR CAS tag=0x%02x size=%d addr=0x%016"PRIx64,
 			    cmd->afu_name, event->tag, event->size, event->addr);
-		  if (put_bytes(client->fd, 10, buffer, cmd->dbg_fp,
-				cmd->dbg_id, event->context) < 0) {
-		    client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-		  }
-		  event->state = MEM_REQUEST;
-		  client->mem_access = (void *)event;
+		  cmd_set_state(cmd, event, MEM_REQUEST);
+		  _mem_request(cmd, client, event, buffer, 12);
 		  return; //exit immediately
 		}
 
@@ -790,31 +1295,26 @@ void handle_buffer_write(struct cmd *cmd)
 		psl_buffer_write(cmd->afu_event, event->tag, event->addr,
 				 CACHELINE_BYTES, event->data, event->parity);
 		event->buffer_activity = 1;
-	} else if (client->mem_access == NULL) {
+	} else if (client->mem_pending < CLIENT_MEM_REQUESTS) {
 	        // if read:
-		// Send read request to client, set client->mem_access
-		// to point to this event blocking any other memory
-		// accesses to client until data is returned by call
-		// to the _handle_mem_read() function.
+		// Send read request to client, the request id in
+		// client->mem_access finds this event again when data
+		// is returned by call to the _handle_mem_read() function.
+		// Other memory accesses to the client carry on meanwhile.
 	        // if read_pe:
 		// build data and parity to represent pe
 	        // set event->state to mem_received
                 if (event->type == CMD_READ) {
 		  buffer[0] = (uint8_t) PSLSE_MEMORY_READ;
-		  buffer[1] = (uint8_t) event->size;
-		  addr = (uint64_t *) & (buffer[2]);
+		  buffer[3] = (uint8_t) event->size;
+		  addr = (uint64_t *) & (buffer[4]);
 		  *addr = htonll(event->addr);
-		  event->abort = &(client->abort);
 		  debug_msg("%s:MEMORY READ tag=0x%02x size=%d addr=0x%016"PRIx64,
 			    cmd->afu_name, event->tag, event->size, event->addr);
-		  if (put_bytes(client->fd, 10, buffer, cmd->dbg_fp,
-				cmd->dbg_id, event->context) < 0) {
-		    client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-		  }
-		  event->state = MEM_REQUEST;
+		  cmd_set_state(cmd, event, MEM_REQUEST);
 		  debug_cmd_client(cmd->dbg_fp, cmd->dbg_id, event->tag,
 				   event->context);
-		  client->mem_access = (void *)event;
+		  _mem_request(cmd, client, event, buffer, 12);
 		}
                 if (event->type == CMD_READ_PE) {
 		  // init data
@@ -825,7 +1325,7 @@ void handle_buffer_write(struct cmd *cmd)
 		  // event->data[116:123] is wed portion
 		  memcpy((void *)&(event->data[116]),(void *)&(client->wed), 8);
 		  generate_cl_parity(event->data, event->parity);
-		  event->state = MEM_RECEIVED;
+		  cmd_set_state(cmd, event, MEM_RECEIVED);
 		  debug_msg("%s:PROCESS ELEMENT READ tag=0x%02x handle=%d",
 			    cmd->afu_name, event->tag, event->context);
 		}
@@ -837,46 +1337,34 @@ void handle_buffer_read(struct cmd *cmd)
 {
 	struct cmd_event *event;
 
-	// Check that cmd struct is valid buffer read is available
-	if ((cmd == NULL) || (cmd->buffer_read != NULL))
+	// Check that cmd struct is valid and a buffer read is available
+	if ((cmd == NULL) || (cmd->buffer_reads >= cmd->parms->buffer_reads))
 		return;
 
 	// Randomly select a pending write (or none)
-	event = cmd->list;
-	while (event != NULL) {
-		if ((event->type == CMD_WRITE) &&
-		    (event->state == MEM_TOUCHED) &&
-		    ((event->client_state != CLIENT_VALID) ||
-		     !allow_reorder(cmd->parms))) {
-			break;
-		}
+	event = _pick(cmd, MEM_TOUCHED, CMD_MASK(CMD_WRITE));
 #if defined PSL9 || defined PSL9lite
-		//Randomly select a pending CAS (or none)
-		if (((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B)) &&
-		    (event->state == MEM_IDLE) &&
-		    ((event->client_state != CLIENT_VALID) ||
-		     !allow_reorder(cmd->parms))) {
-			//printf("sending buffer read request for CAS smd \n");
-			break;
-		}
+	//Randomly select a pending CAS (or none)
+	if (event == NULL)
+		event = _pick(cmd, MEM_IDLE,
+			      CMD_MASK(CMD_CAS_4B) | CMD_MASK(CMD_CAS_8B));
 #endif
-		event = event->_next;
-	}
 
 	// Test for client disconnect
 	if ((event == NULL) || (_get_client(cmd, event) == NULL))
 		return;
 
-	// Send buffer read request to AFU.  Setting cmd->buffer_read
-	// will block any more buffer read requests until buffer read
-	// data is returned and handled in handle_buffer_data().
+	// Send buffer read request to AFU.  Up to parms->buffer_reads
+	// requests wait on cmd->buffer_read until their buffer read data
+	// is returned and handled in handle_buffer_data().
 	debug_msg("%s:BUFFER READ tag=0x%02x addr=0x%016"PRIx64, cmd->afu_name,
 		  event->tag, event->addr);
 	if (psl_buffer_read(cmd->afu_event, event->tag, event->addr,
 			    CACHELINE_BYTES) == PSL_SUCCESS) {
-		cmd->buffer_read = event;
+		cmd->buffer_read[cmd->buffer_reads++] = event;
+		event->buffer_read = 1;
 		debug_cmd_buffer_read(cmd->dbg_fp, cmd->dbg_id, event->tag);
-		event->state = MEM_BUFFER;
+		cmd_set_state(cmd, event, MEM_BUFFER);
 	}
 }
 
@@ -911,23 +1399,18 @@ void handle_dma0_write(struct cmd *cmd)
 
 
 	// Send any ready write data to client immediately
-	event = cmd->list;
-	while (event != NULL) {
-		if (((event->type == CMD_DMA_WR) || (event->type == CMD_DMA_WR_AMO)) &&
-		    (event->state == DMA_OP_REQ))
-			break;
-	if ((event->type == CMD_DMA_WR_AMO) && (event->state == DMA_MEM_RESP))
- 			goto amo_wb;
-
-		event = event->_next;
-	}
+	event = _first(cmd, DMA_OP_REQ,
+		       CMD_MASK(CMD_DMA_WR) | CMD_MASK(CMD_DMA_WR_AMO));
+	if ((event == NULL) &&
+	    ((event = _first(cmd, DMA_MEM_RESP, CMD_MASK(CMD_DMA_WR_AMO))) != NULL))
+		goto amo_wb;
 
 	// Test for client disconnect or nothing to do....
 	if ((event == NULL) || ((client = _get_client(cmd, event)) == NULL))
 		return;
 	// Check that memory request can be driven to client 
-	if (client->mem_access != NULL) {
-		debug_msg("client->mem_access NOT NULL so can't send DMA write for itag=0x%x yet!!!!!", event->itag);
+	if (client->mem_pending >= CLIENT_MEM_REQUESTS) {
+		debug_msg("client->mem_access full so can't send DMA write for itag=0x%x yet!!!!!", event->itag);
 		return;
 	}
 	// check to make sure transaction will stay within a 4K boundary
@@ -944,41 +1427,33 @@ void handle_dma0_write(struct cmd *cmd)
 	// confirmation from the client that the memory write was
 	// successful before generating a response.
 	if (event->type == CMD_DMA_WR) {
-		buffer = (uint8_t *) malloc(event->dsize + 11);
+		buffer = (uint8_t *) malloc(event->dsize + 13);
 		buffer[0] = (uint8_t) PSLSE_DMA0_WR;
-		buffer[1] = (uint8_t) ((event->dsize & 0x0F00) >>8);
-		buffer[2] = (uint8_t) (event->dsize & 0xFF);
-		addr = (uint64_t *) & (buffer[3]);
+		buffer[3] = (uint8_t) ((event->dsize & 0x0F00) >>8);
+		buffer[4] = (uint8_t) (event->dsize & 0xFF);
+		addr = (uint64_t *) & (buffer[5]);
 		*addr = htonll(event->addr);
-		memcpy(&(buffer[11]), &(event->data[0]), event->dsize);
-		event->abort = &(client->abort);
+		memcpy(&(buffer[13]), &(event->data[0]), event->dsize);
 		debug_msg("%s:DMA0 MEMORY WRITE utag=0x%02x size=%d addr=0x%016"PRIx64" port=0x%2x",
 		  	cmd->afu_name, event->utag, event->dsize, event->addr, client->fd);
-		if (put_bytes(client->fd, event->dsize + 11, buffer, cmd->dbg_fp,
-		      cmd->dbg_id, client->context) < 0) {
-			client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-		}
+		_mem_request(cmd, client, event, buffer, event->dsize + 13);
 	} else { // event->type == CMD_DMA_WR_AMO
-		buffer = (uint8_t *) malloc(27);
+		buffer = (uint8_t *) malloc(29);
 		buffer[0] = (uint8_t) PSLSE_DMA0_WR_AMO;
-		buffer[1] = (uint8_t) event->dsize;
-		addr = (uint64_t *) & (buffer[2]);
+		buffer[3] = (uint8_t) event->dsize;
+		addr = (uint64_t *) & (buffer[4]);
 		*addr = htonll(event->addr);
-		buffer[10] = event->atomic_op;
-		memcpy(&(buffer[11]), &(event->data[0]), 16);
-		event->abort = &(client->abort);
+		buffer[12] = event->atomic_op;
+		memcpy(&(buffer[13]), &(event->data[0]), 16);
 		debug_msg("%s:DMA0 MEMORY WRITE for AMO utag=0x%02x size=%d addr=0x%016"PRIx64" port=0x%2x",
 		  	cmd->afu_name, event->utag, event->dsize, event->addr, client->fd);
-		if (put_bytes(client->fd, 27, buffer, cmd->dbg_fp,
-		      cmd->dbg_id, client->context) < 0) {
-			client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-		}
+		_mem_request(cmd, client, event, buffer, 29);
 	}
+	free(buffer);
 
 	// create a separate function to do the sent utag status
-	event->state = DMA_SEND_STS;
-	client->mem_access = (void *)event;
-	debug_msg("Setting client->mem_access in dma0_write for write event @ 0x%016" PRIx64" itag=0x%x",
+	cmd_set_state(cmd, event, DMA_SEND_STS);
+	debug_msg("Added to client->mem_access in dma0_write for write event @ 0x%016" PRIx64" itag=0x%x",
 event, event->itag);
 	return;
 
@@ -1004,7 +1479,7 @@ debug_msg ("event->atomic_op = 0x%x ", event->atomic_op);
 			debug_msg("%s:DMA0 CPL BUS WRITE utag=0x%02x", cmd->afu_name,
 				  event->utag);
 			event->resp = PSL_RESPONSE_DONE;
-			event->state = DMA_CPL_SENT;
+			cmd_set_state(cmd, event, DMA_CPL_SENT);
 			//see if this fixes the core dumps
 			//event->state = MEM_DONE;
 			} else
@@ -1018,7 +1493,6 @@ debug_msg ("event->atomic_op = 0x%x ", event->atomic_op);
 // Send UTAG SENT via DMA port back to AFU
 void handle_dma0_sent_sts(struct cmd *cmd)
 {
-	struct cmd_event **head;
 	struct cmd_event *event;
 	struct client *client;
 
@@ -1027,14 +1501,8 @@ void handle_dma0_sent_sts(struct cmd *cmd)
 		return;
 
 	// look for any pending sent_utag_sts to send to AFU
-	head = &cmd->list;
-	while (*head != NULL) {
-		if ((((*head)->type == CMD_DMA_WR) || ((*head)->type == CMD_DMA_WR_AMO)) &&
-		    ((*head)->state == DMA_SEND_STS))
-			break;
-		head = &((*head)->_next);
-	}
-	event = *head;
+	event = _first(cmd, DMA_SEND_STS,
+		       CMD_MASK(CMD_DMA_WR) | CMD_MASK(CMD_DMA_WR_AMO));
 
 	// Test for client disconnect or nothing to do....
 	if ((event == NULL) || ((client = _get_client(cmd, event)) == NULL))
@@ -1046,7 +1514,7 @@ void handle_dma0_sent_sts(struct cmd *cmd)
 		debug_msg("%s:DMA0 SENT UTAG STS, state now DMA_MEM_RESP FOR DMA_WR utag=0x%02x, itag=0x%02x",
 			 cmd->afu_name, event->utag, event->itag);
 		//state goes to MEM_DONE when Memory ACK is received back from client
-		event->state = DMA_MEM_RESP;
+		cmd_set_state(cmd, event, DMA_MEM_RESP);
 
 	} else
 		debug_msg("%s:DMA0 SENT UTAG STS not SENT, still DMA_SEND_STS FOR DMA_WR utag=0x%02x",
@@ -1059,7 +1527,7 @@ void handle_dma0_read(struct cmd *cmd)
 {
 	struct cmd_event *event;
 	struct client *client;
-	uint8_t buffer[10];
+	uint8_t buffer[13];
 	uint64_t *addr;
 	int quadrant, byte, not_128B_aligned;
 
@@ -1068,57 +1536,16 @@ void handle_dma0_read(struct cmd *cmd)
 		return;
 
 
-	// Randomly select a pending dma0 read (or none)
-	event = cmd->list;
-	while (event != NULL) {
-	        /* if ((event->type == CMD_DMA_RD) &&
-		    (event->state == DMA_CPL_PARTIAL) &&
-		    ((event->client_state != CLIENT_VALID) ||
-		     !allow_reorder(cmd->parms))) {
-			break;
-		} 
-	        if ((event->type == CMD_DMA_RD) &&
-		    ((event->state == DMA_CPL_PARTIAL) || (event->state == DMA_MEM_RESP)))
-		{  debug_msg("selected pending dma read for utag=0x%x", event->utag);
-			break;
-			} */
-		 if ((event->type == CMD_DMA_RD) && (event->bus_lock == 1))
-		{  debug_msg("selected bus locked in progress dma read for utag=0x%x and itag=0x%x", event->utag, event->itag);
-			break;
-		}
-		event = event->_next;
-	}
-	if (event == NULL) {
-		//printf("in handle_dma0_read and bus is free to use\n");
-		event = cmd->list;
-		while (event != NULL) {
-
-		 if ((event->type == CMD_DMA_RD) && (event->state == DMA_CPL_PARTIAL))
-		{  debug_msg("selected DMA_CPL_PARTIAL dma read for utag=0x%x and itag=0x%x", event->utag, event->itag);
-			break;
-		}
-		if ((event->type == CMD_DMA_RD) && (event->state == DMA_MEM_RESP))
-		{  debug_msg("selected DMA_MEM_RESP dma read for utag=0x%x and itag=0x%x", event->utag, event->itag);
-			break;
-		}
-
-
-	        /*if ((event->type == CMD_DMA_RD) &&
-		    (event->state != DMA_CPL_SENT) &&
-		    ((event->client_state != CLIENT_VALID) ||
-		     !allow_reorder(cmd->parms))) {
-			break;
-		}  */ 
-		
-		if ((event->type == CMD_DMA_RD) && (event->state == DMA_OP_REQ))
-		{  debug_msg("selected DMA_OP_REQ new dma read for utag=0x%x and itag=0x%x", event->utag, event->itag);
-			break;
-		}
-
-		event = event->_next;
-		}
-		//printf("in handle_dma0_read and nothing is ready ? \n");
-	}
+	// Select the dma0 read holding the completion bus, otherwise the
+	// oldest read with data to return or waiting to be sent (or none)
+	event = _first(cmd, DMA_CPL_PARTIAL, CMD_MASK(CMD_DMA_RD));
+	if (event == NULL)
+		event = _first(cmd, DMA_MEM_RESP, CMD_MASK(CMD_DMA_RD));
+	if (event == NULL)
+		event = _first(cmd, DMA_OP_REQ, CMD_MASK(CMD_DMA_RD));
+	if (event != NULL)
+		debug_msg("selected dma read in state 0x%x for utag=0x%x and itag=0x%x",
+			  event->state, event->utag, event->itag);
 
 	// Test for client disconnect
 	if ((event == NULL) || ((client = _get_client(cmd, event)) == NULL))
@@ -1178,14 +1605,14 @@ void handle_dma0_read(struct cmd *cmd)
 					event->cpl_size = 256;
 				     else
 					event->cpl_size = 128;
-				event->state = DMA_CPL_PARTIAL;
+				cmd_set_state(cmd, event, DMA_CPL_PARTIAL);
 				debug_msg( "%s:DMA0: AFTER NON_128B ALIGNED BUS WRITE: next cpl_size=0x%04x cpl_byte_count= 0x%4x laddr = 0x%8x",
 							   cmd->afu_name, event->cpl_size,event->cpl_byte_count, event->cpl_laddr );
 				not_128B_aligned = 0;
 				event->bus_lock = 1;
 			} else if (event->cpl_byte_count <= 128) { // Single cycle single completion flow
 					event->resp = PSL_RESPONSE_DONE;
-					event->state = MEM_DONE;
+					cmd_set_state(cmd, event, MEM_DONE);
 					event->cpl_xfers_to_go = 0; // Make sure this is cleared at end of xfer
 					event->bus_lock = 0;
 					debug_msg("%s:DMAO CPL BUS_WRITE FINISHED for utag=0x%x cpl_byte_cnt=0x%x cpl_size=0x%x addr=0xx%016"PRIx64, 
@@ -1201,7 +1628,7 @@ void handle_dma0_read(struct cmd *cmd)
 						event->cpl_laddr += 128; }
 					event->data_offset += 128;
 					// laddr gets incremented after type 1 xfer for bc >= 256
-					event->state = DMA_CPL_PARTIAL;
+					cmd_set_state(cmd, event, DMA_CPL_PARTIAL);
 					event->bus_lock = 1;
 					}
 		} else  {  // cpl_xfers_to_go = 1; type 1 pass thru and cpl_size always 128
@@ -1225,7 +1652,7 @@ void handle_dma0_read(struct cmd *cmd)
 				}
 				if (event->cpl_byte_count == event->cpl_size) {  //this was last transfer
 					event->resp = PSL_RESPONSE_DONE;
-					event->state = MEM_DONE;
+					cmd_set_state(cmd, event, MEM_DONE);
 					event->bus_lock = 0;
 					event->cpl_xfers_to_go = 0; // Make sure to clear this at end of transfer
 					debug_msg("%s:DMAO CPL BUS_WRITE FINISHED for utag=0x%x cpl_byte_cnt=0x%x cpl_size=0x%x addr=0xx%016"PRIx64, 
@@ -1249,41 +1676,33 @@ void handle_dma0_read(struct cmd *cmd)
 	if (event->state != DMA_OP_REQ)
 		return;
 
-	if (client->mem_access == NULL) {
+	if (client->mem_pending < CLIENT_MEM_REQUESTS) {
 	        // if read:
-		// Send read request to client, set client->mem_access
-		// to point to this event blocking any other memory
-		// accesses to client until data is returned by call
-		// to the _handle_mem_read() function.
-                if (event->type == CMD_DMA_RD) {
+		// Send read request to client, the request id in
+		// client->mem_access finds this event again when data
+		// is returned by call to the _handle_mem_read() function.
+		// UTAG SENT goes to the AFU first so the request is only
+		// sent to the client once.
+                if ((event->type == CMD_DMA_RD) &&
+		    (psl_dma0_sent_utag(cmd->afu_event, event->utag,
+					event->sent_sts) == PSL_SUCCESS)) {
+		  debug_msg("%s:DMA0 SENT UTAG STS, state now DMA_MEM_REQ FOR DMA_RD utag=0x%02x", cmd->afu_name,
+			    event->utag);
 		  buffer[0] = (uint8_t) PSLSE_DMA0_RD;
-		  buffer[1] = (uint8_t) ((event->dsize & 0x0F00) >>8);
-		  buffer[2] = (uint8_t) (event->dsize & 0xFF);
-		 // buffer[1] = (uint8_t) event->dsize;
-		  addr = (uint64_t *) & (buffer[3]);
+		  buffer[3] = (uint8_t) ((event->dsize & 0x0F00) >>8);
+		  buffer[4] = (uint8_t) (event->dsize & 0xFF);
+		  addr = (uint64_t *) & (buffer[5]);
 		  *addr = htonll(event->addr);
-		  event->abort = &(client->abort);
 		  debug_msg("%s:DMA0 MEMORY READ utag=0x%02x size=%d addr=0x%016"PRIx64" port = 0x%2x",
 			    cmd->afu_name, event->utag, event->dsize, event->addr, client->fd);
-		  if (put_bytes(client->fd, 11, buffer, cmd->dbg_fp,
-				cmd->dbg_id, event->context) < 0) {
-		    client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-		  }
-		// Now need to send UTAG SENT via DMA port back to AFU
-	if (psl_dma0_sent_utag(cmd->afu_event, event->utag, event->sent_sts)
-				      == PSL_SUCCESS) {
-			debug_msg("%s:DMA0 SENT UTAG STS, state now DMA_MEM_REQ FOR DMA_RD utag=0x%02x", cmd->afu_name,
-				  event->utag);
-
-		  event->state = DMA_MEM_REQ;
+		  cmd_set_state(cmd, event, DMA_MEM_REQ);
+		  _mem_request(cmd, client, event, buffer, 13);
 		 // debug_cmd_client(cmd->dbg_fp, cmd->dbg_id, event->tag,
 		//		   event->context);
-		  client->mem_access = (void *)event;
-		  debug_msg("Setting client->mem_access for dma read for event @ 0x%016" PRIx64 "tag=0x%x", event, event->itag);
-                    }
+		  debug_msg("Added to client->mem_access for dma read for event @ 0x%016" PRIx64 "tag=0x%x", event, event->itag);
 		}
  	} else
-		debug_msg("client->mem_access NOT NULL so can't init DMA0 MEMORY READ for utag=0x%x itag=0x%x", event->utag, event->itag);
+		debug_msg("client->mem_access full so can't init DMA0 MEMORY READ for utag=0x%x itag=0x%x", event->utag, event->itag);
 }
 
 
@@ -1293,7 +1712,7 @@ void handle_touch(struct cmd *cmd)
 {
 	struct cmd_event *event;
 	struct client *client;
-	uint8_t buffer[10];
+	uint8_t buffer[12];
 	uint64_t *addr;
 
 	// Make sure cmd structure is valid
@@ -1301,55 +1720,36 @@ void handle_touch(struct cmd *cmd)
 		return;
 
 	// Randomly select a pending touch (or none)
-	event = cmd->list;
-	while (event != NULL) {
+	event = _pick(cmd, MEM_IDLE,
 #ifdef PSL9
-		if (((event->type == CMD_XLAT_RD_TOUCH) || (event->type == CMD_XLAT_WR_TOUCH))
-		    && (event->state == MEM_IDLE)
-		    && ((event->client_state != CLIENT_VALID)
-			|| !allow_reorder(cmd->parms))) {
-			break;
-		}
-
+		      CMD_MASK(CMD_XLAT_RD_TOUCH) |
+		      CMD_MASK(CMD_XLAT_WR_TOUCH) |
 #endif /* ifdef PSL9 */
-		if (((event->type == CMD_TOUCH) || (event->type == CMD_WRITE))
-		    && (event->state == MEM_IDLE)
-		    && ((event->client_state != CLIENT_VALID)
-			|| !allow_reorder(cmd->parms))) {
-			break;
-		}
-		event = event->_next;
-	}
+		      CMD_MASK(CMD_TOUCH) | CMD_MASK(CMD_WRITE));
 
 	// Test for client disconnect
 	if ((event == NULL) || ((client = _get_client(cmd, event)) == NULL))
 		return;
 
 	// Check that memory request can be driven to client
-	if (client->mem_access != NULL)
+	if (client->mem_pending >= CLIENT_MEM_REQUESTS)
 		return;
 
 	// Send memory touch request to client
 	buffer[0] = (uint8_t) PSLSE_MEMORY_TOUCH;
-	buffer[1] = (uint8_t) event->size;
-	addr = (uint64_t *) & (buffer[2]);
+	buffer[3] = (uint8_t) event->size;
+	addr = (uint64_t *) & (buffer[4]);
 	*addr = htonll(event->addr & CACHELINE_MASK);
-	event->abort = &(client->abort);
 	debug_msg("%s:MEMORY TOUCH tag=0x%02x addr=0x%016"PRIx64, cmd->afu_name,
 		  event->tag, event->addr);
-	if (put_bytes(client->fd, 10, buffer, cmd->dbg_fp, cmd->dbg_id,
-		      event->context) < 0) {
-		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-	}
-	event->state = MEM_TOUCH;
-	client->mem_access = (void *)event;
+	cmd_set_state(cmd, event, MEM_TOUCH);
 	debug_cmd_client(cmd->dbg_fp, cmd->dbg_id, event->tag, event->context);
+	_mem_request(cmd, client, event, buffer, 12);
 }
 
 // Send pending interrupt to client as soon as possible
 void handle_interrupt(struct cmd *cmd)
 {
-	struct cmd_event **head;
 	struct cmd_event *event;
 	struct client *client;
 	uint16_t irq;
@@ -1360,20 +1760,14 @@ void handle_interrupt(struct cmd *cmd)
 		return;
 
 	// Send any interrupts to client immediately
-	head = &cmd->list;
-	while (*head != NULL) {
-		if (((*head)->type == CMD_INTERRUPT) &&
-		    ((*head)->state == MEM_IDLE))
-			break;
-		head = &((*head)->_next);
-	}
-	event = *head;
+	event = _first(cmd, MEM_IDLE, CMD_MASK(CMD_INTERRUPT));
 
 	// Test for client disconnect
 	if ((event == NULL) || ((client = _get_client(cmd, event)) == NULL))
 		return;
 
-	// Send interrupt to client
+	// Send interrupt to client after any writes held back for it
+	cmd_flush_writes(cmd, client);
 	buffer[0] = PSLSE_INTERRUPT;
 	irq = htons(event->addr);  // addr holds the irq during an intreq command
 	// irq = htons(cmd->irq);  // this was the old way and would essentially convert subsequent interrupt irqs to the first one
@@ -1385,7 +1779,7 @@ void handle_interrupt(struct cmd *cmd)
 		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
 	}
 	debug_cmd_client(cmd->dbg_fp, cmd->dbg_id, event->tag, event->context);
-	event->state = MEM_DONE;
+	cmd_set_state(cmd, event, MEM_DONE);
 }
 
 void handle_buffer_data(struct cmd *cmd, uint32_t parity_enable)
@@ -1396,11 +1790,19 @@ void handle_buffer_data(struct cmd *cmd, uint32_t parity_enable)
 	int quadrant, byte;
 
 	// Has struct been initialized?
-	if ((cmd == NULL) || (cmd->buffer_read == NULL))
+	if (cmd == NULL)
 		return;
 
 	// Check if buffer read data has returned from AFU
-	event = cmd->buffer_read;
+	if (!cmd->afu_event->buffer_rdata_valid)
+		return;
+	event = _buffer_read_match(cmd);
+	if (event == NULL) {
+		warn_msg("%s:Buffer read data tag=0x%02x without buffer read",
+			 cmd->afu_name, cmd->afu_event->buffer_rdata_tag);
+		cmd->afu_event->buffer_rdata_valid = 0;
+		return;
+	}
 	rc = psl_get_buffer_read_data(cmd->afu_event, event->data,
 				      event->parity);
 	if (rc == PSL_SUCCESS) {
@@ -1427,29 +1829,28 @@ void handle_buffer_data(struct cmd *cmd, uint32_t parity_enable)
 			free(parity_check);
 		}
 		// Free buffer interface for another event
-		cmd->buffer_read = NULL;
+		_buffer_read_done(cmd, event);
 #if defined PSL9 || defined PSL9lite
 		if ((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B)) {
-			event->state = MEM_CAS_OP;
+			cmd_set_state(cmd, event, MEM_CAS_OP);
 			//printf("HANDLE_BUFFER_DATA read in op1/op2 \n");
 			return;
 		}
 #endif
 		// Randomly decide to not send data to client yet
 		if (!event->buffer_activity && allow_buffer(cmd->parms)) {
-			event->state = MEM_TOUCHED;
+			cmd_set_state(cmd, event, MEM_TOUCHED);
 			event->buffer_activity = 1;
 			return;
 		}
 
-		event->state = MEM_RECEIVED;
+		cmd_set_state(cmd, event, MEM_RECEIVED);
 	}
 
 }
 
 void handle_mem_write(struct cmd *cmd)
 {
-	struct cmd_event **head;
 	struct cmd_event *event;
 	struct client *client;
 	uint64_t *addr;
@@ -1460,77 +1861,84 @@ void handle_mem_write(struct cmd *cmd)
 	if (cmd == NULL)
 		return;
 
+	_combine_age(cmd);
+
 	// Send any ready write data to client immediately
-	head = &cmd->list;
-	while (*head != NULL) {
-		if (((*head)->type == CMD_WRITE) &&
-		    ((*head)->state == MEM_RECEIVED))
-			break;
+	event = _first(cmd, MEM_RECEIVED, CMD_MASK(CMD_WRITE));
 #if defined PSL9 || defined PSL9lite
-		if ((((*head)->type == CMD_CAS_4B) || ((*head)->type == CMD_CAS_8B)) &&
-		    ((*head)->state == MEM_CAS_WR))
-			break;
+	if (event == NULL)
+		event = _first(cmd, MEM_CAS_WR,
+			       CMD_MASK(CMD_CAS_4B) | CMD_MASK(CMD_CAS_8B));
 #endif
-		head = &((*head)->_next);
-	}
-	event = *head;
 
 	// Test for client disconnect
 	if ((event == NULL) || ((client = _get_client(cmd, event)) == NULL))
 		return;
 
 	// Check that memory request can be driven to client
-	if (client->mem_access != NULL)
+	if (client->mem_pending >= CLIENT_MEM_REQUESTS)
 		return;
 
+	// Hold write back if its neighbours can go with it
+	if (_combine_write(cmd, client, event) == 0) {
+		debug_msg("%s:MEMORY WRITE HELD tag=0x%02x size=%d addr=0x%016"
+			  PRIx64, cmd->afu_name, event->tag, event->size,
+			  event->addr);
+		debug_cmd_client(cmd->dbg_fp, cmd->dbg_id, event->tag,
+				 event->context);
+		return;
+	}
+
 	// Send data to client and clear event to allow
 	// the next buffer read to occur.  The request will now await
 	// confirmation from the client that the memory write was
 	// successful before generating a response.  The client
 	// response will cause a call to either handle_aerror() or
 	// handle_mem_return().
-	buffer = (uint8_t *) malloc(event->size + 10);
+	buffer = (uint8_t *) malloc(event->size + 12);
 	offset = event->addr & ~CACHELINE_MASK;
 	buffer[0] = (uint8_t) PSLSE_MEMORY_WRITE;
-	buffer[1] = (uint8_t) event->size;
-	addr = (uint64_t *) & (buffer[2]);
+	buffer[3] = (uint8_t) event->size;
+	addr = (uint64_t *) & (buffer[4]);
 	*addr = htonll(event->addr);
-	memcpy(&(buffer[10]), &(event->data[offset]), event->size);
-	event->abort = &(client->abort);
+	memcpy(&(buffer[12]), &(event->data[offset]), event->size);
 	debug_msg("%s:MEMORY WRITE tag=0x%02x size=%d addr=0x%016"PRIx64,
 		  cmd->afu_name, event->tag, event->size, event->addr);
-	if (put_bytes(client->fd, event->size + 10, buffer, cmd->dbg_fp,
-		      cmd->dbg_id, client->context) < 0) {
-		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-	}
 	debug_cmd_client(cmd->dbg_fp, cmd->dbg_id, event->tag, event->context);
 	  	//printf ("handle_mem_write1: event->type is %2x, event->state is 0x%3x \n", event->type, event->state);
 #if defined PSL9 || defined PSL9lite
-	if ((event->type != CMD_CAS_4B) && (event->type != CMD_CAS_8B))
+	if ((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B))
+		cmd_set_state(cmd, event, MEM_CAS_WR_REQ);
+	else
 #endif
-		event->state = MEM_REQUEST;
+		cmd_set_state(cmd, event, MEM_REQUEST);
 	  	//printf ("handle_mem_write2: event->type is %2x, event->state is 0x%3x \n", event->type, event->state);
-	client->mem_access = (void *)event;
+	_mem_request(cmd, client, event, buffer, event->size + 12);
+	free(buffer);
 }
 
-// Handle data returning from client for memory read
-static void _handle_mem_read(struct cmd *cmd, struct cmd_event *event, int fd)
+// Handle data returning from client for memory read, direct holds the data if
+// it was read straight from the client's memory instead of the socket
+static void _handle_mem_read(struct cmd *cmd, struct cmd_event *event, int fd,
+			     uint8_t * direct)
 {
-	uint8_t data[MAX_LINE_CHARS];
+	uint8_t buffer[MAX_LINE_CHARS];
+	uint8_t *data = (direct != NULL) ? direct : buffer;
 	uint64_t offset = event->addr & ~CACHELINE_MASK;
 
 	 //printf ("_handle_mem_read: event->type is %2x, event->state is 0x%3x \n", event->type, event->state);
 #if defined PSL9 || defined PSL9lite
 	if ((event->type == CMD_READ) ||
-		 (((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B)) && event->state != MEM_CAS_WR)) {
+		 (((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B)) && event->state != MEM_CAS_WR_REQ)) {
 #else
 	if (event->type == CMD_READ) {
 #endif
 	        // printf ("_handle_mem_read: CMD_READ \n" );
 		// Client is returning data from memory read
 		// printf("_handle_mem_read: before get bytes silent \n");
-		if (get_bytes_silent(fd, event->size, data, cmd->parms->timeout,
-			     event->abort) < 0) {
+		if ((direct == NULL) &&
+		    (get_bytes_silent(fd, event->size, data, cmd->parms->timeout,
+				      event->abort) < 0)) {
 	        	debug_msg("%s:_handle_mem_read failed tag=0x%02x size=%d addr=0x%016"PRIx64,
 				  cmd->afu_name, event->tag, event->size, event->addr);
 			event->resp = PSL_RESPONSE_DERROR;
@@ -1538,35 +1946,36 @@ static void _handle_mem_read(struct cmd *cmd, struct cmd_event *event, int fd)
 			if ((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B))
 				event->resp = PSL_RESPONSE_CAS_INV;
 #endif
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 			debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
 				 event->context, event->resp);
 			return;
 		}
 		// printf("_handle_mem_read: AFTER get bytes silent \n");
-		memcpy((void *)&(event->data[offset]), (void *)&data, event->size);
+		memcpy((void *)&(event->data[offset]), (void *)data, event->size);
 		generate_cl_parity(event->data, event->parity);
-		event->state = MEM_RECEIVED;
+		cmd_set_state(cmd, event, MEM_RECEIVED);
 	}
 #ifdef PSL9
         // have to expect data back from some AMO ops
 	else if ((event->type == CMD_DMA_RD) || (event->type == CMD_DMA_WR_AMO)) {
 		// Client is returning data from DMA memory read
                 // printf( "_handle_mem_read: CMD_DMA_RD or CMD_DMA_WR_AMO \n" );
-		if (get_bytes_silent(fd, event->dsize, data, cmd->parms->timeout,
-			     event->abort) < 0) {
+		if ((direct == NULL) &&
+		    (get_bytes_silent(fd, event->dsize, data, cmd->parms->timeout,
+				      event->abort) < 0)) {
 	        	debug_msg("%s:_handle_dma0_mem_read failed tag=0x%02x size=%d addr=0x%016"PRIx64,
 				  cmd->afu_name, event->tag, event->dsize, event->addr);
 			event->resp = PSL_RESPONSE_DERROR;
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 			debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
 				 event->context, event->resp);
 			return;
 		}
 		// DMA return data goes at offset 0 in the event data instead of some other offset.
                 // should we clear event->data first?
-		memcpy((void *)event->data, (void *)&data, event->dsize);
-		event->state = DMA_MEM_RESP;
+		memcpy((void *)event->data, (void *)data, event->dsize);
+		cmd_set_state(cmd, event, DMA_MEM_RESP);
 
 	}
 #endif /* ifdef PSL9 */
@@ -1645,8 +2054,10 @@ static int _page_cached(struct cmd *cmd, uint64_t addr)
 	return hit;
 }
 
-// Decide what to do with a client memory acknowledgement
-void handle_mem_return(struct cmd *cmd, struct cmd_event *event, int fd)
+// Decide what to do with a memory acknowledgement, from the client or for a
+// direct access with its read data in direct
+static void _mem_return(struct cmd *cmd, struct cmd_event *event, int fd,
+			uint8_t * direct)
 {
 	struct client *client;
 
@@ -1667,9 +2078,9 @@ void handle_mem_return(struct cmd *cmd, struct cmd_event *event, int fd)
 	    (client->flushing == FLUSH_NONE) && !_page_cached(cmd, event->addr)
 	    && allow_paged(cmd->parms)) {
 		if (event->type == CMD_READ)
-			_handle_mem_read(cmd, event, fd);
+			_handle_mem_read(cmd, event, fd, direct);
 		event->resp = PSL_RESPONSE_PAGED;
-		event->state = MEM_DONE;
+		cmd_set_state(cmd, event, MEM_DONE);
 		client->flushing = FLUSH_PAGED;
 		debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
 				 event->context, event->resp);
@@ -1677,45 +2088,66 @@ void handle_mem_return(struct cmd *cmd, struct cmd_event *event, int fd)
 	}
 
 	_update_age(cmd, event->addr);
+	_prefetch_invalidate(client, event);
 #if defined PSL9 || defined PSL9lite
 	if ((event->type == CMD_READ) ||
-		 (((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B)) && event->state != MEM_CAS_WR))
+		 (((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B)) && event->state != MEM_CAS_WR_REQ))
 #else
 	if (event->type == CMD_READ)
 #endif
-		_handle_mem_read(cmd, event, fd);
+		_handle_mem_read(cmd, event, fd, direct);
 #ifdef PSL9
 	else if ((event->state == DMA_MEM_RESP) && (event->type == CMD_DMA_WR))
-		event->state = MEM_DONE;
+		cmd_set_state(cmd, event, MEM_DONE);
  	// have to account for AMO fetch cmds with returned data
  	else if (event->type == CMD_DMA_RD)
-		_handle_mem_read(cmd, event, fd);
+		_handle_mem_read(cmd, event, fd, direct);
  	else if (event->type == CMD_DMA_WR_AMO) {
                  if ((event->atomic_op & 0x3f) < 0x20)
-			_handle_mem_read(cmd, event, fd);
+			_handle_mem_read(cmd, event, fd, direct);
 		 else
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 		}
 	else if ((event->type == CMD_CAS_4B) || (event->type == CMD_CAS_8B))
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 
 #endif /* ifdef PSL9 */
 	else if (event->type == CMD_TOUCH)
-		event->state = MEM_DONE;
+		cmd_set_state(cmd, event, MEM_DONE);
 	else if (event->state == MEM_TOUCH)	// Touch before write
-		event->state = MEM_TOUCHED;
+		cmd_set_state(cmd, event, MEM_TOUCHED);
 	else			// Write after touch
-		event->state = MEM_DONE;
+		cmd_set_state(cmd, event, MEM_DONE);
 	debug_cmd_return(cmd->dbg_fp, cmd->dbg_id, event->tag, event->context);
 }
 
-// Mark memory event as address error in preparation for response
+// Decide what to do with a client memory acknowledgement, which answers
+// every write combined with event
+void handle_mem_return(struct cmd *cmd, struct cmd_event *event, int fd)
+{
+	struct cmd_event *next;
+
+	for (; event != NULL; event = next) {
+		next = event->_combine;
+		event->_combine = NULL;
+		_mem_return(cmd, event, fd, NULL);
+	}
+}
+
+// Mark memory event and any writes combined with it as address error in
+// preparation for response
 void handle_aerror(struct cmd *cmd, struct cmd_event *event)
 {
-	event->resp = PSL_RESPONSE_AERROR;
-	event->state = MEM_DONE;
-	debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
-			 event->context, event->resp);
+	struct cmd_event *next;
+
+	for (; event != NULL; event = next) {
+		next = event->_combine;
+		event->_combine = NULL;
+		event->resp = PSL_RESPONSE_AERROR;
+		cmd_set_state(cmd, event, MEM_DONE);
+		debug_cmd_update(cmd->dbg_fp, cmd->dbg_id, event->tag,
+				 event->context, event->resp);
+	}
 }
 
 //#ifdef PSL9
@@ -1760,14 +2192,14 @@ void _handle_cas_op(struct cmd *cmd, struct cmd_event *event)
 				  event->resp = PSL_RESPONSE_COMP_EQ;
 				else
 				  event->resp = PSL_RESPONSE_COMP_NEQ;
-			event->state = MEM_CAS_WR;
+			cmd_set_state(cmd, event, MEM_CAS_WR);
 			debug_msg("HANDLE_CAS_OP CAS_U or CAS_E_4B IS EQUAL or CAS_NE_4B NOT EQUAL");
 		} else	{
 			if (event->command == PSL_COMMAND_CAS_E_4B)
 				event->resp = PSL_RESPONSE_COMP_NEQ;
 			else
 				event->resp = PSL_RESPONSE_COMP_EQ;
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 			debug_msg("HANDLE_CAS_OP CAS_E_4B NOT EQUAL or CAS_NE_4B IS EQUAL");
 		}
 	} else if (event->type == CMD_CAS_8B) {
@@ -1788,31 +2220,72 @@ void _handle_cas_op(struct cmd *cmd, struct cmd_event *event)
 				  event->resp = PSL_RESPONSE_COMP_EQ;
 				else
 				  event->resp = PSL_RESPONSE_COMP_NEQ;
-			event->state = MEM_CAS_WR;
+			cmd_set_state(cmd, event, MEM_CAS_WR);
 			debug_msg("HANDLE_CAS_OP CAS_U or CAS_E_8B IS EQUAL or CAS_NE_8B NOT EQUAL");
 		} else	{
 			if (event->command == PSL_COMMAND_CAS_E_8B)
 				event->resp = PSL_RESPONSE_COMP_NEQ;
 			else
 				event->resp = PSL_RESPONSE_COMP_EQ;
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 			debug_msg("HANDLE_CAS_OP CAS_E_8B NOT EQUAL or CAS_NE_8B IS EQUAL");
 		}
 	}
 }
 
 
+#ifdef PSL9
+// Reserve an unused itag in the range first to last - 1, starting the search
+// at *next so itags are handed out round robin.  Returns 0 if none are free.
+static uint32_t _alloc_itag(struct cmd *cmd, struct cmd_event *event,
+			    uint32_t * next, uint32_t first, uint32_t last)
+{
+	uint32_t itag, i;
+
+	itag = *next;
+	for (i = first; i < last; i++) {
+		if (cmd->itag[itag] == NULL) {
+			cmd->itag[itag] = event;
+			event->itag = itag;
+			*next = (itag + 1 == last) ? first : itag + 1;
+			return itag;
+		}
+		if (++itag == last)
+			itag = first;
+	}
+	return 0;
+}
+
+// Find the translated event an itag abort refers to, if it can be aborted
+static struct cmd_event *_abortable_itag(struct cmd *cmd, uint32_t itag)
+{
+	struct cmd_event *event;
+
+	if (itag >= CMD_ITAGS)
+		return NULL;
+	event = cmd->itag[itag];
+	if (event == NULL)
+		return NULL;
+	debug_msg ("in handle_caia2_cmds, processing ITAG abort : type is %2x, state is 0x%x, itag is 0x%3x ", event->type, event->state, event->itag);
+	if ((event->state != DMA_ITAG_RET) && (event->state != DMA_PENDING))
+		return NULL;
+	return event;
+}
+#endif // ifdef PSL9 only
+
 void handle_caia2_cmds(struct cmd *cmd)
 {
-	struct cmd_event **head;
 	struct cmd_event *event;
 	struct client *client;
-	uint32_t this_itag, done_it;
-	unsigned char need_a_tag;
+#ifdef PSL9
+	struct cmd_event *target;
+	enum mem_state state;
+	uint32_t this_itag;
 	static uint32_t rtag = 1;
 	static uint32_t wtag = 256;
 	// Can't find anything in PSL Interface spec that says rd itags have to be unique from wr itags
 	// so now, 0->511 is range for both. 
+#endif // ifdef PSL9 only
 
 
 	// Make sure cmd structure is valid
@@ -1820,32 +2293,28 @@ void handle_caia2_cmds(struct cmd *cmd)
 		return;
 
 	// Look for any cmds to process
-	head = &cmd->list;
-	while (*head != NULL) {
-	  	//printf ("handle_caia2_cmds: head->type is %2x, head->state is 0x%3x \n", (*head)->type, (*head)->state);
-	//first look for  CAS commands
-		if (((*head)->type == CMD_CAS_4B) || ((*head)->type == CMD_CAS_8B))
-			break;
+	//first look for CAS commands with operands or memory data to work on
+	event = _first(cmd, MEM_CAS_OP,
+		       CMD_MASK(CMD_CAS_4B) | CMD_MASK(CMD_CAS_8B));
+	if (event == NULL)
+		event = _first(cmd, MEM_RECEIVED,
+			       CMD_MASK(CMD_CAS_4B) | CMD_MASK(CMD_CAS_8B));
 #ifdef PSL9
-
 	// next look for xlat read/write requests
-		if ((((*head)->type == CMD_XLAT_RD) &&
-		    ((*head)->state == DMA_ITAG_REQ)) |
-		 (((*head)->type == CMD_XLAT_WR) &&
-		    ((*head)->state == DMA_ITAG_REQ)))
-			break;
+	if (event == NULL)
+		event = _first(cmd, DMA_ITAG_REQ,
+			       CMD_MASK(CMD_XLAT_RD) | CMD_MASK(CMD_XLAT_WR));
 	//next look for itag read/write abort requests
-		if ((((*head)->type == CMD_ITAG_ABRT_RD) && ((*head)->state == MEM_TOUCHED)) |
-		  (((*head)->type == CMD_ITAG_ABRT_WR) && ((*head)->state == MEM_TOUCHED)))
-			break;
+	if (event == NULL)
+		event = _first(cmd, MEM_TOUCHED,
+			       CMD_MASK(CMD_ITAG_ABRT_RD) |
+			       CMD_MASK(CMD_ITAG_ABRT_WR));
 	//next look for itag read/write touch requests
-		if ((((*head)->type == CMD_XLAT_RD_TOUCH) && ((*head)->state != MEM_DONE)) |
-		  (((*head)->type == CMD_XLAT_WR_TOUCH) && ((*head)->state != MEM_DONE)))
-			break;
+	for (state = MEM_IDLE; (event == NULL) && (state < MEM_DONE); state++)
+		event = _first(cmd, state,
+			       CMD_MASK(CMD_XLAT_RD_TOUCH) |
+			       CMD_MASK(CMD_XLAT_WR_TOUCH));
 #endif // ifdef PSL9 only
-		head = &((*head)->_next);
-	}
-	event = *head;
 
 
 // Test for client disconnect
@@ -1866,7 +2335,7 @@ void handle_caia2_cmds(struct cmd *cmd)
 			event->size = CACHELINE_BYTES; // got to set up for cacheline read/write no matter what
 			if (event->state == MEM_CAS_OP)  {
 				_handle_op1_op2_load(cmd, event);
-				event->state = MEM_CAS_RD;
+				cmd_set_state(cmd, event, MEM_CAS_RD);
 				//printf("HANDLE_CAIA2_CMDS read in op1/op2 \n");
 			} else if (event->state == MEM_RECEIVED) {
 				//printf("HANDLE_CAIA2_CMDS calling handle cas op \n");
@@ -1876,87 +2345,32 @@ void handle_caia2_cmds(struct cmd *cmd)
 			break;
 #ifdef PSL9
 		case PSL_COMMAND_XLAT_RD_P0:
-			need_a_tag = 1;
-			done_it = 0;
-			do {
-				this_itag = rtag;
-				head = &cmd->list;
-				while (*head != NULL) {
-					if ((*head)->itag == this_itag) {
-						this_itag +=1;
-						if (this_itag == 256) {
-							if (done_it !=1) {
-								this_itag = 1;
-								done_it = 1; 
-								head = &cmd->list;
-								debug_msg("one more pass thru  \n"); 
-							} else  
-								break;  // no more un used tags
-						}	
-					} else
-						head = &((*head)->_next);
-				}
-				if (*head == NULL)  { // didn't find this tag 
-					rtag = this_itag + 1;
-					if (rtag == 256)
-						rtag = 1;  
-					break;
-				}  else  {
-					info_msg("Temporarily out of itags!! Command IGNORED");
-					event->resp = PSL_RESPONSE_XLAT_NO_ITAG;
-					event->state = MEM_DONE;
-					break;
-					}
-			} while (need_a_tag == 1);
-
-			event->itag = this_itag;
+			if (_alloc_itag(cmd, event, &rtag, 1, 256) == 0) {
+				info_msg("Temporarily out of itags!! Command IGNORED");
+				event->resp = PSL_RESPONSE_XLAT_NO_ITAG;
+				cmd_set_state(cmd, event, MEM_DONE);
+				break;
+			}
 			event->port = 0;
 			//printf("in handle_caia2 for xlat_rd, address is 0x%016"PRIX64 "\n", event->addr);
 			debug_msg("handle_caia2_cmd: for tag=0x%x dma0_itag for read is 0x%x", 
 				event->tag, event->itag);
-			event->state = DMA_ITAG_RET;
+			cmd_set_state(cmd, event, DMA_ITAG_RET);
 			debug_cmd_caia2(cmd->dbg_fp, cmd->dbg_id, event->tag,
 			 	event->context, 0x2);
 			break;
 		case PSL_COMMAND_XLAT_WR_P0:
-			need_a_tag = 1;
-			done_it = 0;
-			do {
-				this_itag = wtag;
-				head = &cmd->list;
-				while (*head != NULL) {
-					if ((*head)->itag == this_itag) {
-						this_itag +=1;
-						if (this_itag == 511) {
-							if (done_it != 1) {
-								this_itag = 256;
-								done_it = 1; 
-								head = &cmd->list;
-								debug_msg("one more pass thru  \n"); 
-					 		} else 
-								break;  // no more un used tags
-						}
-					} else
-						head = &((*head)->_next);
-				}
-				if (*head == NULL)  { // didn't find this tag 
-					wtag = this_itag + 1;
-					if (wtag == 511)
-						wtag = 256;  	
-					break;
-				} else {
-					info_msg("Temporarily out of itags!! Command IGNORED");
-					event->resp = PSL_RESPONSE_XLAT_NO_ITAG;
-					event->state = MEM_DONE;
-					break;
-					}
-			} while (need_a_tag == 1);
-			event->itag = this_itag;
+			if (_alloc_itag(cmd, event, &wtag, 256, 511) == 0) {
+				info_msg("Temporarily out of itags!! Command IGNORED");
+				event->resp = PSL_RESPONSE_XLAT_NO_ITAG;
+				cmd_set_state(cmd, event, MEM_DONE);
+				break;
+			}
 			event->port = 0;
 			//printf("in handle_caia2 for xlat_wr, address is 0x%016"PRIX64 "\n", event->addr);
 			debug_msg("handle_caia2_cmd: for tag=0x%x dma0_itag for write is 0x%x",
 				event->tag, event->itag);
-			event->state = DMA_ITAG_RET;
+			cmd_set_state(cmd, event, DMA_ITAG_RET);
 			debug_cmd_caia2(cmd->dbg_fp, cmd->dbg_id, event->tag,
 			 	event->context, 0x3);
 			break;
@@ -1965,30 +2379,20 @@ void handle_caia2_cmds(struct cmd *cmd)
 			/* otherwise, send back FAIL and warn msg  */
 			this_itag = event->addr;
 			debug_msg("NOW IN PSL_COMMAND_ITAG_ABRT_RD with this_itag = 0x%x ", this_itag);
-			// Look for a matching itag to process immediately
+			// Look up the matching itag to process immediately
 			// check to see if dma op already started
-			head = &cmd->list;
-			while (*head != NULL) {
-				debug_msg ("in handle_caia2_cmds, processing ITAG abt read : head->type is %2x, head->state is 0x%x, head->itag is 0x%3x ", (*head)->type, (*head)->state, (*head)->itag);
-				if (((*head)->state == DMA_ITAG_RET) &&
-		    			((*head)->itag == this_itag))
-					break;
-				if (((*head)->state == DMA_PENDING) &&
-		    			((*head)->itag == this_itag))
-					break;
-				head = &((*head)->_next);
-			}
-			if (*head == NULL)  { // didn't find this tag 
+			target = _abortable_itag(cmd, this_itag);
+			if (target == NULL)  { // didn't find this tag 
 			       //  OR didn't find in abortable state so ignore
 				event->resp = PSL_RESPONSE_XLAT_NO_ITAG;
-				event->state = MEM_DONE;
+				cmd_set_state(cmd, event, MEM_DONE);
 				info_msg("WRONG TAG or STATE: ignored attempt to abort read dma0_itag 0x%x", event->itag);
 				return;
 				}
 				// adjust credits count in psl_interface, not here
-				(*head)->state = MEM_DONE;
+				cmd_set_state(cmd, target, MEM_DONE);
 				event->resp = PSL_RESPONSE_DONE;
-				event->state = MEM_DONE;
+				cmd_set_state(cmd, event, MEM_DONE);
 				debug_msg("dma0_itag  0x%x for read aborted", this_itag);
 				break;
 		case PSL_COMMAND_ITAG_ABRT_WR:
@@ -1996,39 +2400,29 @@ void handle_caia2_cmds(struct cmd *cmd)
 			/* otherwise, ignore cmd, send back nothing, print info msg  */
 			this_itag = event->addr;
 			debug_msg("NOW IN PSL_COMMAND_ITAG_ABRT_WR with this_itag = 0x%x ", this_itag);
-			// Look for a matching itag to process immediately
+			// Look up the matching itag to process immediately
 			// check to see if dma op already started
-			head = &cmd->list;
-			while (*head != NULL) {
-				debug_msg ("in handle_caia2_cmds, processing ITAG abt write : head->type is %2x, head->state is 0x%x, head->itag is 0x%3x ", (*head)->type, (*head)->state, (*head)->itag);
-				if (((*head)->state == DMA_ITAG_RET) &&
-		    			((*head)->itag == this_itag))
-					break;
-				if (((*head)->state == DMA_PENDING) &&
-		    			((*head)->itag == this_itag))
-					break;
-				head = &((*head)->_next);
-			}
-			if (*head == NULL) {  // didn't find this tag OR not in abortable state so ignore
+			target = _abortable_itag(cmd, this_itag);
+			if (target == NULL) {  // didn't find this tag OR not in abortable state so ignore
 				event->resp = PSL_RESPONSE_XLAT_NO_ITAG;
-				event->state = MEM_DONE;
+				cmd_set_state(cmd, event, MEM_DONE);
 				info_msg("WRONG TAG or STATE: ignore attempt to abort write dma0_itag 0x%x", event->itag);
 				break;
 				}
 				// will adjust credits count in psl_interface, not here
-				(*head)->state = MEM_DONE;
+				cmd_set_state(cmd, target, MEM_DONE);
 		   		event->resp = PSL_RESPONSE_DONE;
-				event->state = MEM_DONE;
+				cmd_set_state(cmd, event, MEM_DONE);
 				debug_msg("dma0_itag  0x%x for write aborted", this_itag);
 				break;
 		case PSL_COMMAND_XLAT_RD_TOUCH:
 		   	event->resp = PSL_RESPONSE_DONE;
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 			debug_msg("XLAT_RD_TOUCH command doesn't return itag");
 			break;
 		case PSL_COMMAND_XLAT_WR_TOUCH:
 		   	event->resp = PSL_RESPONSE_DONE;
-			event->state = MEM_DONE;
+			cmd_set_state(cmd, event, MEM_DONE);
 			debug_msg("XLAT_WR_TOUCH command doesn't return itag ");
 			break;
 #endif // ifdef PSL9 only
@@ -2044,12 +2438,11 @@ void handle_caia2_cmds(struct cmd *cmd)
 #ifdef PSL9
 void handle_dma0_port(struct cmd *cmd)
 {
-	struct cmd_event **head;
 	struct cmd_event *event;
 	//struct client *client;
 	uint32_t this_itag;
 
-//here we search list of events to find one that has matching ITAG, then process
+//here we look up the event with the matching ITAG, then process
 
 	// Make sure cmd structure is valid
 	if (cmd == NULL)
@@ -2057,38 +2450,28 @@ void handle_dma0_port(struct cmd *cmd)
 
 	// Look for any dma0 cmds to process
 
-	head = &cmd->list;
-	event = *head;
 	//printf("in handle_dma0_port and cmd->afu_event->dma0_valid is 0x%x\n", cmd->afu_event->dma0_dvalid);
 		if (cmd->afu_event->dma0_dvalid == 1)  {
-	if (event == NULL)
-		debug_msg ("why is event null but dma0_dvalid ??? ");
 	this_itag = cmd->afu_event->dma0_req_itag;
-	// Look for a matching itag to process immediately
-	head = &cmd->list;
-	while (*head != NULL) {
-		debug_msg ("in handle_dma0_port: head->type is %2x, head->itag is 0x%x thisitag is 0x%x", (*head)->type, (*head)->itag, this_itag);
-		if ((((*head)->type == CMD_XLAT_RD) &&
-		    ((*head)->itag == this_itag)) |
-		 (((*head)->type == CMD_XLAT_WR) &&
-		    ((*head)->itag == this_itag)))
-			break;
-		if (((*head)->type == CMD_DMA_WR) &&
-		    ((*head)->itag == this_itag)) 
-			break;
-		head = &((*head)->_next);
-	}
-	if (*head != NULL) {
-		event = *head;
+	// Look up the matching itag to process immediately
+	event = NULL;
+	if (this_itag < CMD_ITAGS)
+		event = cmd->itag[this_itag];
+	if ((event != NULL) &&
+	    !(CMD_MASK(event->type) & (CMD_MASK(CMD_XLAT_RD) |
+				       CMD_MASK(CMD_XLAT_WR) |
+				       CMD_MASK(CMD_DMA_WR))))
+		event = NULL;
+	if (event != NULL) {
 		//Fill in event and set up for next steps
-		debug_msg ("in handle_dma0_port : head->type is %2x, head->itag is 0x%3x thisitag is 0x%x", (*head)->type, (*head)->itag, this_itag);
+		debug_msg ("in handle_dma0_port : event->type is %2x, event->itag is 0x%3x thisitag is 0x%x", event->type, event->itag, this_itag);
 		event->itag = cmd->afu_event->dma0_req_itag;
 		event->utag = cmd->afu_event->dma0_req_utag;
 		event->dtype = cmd->afu_event->dma0_req_type;
 		event->dsize = cmd->afu_event->dma0_req_size;
 		// If DMA read, set up for subsequent handle_dma_mem_read
 		if (event->dtype == DMA_DTYPE_RD_REQ) {
-			event->state = DMA_OP_REQ;
+			cmd_set_state(cmd, event, DMA_OP_REQ);
 			event->type = CMD_DMA_RD;
 		// check to make sure transaction will stay within a 4K boundary
 		if ((event->addr+0x1000) <= (event->addr+(uint64_t)event->dsize))
@@ -2103,7 +2486,7 @@ void handle_dma0_port(struct cmd *cmd)
 		if ((event->dtype == DMA_DTYPE_WR_REQ_128) && (event->dsize <= 128))  {
 			debug_msg("copy to event buffer for write dma data  <= 128B type 1, dsize=0x%2x",
 		event->dsize);
-			event->state = DMA_OP_REQ;
+			cmd_set_state(cmd, event, DMA_OP_REQ);
 			event->type = CMD_DMA_WR;
 		  	memcpy((void *)&(event->data[0]), (void *)&(cmd->afu_event->dma0_req_data), event->dsize);
 			debug_msg("%s:DMA0_VALID itag=0x%02x utag=0x%02x addr=0x%016"PRIx64" type = 0x%02x size=0x%02x", cmd->afu_name,
@@ -2111,7 +2494,7 @@ void handle_dma0_port(struct cmd *cmd)
 			}
 		if ((event->dtype == DMA_DTYPE_WR_REQ_128) && (event->dsize > 128))  {
 			debug_msg("FIRST copy to event buffer for write dma data  > 128B type 1");
-			event->state = DMA_PARTIAL;
+			cmd_set_state(cmd, event, DMA_PARTIAL);
 			event->type = CMD_DMA_WR;
 		  	memcpy((void *)&(event->data[0]), (void *)&(cmd->afu_event->dma0_req_data), 128);
 			event->dpartial = 128;
@@ -2120,7 +2503,7 @@ void handle_dma0_port(struct cmd *cmd)
 			}
 		if ((event->dtype == DMA_DTYPE_WR_REQ_MORE) && ((event->dsize - event->dpartial) > 128))  {
 			debug_msg("copy to event buffer for write dma data  > 128B type 2");
-			event->state = DMA_PARTIAL;
+			cmd_set_state(cmd, event, DMA_PARTIAL);
 			event->type = CMD_DMA_WR;
 		  	memcpy((void *)&(event->data[event->dpartial]), (void *)&(cmd->afu_event->dma0_req_data), 128);
 			event->dpartial += 128;
@@ -2129,7 +2512,7 @@ void handle_dma0_port(struct cmd *cmd)
 			}
 		else if ((event->dtype == DMA_DTYPE_WR_REQ_MORE) && ((event->dsize - event->dpartial) <= 128))  {
 			debug_msg("FINAL copy to event buffer for write dma data  > 128B type 2");
-			event->state = DMA_OP_REQ;
+			cmd_set_state(cmd, event, DMA_OP_REQ);
 			event->type = CMD_DMA_WR;
 		  	memcpy((void *)&(event->data[event->dpartial]), (void *)&(cmd->afu_event->dma0_req_data),
 				 (event->dsize - event->dpartial));
@@ -2140,7 +2523,7 @@ void handle_dma0_port(struct cmd *cmd)
 		if ((event->dtype == DMA_DTYPE_ATOMIC) && (event->type == CMD_XLAT_RD))
 			error_msg("%s:INVALID REQ: DMA AMO W/XLAT_RD ITAG ITAG = 0x%3x DTYPE = %d ", cmd->afu_name, this_itag, event->dtype);
 		if ((event->dtype == DMA_DTYPE_ATOMIC) && (event->type == CMD_XLAT_WR))  {
-			event->state = DMA_OP_REQ;
+			cmd_set_state(cmd, event, DMA_OP_REQ);
 			event->type = CMD_DMA_WR_AMO;
 			event->atomic_op = cmd->afu_event->dma0_atomic_op;
 		  	memcpy((void *)&(event->data[0]), (void *)&(cmd->afu_event->dma0_req_data), 16);
@@ -2162,97 +2545,83 @@ void handle_dma0_port(struct cmd *cmd)
 // Send a randomly selected pending response back to AFU
 void handle_response(struct cmd *cmd)
 {
-	struct cmd_event **head;
 	struct cmd_event *event;
 	struct client *client;
 	int rc;
 
 	// Select a random pending response (or none)
 	client = NULL;
-	head = &cmd->list;
-	while (*head != NULL) {
+	event = cmd->ready[MEM_DONE];
+	while (event != NULL) {
 	       // debug_msg( "%s:RESPONSE examine event @ 0x%016" PRIx64 ", command=0x%x, utag=0x%08x, type=0x%02x, state=0x%02x, resp=0x%x",
 		//	   cmd->afu_name,
-		//	   (*head),
-		//	   (*head)->command,
-		//	   (*head)->utag,
-		//	   (*head)->type,
-		//	   (*head)->state,
-		//	   (*head)->resp );
+		//	   event,
+		//	   event->command,
+		//	   event->utag,
+		//	   event->type,
+		//	   event->state,
+		//	   event->resp );
 		// Fast track error responses
-		if ( ( (*head)->resp == PSL_RESPONSE_PAGED ) ||
-		     ( (*head)->resp == PSL_RESPONSE_NRES ) ||
-		     ( (*head)->resp == PSL_RESPONSE_NLOCK ) ||
-		     ( (*head)->resp == PSL_RESPONSE_FAILED ) ||
-		     ( (*head)->resp == PSL_RESPONSE_FLUSHED ) ) {
-			event = *head;
-			debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ",drive response because resp is PSL_RESPONSE_error", cmd->afu_name, (*head) );
+		if ( ( event->resp == PSL_RESPONSE_PAGED ) ||
+		     ( event->resp == PSL_RESPONSE_NRES ) ||
+		     ( event->resp == PSL_RESPONSE_NLOCK ) ||
+		     ( event->resp == PSL_RESPONSE_FAILED ) ||
+		     ( event->resp == PSL_RESPONSE_FLUSHED ) ) {
+			debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ",drive response because resp is PSL_RESPONSE_error", cmd->afu_name, event );
 			goto drive_resp;
 		}
 #ifdef PSL9
 		// if (dma write and we've sent utag sent status AND it wasn't AMO that has pending cpl resp),
 		// OR (dma write and it was AMO and we've sent cpl resp)
 		// OR (itag was aborted) OR  we are out of itags,  we can remove this event
-		if ( ( ( (*head)->type == CMD_DMA_WR )     && ( (*head)->state == MEM_DONE ) ) ||
-		     ( ( (*head)->type == CMD_DMA_WR_AMO ) && ( (*head)->state == MEM_DONE ) ) ||
-		     ( ( (*head)->type == CMD_XLAT_WR )    && ( (*head)->state == MEM_DONE ) ) ) {
+		if ( ( event->type == CMD_DMA_WR ) ||
+		     ( event->type == CMD_DMA_WR_AMO ) ||
+		     ( event->type == CMD_XLAT_WR ) ) {
 			//  update dma0_wr_credits IF CMD_DMA_WR or CMD_DMA_WR_AM0
-			//if ((*head)->type != CMD_XLAT_WR)
+			//if (event->type != CMD_XLAT_WR)
 			//	cmd->dma0_wr_credits++;
-			event = *head;
-			*head = event->_next;
 			debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ", free event and skip response because dma write related is done OR out of itags",
 				   cmd->afu_name, event );
-			free(event->data);
-			free(event->parity);
-			free(event);
+			cmd_free_event(cmd, event);
 		        //printf("in handle_response and finally freeing original xlat/dma write event \n");
 			return;
 		} 
-		if ( ( ( (*head)->type == CMD_DMA_RD )  && ( (*head)->state == MEM_DONE ) ) ||
-			    ( ( (*head)->type == CMD_XLAT_RD ) && ( (*head)->state == MEM_DONE ) ) ) {
+		if ( ( event->type == CMD_DMA_RD ) ||
+		     ( event->type == CMD_XLAT_RD ) ) {
 		        // if dma read and we've send completion data OR itag aborted , we can remove this event
 			//  update dma0_rd_credits IF CMD_DMA_RD
-			//if ((*head)->type != CMD_XLAT_RD)
+			//if (event->type != CMD_XLAT_RD)
 			//	cmd->dma0_rd_credits++;
-			event = *head;
-			*head = event->_next;
 			debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ", free event and skip response because dma read related is CPL or DONE OR out of itags, itag=0x%x, utag=0x%x",
 				   cmd->afu_name, event, event->itag, event->utag );
-			free(event->data);
-			free(event->parity);
-			free(event);
+			cmd_free_event(cmd, event);
 	                //printf("in handle_response and finally freeing original xlat/dma read event \n");
 			return;
 		}
-
-
-		if ( ( (*head)->type == CMD_XLAT_RD ) ||
-		     ( (*head)->type == CMD_XLAT_WR ) ) {
-				if ((*head)->state == DMA_ITAG_RET) {
-					event = *head;
-					event->resp = PSL_RESPONSE_DONE;
-					debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ", drive response because xlat type state was DMA_ITAG_RET",
-						   cmd->afu_name, event );
-					goto drive_resp;
-				} // else {
-				//	debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ", skip response because xlat type state was not DMA_ITAG_RET",
-				//		   cmd->afu_name, (*head) );
-				//}
-		}
-
 #endif /* ifdef PSL9 */
 
-		if (((*head)->state == MEM_DONE) && !allow_reorder(cmd->parms)) {
+		if (!allow_reorder(cmd->parms)) {
 		        debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ", drive response because MEM_DONE",
-				   cmd->afu_name, (*head) );
+				   cmd->afu_name, event );
 			break;
 		}
-		head = &((*head)->_next);
+		event = event->_ready_next;
 	}
 
+#ifdef PSL9
+	if (event == NULL) {
+		event = _first(cmd, DMA_ITAG_RET,
+			       CMD_MASK(CMD_XLAT_RD) | CMD_MASK(CMD_XLAT_WR));
+		if (event != NULL) {
+			event->resp = PSL_RESPONSE_DONE;
+			debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ", drive response because xlat type state was DMA_ITAG_RET",
+				   cmd->afu_name, event );
+			goto drive_resp;
+		}
+	}
+#endif /* ifdef PSL9 */
+
 	// Randomly decide not to drive response yet
-	event = *head;
 	if (event == NULL) {
 	  // debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 " skipped because NULL", cmd->afu_name, event );
 		return;
@@ -2287,12 +2656,16 @@ void handle_response(struct cmd *cmd)
 		   event->resp );
 
 	// Check for pending buffer activity
-	while (event == cmd->buffer_read) {
-		if (cmd->afu_event->buffer_rdata_valid) {
+	while (event->buffer_read) {
+		if (cmd->afu_event->buffer_rdata_valid &&
+		    (_buffer_read_match(cmd) == event)) {
 			warn_msg("Application terminated while AFU write still active");
 			_print_event(event);
 			cmd->afu_event->buffer_rdata_valid = 0;
-			cmd->buffer_read = NULL;
+			_buffer_read_done(cmd, event);
+		}
+		else if (cmd->afu_event->buffer_rdata_valid) {
+			handle_buffer_data(cmd, 0);
 		}
 		else {
 			psl_signal_afu_model(cmd->afu_event);
@@ -2308,7 +2681,8 @@ void handle_response(struct cmd *cmd)
 	if (rc == PSL_SUCCESS) {
 		debug_msg("%s:RESPONSE event @ 0x%016" PRIx64 ", sent tag=0x%02x code=0x%x", cmd->afu_name,
 			  event, event->tag, event->resp);
-		debug_cmd_response(cmd->dbg_fp, cmd->dbg_id, event->tag);
+		debug_cmd_response(cmd->dbg_fp, cmd->dbg_id, event->tag,
+				   event->resp);
 		if ( ( client != NULL ) && ( event->command == PSL_COMMAND_RESTART ) )
 			client->flushing = FLUSH_NONE;
 
@@ -2322,8 +2696,9 @@ void handle_response(struct cmd *cmd)
 		  debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ", set state dma pending and tag to deadbeef for itag=0x%x",
 			     cmd->afu_name,
 			     event, event->itag );
-		  event->state = DMA_PENDING;
+		  cmd_set_state(cmd, event, DMA_PENDING);
 		  // do this to "free" the tag since AFU thinks it's free now
+		  _clear_tag(cmd, event);
 		  event->tag = 0xdeadbeef;
 		  cmd->credits++;
 		} else {
@@ -2331,10 +2706,7 @@ void handle_response(struct cmd *cmd)
 	     debug_msg( "%s:RESPONSE event @ 0x%016" PRIx64 ", free event",
 		        cmd->afu_name,
 			      event );
-		  *head = event->_next;
-		  free(event->data);
-		  free(event->parity);
-		  free(event);
+		  cmd_free_event(cmd, event);
 		  cmd->credits++;
 #ifdef PSL9
 		}
@@ -2348,32 +2720,29 @@ void handle_response(struct cmd *cmd)
 
 int client_cmd(struct cmd *cmd, struct client *client)
 {
-	int rc = 0;
-	struct cmd_event *event = cmd->list;
+	struct cmd_event *event;
 
-	while (event != NULL) {
-		if (event->context != client->context) {
-			// Event is not for this client
-			event = event->_next;
-			continue;
-		}
-		if ((client->state == CLIENT_NONE) &&
-		    (event->state != MEM_DONE)) {
-			// Client dropped, terminate event
-			event->state = MEM_DONE;
-			if ((event->type == CMD_READ) ||
-			    (event->type == CMD_WRITE) ||
-			    (event->type == CMD_TOUCH)) {
-				event->resp = PSL_RESPONSE_FAILED;
-			}
-			event = event->_next;
+	// No events for this client
+	if ((cmd->pending == NULL) || !cmd->pending[client->context])
+		return 0;
+
+	// Events are for client in valid state
+	if (client->state == CLIENT_VALID)
+		return 1;
+	if (client->state != CLIENT_NONE)
+		return 0;
+
+	// Client dropped, terminate events
+	for (event = cmd->list; event != NULL; event = event->_next) {
+		if ((event->context != client->context) ||
+		    (event->state == MEM_DONE))
 			continue;
+		cmd_set_state(cmd, event, MEM_DONE);
+		if ((event->type == CMD_READ) ||
+		    (event->type == CMD_WRITE) ||
+		    (event->type == CMD_TOUCH)) {
+			event->resp = PSL_RESPONSE_FAILED;
 		}
-		if (client->state == CLIENT_VALID) {
-			// Event is for client in valid state
-			return 1;
-		}
-		event = event->_next;
 	}
-	return rc;
+	return 0;
 }
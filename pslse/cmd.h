@@ -32,6 +32,17 @@
 #define LOG2_ENTRIES 4		// log2(PAGE_ENTRIES) = log2(64/4) = log2(16) = 4
 #define PAGE_ADDR_BITS 12
 #define PAGE_MASK 0xFFF
+#ifdef PSL9
+#define CMD_DATA_BYTES (CACHELINE_BYTES * 4)	// 512B max DMA transfer
+#else
+#define CMD_DATA_BYTES CACHELINE_BYTES
+#endif /* ifdef PSL9 */
+#define CMD_PARITY_BYTES (DWORDS_PER_CACHELINE / 8)
+#define CMD_TAGS 256		// AFU command tags are 8 bits
+#ifdef PSL9
+#define CMD_ITAGS 512		// DMA itags, 1-255 for reads, 256-510 for writes
+#endif /* ifdef PSL9 */
+#define CMD_MASK(type) (1 << (type))
 
 enum cmd_type {
 	CMD_READ,
@@ -69,6 +80,7 @@ enum mem_state {
 	MEM_CAS_OP,
 	MEM_CAS_RD,
 	MEM_CAS_WR,
+	MEM_CAS_WR_REQ,
 #endif
 	MEM_RECEIVED,
 #ifdef PSL9
@@ -86,6 +98,8 @@ enum mem_state {
 	MEM_DONE
 };
 
+#define CMD_STATES (MEM_DONE + 1)
+
 
 struct pages {
 	uint64_t entry[PAGE_ENTRIES][PAGE_WAYS];
@@ -129,19 +143,45 @@ struct cmd_event {
 #endif /*ifdef PSL9 */
 	uint8_t unlock;
 	uint8_t buffer_activity;
+	uint8_t buffer_read;
 	uint8_t *data;
 	uint8_t *parity;
 	int *abort;
 	enum cmd_type type;
 	enum mem_state state;
 	enum client_state client_state;
+	uint64_t seq;
 	struct cmd_event *_next;
+	struct cmd_event *_prev;
+	struct cmd_event *_ready_next;
+	struct cmd_event *_ready_prev;
+	struct cmd_event *_combine;
 };
 
+// Block of cmd_events with their data and parity buffers, see cmd_init()
+struct cmd_slab {
+	struct cmd_event *event;
+	uint8_t *data;
+	uint8_t *parity;
+	struct cmd_slab *_next;
+};
+
+// Every outstanding event is on list and on the ready queue for its current
+// state.  Ready queues are kept in issue order so handlers only walk the
+// events that are waiting on them.
 struct cmd {
 	struct AFU_EVENT *afu_event;
 	struct cmd_event *list;
-	struct cmd_event *buffer_read;
+	struct cmd_event *ready[CMD_STATES];
+	struct cmd_event *ready_tail[CMD_STATES];
+	struct cmd_event *tag[CMD_TAGS];
+#ifdef PSL9
+	struct cmd_event *itag[CMD_ITAGS];
+#endif /* ifdef PSL9 */
+	struct cmd_event *free_list;
+	struct cmd_slab *slabs;
+	struct cmd_event *buffer_read[MAX_BUFFER_READS];
+	int buffer_reads;
 	struct mmio *mmio;
 	struct parms *parms;
 	struct client **client;
@@ -152,7 +192,9 @@ struct cmd {
 	uint8_t dbg_id;
 	uint64_t lock_addr;
 	uint64_t res_addr;
+	uint64_t seq;
 	uint32_t credits;
+	int *pending;
 	int max_clients;
 #if defined PSL9 || PSL9lite
 	uint32_t pagesize;
@@ -165,6 +207,15 @@ struct cmd *cmd_init(struct AFU_EVENT *afu_event, struct parms *parms,
 		     struct mmio *mmio, volatile enum pslse_state *state,
 		     char *afu_name, FILE * dbg_fp, uint8_t dbg_id);
 
+void cmd_free(struct cmd *cmd);
+
+void cmd_free_event(struct cmd *cmd, struct cmd_event *event);
+
+void cmd_set_state(struct cmd *cmd, struct cmd_event *event,
+		   enum mem_state state);
+
+void cmd_flush_writes(struct cmd *cmd, struct client *client);
+
 void handle_cmd(struct cmd *cmd, uint32_t parity_enabled, uint32_t latency);
 
 void handle_buffer_read(struct cmd *cmd);
@@ -18,10 +18,12 @@
  * Description: mmio.c
  *
  *  This file contains the code for MMIO access to the AFU including the
- *  AFU descriptor space.  Only one MMIO access is legal at a time.  So each
- *  client only tracks up to one mmio_access at a time.  However, since a
- *  "directed mode" AFU may have multiple clients attached the mmio struct
- *  tracks multiple mmio accesses with the element "list."  As MMIO requests
+ *  AFU descriptor space.  Only one MMIO access to the AFU is legal at a time,
+ *  but a client may have several requests outstanding.  Its mmio_access points
+ *  to the oldest and the rest are chained through _access in the order they
+ *  must be acknowledged.  Since a "directed mode" AFU may also have multiple
+ *  clients attached the mmio struct tracks all the mmio accesses with the
+ *  element "list."  As MMIO requests
  *  are received from clients they are added to the list and handled in FIFO
  *  order.  The _add_event() function places each new MMIO event on the list
  *  as they are received from a client.  The psl code will periodically call
@@ -32,8 +34,14 @@
  *  the list head to the next event so that the next MMIO request can be sent.
  *  However, the event still lives and the client will still point to it.  When
  *  the psl code next calls handle_mmio_done for that client it will return the
- *  acknowledge as well as any data to the client.  At that point the event
- *  memory will be freed.
+ *  acknowledge as well as any data to the client for each of its accesses that
+ *  are done.  At that point the event
+ *  memory will be freed.  A client may also send a batch of MMIO requests in
+ *  one message.  Each access in the batch becomes its own event on the list,
+ *  chained to the first through _batch, and the client tracks the first.  The
+ *  batch is acknowledged in one message once its last access completes.
+ *  Bulk reads of the AFU descriptor space, such as dumping the error buffer,
+ *  are handled the same way as a batch of descriptor reads.
  */
 
 #include <arpa/inet.h>
@@ -101,8 +109,12 @@ static struct mmio_event *_add_event(struct mmio *mmio, struct client *client,
 	// event->addr = addr;
 	event->desc = desc;
 	event->data = data;
+	event->batch = 0;
+	event->ack = 0;
 	event->state = PSLSE_IDLE;
 	event->_next = NULL;
+	event->_batch = NULL;
+	event->_access = NULL;
 
 	// debug the mmio and print the input address and the translated address
 	// debug_msg("_add_event: %s: WRITE%d word=0x%05x (0x%05x) data=0x%s", 
@@ -139,14 +151,17 @@ static struct mmio_event *_add_mmio(struct mmio *mmio, struct client *client,
 	return _add_event(mmio, client, rnw, dw, addr, 0, data);
 }
 
-static void _wait_for_done(enum pslse_state *state, pthread_mutex_t * lock)
+// Sleep until the psl thread signals that the MMIO has completed
+static void _wait_for_done(enum pslse_state *state, pthread_mutex_t * lock,
+			   pthread_cond_t * done)
 {
-	while (*state != PSLSE_DONE)	/* infinite loop */
-		lock_delay(lock);
+	while (*state != PSLSE_DONE)
+		pthread_cond_wait(done, lock);
 }
 
 // Read the entire AFU descriptor and keep a copy
-int read_descriptor(struct mmio *mmio, pthread_mutex_t * lock)
+int read_descriptor(struct mmio *mmio, pthread_mutex_t * lock,
+		    pthread_cond_t * done)
 {
 	struct mmio_event *event00, *event20, *event28, *event30, *event38,
 	    *event40, *event48;
@@ -161,7 +176,7 @@ int read_descriptor(struct mmio *mmio, pthread_mutex_t * lock)
 	event48 = _add_desc(mmio, 1, 1, 0x48 >> 2, 0L);
 
 	// Store data from reads
-	_wait_for_done(&(event00->state), lock);
+	_wait_for_done(&(event00->state), lock, done);
 	mmio->desc.req_prog_model = (uint16_t) event00->data & 0xffffl;
 	mmio->desc.num_of_afu_CRs = (uint16_t) (event00->data >> 16) & 0xffffl;
 	mmio->desc.num_of_processes =
@@ -170,27 +185,27 @@ int read_descriptor(struct mmio *mmio, pthread_mutex_t * lock)
 	    (uint16_t) (event00->data >> 48) & 0xffffl;
 	free(event00);
 
-	_wait_for_done(&(event20->state), lock);
+	_wait_for_done(&(event20->state), lock, done);
 	mmio->desc.AFU_CR_len = event20->data;
 	free(event20);
 
-	_wait_for_done(&(event28->state), lock);
+	_wait_for_done(&(event28->state), lock, done);
 	mmio->desc.AFU_CR_offset = event28->data;
 	free(event28);
 
-	_wait_for_done(&(event30->state), lock);
+	_wait_for_done(&(event30->state), lock, done);
 	mmio->desc.PerProcessPSA = event30->data;
 	free(event30);
 
-	_wait_for_done(&(event38->state), lock);
+	_wait_for_done(&(event38->state), lock, done);
 	mmio->desc.PerProcessPSA_offset = event38->data;
 	free(event38);
 
-	_wait_for_done(&(event40->state), lock);
+	_wait_for_done(&(event40->state), lock, done);
 	mmio->desc.AFU_EB_len = event40->data;
 	free(event40);
 
-	_wait_for_done(&(event48->state), lock);
+	_wait_for_done(&(event48->state), lock, done);
 	mmio->desc.AFU_EB_offset = event48->data;
 	free(event48);
 
@@ -227,7 +242,7 @@ int read_descriptor(struct mmio *mmio, pthread_mutex_t * lock)
 	eventclass = _add_desc(mmio, 1, 0, (crstart+8) >> 2, 0L);
 	
 	// Store data from reads
-	_wait_for_done(&(eventdevven->state), lock);
+	_wait_for_done(&(eventdevven->state), lock, done);
 	//debug_msg("XXXX: DATA: = %08x\n", eventdevven->data);
 	//cr_array->cr_vendor = (uint16_t) (eventdevven->data >> 48) & 0xffffl;
 	cr_array->cr_vendor = (uint16_t) (eventdevven->data >> 16);
@@ -236,7 +251,7 @@ int read_descriptor(struct mmio *mmio, pthread_mutex_t * lock)
         debug_msg("%x:%x CR dev & vendor", cr_array->cr_device, cr_array->cr_vendor);
         free(eventdevven);
         	debug_msg("%x:%x CR dev & vendor swapped", ntohs(cr_array->cr_device),ntohs(cr_array->cr_vendor));
-        _wait_for_done(&(eventclass->state), lock);
+        _wait_for_done(&(eventclass->state), lock, done);
 	cr_array->cr_class = (uint32_t) (eventclass->data >> 32) & 0xffffffffl;
         free(eventclass);
         }
@@ -344,6 +359,46 @@ void handle_mmio_ack(struct mmio *mmio, uint32_t parity_enabled)
 	}
 }
 
+// Add event to the accesses client is waiting on
+static void _queue_access(struct client *client, struct mmio_event *event)
+{
+	struct mmio_event *last;
+
+	if (event == NULL)
+		return;
+	last = (struct mmio_event *)client->mmio_last;
+	if (client->mmio_access == NULL)
+		client->mmio_access = (void *)event;
+	else
+		last->_access = event;
+	client->mmio_last = (void *)event;
+}
+
+// Queue acknowledge for a request that needs no AFU access behind the
+// client's outstanding accesses so it is returned in order
+static void _queue_ack(struct client *client, uint8_t ack)
+{
+	struct mmio_event *event;
+
+	event = (struct mmio_event *)calloc(1, sizeof(struct mmio_event));
+	if (!event) {
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+		return;
+	}
+	event->ack = ack;
+	event->state = PSLSE_DONE;
+	_queue_access(client, event);
+}
+
+// Is offset within the MMIO space client may access?  Addresses sent to the
+// AFU are word addresses of MMIO_FULL_RANGE bytes.
+static int _mmio_in_range(struct client *client, uint32_t offset)
+{
+	if (client->type == 's')
+		return offset < client->mmio_size;
+	return offset < MMIO_FULL_RANGE;
+}
+
 // Handle MMIO map request from client
 void handle_mmio_map(struct mmio *mmio, struct client *client)
 {
@@ -364,8 +419,7 @@ void handle_mmio_map(struct mmio *mmio, struct client *client)
 		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
 		warn_msg("Socket failure with client context %d",
 			 client->context);
-		ack = PSLSE_MMIO_FAIL;
-		goto map_done;
+		return;
 	}
 	// Check flags value and set
 	if (!mmio->flags) {
@@ -380,11 +434,8 @@ void handle_mmio_map(struct mmio *mmio, struct client *client)
 	}
 
  map_done:
-	// Send acknowledge to client
-	if (put_bytes(fd, 1, &ack, mmio->dbg_fp, mmio->dbg_id, client->context)
-	    < 0) {
-		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-	}
+	// Acknowledge to client once its earlier accesses are acknowledged
+	_queue_ack(client, ack);
 }
 
 // Add mmio write event of register at offset to list
@@ -421,6 +472,12 @@ static struct mmio_event *_handle_mmio_write(struct mmio *mmio,
 		data <<= 32;
 		data |= (uint64_t) data32;
 	}
+	if (!_mmio_in_range(client, offset)) {
+		warn_msg("MMIO write offset 0x%x out of range for context %d",
+			 offset, client->context);
+		_queue_ack(client, PSLSE_MMIO_FAIL);
+		return NULL;
+	}
 	event = _add_mmio(mmio, client, 0, dw, offset / 4, data);
 	return event;
 
@@ -445,6 +502,12 @@ static struct mmio_event *_handle_mmio_read(struct mmio *mmio,
 		goto read_fail;
 	}
 	offset = ntohl(offset);
+	if (!_mmio_in_range(client, offset)) {
+		warn_msg("MMIO read offset 0x%x out of range for context %d",
+			 offset, client->context);
+		_queue_ack(client, PSLSE_MMIO_FAIL);
+		return NULL;
+	}
 	event = _add_mmio(mmio, client, 1, dw, offset / 4, 0);
 	return event;
 
@@ -485,44 +548,252 @@ static struct mmio_event *_handle_mmio_read_eb(struct mmio *mmio,
 }
 
 
+// Get the read/write and size of a batched MMIO access of type
+static int _batch_op(uint8_t type, uint32_t * rnw, uint32_t * dw)
+{
+	switch (type) {
+	case PSLSE_MMIO_WRITE64:
+		*rnw = 0;
+		*dw = 1;
+		return 0;
+	case PSLSE_MMIO_WRITE32:
+		*rnw = 0;
+		*dw = 0;
+		return 0;
+	case PSLSE_MMIO_READ64:
+		*rnw = 1;
+		*dw = 1;
+		return 0;
+	case PSLSE_MMIO_READ32:
+		*rnw = 1;
+		*dw = 0;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+// Handle batch of MMIO requests from client.  All accesses are added to the
+// list back to back and the first is returned with the rest chained to it.
+struct mmio_event *handle_mmio_batch(struct mmio *mmio, struct client *client)
+{
+	struct mmio_event *first, *event;
+	struct mmio_event **batch;
+	uint8_t *buffer, *op;
+	uint64_t data;
+	uint32_t offset, data32, rnw, dw;
+	uint16_t count;
+	uint8_t ack;
+	int i, fd = client->fd;
+
+	if (get_bytes_silent(fd, 2, (uint8_t *) & count, mmio->timeout,
+			     &(client->abort)) < 0) {
+		goto batch_fail;
+	}
+	count = ntohs(count);
+	if ((count == 0) || (count > PSLSE_MMIO_BATCH_MAX)) {
+		warn_msg("MMIO batch of %d accesses from client context %d",
+			 count, client->context);
+		goto batch_fail;
+	}
+	buffer = (uint8_t *) malloc(count * PSLSE_MMIO_BATCH_OP);
+	if (get_bytes_silent(fd, count * PSLSE_MMIO_BATCH_OP, buffer,
+			     mmio->timeout, &(client->abort)) < 0) {
+		free(buffer);
+		goto batch_fail;
+	}
+
+	// Check the whole batch before queuing any of it
+	ack = PSLSE_MMIO_ACK;
+	rnw = 0;
+	dw = 0;
+	if (client->state != CLIENT_VALID)
+		ack = PSLSE_MMIO_FAIL;
+	for (i = 0; i < count; i++) {
+		op = &(buffer[i * PSLSE_MMIO_BATCH_OP]);
+		if (_batch_op(op[0], &rnw, &dw) < 0) {
+			warn_msg("Bad MMIO batch access type 0x%02x", op[0]);
+			ack = PSLSE_MMIO_FAIL;
+		}
+		memcpy(&offset, &(op[1]), sizeof(offset));
+		if (!_mmio_in_range(client, ntohl(offset))) {
+			warn_msg("MMIO batch offset 0x%x out of range",
+				 ntohl(offset));
+			ack = PSLSE_MMIO_FAIL;
+		}
+	}
+	if (ack == PSLSE_MMIO_FAIL) {
+		free(buffer);
+		_queue_ack(client, ack);
+		return NULL;
+	}
+
+	first = NULL;
+	batch = &first;
+	for (i = 0; i < count; i++) {
+		op = &(buffer[i * PSLSE_MMIO_BATCH_OP]);
+		_batch_op(op[0], &rnw, &dw);
+		memcpy(&offset, &(op[1]), sizeof(offset));
+		offset = ntohl(offset);
+		memcpy(&data, &(op[5]), sizeof(data));
+		data = ntohll(data);
+		if (!dw) {
+			data32 = (uint32_t) data;
+			data = (uint64_t) data32;
+			data <<= 32;
+			data |= (uint64_t) data32;
+		}
+		event = _add_mmio(mmio, client, rnw, dw, offset / 4, data);
+		event->batch = 1;
+		*batch = event;
+		batch = &(event->_batch);
+	}
+	free(buffer);
+	_queue_access(client, first);
+	return first;
+
+ batch_fail:
+	// Socket connection is dead
+	debug_msg("%s:handle_mmio_batch failed context=%d",
+		  mmio->afu_name, client->context);
+	client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+	return NULL;
+}
+
+// Handle bulk read of a range of the descriptor space, or of the AFU error
+// buffer within it, from client.  Each dword is read back to back and all the
+// data is returned together like a batch of reads.
+struct mmio_event *handle_mmio_desc_read(struct mmio *mmio,
+					 struct client *client)
+{
+	struct mmio_event *first, *event;
+	struct mmio_event **batch;
+	uint8_t buffer[1 + sizeof(uint32_t) + sizeof(uint16_t)];
+	uint32_t offset;
+	uint16_t count;
+	int i, fd = client->fd;
+
+	if (get_bytes_silent(fd, sizeof(buffer), buffer, mmio->timeout,
+			     &(client->abort)) < 0) {
+		debug_msg("%s:handle_mmio_desc_read failed context=%d",
+			  mmio->afu_name, client->context);
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+		return NULL;
+	}
+	memcpy(&offset, &(buffer[1]), sizeof(offset));
+	offset = ntohl(offset);
+	memcpy(&count, &(buffer[1 + sizeof(offset)]), sizeof(count));
+	count = ntohs(count);
+	if (buffer[0] == PSLSE_DESC_ERROR_BUFFER)
+		offset += (uint32_t) mmio->desc.AFU_EB_offset;
+
+	if ((client->state != CLIENT_VALID) || (offset & 0x7) ||
+	    (count == 0) || (count > PSLSE_MMIO_BATCH_MAX)) {
+		warn_msg("Bad descriptor read of %d dwords at 0x%x", count,
+			 offset);
+		_queue_ack(client, PSLSE_MMIO_FAIL);
+		return NULL;
+	}
+
+	first = NULL;
+	batch = &first;
+	for (i = 0; i < count; i++) {
+		event = _add_desc(mmio, 1, 1, (offset >> 2) + (i * 2), 0);
+		event->batch = 1;
+		*batch = event;
+		batch = &(event->_batch);
+	}
+	_queue_access(client, first);
+	return first;
+}
+
 // Handle MMIO request from client
 struct mmio_event *handle_mmio(struct mmio *mmio, struct client *client,
 			       int rnw, int dw, int eb_rd)
 {
-	uint8_t ack;
+	struct mmio_event *event;
 
 	// Only allow MMIO access when client is valid
 	if (client->state != CLIENT_VALID) {
-		ack = PSLSE_MMIO_FAIL;
-		if (put_bytes(client->fd, 1, &ack, mmio->dbg_fp, mmio->dbg_id,
-			      client->context) < 0) {
-			client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
-		}
+		_queue_ack(client, PSLSE_MMIO_FAIL);
 		return NULL;
 	}
 
-	if (eb_rd) 
-		return _handle_mmio_read_eb(mmio, client, dw);
-
-	if (rnw)
-		return _handle_mmio_read(mmio, client, dw);
+	if (eb_rd)
+		event = _handle_mmio_read_eb(mmio, client, dw);
+	else if (rnw)
+		event = _handle_mmio_read(mmio, client, dw);
 	else
-		return _handle_mmio_write(mmio, client, dw);
+		event = _handle_mmio_write(mmio, client, dw);
+	_queue_access(client, event);
+	return event;
 }
 
-// Handle MMIO done
-struct mmio_event *handle_mmio_done(struct mmio *mmio, struct client *client)
+// Return acknowledge for batch starting at first once all of it is done, with
+// 64 bits of data for each read in the batch
+static struct mmio_event *_handle_mmio_batch_done(struct mmio *mmio,
+						  struct client *client,
+						  struct mmio_event *first)
+{
+	struct mmio_event *event, *next;
+	uint64_t data64;
+	uint8_t *buffer;
+	int size;
+
+	size = 1;
+	for (event = first; event != NULL; event = event->_batch) {
+		if (event->state != PSLSE_DONE)
+			return first;
+		if (event->rnw)
+			size += sizeof(data64);
+	}
+
+	buffer = (uint8_t *) malloc(size);
+	buffer[0] = PSLSE_MMIO_ACK;
+	size = 1;
+	event = first;
+	while (event != NULL) {
+		if (event->rnw) {
+			data64 = htonll(event->data);
+			memcpy(&(buffer[size]), &data64, sizeof(data64));
+			size += sizeof(data64);
+		}
+		next = event->_batch;
+		free(event);
+		event = next;
+	}
+	if (put_bytes(client->fd, size, buffer, mmio->dbg_fp, mmio->dbg_id,
+		      client->context) < 0) {
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+	}
+	debug_mmio_return(mmio->dbg_fp, mmio->dbg_id, client->context);
+	free(buffer);
+
+	return NULL;
+}
+
+// Return acknowledge for event if it is done
+static struct mmio_event *_handle_mmio_access_done(struct mmio *mmio,
+						   struct client *client,
+						   struct mmio_event *event)
 {
-	struct mmio_event *event;
 	uint64_t data64;
 	uint32_t data32;
 	uint8_t *buffer;
 	int fd = client->fd;
 
-	// Is there an MMIO event pending?
-	event = (struct mmio_event *)client->mmio_access;
-	if (event == NULL)
+	if (event->batch)
+		return _handle_mmio_batch_done(mmio, client, event);
+
+	// Acknowledge without AFU access
+	if (event->ack) {
+		if (put_bytes(fd, 1, &(event->ack), mmio->dbg_fp, mmio->dbg_id,
+			      client->context) < 0) {
+			client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+		}
+		free(event);
 		return NULL;
+	}
 
 	// MMIO event not done yet
 	if (event->state != PSLSE_DONE)
@@ -567,6 +838,25 @@ struct mmio_event *handle_mmio_done(struct mmio *mmio, struct client *client)
 	return NULL;
 }
 
+// Handle MMIO done, acknowledging the client's accesses in order up to the
+// first that is still outstanding, which is returned
+struct mmio_event *handle_mmio_done(struct mmio *mmio, struct client *client)
+{
+	struct mmio_event *event, *next;
+
+	event = (struct mmio_event *)client->mmio_access;
+	while (event != NULL) {
+		next = event->_access;
+		if (_handle_mmio_access_done(mmio, client, event) != NULL)
+			return event;
+		// Client dropped on socket failure
+		if (client->state == CLIENT_NONE)
+			return NULL;
+		event = next;
+	}
+	return NULL;
+}
+
 int dedicated_mode_support(struct mmio *mmio)
 {
 	return ((mmio->desc.req_prog_model & PROG_MODEL_MASK) ==
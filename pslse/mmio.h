@@ -47,8 +47,12 @@ struct mmio_event {
 	uint32_t desc;
 	uint64_t data;
 	uint32_t parity;
+	uint32_t batch;
+	uint8_t ack;
 	enum pslse_state state;
 	struct mmio_event *_next;
+	struct mmio_event *_batch;
+	struct mmio_event *_access;
 };
 
 struct config_record  {
@@ -88,7 +92,8 @@ struct mmio {
 struct mmio *mmio_init(struct AFU_EVENT *afu_event, int timeout, char *afu_name,
 		       FILE * dbg_fp, uint8_t dbg_id);
 
-int read_descriptor(struct mmio *mmio, pthread_mutex_t * lock);
+int read_descriptor(struct mmio *mmio, pthread_mutex_t * lock,
+		    pthread_cond_t * done);
 
 struct mmio_event *add_mmio(struct mmio *mmio, uint32_t rnw, uint32_t dw,
 			    uint32_t addr, uint64_t data);
@@ -102,6 +107,11 @@ void handle_mmio_map(struct mmio *mmio, struct client *client);
 struct mmio_event *handle_mmio(struct mmio *mmio, struct client *client,
 			       int rnw, int dw, int eb_rd);
 
+struct mmio_event *handle_mmio_batch(struct mmio *mmio, struct client *client);
+
+struct mmio_event *handle_mmio_desc_read(struct mmio *mmio,
+					 struct client *client);
+
 struct mmio_event *handle_mmio_done(struct mmio *mmio, struct client *client);
 
 int dedicated_mode_support(struct mmio *mmio);
@@ -103,6 +103,10 @@ struct parms *parse_parms(char *filename, FILE * dbg_fp)
 	parms->paged_percent = 5;
 	parms->reorder_percent = 20;
 	parms->buffer_percent = 50;
+	parms->buffer_reads = MAX_BUFFER_READS;
+	parms->direct_memory = 0;
+	parms->prefetch_lines = 0;
+	parms->write_combine = 0;
 
 	// Open file and parse contents
 	fp = fopen(filename, "r");
@@ -199,6 +203,47 @@ struct parms *parse_parms(char *filename, FILE * dbg_fp)
 				parms->buffer_percent = data;
 			debug_parm(dbg_fp, DBG_PARM_BUFFER_PERCENT,
 				   parms->buffer_percent);
+		} else if (!(strcmp(parm, "BUFFER_READS"))) {
+			data = atoi(value);
+			if ((data > MAX_BUFFER_READS) || (data <= 0))
+				warn_msg("BUFFER_READS must be 1-%d",
+					 MAX_BUFFER_READS);
+			else
+				parms->buffer_reads = data;
+			debug_parm(dbg_fp, DBG_PARM_BUFFER_READS,
+				   parms->buffer_reads);
+		} else if (!(strcmp(parm, "DIRECT_MEMORY"))) {
+			data = atoi(value);
+			if ((data > 1) || (data < 0))
+				warn_msg("DIRECT_MEMORY must be 0 or 1");
+			else
+				parms->direct_memory = data;
+			debug_parm(dbg_fp, DBG_PARM_DIRECT_MEMORY,
+				   parms->direct_memory);
+		} else if (!(strcmp(parm, "PREFETCH_LINES"))) {
+			data = atoi(value);
+			if ((data > MAX_PREFETCH_LINES) || (data < 0))
+				warn_msg("PREFETCH_LINES must be 0-%d",
+					 MAX_PREFETCH_LINES);
+			else
+				parms->prefetch_lines = data;
+			debug_parm(dbg_fp, DBG_PARM_PREFETCH_LINES,
+				   parms->prefetch_lines);
+		} else if (!(strcmp(parm, "WRITE_COMBINE"))) {
+			data = atoi(value);
+			if ((data > MAX_WRITE_COMBINE) || (data < 0))
+				warn_msg("WRITE_COMBINE must be 0-%d",
+					 MAX_WRITE_COMBINE);
+			else
+				parms->write_combine = data;
+			debug_parm(dbg_fp, DBG_PARM_WRITE_COMBINE,
+				   parms->write_combine);
+		} else if (!(strcmp(parm, "LOG_LEVEL"))) {
+			// PSLSE_LOG_LEVEL in the environment takes precedence
+			if (!getenv("PSLSE_LOG_LEVEL") &&
+			    (msg_level_set(value) < 0))
+				warn_msg("LOG_LEVEL must be fatal, error, warn, "
+					 "info, debug or 0-4");
 		} else if (!(strcmp(parm, "CAIA_VERSION"))) {
 			parms->caia_version = atoi(value);
 			debug_parm(dbg_fp, DBG_CAIA_VERSION, parms->caia_version);
@@ -223,18 +268,28 @@ struct parms *parse_parms(char *filename, FILE * dbg_fp)
 	srand(parms->seed);
 
 	// Print out parm settings
-	info_msg("PSLSE parm values:");
-	printf("\tSeed     = %d\n", parms->seed);
-	if (parms->credits != DEFAULT_CREDITS)
-		printf("\tCredits  = %d\n", parms->credits);
-	if (parms->timeout)
-		printf("\tTimeout  = %d seconds\n", parms->timeout);
-	else
-		printf("\tTimeout  = DISABLED\n");
-	printf("\tResponse = %d%%\n", parms->resp_percent);
-	printf("\tPaged    = %d%%\n", parms->paged_percent);
-	printf("\tReorder  = %d%%\n", parms->reorder_percent);
-	printf("\tBuffer   = %d%%\n", parms->buffer_percent);
+	if (msg_enabled(MSG_LEVEL_INFO)) {
+		info_msg("PSLSE parm values:");
+		printf("\tSeed     = %d\n", parms->seed);
+		if (parms->credits != DEFAULT_CREDITS)
+			printf("\tCredits  = %d\n", parms->credits);
+		if (parms->timeout)
+			printf("\tTimeout  = %d seconds\n", parms->timeout);
+		else
+			printf("\tTimeout  = DISABLED\n");
+		printf("\tResponse = %d%%\n", parms->resp_percent);
+		printf("\tPaged    = %d%%\n", parms->paged_percent);
+		printf("\tReorder  = %d%%\n", parms->reorder_percent);
+		printf("\tBuffer   = %d%%\n", parms->buffer_percent);
+		if (parms->buffer_reads != MAX_BUFFER_READS)
+			printf("\tReads    = %d\n", parms->buffer_reads);
+		if (parms->direct_memory)
+			printf("\tDirect memory access enabled\n");
+		if (parms->prefetch_lines)
+			printf("\tPrefetch = %d lines\n", parms->prefetch_lines);
+		if (parms->write_combine)
+			printf("\tCombine  = %d cycles\n", parms->write_combine);
+	}
 //When we start reading these values in from pslse.parms, uncomment
 //	printf("\tCAIA_Ver     = %4d\n", parms->caia_version);
 //	printf("\tPSL_REV      = %d\n", parms->psl_rev_level);
@@ -20,6 +20,16 @@
 #include <stdio.h>
 #include "../common/psl_interface.h"
 
+// Most buffer reads PSL keeps in flight, one per clock of the longest
+// ah_brlat latency plus the clock the data returns on
+#define MAX_BUFFER_READS 4
+
+// Most host memory lines libcxl reads ahead of a sequential stream
+#define MAX_PREFETCH_LINES 16
+
+// Most clock cycles PSLSE holds AFU writes back to combine them
+#define MAX_WRITE_COMBINE 4096
+
 struct parms {
 	unsigned int timeout;
 	unsigned int credits;
@@ -31,6 +41,10 @@ struct parms {
 	unsigned int paged_percent;
 	unsigned int reorder_percent;
 	unsigned int buffer_percent;
+	unsigned int buffer_reads;
+	unsigned int direct_memory;
+	unsigned int prefetch_lines;
+	unsigned int write_combine;
 	unsigned int caia_version;
 	unsigned int psl_rev_level;
 	unsigned int image_loaded;
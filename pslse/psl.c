@@ -22,44 +22,76 @@
  *  psl struct if successful.  Finally it starts a _psl_loop thread for
  *  that AFU that will monitor any incoming socket data from either the
  *  simulator (AFU) or any clients (applications) that attach to this
- *  AFU.  The code in here is just the foundation for the psl.  The code
- *  for handling jobs, commands and mmios are each in there own separate files.
+ *  AFU.  Each psl has its own lock.  The _psl_loop thread holds it except
+ *  while waiting on the AFU or, once clocks have stopped, while sleeping in
+ *  epoll_wait() on the client sockets and the psl wake_fd eventfd.  Each
+ *  pass of the loop makes one epoll_wait() call, only reads from clients
+ *  that are ready and only visits the contexts in the active list.  Other
+ *  threads that queue work for the AFU call psl_wake() and threads waiting
+ *  for AFU work to complete sleep on the psl done condition.  The code in
+ *  here is just the foundation for the psl.  The code for handling jobs,
+ *  commands and mmios are each in there own separate files.
  */
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
-#include <poll.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "mmio.h"
 #include "psl.h"
 #include "../common/debug.h"
 #include "../common/psl_interface.h"
 
+#define PSL_EPOLL_EVENTS 64
+#define PSL_EPOLL_WAKE 0xFFFFFFFF
+
 // are there any pending commands with this context?
 int _is_cmd_pending(struct psl *psl, int32_t context)
 {
-  struct cmd_event *cmd_event;
-
-  if ( psl->cmd == NULL ) {
+  if ( ( psl->cmd == NULL ) || ( psl->cmd->pending == NULL ) ) {
     // no cmd struct
     return 0;
   }
 
-  cmd_event = psl->cmd->list;
-  while ( cmd_event != NULL ) {
-    if ( cmd_event->context == context ) {
-      // found a matching element
-      return 1;
-    }
-    cmd_event = cmd_event->_next;
-  }
+  // count of outstanding events for this context
+  return ( psl->cmd->pending[context] != 0 );
+
+}
 
-  // no matching elements found
-  return 0;
+// Use the pid and address of a copy of it sent by the application at attach
+// to reach its memory directly, if enabled and the application is on this host
+static void _attach_direct(struct psl *psl, struct client *client,
+			   uint8_t * buffer)
+{
+	uint32_t pid, check;
+	uint64_t addr;
 
+	client->pid = 0;
+	if (!psl->cmd->parms->direct_memory)
+		return;
+	memcpy((char *)&pid, (char *)buffer, sizeof(uint32_t));
+	memcpy((char *)&addr, (char *)&(buffer[sizeof(uint32_t)]),
+	       sizeof(uint64_t));
+	pid = ntohl(pid);
+	addr = ntohll(addr);
+	client->pid = pid;
+	check = 0;
+	if ((pid == 0) ||
+	    (client_mem_copy(client, addr, (uint8_t *) & check,
+			     sizeof(uint32_t), 0) < 0) || (check != pid)) {
+		info_msg("%s context %d memory accessed over socket",
+			 psl->name, client->context);
+		client->pid = 0;
+		return;
+	}
+	info_msg("%s context %d memory accessed directly in pid %d",
+		 psl->name, client->context, pid);
 }
 
 // Attach to AFU
@@ -77,7 +109,7 @@ static void _attach(struct psl *psl, struct client *client)
 	// always do the get
         // pass the wed only for dedicated
 	ack = PSLSE_DETACH;
-	size = sizeof(uint64_t);
+	size = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t);
 	if (get_bytes_silent(client->fd, size, buffer, psl->timeout,
 			     &(client->abort)) < 0) {
 	  warn_msg("Failed to get WED value from client");
@@ -96,6 +128,7 @@ static void _attach(struct psl *psl, struct client *client)
 #else
 	client->wed = ntohll(wed);
 #endif 
+	_attach_direct(psl, client, &(buffer[sizeof(uint64_t)]));
 
 	// Send start to AFU
 	// only add PSL_JOB_START for dedicated and master clients.
@@ -155,7 +188,17 @@ static void _attach(struct psl *psl, struct client *client)
 	}
 
  attach_done:
-	if (put_bytes(client->fd, 1, &ack, psl->dbg_fp, psl->dbg_id,
+	// A successful attach also tells libcxl how many lines to read ahead,
+	// which is pointless when its memory is read directly
+	buffer[0] = ack;
+	size = 1;
+	if (ack == PSLSE_ATTACH) {
+		client->prefetch_lines = 0;
+		if (client->pid == 0)
+			client->prefetch_lines = psl->cmd->parms->prefetch_lines;
+		buffer[size++] = client->prefetch_lines;
+	}
+	if (put_bytes(client->fd, size, buffer, psl->dbg_fp, psl->dbg_id,
 		      client->context) < 0) {
 		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
 	}
@@ -200,29 +243,79 @@ static void _detach(struct psl *psl, struct client *client)
 	
 }
 
+// Add newly associated client to the context table, the active list and
+// the epoll set.  Called with psl->lock held.
+int psl_add_client(struct psl *psl, struct client *client)
+{
+	struct epoll_event ev;
+	int i;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = client->context;
+	if (epoll_ctl(psl->epoll_fd, EPOLL_CTL_ADD, client->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	psl->client[client->context] = client;
+
+	// Keep active list in context order so clients are served as before
+	i = psl->active_count++;
+	while ((i > 0) && (psl->active[i - 1] > client->context)) {
+		psl->active[i] = psl->active[i - 1];
+		--i;
+	}
+	psl->active[i] = client->context;
+	return 0;
+}
+
+// Remove released client from the context table and the active list, then
+// hand it back to main() to free
+static void _remove_client(struct psl *psl, int context)
+{
+	struct client *client;
+	int i;
+
+	client = psl->client[context];
+	psl->client[context] = NULL;
+	for (i = 0; i < psl->active_count; i++) {
+		if (psl->active[i] == context)
+			break;
+	}
+	if (i < psl->active_count) {
+		--psl->active_count;
+		for (; i < psl->active_count; i++)
+			psl->active[i] = psl->active[i + 1];
+	}
+	__atomic_store_n(&(client->detached), 1, __ATOMIC_RELEASE);
+}
+
 // Client release from AFU
 static void _free(struct psl *psl, struct client *client)
 {
 	struct cmd_event *mem_access;
+	int i;
 
 	// DEBUG
 	debug_context_remove(psl->dbg_fp, psl->dbg_id, client->context);
 
 	info_msg("%s client disconnect from %s context %d", client->ip,
 		 psl->name, client->context);
+	epoll_ctl(psl->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
 	close_socket(&(client->fd));
 	if (client->ip)
 		free(client->ip);
 	client->ip = NULL;
-	mem_access = (struct cmd_event *)client->mem_access;
-	if (mem_access != NULL) {
-		if (mem_access->state != MEM_DONE) {
+	for (i = 0; client->mem_pending && (i < CLIENT_MEM_REQUESTS); i++) {
+		mem_access = (struct cmd_event *)client_mem_response(client, i);
+		for (; mem_access != NULL; mem_access = mem_access->_combine) {
+			if (mem_access->state == MEM_DONE)
+				continue;
 			mem_access->resp = PSL_RESPONSE_FAILED;
-			mem_access->state = MEM_DONE;
+			cmd_set_state(psl->cmd, mem_access, MEM_DONE);
 		}
 	}
-	client->mem_access = NULL;
 	client->mmio_access = NULL;
+	client->mmio_last = NULL;
 	client->state = CLIENT_NONE;
 
 	psl->attached_clients--;
@@ -354,7 +447,7 @@ int _handle_aux2(struct psl *psl, uint32_t * parity, uint32_t * latency,
 			    	      psl->dbg_fp, psl->dbg_id,
 			    	      psl->client[context]->context);
 			    _free( psl, psl->client[context] );
-			    psl->client[context] = NULL;  // I don't like this part...
+			    _remove_client(psl, context);  // I don't like this part...
 			    break;
 			  default:
 			    debug_msg("%s,%d:_handle_aux2: acked llcmd %d did not match an LLCMD pe", 
@@ -465,9 +558,77 @@ static void _handle_afu(struct psl *psl)
 	}
 }
 
+// Get the request id of a memory acknowledgement from client and return the
+// event it answers.  The rest of an acknowledgement for an unknown id can't be
+// parsed so the client is dropped.
+static struct cmd_event *_mem_response(struct psl *psl, struct client *client)
+{
+	struct cmd_event *event;
+	uint16_t id;
+
+	if (get_bytes_silent(client->fd, sizeof(id), (uint8_t *) & id,
+			     psl->timeout, &(client->abort)) < 0) {
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+		return NULL;
+	}
+	id = ntohs(id);
+	event = (struct cmd_event *)client_mem_response(client, id);
+	if (event == NULL) {
+		warn_msg("%s:Memory acknowledgement for unknown request id %d",
+			 psl->name, id);
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+	}
+	return event;
+}
+
+// Could the application have just changed memory for the AFU to use?  If so
+// lines it sent ahead can no longer be trusted.  Memory replies and reads of
+// the AFU don't hand it any new work.
+static int _handoff(uint8_t type)
+{
+	switch (type) {
+	case PSLSE_MEM_SUCCESS:
+	case PSLSE_MEM_FAILURE:
+	case PSLSE_MEMORY_PREFETCH:
+	case PSLSE_MMIO_MAP:
+	case PSLSE_MMIO_READ32:
+	case PSLSE_MMIO_READ64:
+	case PSLSE_MMIO_EBREAD:
+	case PSLSE_MMIO_DESC_READ:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+// Hold lines of client memory libcxl sent ahead of the AFU reading them
+static void _prefetch(struct psl *psl, struct client *client)
+{
+	uint8_t buffer[CACHELINE_BYTES];
+	uint64_t addr;
+	uint8_t count;
+
+	if (get_bytes_silent(client->fd, sizeof(count) + sizeof(addr), buffer,
+			     psl->timeout, &(client->abort)) < 0) {
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+		return;
+	}
+	count = buffer[0];
+	memcpy((char *)&addr, (char *)&(buffer[1]), sizeof(addr));
+	addr = ntohll(addr);
+	while (count--) {
+		if (get_bytes_silent(client->fd, CACHELINE_BYTES, buffer,
+				     psl->timeout, &(client->abort)) < 0) {
+			client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+			return;
+		}
+		client_prefetch_store(client, addr, buffer);
+		addr += CACHELINE_BYTES;
+	}
+}
+
 static void _handle_client(struct psl *psl, struct client *client)
 {
-	struct mmio_event *mmio;
 	struct cmd_event *cmd;
 	uint8_t buffer[MAX_LINE_CHARS];
 	int dw = 0;
@@ -483,18 +644,20 @@ static void _handle_client(struct psl *psl, struct client *client)
 		return;
 
 	// Check for event from application
-	cmd = (struct cmd_event *)client->mem_access;
-	mmio = NULL;
-	if (bytes_ready(client->fd, 1, &(client->abort))) {
+	if (client->ready) {
+		client->ready = 0;
 		if (get_bytes(client->fd, 1, buffer, psl->timeout,
 			      &(client->abort), psl->dbg_fp, psl->dbg_id,
 			      client->context) < 0) {
 			client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
 			return;
 		}
+		if (_handoff(buffer[0]))
+			client_prefetch_flush(client);
 		switch (buffer[0]) {
 		case PSLSE_DETACH:
 		        debug_msg("DETACH request from client context %d on socket %d", client->context, client->fd);
+			cmd_flush_writes(psl->cmd, client);
 		        //client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
 		        _detach(psl, client);
 			break;
@@ -502,15 +665,17 @@ static void _handle_client(struct psl *psl, struct client *client)
 			_attach(psl, client);
 			break;
 		case PSLSE_MEM_FAILURE:
-			if (client->mem_access != NULL)
+		case PSLSE_MEM_SUCCESS:	/*fall through */
+			cmd = _mem_response(psl, client);
+			if (cmd == NULL)
+				return;
+			if (buffer[0] == PSLSE_MEM_FAILURE)
 				handle_aerror(psl->cmd, cmd);
-			client->mem_access = NULL;
-			break;
-		case PSLSE_MEM_SUCCESS:
-			if (client->mem_access != NULL)
+			else
 				handle_mem_return(psl->cmd, cmd, client->fd);
-			client->mem_access = NULL;
-			debug_msg("PSL LOOP SETTING mem_access back to NULL");
+			break;
+		case PSLSE_MEMORY_PREFETCH:
+			_prefetch(psl, client);
 			break;
 		case PSLSE_MMIO_MAP:
 			handle_mmio_map(psl->mmio, client);
@@ -518,37 +683,121 @@ static void _handle_client(struct psl *psl, struct client *client)
 		case PSLSE_MMIO_WRITE64:
 			dw = 1;
 		case PSLSE_MMIO_WRITE32:	/*fall through */
-			mmio = handle_mmio(psl->mmio, client, 0, dw, 0);
+			handle_mmio(psl->mmio, client, 0, dw, 0);
 			break;
 		case PSLSE_MMIO_EBREAD:
                         eb_rd = 1;
 		case PSLSE_MMIO_READ64: /*fall through */
 			dw = 1;
 		case PSLSE_MMIO_READ32:	/*fall through */
-			mmio = handle_mmio(psl->mmio, client, 1, dw, eb_rd);
+			handle_mmio(psl->mmio, client, 1, dw, eb_rd);
+			break;
+		case PSLSE_MMIO_BATCH:
+			handle_mmio_batch(psl->mmio, client);
+			break;
+		case PSLSE_MMIO_DESC_READ:
+			handle_mmio_desc_read(psl->mmio, client);
 			break;
 		default:
 		  error_msg("Unexpected 0x%02x from client on socket", buffer[0], client->fd);
 		}
 
-		if (mmio)
-			client->mmio_access = (void *)mmio;
-
 		if (client->state == CLIENT_VALID)
 			client->idle_cycles = PSL_IDLE_CYCLES;
 	}
 }
 
+// Is there nothing waiting to be driven to the AFU?
+static int _psl_quiet(struct psl *psl)
+{
+	struct job_event *pe;
+
+	if ((psl->state == PSLSE_RESET) || (psl->mmio->list != NULL))
+		return 0;
+	if ((psl->cmd != NULL) && (psl->cmd->list != NULL))
+		return 0;
+	if ((psl->job->job != NULL) && (psl->job->job->state != PSLSE_PENDING))
+		return 0;
+	for (pe = psl->job->pe; pe != NULL; pe = pe->_next) {
+		if (pe->state == PSLSE_IDLE)
+			return 0;
+	}
+	return 1;
+}
+
+// Wake the PSL thread if it is sleeping with clocks stopped
+void psl_wake(struct psl *psl)
+{
+	uint64_t one = 1;
+
+	if (write(psl->wake_fd, &one, sizeof(one)) != sizeof(one))
+		debug_msg("%s:psl_wake: eventfd write failed", psl->name);
+}
+
+// Does any active client still have work in flight?
+static int _psl_busy(struct psl *psl)
+{
+	struct client *client;
+	int i;
+
+	for (i = 0; i < psl->active_count; i++) {
+		client = psl->client[psl->active[i]];
+		if (client->idle_cycles || (client->mmio_access != NULL))
+			return 1;
+	}
+	return 0;
+}
+
+// Mark clients with socket data waiting as ready, sleeping for up to timeout
+// ms.  The lock is only dropped if we might actually sleep.
+static void _psl_poll(struct psl *psl, int timeout)
+{
+	struct epoll_event ev[PSL_EPOLL_EVENTS];
+	struct client *client;
+	uint64_t count;
+	int i, n;
+
+	if (timeout != 0)
+		pthread_mutex_unlock(&(psl->lock));
+	do {
+		n = epoll_wait(psl->epoll_fd, ev, PSL_EPOLL_EVENTS, timeout);
+	} while ((n < 0) && (errno == EINTR));
+	if (timeout != 0)
+		pthread_mutex_lock(&(psl->lock));
+
+	for (i = 0; i < n; i++) {
+		if (ev[i].data.u32 == PSL_EPOLL_WAKE) {
+			if (read(psl->wake_fd, &count, sizeof(count)) !=
+			    sizeof(count))
+				debug_msg("%s:_psl_poll: eventfd read failed",
+					  psl->name);
+			continue;
+		}
+		client = psl->client[ev[i].data.u32];
+		if (client == NULL)
+			continue;
+		// Dropped client waiting to be freed, stop watching it
+		if (client->state == CLIENT_NONE) {
+			epoll_ctl(psl->epoll_fd, EPOLL_CTL_DEL, client->fd,
+				  NULL);
+			continue;
+		}
+		client->ready = 1;
+	}
+}
+
 // PSL thread loop
 static void *_psl_loop(void *ptr)
 {
 	struct psl *psl = (struct psl *)ptr;
+	struct client *client;
 	struct cmd_event *event, *temp;
-	int events, i, stopped, reset;
+	int events, i, n, stopped, reset;
+	uint32_t cycles, burst;
 	uint8_t ack = PSLSE_DETACH;
 
 	stopped = 1;
-	pthread_mutex_lock(psl->lock);
+	pthread_mutex_lock(&(psl->lock));
 	while (psl->state != PSLSE_DONE) {
 		// idle_cycles continues to generate clock cycles for some
 		// time after the AFU has gone idle.  Eventually clocks will
@@ -557,20 +806,39 @@ static void *_psl_loop(void *ptr)
 		if (psl->state != PSLSE_IDLE) {
 		  // if we have clients or we are in the reset state, refresh idle_cycles 
 		  // so that the afu clock will not be allowed to stop to save afu event simulator cycles
-		  if ((psl->attached_clients > 0) || (psl->state == PSLSE_RESET)) {
+		  // psl_init() queues descriptor reads in batches, keep clocking between them too
+		  if ((psl->attached_clients > 0) || (psl->state == PSLSE_RESET) ||
+		      (psl->state == PSLSE_DESC)) {
 			psl->idle_cycles = PSL_IDLE_CYCLES;
 			if (stopped)
 				info_msg("Clocking %s", psl->name);
-			fflush(stdout);
 			stopped = 0;
 		  }
 		}
 		if (psl->idle_cycles) {
-			// Clock AFU
-//printf("before psl_signal_afu_model in psl_loop \n");
-			psl_signal_afu_model(psl->afu_event);
-			// Check for events from AFU
+			// Clock AFU, letting it run ahead on its own while
+			// there is nothing to send to it
+			cycles = 1;
+			if (_psl_quiet(psl)) {
+				burst = psl->idle_cycles;
+				if (psl->attached_clients > 0)
+					burst = PSL_IDLE_BURST;
+				psl_signal_afu_idle(psl->afu_event, burst);
+			} else {
+				psl_signal_afu_model(psl->afu_event);
+			}
+			// Check for events from AFU, other threads may queue
+			// work while we wait on the simulator
+			pthread_mutex_unlock(&(psl->lock));
 			events = psl_get_afu_events(psl->afu_event);
+			pthread_mutex_lock(&(psl->lock));
+			if (psl->afu_event->idle_elapsed) {
+				cycles = psl->afu_event->idle_elapsed;
+				psl->afu_event->idle_elapsed = 0;
+			}
+			// Cycle count is stamped on debug.log records
+			psl->cycle += cycles;
+			debug_cycle(psl->dbg_id, psl->cycle);
 //printf("after psl_get_afu_events, events is 0x%3x \n", events);
 			// Error on socket
 			if (events < 0) {
@@ -578,43 +846,49 @@ static void *_psl_loop(void *ptr)
 				break;
 			}
 			// Handle events from AFU
-			if (events > 0)
+			if (events > 0) {
 				_handle_afu(psl);
+				pthread_cond_broadcast(&(psl->done));
+			}
 
 			// Drive events to AFU
 			send_job(psl->job);
 			send_pe(psl->job);
 			send_mmio(psl->mmio);
+			_psl_poll(psl, 0);
 
-			if (psl->mmio->list == NULL)
-				psl->idle_cycles--;
+			if (psl->mmio->list == NULL) {
+				if (cycles < psl->idle_cycles)
+					psl->idle_cycles -= cycles;
+				else
+					psl->idle_cycles = 0;
+			}
 		} else {
 			if (!stopped)
 				info_msg("Stopping clocks to %s", psl->name);
 			stopped = 1;
-			lock_delay(psl->lock);
+			_psl_poll(psl, _psl_busy(psl) ? 0 : -1);
 		}
 
 		// Skip client section if AFU descriptor hasn't been read yet
-		if (psl->client == NULL) {
-			lock_delay(psl->lock);
+		if (psl->client == NULL)
 			continue;
-		}
 		// Check for event from application
 		reset = 0;
-		for (i = 0; i < psl->max_clients; i++) {
-			if (psl->client[i] == NULL)
-				continue;
-			if ((psl->client[i]->type == 'd') && 
-			    (psl->client[i]->state == CLIENT_NONE) &&
-			    (psl->client[i]->idle_cycles == 0)) {
+		for (n = 0; n < psl->active_count; n++) {
+			i = psl->active[n];
+			client = psl->client[i];
+			if ((client->type == 'd') && 
+			    (client->state == CLIENT_NONE) &&
+			    (client->idle_cycles == 0)) {
 			        // this was the old way of detaching a dedicated process app/afu pair
 			        // we get the detach message, drop the client, and wait for idle cycle to get to 0
-				put_bytes(psl->client[i]->fd, 1, &ack,
+				put_bytes(client->fd, 1, &ack,
 					  psl->dbg_fp, psl->dbg_id,
-					  psl->client[i]->context);
-				_free(psl, psl->client[i]);
-				psl->client[i] = NULL;  // aha - this is how we only called _free once the old way
+					  client->context);
+				_free(psl, client);
+				_remove_client(psl, i);
+				--n;			// aha - this is how we only called _free once the old way
 				                        // why do we not free client[i]?
 				                        // because this was a short cut pointer
 				                        // the *real* client point is in client_list in pslse
@@ -629,18 +903,17 @@ static void *_psl_loop(void *ptr)
 			}
 			if (psl->state == PSLSE_RESET)
 				continue;
-			_handle_client(psl, psl->client[i]);
-			if (psl->client[i]->idle_cycles) {
-				psl->client[i]->idle_cycles--;
+			_handle_client(psl, client);
+			if (client->idle_cycles) {
+				client->idle_cycles--;
 			}
-			if (client_cmd(psl->cmd, psl->client[i])) {
-				psl->client[i]->idle_cycles = PSL_IDLE_CYCLES;
+			if (client_cmd(psl->cmd, client)) {
+				client->idle_cycles = PSL_IDLE_CYCLES;
 			}
 		}
 
 		// Send reset to AFU
 		if (reset == 1) {
-			psl->cmd->buffer_read = NULL;
 			event = psl->cmd->list;
 			while (event != NULL) {
 				if (reset) {
@@ -654,22 +927,13 @@ static void *_psl_loop(void *ptr)
 				info_msg("Dumping itag=0x%02x utag=0x%02x type=0x%02x state=0x%02x",
 					event->itag, event->utag, event->type, event->state);
 #endif
-				if (event->data) {
-					free(event->data);
-				}
-				if (event->parity) {
-					free(event->parity);
-				}
 				temp = event;
 				event = event->_next;
-				free(temp);
+				cmd_free_event(psl->cmd, temp);
 			}
-			psl->cmd->list = NULL;
 			info_msg("Sending reset to AFU");
 			add_job(psl->job, PSL_JOB_RESET, 0L);
 		}
-
-		lock_delay(psl->lock);
 	}
 
 	// Disconnect clients
@@ -687,14 +951,30 @@ static void *_psl_loop(void *ptr)
 
 	// Disconnect from simulator, free memory and shut down thread
 	info_msg("Disconnecting %s @ %s:%d", psl->name, psl->host, psl->port);
-	if (psl->client)
-		free(psl->client);
+	psl->closing = 1;
+	pthread_mutex_lock(psl->list_lock);
 	if (psl->_prev)
 		psl->_prev->_next = psl->_next;
 	if (psl->_next)
 		psl->_next->_prev = psl->_prev;
+	if (*(psl->head) == psl)
+		*(psl->head) = psl->_next;
+	pthread_mutex_unlock(psl->list_lock);
+
+	// Wait for client threads that found psl before it was unlinked, they
+	// take lock so drop it meanwhile
+	pthread_mutex_unlock(&(psl->lock));
+	pthread_mutex_lock(psl->list_lock);
+	while (psl->users)
+		pthread_cond_wait(&(psl->unpinned), psl->list_lock);
+	pthread_mutex_unlock(psl->list_lock);
+	pthread_mutex_lock(&(psl->lock));
+	if (psl->client)
+		free(psl->client);
+	if (psl->active)
+		free(psl->active);
 	if (psl->cmd) {
-		free(psl->cmd);
+		cmd_free(psl->cmd);
 	}
 	if (psl->job) {
 		free(psl->job);
@@ -710,9 +990,12 @@ static void *_psl_loop(void *ptr)
 	}
 	if (psl->name)
 		free(psl->name);
-	if (*(psl->head) == psl)
-		*(psl->head) = psl->_next;
-	pthread_mutex_unlock(psl->lock);
+	close(psl->epoll_fd);
+	close(psl->wake_fd);
+	pthread_mutex_unlock(&(psl->lock));
+	pthread_cond_destroy(&(psl->done));
+	pthread_cond_destroy(&(psl->unpinned));
+	pthread_mutex_destroy(&(psl->lock));
 	free(psl);
 	pthread_exit(NULL);
 }
@@ -723,10 +1006,11 @@ static void *_psl_loop(void *ptr)
 // possible adapter.  Then the 4 bits in each adapter represent the 4 possible
 // AFUs on an adapter.  For example: afu0.0 is 0x8000 and afu3.0 is 0x0008.
 uint16_t psl_init(struct psl **head, struct parms *parms, char *id, char *host,
-		  int port, pthread_mutex_t * lock, FILE * dbg_fp)
+		  int port, pthread_mutex_t * list_lock, FILE * dbg_fp)
 {
 	struct psl *psl;
 	struct job_event *reset;
+	struct epoll_event ev;
 	uint16_t location;
 
 	location = 0x8000;
@@ -735,6 +1019,8 @@ uint16_t psl_init(struct psl **head, struct parms *parms, char *id, char *host,
 		error_msg("Unable to allocation memory for psl");
 		goto init_fail;
 	}
+	psl->wake_fd = -1;
+	psl->epoll_fd = -1;
 	psl->timeout = parms->timeout;
 	if ((strlen(id) != 6) || strncmp(id, "afu", 3) || (id[4] != '.')) {
 		warn_msg("Invalid afu name: %s", id);
@@ -770,7 +1056,24 @@ uint16_t psl_init(struct psl **head, struct parms *parms, char *id, char *host,
 	psl->port = port;
 	psl->client = NULL;
 	psl->idle_cycles = PSL_IDLE_CYCLES;
-	psl->lock = lock;
+	psl->list_lock = list_lock;
+	pthread_mutex_init(&(psl->lock), NULL);
+	pthread_cond_init(&(psl->done), NULL);
+	pthread_cond_init(&(psl->unpinned), NULL);
+	if ((psl->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		perror("eventfd");
+		goto init_fail;
+	}
+	if ((psl->epoll_fd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		goto init_fail;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = PSL_EPOLL_WAKE;
+	if (epoll_ctl(psl->epoll_fd, EPOLL_CTL_ADD, psl->wake_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		goto init_fail;
+	}
 
 	// Connect to AFU
 	psl->afu_event = (struct AFU_EVENT *)malloc(sizeof(struct AFU_EVENT));
@@ -823,11 +1126,14 @@ uint16_t psl_init(struct psl **head, struct parms *parms, char *id, char *host,
 		goto init_fail;
 	}
 	// Start psl loop thread
+	pthread_mutex_lock(&(psl->lock));
 	if (pthread_create(&(psl->thread), NULL, _psl_loop, psl)) {
 		perror("pthread_create");
+		pthread_mutex_unlock(&(psl->lock));
 		goto init_fail;
 	}
 	// Add psl to list
+	pthread_mutex_lock(list_lock);
 	while ((*head != NULL) && ((*head)->major < psl->major)) {
 		head = &((*head)->_next);
 	}
@@ -839,19 +1145,20 @@ uint16_t psl_init(struct psl **head, struct parms *parms, char *id, char *host,
 	if (psl->_next != NULL)
 		psl->_next->_prev = psl;
 	*head = psl;
+	pthread_mutex_unlock(list_lock);
 
 	// Send reset to AFU
 	debug_msg("%s @ %s:%d: Sending reset job.", psl->name, psl->host, psl->port);
 	reset = add_job(psl->job, PSL_JOB_RESET, 0L);
-	while (psl->job->job == reset) {	/*infinite loop */
-		lock_delay(psl->lock);
-	}
+	while (psl->job->job == reset)
+		pthread_cond_wait(&(psl->done), &(psl->lock));
 
-	// Read AFU descriptor
+	// Read AFU descriptor, clocks may have stopped since the reset
 	debug_msg("%s @ %s:%d: Reading AFU descriptor.", psl->name, psl->host,
 	          psl->port);
 	psl->state = PSLSE_DESC;
-	read_descriptor(psl->mmio, psl->lock);
+	psl_wake(psl);
+	read_descriptor(psl->mmio, &(psl->lock), &(psl->done));
 
 	// Finish PSL configuration
 	psl->state = PSLSE_IDLE;
@@ -867,10 +1174,13 @@ uint16_t psl_init(struct psl **head, struct parms *parms, char *id, char *host,
 		error_msg("AFU programming model is invalid");
 		goto init_fail;
 	}
+	psl->active = (int *)calloc(psl->max_clients, sizeof(int));
 	psl->client = (struct client **)calloc(psl->max_clients,
 					       sizeof(struct client *));
+	psl->cmd->pending = (int *)calloc(psl->max_clients, sizeof(int));
 	psl->cmd->client = psl->client;
 	psl->cmd->max_clients = psl->max_clients;
+	pthread_mutex_unlock(&(psl->lock));
 
 	return location;
 
@@ -884,8 +1194,11 @@ uint16_t psl_init(struct psl **head, struct parms *parms, char *id, char *host,
 			free(psl->host);
 		if (psl->name)
 			free(psl->name);
+		if (psl->epoll_fd >= 0)
+			close(psl->epoll_fd);
+		if (psl->wake_fd >= 0)
+			close(psl->wake_fd);
 		free(psl);
 	}
-	pthread_mutex_unlock(lock);
 	return 0;
 }
@@ -32,7 +32,11 @@
 struct psl {
 	struct AFU_EVENT *afu_event;
 	pthread_t thread;
-	pthread_mutex_t *lock;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	pthread_cond_t unpinned;
+	pthread_mutex_t *list_lock;
+	int *active;
 	FILE *dbg_fp;
 	struct client **client;
 	struct cmd *cmd;
@@ -50,11 +54,17 @@ struct psl {
 	uint8_t minor;
 	uint8_t dbg_id;
 	int port;
+	int wake_fd;
+	int epoll_fd;
+	int active_count;
 	int idle_cycles;
+	uint64_t cycle;
 	int max_clients;
 	int attached_clients;
 	int timeout;
 	int has_been_reset;
+	int users;		// Client threads using psl, under list_lock
+	int closing;		// PSL thread is shutting down, under lock
 	uint16_t vsec_caia_version;
 	uint16_t vsec_psl_rev_level;
 	uint16_t vsec_image_loaded;
@@ -62,6 +72,10 @@ struct psl {
 };
 
 uint16_t psl_init(struct psl **head, struct parms *parms, char *id, char *host,
-		  int port, pthread_mutex_t * lock, FILE * dbg_fp);
+		  int port, pthread_mutex_t * list_lock, FILE * dbg_fp);
+
+int psl_add_client(struct psl *psl, struct client *client);
+
+void psl_wake(struct psl *psl);
 
 #endif				/* _PSL_H_ */
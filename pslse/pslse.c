@@ -27,7 +27,8 @@
  *  connections.  Each time a valid client connection is made it will be
  *  assigned to the appropriate psl thread for whichever AFU it is accessing.
  *  If it is the first client to connect then the AFU is reset and the AFU
- *  descriptor is read.
+ *  descriptor is read.  The global lock only protects psl_list, each psl
+ *  thread has its own lock for the state of its AFU.
  */
 
 #include <assert.h>
@@ -43,6 +44,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <termios.h>
 #include <time.h>
@@ -63,16 +65,25 @@ pthread_mutex_t lock;
 uint16_t afu_map;
 int timeout;
 FILE *fp;
+static volatile sig_atomic_t _interrupted;
 
-// Disconnect client connections and stop threads gracefully on Ctrl-C
+// Only note Ctrl-C here, the message and debug locks can't be taken from a
+// signal handler.  main() shuts down once pselect() returns.
 static void _INThandler(int sig)
+{
+	_interrupted = 1;
+}
+
+// Disconnect client connections and stop threads gracefully on Ctrl-C
+static void _shutdown()
 {
 	pthread_t thread;
-	struct psl *psl;
+	struct psl *psl, *next;
 	int i;
 
 	// Flush debug output
-	fflush(fp);
+	debug_flush(fp);
+	msg_flush();
 
 	// Shut down PSL threads
 	psl = psl_list;
@@ -82,20 +93,25 @@ static void _INThandler(int sig)
 			if (psl->client[i] != NULL)
 				psl->client[i]->abort = 1;
 		}
-		psl->state = PSLSE_DONE;
+		// Once woken the PSL thread frees psl, so read it out first
 		thread = psl->thread;
-		psl = psl->_next;
+		next = psl->_next;
+		psl->state = PSLSE_DONE;
+		psl_wake(psl);
+		psl = next;
 		pthread_join(thread, NULL);
 	}
 }
 
-// Find PSL for specific AFU id
+// Find PSL for specific AFU id.  Returns with the PSL list lock held so the
+// PSL thread cannot unlink and free the PSL, caller must unlock it.
 static struct psl *_find_psl(uint8_t id, uint8_t * major, uint8_t * minor)
 {
 	struct psl *psl;
 
 	*major = id >> 4;
 	*minor = id & 0x3;
+	pthread_mutex_lock(&lock);
 	psl = psl_list;
 	while (psl) {
 		if (id == psl->dbg_id)
@@ -110,10 +126,16 @@ static void _query(struct client *client, uint8_t id)
 {
 	struct psl *psl;
 	uint8_t *buffer;
-	uint8_t major, minor;
+	uint8_t major, minor, dbg_id;
 	int size, offset;
 
 	psl = _find_psl(id, &major, &minor);
+	if (!psl) {
+		pthread_mutex_unlock(&lock);
+		info_msg("Did not find valid PSL for afu%d.%d\n", major, minor);
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+		return;
+	}
 	size = 1 + sizeof(psl->mmio->desc.num_ints_per_process) + sizeof(client->max_irqs) + 
 	    sizeof(psl->mmio->desc.req_prog_model) +
 	    sizeof(psl->mmio->desc.PerProcessPSA) + sizeof(psl->mmio->desc.PerProcessPSA_offset) +
@@ -158,7 +180,9 @@ static void _query(struct client *client, uint8_t id)
 	memcpy(&(buffer[offset]),
 	       (char *)&(psl->mmio->desc.crptr->cr_class),
 	       sizeof(psl->mmio->desc.crptr->cr_class));
-	if (put_bytes(client->fd, size, buffer, psl->dbg_fp, psl->dbg_id,
+	dbg_id = psl->dbg_id;
+	pthread_mutex_unlock(&lock);
+	if (put_bytes(client->fd, size, buffer, fp, dbg_id,
 		      client->context) < 0) {
 		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
 	}
@@ -170,13 +194,27 @@ static void _max_irqs(struct client *client, uint8_t id)
 {
 	struct psl *psl;
 	uint8_t buffer[MAX_LINE_CHARS];
-	uint8_t major, minor;
-	uint16_t value;
+	uint8_t major, minor, dbg_id;
+	uint16_t value, min_irqs, max_irqs;
+	int psl_timeout;
 
-	// Retrieve requested new maximum interrupts
+	// Copy the limits out so the socket is not read with the list locked
 	psl = _find_psl(id, &major, &minor);
-	if (get_bytes(client->fd, 2, buffer, psl->timeout, &(client->abort),
-		      psl->dbg_fp, psl->dbg_id, client->context) < 0) {
+	if (!psl) {
+		pthread_mutex_unlock(&lock);
+		info_msg("Did not find valid PSL for afu%d.%d\n", major, minor);
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+		return;
+	}
+	min_irqs = psl->mmio->desc.num_ints_per_process;
+	max_irqs = 2037 / psl->mmio->desc.num_of_processes;
+	psl_timeout = psl->timeout;
+	dbg_id = psl->dbg_id;
+	pthread_mutex_unlock(&lock);
+
+	// Retrieve requested new maximum interrupts
+	if (get_bytes(client->fd, 2, buffer, psl_timeout, &(client->abort),
+		      fp, dbg_id, client->context) < 0) {
 		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
 		return;
 	}
@@ -184,16 +222,16 @@ static void _max_irqs(struct client *client, uint8_t id)
 	client->max_irqs = ntohs(client->max_irqs);
 
 	// Limit to legal value
-	if (client->max_irqs < psl->mmio->desc.num_ints_per_process)
-		client->max_irqs = psl->mmio->desc.num_ints_per_process;
-	if (client->max_irqs > 2037 / psl->mmio->desc.num_of_processes)
-		client->max_irqs = 2037 / psl->mmio->desc.num_of_processes;
+	if (client->max_irqs < min_irqs)
+		client->max_irqs = min_irqs;
+	if (client->max_irqs > max_irqs)
+		client->max_irqs = max_irqs;
 
 	// Return set value
 	buffer[0] = PSLSE_MAX_INT;
 	value = htons(client->max_irqs);
 	memcpy(&(buffer[1]), (char *)&value, 2);
-	if (put_bytes(client->fd, 3, buffer, psl->dbg_fp, psl->dbg_id,
+	if (put_bytes(client->fd, 3, buffer, fp, dbg_id,
 		      client->context) < 0) {
 		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
 	}
@@ -260,24 +298,15 @@ static struct client *_client_connect(int *fd, char *ip)
 	return client;
 }
 
-// Associate client to PSL
-static int _client_associate(struct client *client, uint8_t id, char afu_type)
+// Associate client to pinned PSL.  Returns 0 once the PSL owns client.
+static int _psl_associate(struct client *client, struct psl *psl,
+			  uint8_t major, uint8_t minor, char afu_type)
 {
-	struct psl *psl;
 	uint32_t mmio_offset, mmio_size;
-	uint8_t major, minor;
 	int i, context, clients;
 	uint8_t rc[2];
 
-	// Associate with PSL
 	rc[0] = PSLSE_DETACH;
-	psl = _find_psl(id, &major, &minor);
-	if (!psl) {
-		info_msg("Did not find valid PSL for afu%d.%d\n", major, minor);
-		put_bytes(client->fd, 1, &(rc[0]), fp, -1, -1);
-		close_socket(&(client->fd));
-		return -1;
-	}
 
 	// Check AFU type is valid for connection
 	switch (afu_type) {
@@ -310,8 +339,17 @@ static int _client_associate(struct client *client, uint8_t id, char afu_type)
 
 	// check to see if device is already open
 	// lgt - I think I can open any combination of m/s upto max
+	pthread_mutex_lock(&(psl->lock));
+	if (psl->closing) {
+		pthread_mutex_unlock(&(psl->lock));
+		info_msg("afu%d.%d is shutting down\n", major, minor);
+		put_bytes(client->fd, 1, &(rc[0]), fp, psl->dbg_id, -1);
+		close_socket(&(client->fd));
+		return -1;
+	}
 	if ( afu_type == 'd' /* | afu_type == 'm' */ ) {
 		if (psl->client[0] != NULL) {
+			pthread_mutex_unlock(&(psl->lock));
 			warn_msg
 			    ("afu%d.%d%c is already open\n",
 			     major, minor, afu_type);
@@ -332,14 +370,17 @@ static int _client_associate(struct client *client, uint8_t id, char afu_type)
 		if (psl->client[i] != NULL)
 			++clients;
 		if ((context < 0) && (psl->client[i] == NULL)) {
-			client->context = context = i;
+			client->context = i;
+			if (psl_add_client(psl, client) < 0)
+				break;
+			context = i;
 			client->state = CLIENT_VALID;
 			client->pending = 0;
-			psl->client[i] = client;
 			break;
 		}
 	}
 	if (context < 0) {
+		pthread_mutex_unlock(&(psl->lock));
 		info_msg("No room for new client on afu%d.%d\n", major, minor);
 		put_bytes(client->fd, 1, &(rc[0]), fp, psl->dbg_id, -1);
 		close_socket(&(client->fd));
@@ -389,30 +430,63 @@ static int _client_associate(struct client *client, uint8_t id, char afu_type)
 	default:
 	        debug_msg( "_client_associate: invalid afu_type: %c", afu_type );
 	}
+	pthread_mutex_unlock(&(psl->lock));
+	psl_wake(psl);
 
-	// Acknowledge to client
+	// Acknowledge to client, the PSL thread closes the socket on failure
 	if (put_bytes(client->fd, 2, &(rc[0]), fp, psl->dbg_id, context) < 0) {
-		close_socket(&(client->fd));
-		return -1;
+		pthread_mutex_lock(&(psl->lock));
+		client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
+		pthread_mutex_unlock(&(psl->lock));
+		psl_wake(psl);
+		return 0;
 	}
 	debug_context_add(fp, psl->dbg_id, context);
 
 	return 0;
 }
 
+// Associate client to PSL, pinning the PSL so its thread can't free it
+// until we are done with it
+static int _client_associate(struct client *client, uint8_t id, char afu_type)
+{
+	struct psl *psl;
+	uint8_t major, minor;
+	uint8_t rc;
+	int ret;
+
+	psl = _find_psl(id, &major, &minor);
+	if (psl)
+		psl->users++;
+	pthread_mutex_unlock(&lock);
+	if (!psl) {
+		info_msg("Did not find valid PSL for afu%d.%d\n", major, minor);
+		rc = PSLSE_DETACH;
+		put_bytes(client->fd, 1, &rc, fp, -1, -1);
+		close_socket(&(client->fd));
+		return -1;
+	}
+
+	ret = _psl_associate(client, psl, major, minor, afu_type);
+
+	pthread_mutex_lock(&lock);
+	if (--psl->users == 0)
+		pthread_cond_signal(&(psl->unpinned));
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
 static void *_client_loop(void *ptr)
 {
 	struct client *client = (struct client *)ptr;
 	uint8_t data[2];
-	int rc;
+	int rc, owned;
 
-	pthread_mutex_lock(&lock);
+	owned = 1;
 	while (client->pending) {
 		rc = bytes_ready(client->fd, client->timeout, &(client->abort));
-		if (rc == 0) {
-			lock_delay(&lock);
+		if (rc == 0)
 			continue;
-		}
 		if ((rc < 0) || get_bytes(client->fd, 1, data, 10,
 					  &(client->abort), fp, -1, -1) < 0) {
 			client_drop(client, PSL_IDLE_CYCLES, CLIENT_NONE);
@@ -427,7 +501,6 @@ static void *_client_loop(void *ptr)
 				break;
 			}
 			_query(client, data[0]);
-			lock_delay(&lock);
 			continue;
 		}
 		if (data[0] == PSLSE_MAX_INT) {
@@ -438,7 +511,6 @@ static void *_client_loop(void *ptr)
 				break;
 			}
 			_max_irqs(client, data[0]);
-			lock_delay(&lock);
 			continue;
 		}
 		if (data[0] == PSLSE_OPEN) {
@@ -449,15 +521,19 @@ static void *_client_loop(void *ptr)
 				debug_msg("_client_loop: client associate failed; could not communicate with socket");
 				break;
 			}
-			_client_associate(client, data[0], (char)data[1]);
+			if (_client_associate(client, data[0],
+					      (char)data[1]) == 0)
+				owned = 0;
 			debug_msg("_client_loop: client associated");
 			break;
 		}
 		client->pending = 0;
 		break;
-		lock_delay(&lock);
 	}
-	pthread_mutex_unlock(&lock);
+
+	// Hand client back to main() to free unless a PSL now owns it
+	if (owned)
+		__atomic_store_n(&(client->detached), 1, __ATOMIC_RELEASE);
 
 	// Terminate thread
 	pthread_exit(NULL);
@@ -520,7 +596,8 @@ int main(int argc, char **argv)
 	struct client **client_ptr;
 	int listen_fd, connect_fd;
 	socklen_t client_len;
-	sigset_t set;
+	sigset_t set, wait_set;
+	fd_set fds;
 	struct sigaction action;
 	char *shim_host_path;
 	char *parms_path;
@@ -537,19 +614,29 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	// Mask SIGPIPE signal for all threads
+	// Mask SIGPIPE signal for all threads, and SIGINT except while main
+	// waits for a client in pselect()
 	sigemptyset(&set);
 	sigaddset(&set, SIGPIPE);
+	sigaddset(&set, SIGINT);
 	if (pthread_sigmask(SIG_BLOCK, &set, NULL)) {
 		perror("pthread_sigmask");
 		return -1;
 	}
-	// Catch SIGINT for graceful termination
+	wait_set = set;
+	sigdelset(&wait_set, SIGINT);
+	// Catch SIGINT for graceful termination, without SA_RESTART so
+	// pselect() returns
 	action.sa_handler = _INThandler;
 	sigemptyset(&(action.sa_mask));
 	action.sa_flags = 0;
 	sigaction(SIGINT, &action, NULL);
 
+	// Write debug.log from a background thread, threads started later
+	// inherit the signal mask above
+	if (debug_start(fp) < 0)
+		warn_msg("Unable to start debug.log writer, writing directly");
+
 	// Report version
 	info_msg("PSLSE version %d.%03d compiled @ %s %s", PSLSE_VERSION_MAJOR,
 		 PSLSE_VERSION_MINOR, __DATE__, __TIME__);
@@ -575,15 +662,19 @@ int main(int argc, char **argv)
 	}
 	timeout = parms->timeout;
 
+	// Display messages from a background thread, once the parms have been
+	// printed directly
+	if (msg_start() < 0)
+		warn_msg("Unable to start message writer, writing directly");
+
 	// Connect to simulator(s) and start psl thread(s)
 	pthread_mutex_init(&lock, NULL);
-	pthread_mutex_lock(&lock);
 	shim_host_path = getenv("SHIM_HOST_DAT");
 	if (!shim_host_path) shim_host_path = "shim_host.dat";
 	afu_map = parse_host_data(&psl_list, parms, shim_host_path, &lock, fp);
 	if (psl_list == NULL) {
-		pthread_mutex_unlock(&lock);
 		free(parms);
+		debug_stop(fp);
 		fclose(fp);
 		pthread_mutex_destroy(&lock);
 		warn_msg("Unable to connect to any simulators");
@@ -591,8 +682,8 @@ int main(int argc, char **argv)
 	}
 	// Start server
 	if ((listen_fd = _start_server()) < 0) {
-		pthread_mutex_unlock(&lock);
 		free(parms);
+		debug_stop(fp);
 		fclose(fp);
 		pthread_mutex_destroy(&lock);
 		return -1;
@@ -600,15 +691,21 @@ int main(int argc, char **argv)
 	// Watch for client connections
 	while (psl_list != NULL) {
 		// Wait for next client to connect
+		FD_ZERO(&fds);
+		FD_SET(listen_fd, &fds);
+		if (pselect(listen_fd + 1, &fds, NULL, NULL, NULL,
+			    &wait_set) < 0) {
+			if (_interrupted) {
+				_shutdown();
+				break;
+			}
+			continue;
+		}
 		client_len = sizeof(client_addr);
-		pthread_mutex_unlock(&lock);
 		connect_fd = accept(listen_fd, (struct sockaddr *)&client_addr,
 				    &client_len);
-		pthread_mutex_lock(&lock);
-		if (connect_fd < 0) {
-			lock_delay(&lock);
+		if (connect_fd < 0)
 			continue;
-		}
 		ip = (char *)malloc(INET_ADDRSTRLEN + 1);
 		inet_ntop(AF_INET, &(client_addr.sin_addr.s_addr), ip,
 			  INET_ADDRSTRLEN);
@@ -616,13 +713,13 @@ int main(int argc, char **argv)
 		client_ptr = &client_list;
 		while (*client_ptr != NULL) {
 			client = *client_ptr;
-			if ((client->pending == 0)
-			    && (client->state == CLIENT_NONE)) {
+			if (__atomic_load_n(&(client->detached),
+					    __ATOMIC_ACQUIRE)) {
 				*client_ptr = client->_next;
 				if (client->_next != NULL)
 					client->_next->_prev = client->_prev;
+				pthread_join(client->thread, NULL);
 				_free_client(client);
-				lock_delay(&lock);
 				continue;
 			}
 			client_ptr = &((*client_ptr)->_next);
@@ -641,7 +738,6 @@ int main(int argc, char **argv)
 				break;
 			}
 		}
-		lock_delay(&lock);
 	}
 	info_msg("No AFUs connected, Shutting down PSLSE\n");
 	close_socket(&listen_fd);
@@ -652,15 +748,13 @@ int main(int argc, char **argv)
 		client_list = client->_next;
 		if (client->pending)
 			client->pending = 0;
-		pthread_mutex_unlock(&lock);
 		pthread_join(client->thread, NULL);
-		pthread_mutex_lock(&lock);
 		close_socket(&(client->fd));
 		_free_client(client);
 	}
-	pthread_mutex_unlock(&lock);
 
 	free(parms);
+	debug_stop(fp);
 	fclose(fp);
 	pthread_mutex_destroy(&lock);
 
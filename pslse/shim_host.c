@@ -66,7 +66,8 @@ uint16_t parse_host_data(struct psl ** head, struct parms * parms,
 				  filename, hostdata);
 			continue;
 		}
-		port_str = strchr(host, ':');
+		// Search from the end, host may carry a "shm:" prefix
+		port_str = strrchr(host, ':');
 		if (port_str) {
 			*port_str = '\0';
 			++port_str;
@@ -49,11 +49,9 @@ AFU::start ()
     uint32_t cycle = 0;
 
     while (1) {
-        fd_set watchset;
-
-        FD_ZERO (&watchset);
-        FD_SET (afu_event.sockfd, &watchset);
-        select (afu_event.sockfd + 1, &watchset, NULL, NULL, NULL);
+        // Idle bursts run clocks locally with no socket traffic, so wait
+        // through the interface rather than selecting on the socket
+        psl_wait_events (&afu_event);
         int rc = psl_get_psl_events (&afu_event);
 
         //info_msg("Cycle: %d", cycle);
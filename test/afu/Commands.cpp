@@ -337,8 +337,8 @@ StoreCommand::process_buffer_read (AFU_EVENT * afu_event,
     if (buffer_read_parity)
         parity[rand () % 2] += rand () % 256;
 
-    if (psl_afu_read_buffer_data (afu_event, 128, cache_line, parity) !=
-            PSL_SUCCESS) {
+    if (psl_afu_read_buffer_data_tag (afu_event, Command::tag, 128,
+                                      cache_line, parity) != PSL_SUCCESS) {
         error_msg ("StoreCommand; failed to build buffer read data");
     }
   
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2015 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Description : mmio_async.c
+ *
+ * This test submits a mix of asynchronous 32-bit and 64-bit MMIO reads and
+ * writes to the Test AFU machine registers, including one access outside the
+ * MMIO space that must fail.  It waits on the completion fd and checks the
+ * ops are reaped in the order they were submitted with the right result and
+ * read data.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libcxl.h"
+
+// Test AFU machine configuration registers, dwords 2 and 3 of each machine
+// are read/write and don't enable it
+#define MACHINE_CONFIG 0x1000
+#define MACHINE_SIZE 0x20
+#define MACHINES 16
+
+// First offset past the MMIO space of a dedicated AFU
+#define MMIO_OUT_OF_RANGE 0x4000000
+
+// Ops submitted per machine and the op that is sent out of range
+#define OPS_PER_MACHINE 6
+#define OPS (MACHINES * OPS_PER_MACHINE + 1)
+#define BAD_OP (OPS / 2)
+
+// Most ops reaped per call, smaller than OPS so reaping takes several calls
+#define REAP_MAX 8
+
+void usage(char *name)
+{
+	printf("Usage: %s [OPTION]...\n\n", name);
+	printf("  -s, --seed\t\tseed for random number generation\n");
+	printf("      --help\tdisplay this help and exit\n\n");
+}
+
+static uint64_t rand64(void)
+{
+	uint64_t value;
+
+	value = rand();
+	value <<= 32;
+	value |= rand();
+	return value;
+}
+
+static void set_op(struct cxl_mmio_op *op, uint32_t type, uint64_t offset,
+		   uint64_t data)
+{
+	op->type = type;
+	op->result = 1;
+	op->offset = offset;
+	op->data = data;
+}
+
+int main(int argc, char *argv[])
+{
+	struct cxl_afu_h *afu_h;
+	struct cxl_mmio_op ops[OPS], bad, *reaped[REAP_MAX];
+	uint64_t expect[OPS];
+	uint64_t reg, value;
+	uint32_t upper, lower;
+	struct pollfd pfd;
+	unsigned seed;
+	int opt, option_index;
+	int i, m, n, count, reap;
+	char *name;
+
+	name = strrchr(argv[0], '/');
+	if (name)
+		name++;
+	else
+		name = argv[0];
+
+	static struct option long_options[] = {
+		{"help",	no_argument,		0,		'h'},
+		{"seed",	required_argument,	0,		's'},
+		{NULL, 0, 0, 0}
+	};
+
+	option_index = 0;
+	seed = time(NULL);
+	while ((opt = getopt_long (argc, argv, "hs:",
+				   long_options, &option_index)) >= 0) {
+		switch (opt)
+		{
+		case 0:
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(name);
+			return 0;
+		}
+	}
+
+	// Seed random number generator
+	srand(seed);
+	printf("%s: seed=%d\n", name, seed);
+
+	// Find first AFU in system
+	afu_h = cxl_afu_next(NULL);
+	if (!afu_h) {
+		fprintf(stderr, "FAILED:No AFU found!\n");
+		goto done;
+	}
+
+	// Open AFU
+	afu_h = cxl_afu_open_h(afu_h, CXL_VIEW_DEDICATED);
+	if (!afu_h) {
+		perror("FAILED:cxl_afu_open_h");
+		goto done;
+	}
+
+	// Start AFU
+	cxl_afu_attach(afu_h, rand64());
+
+	// Map AFU MMIO registers
+	printf("Mapping AFU registers...\n");
+	if ((cxl_mmio_map(afu_h, CXL_MMIO_BIG_ENDIAN)) < 0) {
+		perror("FAILED:cxl_mmio_map");
+		goto done;
+	}
+
+	//////////////////////////////////////////////////////
+	// CHECK 1 - Misaligned ops are rejected on submit  //
+	//////////////////////////////////////////////////////
+
+	set_op(&bad, CXL_MMIO_OP_READ64, MACHINE_CONFIG + 4, 0);
+	if ((cxl_mmio_submit(afu_h, &bad) == 0) || (errno != EINVAL)) {
+		printf("FAILED:cxl_mmio_submit of misaligned READ64\n");
+		goto done;
+	}
+	set_op(&bad, CXL_MMIO_OP_WRITE32, MACHINE_CONFIG + 2, 0);
+	if ((cxl_mmio_submit(afu_h, &bad) == 0) || (errno != EINVAL)) {
+		printf("FAILED:cxl_mmio_submit of misaligned WRITE32\n");
+		goto done;
+	}
+	printf("Misaligned submit check complete\n");
+
+	///////////////////////////////////////////////////////////
+	// CHECK 2 - Ops are reaped in order with result and data //
+	///////////////////////////////////////////////////////////
+
+	// Each machine gets a 64-bit write read back both ways and two 32-bit
+	// writes read back both ways.  One read out of range goes in the middle.
+	memset(expect, 0, sizeof(expect));
+	n = 0;
+	for (m = 0; m < MACHINES; m++) {
+		if (n == BAD_OP) {
+			set_op(&(ops[n]), CXL_MMIO_OP_READ64,
+			       MMIO_OUT_OF_RANGE, 0);
+			n++;
+		}
+		reg = MACHINE_CONFIG + (m * MACHINE_SIZE) + 0x10;
+		value = rand64();
+		set_op(&(ops[n++]), CXL_MMIO_OP_WRITE64, reg, value);
+		set_op(&(ops[n]), CXL_MMIO_OP_READ64, reg, 0);
+		expect[n++] = value;
+		set_op(&(ops[n]), CXL_MMIO_OP_READ32, reg + 4, 0);
+		expect[n++] = value & 0xffffffff;
+
+		reg += 8;
+		upper = rand();
+		lower = rand();
+		set_op(&(ops[n++]), CXL_MMIO_OP_WRITE32, reg, upper);
+		set_op(&(ops[n++]), CXL_MMIO_OP_WRITE32, reg + 4, lower);
+		set_op(&(ops[n]), CXL_MMIO_OP_READ64, reg, 0);
+		expect[n++] = ((uint64_t) upper << 32) | lower;
+	}
+
+	for (i = 0; i < OPS; i++) {
+		if (cxl_mmio_submit(afu_h, &(ops[i])) < 0) {
+			perror("FAILED:cxl_mmio_submit");
+			goto done;
+		}
+	}
+
+	pfd.fd = cxl_mmio_completion_fd(afu_h);
+	pfd.events = POLLIN;
+	count = 0;
+	while (count < OPS) {
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 10000) <= 0) {
+			printf("FAILED:No completion after %d of %d ops\n",
+			       count, OPS);
+			goto done;
+		}
+		reap = cxl_mmio_reap(afu_h, reaped, REAP_MAX);
+		if (reap < 0) {
+			perror("FAILED:cxl_mmio_reap");
+			goto done;
+		}
+		for (i = 0; i < reap; i++, count++) {
+			if (reaped[i] != &(ops[count])) {
+				printf("\nFAILED:Op %d reaped as op %d!\n",
+				       (int)(reaped[i] - ops), count);
+				goto done;
+			}
+			if (reaped[i]->result != ((count == BAD_OP) ? -1 : 0)) {
+				printf("\nFAILED:Op %d result %d!\n", count,
+				       reaped[i]->result);
+				goto done;
+			}
+			if ((count == BAD_OP) ||
+			    ((reaped[i]->type != CXL_MMIO_OP_READ64) &&
+			     (reaped[i]->type != CXL_MMIO_OP_READ32)))
+				continue;
+			if (reaped[i]->data != expect[count]) {
+				printf("\nFAILED:Op %d read mismatch!\n",
+				       count);
+				printf("\tExpected:0x%016"PRIx64"\n",
+				       expect[count]);
+				printf("\tActual  :0x%016"PRIx64"\n",
+				       reaped[i]->data);
+				goto done;
+			}
+		}
+	}
+
+	// Nothing is left to reap once every op has been
+	pfd.revents = 0;
+	if ((poll(&pfd, 1, 0) != 0) ||
+	    (cxl_mmio_reap(afu_h, reaped, REAP_MAX) != 0)) {
+		printf("FAILED:Completion left after all ops reaped\n");
+		goto done;
+	}
+	printf("Reap order, result and read data check complete\n");
+
+	// Report test as passing
+	printf("PASSED\n");
+done:
+	if (afu_h) {
+		// Unmap AFU MMIO registers
+		cxl_mmio_unmap(afu_h);
+		// Free AFU
+		cxl_afu_free(afu_h);
+	}
+
+	return 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright 2015 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Description : mmio_batch.c
+ *
+ * This test runs a cxl_mmio_batch() of 32-bit and 64-bit MMIO reads and
+ * writes to the Test AFU machine registers that is too big for one PSLSE
+ * request, so libcxl splits it.  It checks the per-op result and read data,
+ * then that batches with an invalid op type or an access outside the MMIO
+ * space fail without making any of their accesses.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libcxl.h"
+#include "utils.h"
+
+// Test AFU machine configuration registers, dwords 2 and 3 of each machine
+// are read/write and don't enable it
+#define MACHINE_CONFIG 0x1000
+#define MACHINE_SIZE 0x20
+#define MACHINES 16
+
+// First offset past the MMIO space of a dedicated AFU
+#define MMIO_OUT_OF_RANGE 0x4000000
+
+// Ops per machine visit and enough visits for the batch to be sent to PSLSE
+// in three parts, with visits straddling the splits
+#define OPS_PER_MACHINE 6
+#define VISITS ((5 * PSLSE_MMIO_BATCH_MAX / 2) / OPS_PER_MACHINE)
+#define OPS (VISITS * OPS_PER_MACHINE)
+
+void usage(char *name)
+{
+	printf("Usage: %s [OPTION]...\n\n", name);
+	printf("  -s, --seed\t\tseed for random number generation\n");
+	printf("      --help\tdisplay this help and exit\n\n");
+}
+
+static uint64_t rand64(void)
+{
+	uint64_t value;
+
+	value = rand();
+	value <<= 32;
+	value |= rand();
+	return value;
+}
+
+static void set_op(struct cxl_mmio_op *op, uint32_t type, uint64_t offset,
+		   uint64_t data)
+{
+	op->type = type;
+	op->result = 1;
+	op->offset = offset;
+	op->data = data;
+}
+
+// A batch that fails must leave every op and the register written by its
+// first op untouched
+static int check_rejected(struct cxl_afu_h *afu_h, struct cxl_mmio_op *ops,
+			  int n, int err, uint64_t reg, uint64_t value)
+{
+	uint64_t check;
+	int i;
+
+	if ((cxl_mmio_batch(afu_h, ops, n) == 0) || (errno != err)) {
+		printf("FAILED:cxl_mmio_batch not rejected with errno %d\n",
+		       err);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (ops[i].result != 1) {
+			printf("FAILED:Op %d of rejected batch has result %d\n",
+			       i, ops[i].result);
+			return -1;
+		}
+	}
+	if (cxl_mmio_read64(afu_h, reg, &check) < 0) {
+		perror("FAILED:cxl_mmio_read64");
+		return -1;
+	}
+	if (check != value) {
+		printf("\nFAILED:Rejected batch wrote register!\n");
+		printf("\tExpected:0x%016"PRIx64"\n", value);
+		printf("\tActual  :0x%016"PRIx64"\n", check);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct cxl_afu_h *afu_h;
+	struct cxl_mmio_op *ops;
+	uint64_t *expect;
+	uint64_t reg, value;
+	uint32_t upper, lower;
+	unsigned seed;
+	int opt, option_index;
+	int i, n;
+	char *name;
+
+	name = strrchr(argv[0], '/');
+	if (name)
+		name++;
+	else
+		name = argv[0];
+
+	static struct option long_options[] = {
+		{"help",	no_argument,		0,		'h'},
+		{"seed",	required_argument,	0,		's'},
+		{NULL, 0, 0, 0}
+	};
+
+	option_index = 0;
+	seed = time(NULL);
+	while ((opt = getopt_long (argc, argv, "hs:",
+				   long_options, &option_index)) >= 0) {
+		switch (opt)
+		{
+		case 0:
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(name);
+			return 0;
+		}
+	}
+
+	// Seed random number generator
+	srand(seed);
+	printf("%s: seed=%d\n", name, seed);
+
+	ops = (struct cxl_mmio_op *)calloc(OPS, sizeof(struct cxl_mmio_op));
+	expect = (uint64_t *)calloc(OPS, sizeof(uint64_t));
+	if (!ops || !expect) {
+		perror("FAILED:calloc");
+		afu_h = NULL;
+		goto done;
+	}
+
+	// Find first AFU in system
+	afu_h = cxl_afu_next(NULL);
+	if (!afu_h) {
+		fprintf(stderr, "FAILED:No AFU found!\n");
+		goto done;
+	}
+
+	// Open AFU
+	afu_h = cxl_afu_open_h(afu_h, CXL_VIEW_DEDICATED);
+	if (!afu_h) {
+		perror("FAILED:cxl_afu_open_h");
+		goto done;
+	}
+
+	// Start AFU
+	cxl_afu_attach(afu_h, rand64());
+
+	// Map AFU MMIO registers
+	printf("Mapping AFU registers...\n");
+	if ((cxl_mmio_map(afu_h, CXL_MMIO_BIG_ENDIAN)) < 0) {
+		perror("FAILED:cxl_mmio_map");
+		goto done;
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// CHECK 1 - Batch split across requests returns results in order //
+	//////////////////////////////////////////////////////////////////
+
+	// Each visit to a machine writes a 64-bit value read back both ways
+	// and two 32-bit values read back both ways.  Later visits overwrite
+	// the values of earlier ones, so reads must be made in order.
+	n = 0;
+	for (i = 0; i < VISITS; i++) {
+		reg = MACHINE_CONFIG + ((i % MACHINES) * MACHINE_SIZE) + 0x10;
+		value = rand64();
+		set_op(&(ops[n++]), CXL_MMIO_OP_WRITE64, reg, value);
+		set_op(&(ops[n]), CXL_MMIO_OP_READ64, reg, 0);
+		expect[n++] = value;
+		set_op(&(ops[n]), CXL_MMIO_OP_READ32, reg, 0);
+		expect[n++] = value >> 32;
+
+		reg += 8;
+		upper = rand();
+		lower = rand();
+		set_op(&(ops[n++]), CXL_MMIO_OP_WRITE32, reg, upper);
+		set_op(&(ops[n++]), CXL_MMIO_OP_WRITE32, reg + 4, lower);
+		set_op(&(ops[n]), CXL_MMIO_OP_READ64, reg, 0);
+		expect[n++] = ((uint64_t) upper << 32) | lower;
+	}
+
+	printf("Running batch of %d ops, PSLSE takes %d at a time\n", OPS,
+	       PSLSE_MMIO_BATCH_MAX);
+	if (cxl_mmio_batch(afu_h, ops, OPS) < 0) {
+		perror("FAILED:cxl_mmio_batch");
+		goto done;
+	}
+	for (i = 0; i < OPS; i++) {
+		if (ops[i].result != 0) {
+			printf("\nFAILED:Op %d result %d!\n", i, ops[i].result);
+			goto done;
+		}
+		if ((ops[i].type != CXL_MMIO_OP_READ64) &&
+		    (ops[i].type != CXL_MMIO_OP_READ32))
+			continue;
+		if (ops[i].data != expect[i]) {
+			printf("\nFAILED:Op %d read mismatch!\n", i);
+			printf("\tExpected:0x%016"PRIx64"\n", expect[i]);
+			printf("\tActual  :0x%016"PRIx64"\n", ops[i].data);
+			goto done;
+		}
+	}
+	printf("Split batch result and read data check complete\n");
+
+	///////////////////////////////////////////////////////////
+	// CHECK 2 - Batches with a bad op fail and make no access //
+	///////////////////////////////////////////////////////////
+
+	reg = MACHINE_CONFIG + 0x10;
+	value = rand64();
+	if (cxl_mmio_write64(afu_h, reg, value) < 0) {
+		perror("FAILED:cxl_mmio_write64");
+		goto done;
+	}
+
+	// Invalid op type is rejected by libcxl
+	set_op(&(ops[0]), CXL_MMIO_OP_WRITE64, reg, ~value);
+	set_op(&(ops[1]), CXL_MMIO_OP_READ32, reg, 0);
+	set_op(&(ops[2]), 0x7, reg, 0);
+	if (check_rejected(afu_h, ops, 3, EINVAL, reg, value) < 0)
+		goto done;
+	printf("Invalid op type check complete\n");
+
+	// Access outside the MMIO space is rejected by PSLSE
+	set_op(&(ops[0]), CXL_MMIO_OP_WRITE64, reg, ~value);
+	set_op(&(ops[1]), CXL_MMIO_OP_READ64, MMIO_OUT_OF_RANGE, 0);
+	if (check_rejected(afu_h, ops, 2, ENODEV, reg, value) < 0)
+		goto done;
+	printf("Out of range access check complete\n");
+
+	// Report test as passing
+	printf("PASSED\n");
+done:
+	if (afu_h) {
+		// Unmap AFU MMIO registers
+		cxl_mmio_unmap(afu_h);
+		// Free AFU
+		cxl_afu_free(afu_h);
+	}
+	free(ops);
+	free(expect);
+
+	return 0;
+}